@@ -68,11 +68,12 @@ typedef struct file_info_s {
 #define FS_SEARCH_DIRSONLY      0x00001000
 #define FS_SEARCH_MASK          0x00001f00
 
-// bits 8 - 11, flag
+// bits 8 - 12, flag
 #define FS_FLAG_GZIP            0x00000100
 #define FS_FLAG_EXCL            0x00000200
 #define FS_FLAG_TEXT            0x00000400
 #define FS_FLAG_DEFLATE         0x00000800
+#define FS_FLAG_MAPPED          0x00001000
 
 //
 // Limit the maximum file size FS_LoadFile can handle, as a protection from
@@ -89,7 +90,6 @@ typedef struct file_info_s {
 #define FS_LoadFile(path, buf)  FS_LoadFileEx(path, buf, 0, TAG_FILESYSTEM)
 #define FS_LoadFileFlags(path, buf, flags)  \
                                 FS_LoadFileEx(path, buf, (flags), TAG_FILESYSTEM)
-#define FS_FreeFile(buf)        Z_Free(buf)
 
 // just regular malloc for now
 #define FS_AllocTempMem(size)   FS_Malloc(size)
@@ -112,6 +112,8 @@ qerror_t FS_RenameFile(const char *from, const char *to);
 
 qerror_t FS_CreatePath(char *path);
 
+void    FS_InvalidateDirCache(const char *fullpath);
+
 char    *FS_CopyExtraInfo(const char *name, const file_info_t *info);
 
 ssize_t FS_FOpenFile(const char *filename, qhandle_t *f, unsigned mode);
@@ -136,6 +138,19 @@ qerror_t FS_FilterFile(qhandle_t f);
 ssize_t FS_LoadFileEx(const char *path, void **buffer, unsigned flags, memtag_t tag);
 // a NULL buffer will just return the file length without loading
 // length < 0 indicates error
+// with FS_FLAG_MAPPED, files from memory mapped packs are returned without
+// copying: buffer is read-only, not NUL terminated and ignores the tag
+void    FS_FreeFile(void *buf);
+
+// callback runs on the main thread and owns the buffer, which is NULL on error
+typedef void (*fsasync_t)(const char *path, void *buffer, ssize_t len, void *arg);
+
+void    FS_LoadFileAsync(const char *path, unsigned flags, fsasync_t callback, void *arg);
+void    FS_PollAsync(void);
+void    FS_FlushAsync(void);
+
+// inflates compressed file in background for a later FS_LoadFile
+#define FS_PrefetchFile(path)   FS_LoadFileAsync(path, 0, NULL, NULL)
 
 qerror_t FS_WriteFile(const char *path, const void *data, size_t len);
 
@@ -161,6 +176,7 @@ qboolean FS_WildCmp(const char *filter, const char *string);
 qboolean FS_ExtCmp(const char *extension, const char *string);
 
 qerror_t FS_LastModified(char const * file, uint64_t * last_modified);
+qerror_t FS_FileStamp(const char *path, uint64_t *stamp);
 
 void    **FS_ListFiles(const char *path, const char *filter, unsigned flags, int *count_p);
 void    **FS_CopyList(void **list, int count);
@@ -0,0 +1,57 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef JOBS_H
+#define JOBS_H
+
+//
+// Worker thread pool for CPU bound tasks.
+//
+// Job functions run on worker threads and must not touch engine state:
+// filesystem, cvars and console are not thread safe. The zone allocator
+// may be used.
+// Anything a job needs has to be prepared by the submitting thread.
+//
+
+typedef struct job_s {
+    struct job_s    *next;
+    void            (*func)(struct job_s *job);
+    int             state;      // private to jobs.c
+} job_t;
+
+typedef void (*jobfor_t)(void *arg, int index);
+
+void    Job_Init(void);
+void    Job_Shutdown(void);
+
+// number of worker threads, 0 if jobs are run inline
+int     Job_NumWorkers(void);
+
+// job must stay valid until Job_Done returns true or Job_Wait returns
+void    Job_Submit(job_t *job);
+qboolean Job_Done(job_t *job);
+void    Job_Wait(job_t *job);
+
+// calls func(arg, index) for each index in [0, count) on worker threads
+// and the calling thread, returns once all of them have finished
+void    Job_ParallelFor(jobfor_t func, void *arg, int count);
+
+// same, but uses at most the given number of threads including the caller
+void    Job_ParallelForEx(jobfor_t func, void *arg, int count, int threads);
+
+#endif // JOBS_H
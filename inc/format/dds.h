@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef FORMAT_DDS_H
+#define FORMAT_DDS_H
+
+/*
+========================================================================
+
+DDS files hold block compressed textures, only DXT1 and DXT5 are read
+
+========================================================================
+*/
+
+#define DDS_IDENT       (('D'<<0)|('D'<<8)|('S'<<16)|(' '<<24))
+
+#define DDSD_MIPMAPCOUNT    0x20000
+
+#define DDPF_FOURCC     0x4
+
+#define DDS_FOURCC_DXT1 (('D'<<0)|('X'<<8)|('T'<<16)|('1'<<24))
+#define DDS_FOURCC_DXT5 (('D'<<0)|('X'<<8)|('T'<<16)|('5'<<24))
+
+typedef struct {
+    uint32_t    size;
+    uint32_t    flags;
+    uint32_t    fourcc;
+    uint32_t    rgb_bit_count;
+    uint32_t    masks[4];
+} ddspixelformat_t;
+
+typedef struct {
+    uint32_t    ident;
+    uint32_t    size;               // 124, not counting ident
+    uint32_t    flags;
+    uint32_t    height;
+    uint32_t    width;
+    uint32_t    pitch_or_linear_size;
+    uint32_t    depth;
+    uint32_t    mipmap_count;
+    uint32_t    reserved1[11];
+    ddspixelformat_t    pf;
+    uint32_t    caps[4];
+    uint32_t    reserved2;
+} dds_t;
+
+#endif // FORMAT_DDS_H
@@ -62,6 +62,7 @@ typedef enum {
     IM_TGA,
     IM_JPG,
     IM_PNG,
+    IM_DDS,
     IM_MAX
 } imageformat_t;
 
@@ -88,6 +89,10 @@ typedef struct image_s {
 	vec2_t          max_light_texcoord;
 	qboolean        entire_texture_emissive;
 	qboolean        processing_complete;
+	byte            *dds_blocks; // mip levels as stored in a .dds file, if any
+	size_t          dds_size;
+	int             dds_format; // tcformat_t
+	int             dds_levels;
 #else
     byte            *pixels[4]; // mip levels
 #endif
@@ -108,6 +113,9 @@ extern uint32_t d_8to24table[256];
 void IMG_ReloadAll();
 image_t *IMG_Find(const char *name, imagetype_t type, imageflags_t flags);
 image_t *IMG_FindExisting(const char *name, imagetype_t type);
+void IMG_Prefetch(const char *name, imagetype_t type, imageflags_t flags);
+void IMG_DecodePrefetched(void);
+void IMG_FlushPrefetched(void);
 image_t *IMG_Clone(image_t *image, const char* new_name);
 void IMG_FreeUnused(void);
 void IMG_FreeAll(void);
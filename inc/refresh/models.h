@@ -177,8 +177,44 @@ struct dmd2header_s;
 qerror_t MOD_ValidateMD2(struct dmd2header_s *header, size_t length);
 
 qerror_t MOD_LoadIQM_Base(model_t* mod, const void* rawdata, size_t length, const char* mod_name);
+qerror_t MOD_ParseIQM_Base(model_t* mod, const void* rawdata, size_t length, const char* mod_name);
 qboolean R_ComputeIQMTransforms(const iqm_model_t* model, const entity_t* entity, float* pose_matrices);
 
+// everything the pose of an IQM entity depends on
+typedef struct
+{
+	const iqm_model_t* model;
+	int frame;
+	int oldframe;
+	float backlerp;
+} iqm_pose_key_t;
+
+#define IQM_POSE_CACHE_SIZE 4096 // power of two
+
+typedef struct
+{
+	iqm_pose_key_t key;
+	int offset;
+	unsigned sequence;
+} iqm_pose_entry_t;
+
+// Poses computed during one frame, so that entities which share model,
+// frames and backlerp also share their matrices. Clearing only bumps
+// the sequence number.
+typedef struct
+{
+	iqm_pose_entry_t entries[IQM_POSE_CACHE_SIZE];
+	unsigned sequence;
+	int num_entries;
+	int num_lookups;
+	int num_hits;
+} iqm_pose_cache_t;
+
+void R_IQMPoseKey(const iqm_model_t* model, const entity_t* entity, iqm_pose_key_t* key);
+void R_ClearIQMPoseCache(iqm_pose_cache_t* cache);
+int R_CacheIQMPose(iqm_pose_cache_t* cache, const iqm_pose_key_t* key, int offset);
+void IQM_PoseTest_f(void);
+
 // these are implemented in [gl,sw]_models.c
 typedef qerror_t (*mod_load_t)(model_t *, const void *, size_t, const char*);
 extern qerror_t (*MOD_LoadMD2)(model_t *model, const void *rawdata, size_t length, const char* mod_name);
@@ -188,4 +224,13 @@ extern qerror_t (*MOD_LoadMD3)(model_t *model, const void *rawdata, size_t lengt
 extern qerror_t(*MOD_LoadIQM)(model_t* model, const void* rawdata, size_t length, const char* mod_name);
 extern void (*MOD_Reference)(model_t *model);
 
+// Optional split of the loaders above, used by R_LoadPrefetchedModels. The parse
+// step runs on worker threads and must not touch materials, images or the
+// console. The finalize step then runs on the main thread with the same data.
+extern mod_load_t MOD_ParseMD2, MOD_FinalizeMD2;
+#if USE_MD3
+extern mod_load_t MOD_ParseMD3, MOD_FinalizeMD3;
+#endif
+extern mod_load_t MOD_ParseIQM, MOD_FinalizeIQM;
+
 #endif // MODELS_H
@@ -25,7 +25,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #define MAX_DLIGHTS     32
 #define MAX_ENTITIES    1024     // == MAX_PACKET_ENTITIES * 2
-#define MAX_PARTICLES   16384
+#define MAX_PARTICLES   16384    // default of cl_maxparticles
+#define MIN_PARTICLE_BUDGET     1024
+#define MAX_PARTICLE_BUDGET     (MAX_PARTICLES * 16)
 #define MAX_LIGHTSTYLES 256
 
 #define POWERSUIT_SCALE     4.0f
@@ -205,6 +207,7 @@ typedef enum {
     IF_SRGB         = (1 << 9),
     IF_FAKE_EMISSIVE= (1 << 10),
     IF_EXACT        = (1 << 11),
+    IF_NORMAL_MAP   = (1 << 12),
 
     // Image source indicator/requirement flags
     IF_SRC_BASE     = (0x1 << 16),
@@ -247,6 +250,9 @@ extern void        (*R_Shutdown)(qboolean total);
 // slash will not use the "pics/" prefix or the ".pcx" postfix)
 extern void    (*R_BeginRegistration)(const char *map);
 qhandle_t R_RegisterModel(const char *name);
+// optional, loads a batch of models on worker threads before they are registered
+void R_PrefetchModel(const char *name);
+void R_LoadPrefetchedModels(void);
 qhandle_t R_RegisterImage(const char *name, imagetype_t type,
                           imageflags_t flags, qerror_t *err_p);
 qhandle_t R_RegisterRawImage(const char *name, int width, int height, byte* pic, imagetype_t type,
@@ -296,6 +302,8 @@ void R_RegisterFunctionsGL();
 #endif
 #if REF_VKPT
 void R_RegisterFunctionsRTX();
+// adds the renderer tests and tools that run on the CPU only, see vkpt/main.c
+void R_RegisterToolsRTX(void);
 #endif
 
 #endif // REFRESH_H
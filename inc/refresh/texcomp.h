@@ -0,0 +1,51 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef TEXCOMP_H
+#define TEXCOMP_H
+
+//
+// texcomp.h -- BC1 and BC3 block compression on the CPU
+//
+
+typedef enum {
+    TC_NONE,
+    TC_BC1,     // RGB, 8 bytes per 4x4 block
+    TC_BC3,     // RGBA, 16 bytes per 4x4 block
+} tcformat_t;
+
+// size of one level in bytes, partial blocks at the edges count as whole
+size_t TC_LevelSize(tcformat_t format, int width, int height);
+
+// compresses RGBA8 pixels into TC_LevelSize bytes at out
+void TC_Encode(tcformat_t format, const byte *rgba, int width, int height, byte *out);
+
+// expands blocks back to RGBA8
+void TC_Decode(tcformat_t format, const byte *in, int width, int height, byte *rgba);
+
+// compresses the image and a full chain of box filtered mip levels down to
+// 1x1, averaging in linear space if srgb is set; free the result with Z_Free
+byte *TC_EncodeMipChain(tcformat_t format, const byte *rgba, int width, int height,
+                        qboolean srgb, int *num_levels, size_t *size);
+
+// like TC_EncodeMipChain, but the first num_blocks levels are copied from
+// an already compressed chain and only the rest are filtered and encoded
+byte *TC_CompleteMipChain(tcformat_t format, const byte *blocks, int num_blocks,
+                          int width, int height, qboolean srgb, int *num_levels, size_t *size);
+
+#endif // TEXCOMP_H
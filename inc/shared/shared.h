@@ -44,6 +44,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "shared/platform.h"
 
+// SSE2 is part of the x86_64 baseline, so no runtime detection is needed.
+// The CPU kernels of the client and the renderers stop at SSE2: wider
+// instruction sets such as AVX2 would need per-file compiler flags and
+// runtime dispatch, which the build does not have.
+#if (defined __SSE2__) || (defined _M_X64) || (defined _M_IX86_FP && _M_IX86_FP >= 2)
+#define USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define USE_SSE2 0
+#endif
+
 #define q_countof(a)        (sizeof(a) / sizeof(a[0]))
 
 typedef unsigned char byte;
@@ -27,6 +27,7 @@ void    Sys_FreeLibrary(void *handle);
 void    *Sys_GetProcAddress(void *handle, const char *sym);
 
 unsigned    Sys_Milliseconds(void);
+uint64_t    Sys_Microseconds(void);     // monotonic, for profiling
 void    Sys_Sleep(int msec);
 qboolean Sys_IsDir(const char *path);
 qboolean Sys_IsFile(const char *path);
@@ -791,6 +791,18 @@ void M_ChangeYaw(edict_t *ent);
 //
 void G_RunEntity(edict_t *ent);
 
+//
+// g_prof.c
+//
+extern  cvar_t  *g_profile;
+
+void G_InitProfile(void);
+uint64_t G_ProfileTime(void);
+void G_ProfileClassname(const char *classname, uint64_t usec);
+void G_ProfileThink(void (*think)(edict_t *), uint64_t usec);
+void G_ProfileFrame(void);
+void Svcmd_Profile_f(void);
+
 //
 // g_main.c
 //
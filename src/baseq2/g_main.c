@@ -179,6 +179,9 @@ void InitGame(void)
     // export our own features
     gi.cvar_forceset("g_features", va("%d", G_FEATURES));
 
+    // think time profiler
+    G_InitProfile();
+
     // items
     InitItems();
 
@@ -526,5 +529,8 @@ void G_RunFrame(void)
 
     // build the playerstate_t structures for all players
     ClientEndServerFrames();
+
+    // flush periodic think time histograms
+    G_ProfileFrame();
 }
 
@@ -102,7 +102,16 @@ qboolean SV_RunThink(edict_t *ent)
     ent->nextthink = 0;
     if (!ent->think)
         gi.error("NULL ent->think");
-    ent->think(ent);
+
+    if (g_profile->integer) {
+        void (*think)(edict_t *) = ent->think;
+        uint64_t start = G_ProfileTime();
+
+        think(ent);
+        G_ProfileThink(think, G_ProfileTime() - start);
+    } else {
+        ent->think(ent);
+    }
 
     return qfalse;
 }
@@ -378,6 +387,63 @@ pushed_t    pushed[MAX_EDICTS], *pushed_p;
 
 edict_t *obstacle;
 
+static edict_t  *push_candidates[MAX_EDICTS];
+
+static int pushcmp(const void *p1, const void *p2)
+{
+    const edict_t *e1 = *(const edict_t **)p1;
+    const edict_t *e2 = *(const edict_t **)p2;
+
+    return e1 - e2;
+}
+
+/*
+============
+SV_PushCandidates
+
+Gathers entities that may ride on or be blocked by the pusher from the
+server's area tree instead of walking every edict for a bounds test.
+Entities standing on the pusher are always moved, even when they are
+outside its bounds, so they are added by a cheap ground check. Result is
+sorted by edict number to keep the processing order of the full scan.
+============
+*/
+static int SV_PushCandidates(edict_t *pusher, vec3_t move)
+{
+    vec3_t  mins, maxs;
+    edict_t *check;
+    int     i, j, count;
+
+    for (i = 0 ; i < 3 ; i++) {
+        if (move[i] > 0) {
+            mins[i] = pusher->absmin[i] - 1;
+            maxs[i] = pusher->absmax[i] + move[i] + 1;
+        } else {
+            mins[i] = pusher->absmin[i] + move[i] - 1;
+            maxs[i] = pusher->absmax[i] + 1;
+        }
+    }
+
+    // items and other triggers can ride movers as well
+    count = gi.BoxEdicts(mins, maxs, push_candidates, MAX_EDICTS, AREA_SOLID);
+    count += gi.BoxEdicts(mins, maxs, push_candidates + count, MAX_EDICTS - count, AREA_TRIGGERS);
+
+    for (i = 1, check = g_edicts + 1; i < globals.num_edicts && count < MAX_EDICTS; i++, check++) {
+        if (check->inuse && check->groundentity == pusher)
+            push_candidates[count++] = check;
+    }
+
+    qsort(push_candidates, count, sizeof(push_candidates[0]), pushcmp);
+
+    // riders within the bounds were found twice
+    for (i = j = 0; i < count; i++) {
+        if (j == 0 || push_candidates[i] != push_candidates[j - 1])
+            push_candidates[j++] = push_candidates[i];
+    }
+
+    return j;
+}
+
 /*
 ============
 SV_Push
@@ -388,7 +454,7 @@ otherwise riders would continue to slide.
 */
 qboolean SV_Push(edict_t *pusher, vec3_t move, vec3_t amove)
 {
-    int         i, e;
+    int         i, e, count;
     edict_t     *check, *block;
     vec3_t      mins, maxs;
     pushed_t    *p;
@@ -412,6 +478,9 @@ qboolean SV_Push(edict_t *pusher, vec3_t move, vec3_t amove)
         maxs[i] = pusher->absmax[i] + move[i];
     }
 
+// find everything close enough to be affected before the pusher moves
+    count = SV_PushCandidates(pusher, move);
+
 // we need this for pushing things later
     VectorSubtract(vec3_origin, amove, org);
     AngleVectors(org, forward, right, up);
@@ -432,8 +501,8 @@ qboolean SV_Push(edict_t *pusher, vec3_t move, vec3_t amove)
     gi.linkentity(pusher);
 
 // see if any solid entities are inside the final position
-    check = g_edicts + 1;
-    for (e = 1; e < globals.num_edicts; e++, check++) {
+    for (e = 0; e < count; e++) {
+        check = push_candidates[e];
         if (!check->inuse)
             continue;
         if (check->movetype == MOVETYPE_PUSH
@@ -904,6 +973,13 @@ G_RunEntity
 */
 void G_RunEntity(edict_t *ent)
 {
+    // ent may be freed while running, so sample classname first
+    const char  *classname = ent->classname;
+    uint64_t    start = 0;
+
+    if (g_profile->integer)
+        start = G_ProfileTime();
+
     if (ent->prethink)
         ent->prethink(ent);
 
@@ -930,4 +1006,7 @@ void G_RunEntity(edict_t *ent)
     default:
         gi.error("SV_Physics: bad movetype %i", (int)ent->movetype);
     }
+
+    if (start)
+        G_ProfileClassname(classname, G_ProfileTime() - start);
 }
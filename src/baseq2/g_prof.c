@@ -0,0 +1,336 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//
+// g_prof.c -- per-classname and per-think function timing
+//
+
+#include "g_local.h"
+#include "g_ptrs.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#define PROF_HASH_SIZE      256     // must be power of two
+#define PROF_NAME_LEN       48
+#define PROF_BUCKETS        16      // 1 usec .. 32 msec, power of two steps
+
+typedef struct {
+    char        name[PROF_NAME_LEN];    // classname, or empty for think entries
+    void        *func;                  // think function, or NULL for classname entries
+    uint64_t    usec;
+    uint64_t    peak;
+    unsigned    calls;
+    unsigned    buckets[PROF_BUCKETS];
+} prof_entry_t;
+
+static prof_entry_t prof_classnames[PROF_HASH_SIZE];
+static prof_entry_t prof_thinks[PROF_HASH_SIZE];
+static int          prof_overflows;
+static float        prof_nextlog;
+
+cvar_t  *g_profile;
+cvar_t  *g_profile_log;
+
+/*
+=================
+G_ProfileTime
+
+Returns a monotonic timestamp in microseconds.
+=================
+*/
+uint64_t G_ProfileTime(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static void add_sample(prof_entry_t *e, uint64_t usec)
+{
+    int b;
+
+    e->usec += usec;
+    e->calls++;
+    if (usec > e->peak)
+        e->peak = usec;
+
+    for (b = 0; b < PROF_BUCKETS - 1 && usec >= (1ULL << b); b++)
+        ;
+    e->buckets[b]++;
+}
+
+void G_ProfileClassname(const char *classname, uint64_t usec)
+{
+    prof_entry_t *e;
+    unsigned hash = 0;
+    const char *s;
+    int i;
+
+    if (!classname)
+        classname = "noclass";
+
+    for (s = classname; *s; s++)
+        hash = hash * 31 + Q_tolower(*s);
+
+    // linear probing, table is never reallocated
+    for (i = 0; i < PROF_HASH_SIZE; i++) {
+        e = &prof_classnames[(hash + i) & (PROF_HASH_SIZE - 1)];
+        if (!e->name[0]) {
+            Q_strlcpy(e->name, classname, sizeof(e->name));
+            break;
+        }
+        if (!Q_strncasecmp(e->name, classname, sizeof(e->name) - 1))
+            break;
+    }
+
+    if (i == PROF_HASH_SIZE) {
+        prof_overflows++;
+        return;
+    }
+
+    add_sample(e, usec);
+}
+
+void G_ProfileThink(void (*think)(edict_t *), uint64_t usec)
+{
+    prof_entry_t *e;
+    size_t hash = (size_t)think >> 4;
+    int i;
+
+    for (i = 0; i < PROF_HASH_SIZE; i++) {
+        e = &prof_thinks[(hash + i) & (PROF_HASH_SIZE - 1)];
+        if (!e->func) {
+            e->func = think;
+            break;
+        }
+        if (e->func == think)
+            break;
+    }
+
+    if (i == PROF_HASH_SIZE) {
+        prof_overflows++;
+        return;
+    }
+
+    add_sample(e, usec);
+}
+
+// resolve think function through the savegame pointer table
+static const char *think_name(void *func)
+{
+    static char buffer[32];
+    const save_ptr_t *ptr;
+    int i;
+
+    for (i = 0, ptr = save_ptrs; i < num_save_ptrs; i++, ptr++) {
+        if (ptr->type == P_think && ptr->ptr == func)
+            return ptr->name;
+    }
+
+    Q_snprintf(buffer, sizeof(buffer), "%p", func);
+    return buffer;
+}
+
+static const char *entry_name(const prof_entry_t *e)
+{
+    return e->func ? think_name(e->func) : e->name;
+}
+
+static int entrycmp(const void *p1, const void *p2)
+{
+    const prof_entry_t *e1 = *(const prof_entry_t **)p1;
+    const prof_entry_t *e2 = *(const prof_entry_t **)p2;
+
+    if (e1->usec > e2->usec)
+        return -1;
+    if (e1->usec < e2->usec)
+        return 1;
+    return 0;
+}
+
+// returns number of used entries sorted by total time
+static int sort_entries(prof_entry_t *table, prof_entry_t **sorted)
+{
+    int i, count;
+
+    for (i = 0, count = 0; i < PROF_HASH_SIZE; i++) {
+        if (table[i].calls)
+            sorted[count++] = &table[i];
+    }
+
+    qsort(sorted, count, sizeof(sorted[0]), entrycmp);
+    return count;
+}
+
+static void print_table(const char *title, prof_entry_t *table, int top)
+{
+    prof_entry_t *sorted[PROF_HASH_SIZE], *e;
+    int i, count;
+
+    count = sort_entries(table, sorted);
+    if (count > top)
+        count = top;
+
+    gi.cprintf(NULL, PRINT_HIGH, "%-32s %10s %8s %8s %8s\n",
+               title, "total us", "calls", "avg us", "peak us");
+    for (i = 0; i < count; i++) {
+        e = sorted[i];
+        gi.cprintf(NULL, PRINT_HIGH, "%-32.32s %10"PRIu64" %8u %8"PRIu64" %8"PRIu64"\n",
+                   entry_name(e), e->usec, e->calls, e->usec / e->calls, e->peak);
+    }
+}
+
+static void write_table(FILE *f, const char *title, prof_entry_t *table)
+{
+    prof_entry_t *sorted[PROF_HASH_SIZE], *e;
+    int i, b, count;
+
+    count = sort_entries(table, sorted);
+
+    fprintf(f, "# %s: name total_us calls peak_us histogram[<1us <2us <4us ... >=16ms]\n", title);
+    for (i = 0; i < count; i++) {
+        e = sorted[i];
+        fprintf(f, "%s %"PRIu64" %u %"PRIu64, entry_name(e), e->usec, e->calls, e->peak);
+        for (b = 0; b < PROF_BUCKETS; b++)
+            fprintf(f, " %u", e->buckets[b]);
+        fprintf(f, "\n");
+    }
+}
+
+static void reset_profile(void)
+{
+    memset(prof_classnames, 0, sizeof(prof_classnames));
+    memset(prof_thinks, 0, sizeof(prof_thinks));
+    prof_overflows = 0;
+}
+
+static void write_profile_log(void)
+{
+    FILE    *f;
+    char    name[MAX_OSPATH];
+    size_t  len;
+    cvar_t  *game;
+
+    game = gi.cvar("game", "", 0);
+
+    if (!*game->string)
+        len = Q_snprintf(name, sizeof(name), "%s/profile.log", GAMEVERSION);
+    else
+        len = Q_snprintf(name, sizeof(name), "%s/profile.log", game->string);
+
+    if (len >= sizeof(name))
+        return;
+
+    f = fopen(name, "a");
+    if (!f) {
+        gi.dprintf("Couldn't open %s\n", name);
+        return;
+    }
+
+    fprintf(f, "== %s frame %d time %.1f\n", level.mapname, level.framenum, level.time);
+    write_table(f, "classnames", prof_classnames);
+    write_table(f, "think", prof_thinks);
+    if (prof_overflows)
+        fprintf(f, "# %d samples dropped\n", prof_overflows);
+
+    fclose(f);
+}
+
+/*
+=================
+G_ProfileFrame
+
+Called at the end of each server frame. Flushes histograms collected
+over the last g_profile_log seconds to profile.log and starts over.
+=================
+*/
+void G_ProfileFrame(void)
+{
+    if (!g_profile->integer || g_profile_log->value <= 0)
+        return;
+
+    if (level.time < prof_nextlog && prof_nextlog - level.time <= g_profile_log->value)
+        return;
+
+    // first call after enabling only arms the timer
+    if (prof_nextlog)
+        write_profile_log();
+
+    reset_profile();
+    prof_nextlog = level.time + g_profile_log->value;
+}
+
+/*
+=================
+Svcmd_Profile_f
+
+sv profile [top count|reset]
+=================
+*/
+void Svcmd_Profile_f(void)
+{
+    char    *cmd;
+    int     top = 10;
+
+    cmd = gi.argv(2);
+    if (!Q_stricmp(cmd, "reset")) {
+        reset_profile();
+        gi.cprintf(NULL, PRINT_HIGH, "Profile reset.\n");
+        return;
+    }
+
+    if (!Q_stricmp(cmd, "top"))
+        top = atoi(gi.argv(3));
+    if (top < 1)
+        top = 10;
+
+    if (!g_profile->integer)
+        gi.cprintf(NULL, PRINT_HIGH, "Profiling is disabled, set g_profile 1 to enable.\n");
+
+    print_table("classname", prof_classnames, top);
+    gi.cprintf(NULL, PRINT_HIGH, "\n");
+    print_table("think", prof_thinks, top);
+
+    if (prof_overflows)
+        gi.cprintf(NULL, PRINT_HIGH, "%d samples dropped (table full)\n", prof_overflows);
+}
+
+void G_InitProfile(void)
+{
+    g_profile = gi.cvar("g_profile", "0", 0);
+    g_profile_log = gi.cvar("g_profile_log", "0", 0);
+
+    reset_profile();
+    prof_nextlog = 0;
+}
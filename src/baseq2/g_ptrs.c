@@ -617,621 +617,621 @@ extern void door_secret_done(void);
 extern void flare_think(void); // Q2RTX
 extern void flare_touch(void); // Q2RTX
 const save_ptr_t save_ptrs[] = {
-{ P_blocked, door_blocked },
-{ P_blocked, door_secret_blocked },
-{ P_blocked, plat_blocked },
-{ P_blocked, rotating_blocked },
-{ P_blocked, train_blocked },
-{ P_blocked, turret_blocked },
-{ P_die, actor_die },
-{ P_die, barrel_delay },
-{ P_die, berserk_die },
-{ P_die, body_die },
-{ P_die, boss2_die },
-{ P_die, brain_die },
-{ P_die, button_killed },
-{ P_die, chick_die },
-{ P_die, debris_die },
-{ P_die, door_killed },
-{ P_die, door_secret_die },
-{ P_die, flipper_die },
-{ P_die, floater_die },
-{ P_die, flyer_die },
-{ P_die, func_explosive_explode },
-{ P_die, gib_die },
-{ P_die, gladiator_die },
-{ P_die, gunner_die },
-{ P_die, hover_die },
-{ P_die, infantry_die },
-{ P_die, insane_die },
-{ P_die, jorg_die },
-{ P_die, makron_die },
-{ P_die, medic_die },
-{ P_die, misc_deadsoldier_die },
-{ P_die, mutant_die },
-{ P_die, parasite_die },
-{ P_die, player_die },
-{ P_die, soldier_die },
-{ P_die, supertank_die },
-{ P_die, tank_die },
-{ P_die, turret_driver_die },
-{ P_monsterinfo_attack, actor_attack },
-{ P_monsterinfo_attack, boss2_attack },
-{ P_monsterinfo_attack, chick_attack },
-{ P_monsterinfo_attack, floater_attack },
-{ P_monsterinfo_attack, flyer_attack },
-{ P_monsterinfo_attack, gladiator_attack },
-{ P_monsterinfo_attack, gunner_attack },
-{ P_monsterinfo_attack, hover_start_attack },
-{ P_monsterinfo_attack, infantry_attack },
-{ P_monsterinfo_attack, jorg_attack },
-{ P_monsterinfo_attack, makron_attack },
-{ P_monsterinfo_attack, medic_attack },
-{ P_monsterinfo_attack, mutant_jump },
-{ P_monsterinfo_attack, parasite_attack },
-{ P_monsterinfo_attack, soldier_attack },
-{ P_monsterinfo_attack, supertank_attack },
-{ P_monsterinfo_attack, tank_attack },
-{ P_monsterinfo_checkattack, Boss2_CheckAttack },
-{ P_monsterinfo_checkattack, Jorg_CheckAttack },
-{ P_monsterinfo_checkattack, Makron_CheckAttack },
-{ P_monsterinfo_checkattack, M_CheckAttack },
-{ P_monsterinfo_checkattack, medic_checkattack },
-{ P_monsterinfo_checkattack, mutant_checkattack },
-{ P_monsterinfo_currentmove, &actor_move_attack },
-{ P_monsterinfo_currentmove, &actor_move_death1 },
-{ P_monsterinfo_currentmove, &actor_move_death2 },
-{ P_monsterinfo_currentmove, &actor_move_flipoff },
-{ P_monsterinfo_currentmove, &actor_move_pain1 },
-{ P_monsterinfo_currentmove, &actor_move_pain2 },
-{ P_monsterinfo_currentmove, &actor_move_pain3 },
-{ P_monsterinfo_currentmove, &actor_move_run },
-{ P_monsterinfo_currentmove, &actor_move_stand },
-{ P_monsterinfo_currentmove, &actor_move_taunt },
-{ P_monsterinfo_currentmove, &actor_move_walk },
-{ P_monsterinfo_currentmove, &berserk_move_attack_club },
-{ P_monsterinfo_currentmove, &berserk_move_attack_spike },
-{ P_monsterinfo_currentmove, &berserk_move_death1 },
-{ P_monsterinfo_currentmove, &berserk_move_death2 },
-{ P_monsterinfo_currentmove, &berserk_move_pain1 },
-{ P_monsterinfo_currentmove, &berserk_move_pain2 },
-{ P_monsterinfo_currentmove, &berserk_move_run1 },
-{ P_monsterinfo_currentmove, &berserk_move_stand },
-{ P_monsterinfo_currentmove, &berserk_move_stand_fidget },
-{ P_monsterinfo_currentmove, &berserk_move_walk },
-{ P_monsterinfo_currentmove, &boss2_move_attack_mg },
-{ P_monsterinfo_currentmove, &boss2_move_attack_post_mg },
-{ P_monsterinfo_currentmove, &boss2_move_attack_pre_mg },
-{ P_monsterinfo_currentmove, &boss2_move_attack_rocket },
-{ P_monsterinfo_currentmove, &boss2_move_death },
-{ P_monsterinfo_currentmove, &boss2_move_pain_heavy },
-{ P_monsterinfo_currentmove, &boss2_move_pain_light },
-{ P_monsterinfo_currentmove, &boss2_move_run },
-{ P_monsterinfo_currentmove, &boss2_move_stand },
-{ P_monsterinfo_currentmove, &boss2_move_stand },
-{ P_monsterinfo_currentmove, &boss2_move_walk },
-{ P_monsterinfo_currentmove, &brain_move_attack1 },
-{ P_monsterinfo_currentmove, &brain_move_attack2 },
-{ P_monsterinfo_currentmove, &brain_move_death1 },
-{ P_monsterinfo_currentmove, &brain_move_death2 },
-{ P_monsterinfo_currentmove, &brain_move_duck },
-{ P_monsterinfo_currentmove, &brain_move_idle },
-{ P_monsterinfo_currentmove, &brain_move_pain1 },
-{ P_monsterinfo_currentmove, &brain_move_pain2 },
-{ P_monsterinfo_currentmove, &brain_move_pain3 },
-{ P_monsterinfo_currentmove, &brain_move_run },
-{ P_monsterinfo_currentmove, &brain_move_stand },
-{ P_monsterinfo_currentmove, &brain_move_stand },
-{ P_monsterinfo_currentmove, &brain_move_walk1 },
-{ P_monsterinfo_currentmove, &chick_move_attack1 },
-{ P_monsterinfo_currentmove, &chick_move_death1 },
-{ P_monsterinfo_currentmove, &chick_move_death2 },
-{ P_monsterinfo_currentmove, &chick_move_duck },
-{ P_monsterinfo_currentmove, &chick_move_end_attack1 },
-{ P_monsterinfo_currentmove, &chick_move_end_slash },
-{ P_monsterinfo_currentmove, &chick_move_fidget },
-{ P_monsterinfo_currentmove, &chick_move_pain1 },
-{ P_monsterinfo_currentmove, &chick_move_pain2 },
-{ P_monsterinfo_currentmove, &chick_move_pain3 },
-{ P_monsterinfo_currentmove, &chick_move_run },
-{ P_monsterinfo_currentmove, &chick_move_slash },
-{ P_monsterinfo_currentmove, &chick_move_stand },
-{ P_monsterinfo_currentmove, &chick_move_start_attack1 },
-{ P_monsterinfo_currentmove, &chick_move_start_run },
-{ P_monsterinfo_currentmove, &chick_move_start_slash },
-{ P_monsterinfo_currentmove, &chick_move_walk },
-{ P_monsterinfo_currentmove, &flipper_move_attack },
-{ P_monsterinfo_currentmove, &flipper_move_death },
-{ P_monsterinfo_currentmove, &flipper_move_pain1 },
-{ P_monsterinfo_currentmove, &flipper_move_pain2 },
-{ P_monsterinfo_currentmove, &flipper_move_run_loop },
-{ P_monsterinfo_currentmove, &flipper_move_run_start },
-{ P_monsterinfo_currentmove, &flipper_move_stand },
-{ P_monsterinfo_currentmove, &flipper_move_stand },
-{ P_monsterinfo_currentmove, &flipper_move_start_run },
-{ P_monsterinfo_currentmove, &flipper_move_walk },
-{ P_monsterinfo_currentmove, &floater_move_attack1 },
-{ P_monsterinfo_currentmove, &floater_move_attack2 },
-{ P_monsterinfo_currentmove, &floater_move_attack3 },
-{ P_monsterinfo_currentmove, &floater_move_pain1 },
-{ P_monsterinfo_currentmove, &floater_move_pain2 },
-{ P_monsterinfo_currentmove, &floater_move_run },
-{ P_monsterinfo_currentmove, &floater_move_stand1 },
-{ P_monsterinfo_currentmove, &floater_move_stand1 },
-{ P_monsterinfo_currentmove, &floater_move_stand2 },
-{ P_monsterinfo_currentmove, &floater_move_stand2 },
-{ P_monsterinfo_currentmove, &floater_move_walk },
-{ P_monsterinfo_currentmove, &flyer_move_attack2 },
-{ P_monsterinfo_currentmove, &flyer_move_end_melee },
-{ P_monsterinfo_currentmove, &flyer_move_loop_melee },
-{ P_monsterinfo_currentmove, &flyer_move_pain1 },
-{ P_monsterinfo_currentmove, &flyer_move_pain2 },
-{ P_monsterinfo_currentmove, &flyer_move_pain3 },
-{ P_monsterinfo_currentmove, &flyer_move_run },
-{ P_monsterinfo_currentmove, &flyer_move_stand },
-{ P_monsterinfo_currentmove, &flyer_move_stand },
-{ P_monsterinfo_currentmove, &flyer_move_start },
-{ P_monsterinfo_currentmove, &flyer_move_start_melee },
-{ P_monsterinfo_currentmove, &flyer_move_stop },
-{ P_monsterinfo_currentmove, &flyer_move_walk },
-{ P_monsterinfo_currentmove, &gladiator_move_attack_gun },
-{ P_monsterinfo_currentmove, &gladiator_move_attack_melee },
-{ P_monsterinfo_currentmove, &gladiator_move_death },
-{ P_monsterinfo_currentmove, &gladiator_move_pain },
-{ P_monsterinfo_currentmove, &gladiator_move_pain_air },
-{ P_monsterinfo_currentmove, &gladiator_move_run },
-{ P_monsterinfo_currentmove, &gladiator_move_stand },
-{ P_monsterinfo_currentmove, &gladiator_move_walk },
-{ P_monsterinfo_currentmove, &gunner_move_attack_chain },
-{ P_monsterinfo_currentmove, &gunner_move_attack_grenade },
-{ P_monsterinfo_currentmove, &gunner_move_death },
-{ P_monsterinfo_currentmove, &gunner_move_duck },
-{ P_monsterinfo_currentmove, &gunner_move_endfire_chain },
-{ P_monsterinfo_currentmove, &gunner_move_fidget },
-{ P_monsterinfo_currentmove, &gunner_move_fire_chain },
-{ P_monsterinfo_currentmove, &gunner_move_pain1 },
-{ P_monsterinfo_currentmove, &gunner_move_pain2 },
-{ P_monsterinfo_currentmove, &gunner_move_pain3 },
-{ P_monsterinfo_currentmove, &gunner_move_run },
-{ P_monsterinfo_currentmove, &gunner_move_runandshoot },
-{ P_monsterinfo_currentmove, &gunner_move_stand },
-{ P_monsterinfo_currentmove, &gunner_move_stand },
-{ P_monsterinfo_currentmove, &gunner_move_walk },
-{ P_monsterinfo_currentmove, &hover_move_attack1 },
-{ P_monsterinfo_currentmove, &hover_move_death1 },
-{ P_monsterinfo_currentmove, &hover_move_end_attack },
-{ P_monsterinfo_currentmove, &hover_move_pain1 },
-{ P_monsterinfo_currentmove, &hover_move_pain2 },
-{ P_monsterinfo_currentmove, &hover_move_pain3 },
-{ P_monsterinfo_currentmove, &hover_move_run },
-{ P_monsterinfo_currentmove, &hover_move_stand },
-{ P_monsterinfo_currentmove, &hover_move_stand },
-{ P_monsterinfo_currentmove, &hover_move_start_attack },
-{ P_monsterinfo_currentmove, &hover_move_walk },
-{ P_monsterinfo_currentmove, &infantry_move_attack1 },
-{ P_monsterinfo_currentmove, &infantry_move_attack2 },
-{ P_monsterinfo_currentmove, &infantry_move_death1 },
-{ P_monsterinfo_currentmove, &infantry_move_death2 },
-{ P_monsterinfo_currentmove, &infantry_move_death3 },
-{ P_monsterinfo_currentmove, &infantry_move_duck },
-{ P_monsterinfo_currentmove, &infantry_move_fidget },
-{ P_monsterinfo_currentmove, &infantry_move_pain1 },
-{ P_monsterinfo_currentmove, &infantry_move_pain2 },
-{ P_monsterinfo_currentmove, &infantry_move_run },
-{ P_monsterinfo_currentmove, &infantry_move_stand },
-{ P_monsterinfo_currentmove, &infantry_move_walk },
-{ P_monsterinfo_currentmove, &insane_move_crawl },
-{ P_monsterinfo_currentmove, &insane_move_crawl_death },
-{ P_monsterinfo_currentmove, &insane_move_crawl_pain },
-{ P_monsterinfo_currentmove, &insane_move_cross },
-{ P_monsterinfo_currentmove, &insane_move_down },
-{ P_monsterinfo_currentmove, &insane_move_downtoup },
-{ P_monsterinfo_currentmove, &insane_move_jumpdown },
-{ P_monsterinfo_currentmove, &insane_move_runcrawl },
-{ P_monsterinfo_currentmove, &insane_move_run_insane },
-{ P_monsterinfo_currentmove, &insane_move_run_normal },
-{ P_monsterinfo_currentmove, &insane_move_stand_death },
-{ P_monsterinfo_currentmove, &insane_move_stand_insane },
-{ P_monsterinfo_currentmove, &insane_move_stand_normal },
-{ P_monsterinfo_currentmove, &insane_move_stand_pain },
-{ P_monsterinfo_currentmove, &insane_move_struggle_cross },
-{ P_monsterinfo_currentmove, &insane_move_struggle_cross },
-{ P_monsterinfo_currentmove, &insane_move_uptodown },
-{ P_monsterinfo_currentmove, &insane_move_walk_insane },
-{ P_monsterinfo_currentmove, &insane_move_walk_normal },
-{ P_monsterinfo_currentmove, &jorg_move_attack1 },
-{ P_monsterinfo_currentmove, &jorg_move_attack2 },
-{ P_monsterinfo_currentmove, &jorg_move_death },
-{ P_monsterinfo_currentmove, &jorg_move_end_attack1 },
-{ P_monsterinfo_currentmove, &jorg_move_pain1 },
-{ P_monsterinfo_currentmove, &jorg_move_pain2 },
-{ P_monsterinfo_currentmove, &jorg_move_pain3 },
-{ P_monsterinfo_currentmove, &jorg_move_run },
-{ P_monsterinfo_currentmove, &jorg_move_stand },
-{ P_monsterinfo_currentmove, &jorg_move_start_attack1 },
-{ P_monsterinfo_currentmove, &jorg_move_walk },
-{ P_monsterinfo_currentmove, &makron_move_attack3 },
-{ P_monsterinfo_currentmove, &makron_move_attack4 },
-{ P_monsterinfo_currentmove, &makron_move_attack5 },
-{ P_monsterinfo_currentmove, &makron_move_death2 },
-{ P_monsterinfo_currentmove, &makron_move_pain4 },
-{ P_monsterinfo_currentmove, &makron_move_pain5 },
-{ P_monsterinfo_currentmove, &makron_move_pain6 },
-{ P_monsterinfo_currentmove, &makron_move_run },
-{ P_monsterinfo_currentmove, &makron_move_sight },
-{ P_monsterinfo_currentmove, &makron_move_stand },
-{ P_monsterinfo_currentmove, &makron_move_walk },
-{ P_monsterinfo_currentmove, &medic_move_attackBlaster },
-{ P_monsterinfo_currentmove, &medic_move_attackCable },
-{ P_monsterinfo_currentmove, &medic_move_attackHyperBlaster },
-{ P_monsterinfo_currentmove, &medic_move_death },
-{ P_monsterinfo_currentmove, &medic_move_duck },
-{ P_monsterinfo_currentmove, &medic_move_pain1 },
-{ P_monsterinfo_currentmove, &medic_move_pain2 },
-{ P_monsterinfo_currentmove, &medic_move_run },
-{ P_monsterinfo_currentmove, &medic_move_stand },
-{ P_monsterinfo_currentmove, &medic_move_walk },
-{ P_monsterinfo_currentmove, &mutant_move_attack },
-{ P_monsterinfo_currentmove, &mutant_move_death1 },
-{ P_monsterinfo_currentmove, &mutant_move_death2 },
-{ P_monsterinfo_currentmove, &mutant_move_idle },
-{ P_monsterinfo_currentmove, &mutant_move_jump },
-{ P_monsterinfo_currentmove, &mutant_move_pain1 },
-{ P_monsterinfo_currentmove, &mutant_move_pain2 },
-{ P_monsterinfo_currentmove, &mutant_move_pain3 },
-{ P_monsterinfo_currentmove, &mutant_move_run },
-{ P_monsterinfo_currentmove, &mutant_move_stand },
-{ P_monsterinfo_currentmove, &mutant_move_start_walk },
-{ P_monsterinfo_currentmove, &mutant_move_walk },
-{ P_monsterinfo_currentmove, &parasite_move_death },
-{ P_monsterinfo_currentmove, &parasite_move_drain },
-{ P_monsterinfo_currentmove, &parasite_move_end_fidget },
-{ P_monsterinfo_currentmove, &parasite_move_fidget },
-{ P_monsterinfo_currentmove, &parasite_move_pain1 },
-{ P_monsterinfo_currentmove, &parasite_move_run },
-{ P_monsterinfo_currentmove, &parasite_move_stand },
-{ P_monsterinfo_currentmove, &parasite_move_stand },
-{ P_monsterinfo_currentmove, &parasite_move_start_fidget },
-{ P_monsterinfo_currentmove, &parasite_move_start_run },
-{ P_monsterinfo_currentmove, &parasite_move_start_walk },
-{ P_monsterinfo_currentmove, &parasite_move_walk },
-{ P_monsterinfo_currentmove, &soldier_move_attack1 },
-{ P_monsterinfo_currentmove, &soldier_move_attack2 },
-{ P_monsterinfo_currentmove, &soldier_move_attack3 },
-{ P_monsterinfo_currentmove, &soldier_move_attack4 },
-{ P_monsterinfo_currentmove, &soldier_move_attack6 },
-{ P_monsterinfo_currentmove, &soldier_move_death1 },
-{ P_monsterinfo_currentmove, &soldier_move_death2 },
-{ P_monsterinfo_currentmove, &soldier_move_death3 },
-{ P_monsterinfo_currentmove, &soldier_move_death4 },
-{ P_monsterinfo_currentmove, &soldier_move_death5 },
-{ P_monsterinfo_currentmove, &soldier_move_death6 },
-{ P_monsterinfo_currentmove, &soldier_move_duck },
-{ P_monsterinfo_currentmove, &soldier_move_pain1 },
-{ P_monsterinfo_currentmove, &soldier_move_pain2 },
-{ P_monsterinfo_currentmove, &soldier_move_pain3 },
-{ P_monsterinfo_currentmove, &soldier_move_pain4 },
-{ P_monsterinfo_currentmove, &soldier_move_run },
-{ P_monsterinfo_currentmove, &soldier_move_stand1 },
-{ P_monsterinfo_currentmove, &soldier_move_stand3 },
-{ P_monsterinfo_currentmove, &soldier_move_start_run },
-{ P_monsterinfo_currentmove, &soldier_move_walk1 },
-{ P_monsterinfo_currentmove, &soldier_move_walk2 },
-{ P_monsterinfo_currentmove, &supertank_move_attack1 },
-{ P_monsterinfo_currentmove, &supertank_move_attack2 },
-{ P_monsterinfo_currentmove, &supertank_move_death },
-{ P_monsterinfo_currentmove, &supertank_move_end_attack1 },
-{ P_monsterinfo_currentmove, &supertank_move_end_attack1 },
-{ P_monsterinfo_currentmove, &supertank_move_forward },
-{ P_monsterinfo_currentmove, &supertank_move_pain1 },
-{ P_monsterinfo_currentmove, &supertank_move_pain2 },
-{ P_monsterinfo_currentmove, &supertank_move_pain3 },
-{ P_monsterinfo_currentmove, &supertank_move_run },
-{ P_monsterinfo_currentmove, &supertank_move_stand },
-{ P_monsterinfo_currentmove, &tank_move_attack_blast },
-{ P_monsterinfo_currentmove, &tank_move_attack_chain },
-{ P_monsterinfo_currentmove, &tank_move_attack_fire_rocket },
-{ P_monsterinfo_currentmove, &tank_move_attack_post_blast },
-{ P_monsterinfo_currentmove, &tank_move_attack_post_rocket },
-{ P_monsterinfo_currentmove, &tank_move_attack_pre_rocket },
-{ P_monsterinfo_currentmove, &tank_move_attack_strike },
-{ P_monsterinfo_currentmove, &tank_move_death },
-{ P_monsterinfo_currentmove, &tank_move_pain1 },
-{ P_monsterinfo_currentmove, &tank_move_pain2 },
-{ P_monsterinfo_currentmove, &tank_move_pain3 },
-{ P_monsterinfo_currentmove, &tank_move_reattack_blast },
-{ P_monsterinfo_currentmove, &tank_move_run },
-{ P_monsterinfo_currentmove, &tank_move_stand },
-{ P_monsterinfo_currentmove, &tank_move_start_run },
-{ P_monsterinfo_currentmove, &tank_move_walk },
-{ P_monsterinfo_dodge, brain_dodge },
-{ P_monsterinfo_dodge, chick_dodge },
-{ P_monsterinfo_dodge, gunner_dodge },
-{ P_monsterinfo_dodge, infantry_dodge },
-{ P_monsterinfo_dodge, medic_dodge },
-{ P_monsterinfo_dodge, soldier_dodge },
-{ P_monsterinfo_idle, brain_idle },
-{ P_monsterinfo_idle, floater_idle },
-{ P_monsterinfo_idle, flyer_idle },
-{ P_monsterinfo_idle, gladiator_idle },
-{ P_monsterinfo_idle, infantry_fidget },
-{ P_monsterinfo_idle, medic_idle },
-{ P_monsterinfo_idle, mutant_idle },
-{ P_monsterinfo_idle, parasite_idle },
-{ P_monsterinfo_idle, tank_idle },
-{ P_monsterinfo_melee, berserk_melee },
-{ P_monsterinfo_melee, brain_melee },
-{ P_monsterinfo_melee, chick_melee },
-{ P_monsterinfo_melee, flipper_melee },
-{ P_monsterinfo_melee, floater_melee },
-{ P_monsterinfo_melee, flyer_melee },
-{ P_monsterinfo_melee, gladiator_melee },
-{ P_monsterinfo_melee, mutant_melee },
-{ P_monsterinfo_run, actor_run },
-{ P_monsterinfo_run, berserk_run },
-{ P_monsterinfo_run, boss2_run },
-{ P_monsterinfo_run, brain_run },
-{ P_monsterinfo_run, chick_run },
-{ P_monsterinfo_run, flipper_start_run },
-{ P_monsterinfo_run, floater_run },
-{ P_monsterinfo_run, flyer_run },
-{ P_monsterinfo_run, gladiator_run },
-{ P_monsterinfo_run, gunner_run },
-{ P_monsterinfo_run, hover_run },
-{ P_monsterinfo_run, infantry_run },
-{ P_monsterinfo_run, insane_run },
-{ P_monsterinfo_run, jorg_run },
-{ P_monsterinfo_run, makron_run },
-{ P_monsterinfo_run, medic_run },
-{ P_monsterinfo_run, mutant_run },
-{ P_monsterinfo_run, parasite_start_run },
-{ P_monsterinfo_run, soldier_run },
-{ P_monsterinfo_run, supertank_run },
-{ P_monsterinfo_run, tank_run },
-{ P_monsterinfo_search, berserk_search },
-{ P_monsterinfo_search, boss2_search },
-{ P_monsterinfo_search, brain_search },
-{ P_monsterinfo_search, gladiator_search },
-{ P_monsterinfo_search, gunner_search },
-{ P_monsterinfo_search, hover_search },
-{ P_monsterinfo_search, jorg_search },
-{ P_monsterinfo_search, medic_search },
-{ P_monsterinfo_search, mutant_search },
-{ P_monsterinfo_search, supertank_search },
-{ P_monsterinfo_sight, berserk_sight },
-{ P_monsterinfo_sight, brain_sight },
-{ P_monsterinfo_sight, chick_sight },
-{ P_monsterinfo_sight, flipper_sight },
-{ P_monsterinfo_sight, floater_sight },
-{ P_monsterinfo_sight, flyer_sight },
-{ P_monsterinfo_sight, gladiator_sight },
-{ P_monsterinfo_sight, gunner_sight },
-{ P_monsterinfo_sight, hover_sight },
-{ P_monsterinfo_sight, infantry_sight },
-{ P_monsterinfo_sight, makron_sight },
-{ P_monsterinfo_sight, medic_sight },
-{ P_monsterinfo_sight, mutant_sight },
-{ P_monsterinfo_sight, parasite_sight },
-{ P_monsterinfo_sight, soldier_sight },
-{ P_monsterinfo_sight, tank_sight },
-{ P_monsterinfo_stand, actor_stand },
-{ P_monsterinfo_stand, berserk_stand },
-{ P_monsterinfo_stand, boss2_stand },
-{ P_monsterinfo_stand, brain_stand },
-{ P_monsterinfo_stand, chick_stand },
-{ P_monsterinfo_stand, flipper_stand },
-{ P_monsterinfo_stand, floater_stand },
-{ P_monsterinfo_stand, flyer_stand },
-{ P_monsterinfo_stand, gladiator_stand },
-{ P_monsterinfo_stand, gunner_stand },
-{ P_monsterinfo_stand, hover_stand },
-{ P_monsterinfo_stand, infantry_stand },
-{ P_monsterinfo_stand, insane_stand },
-{ P_monsterinfo_stand, jorg_stand },
-{ P_monsterinfo_stand, makron_stand },
-{ P_monsterinfo_stand, medic_stand },
-{ P_monsterinfo_stand, mutant_stand },
-{ P_monsterinfo_stand, parasite_stand },
-{ P_monsterinfo_stand, soldier_stand },
-{ P_monsterinfo_stand, supertank_stand },
-{ P_monsterinfo_stand, tank_stand },
-{ P_monsterinfo_walk, actor_walk },
-{ P_monsterinfo_walk, berserk_walk },
-{ P_monsterinfo_walk, boss2_walk },
-{ P_monsterinfo_walk, brain_walk },
-{ P_monsterinfo_walk, chick_walk },
-{ P_monsterinfo_walk, flipper_walk },
-{ P_monsterinfo_walk, floater_walk },
-{ P_monsterinfo_walk, flyer_walk },
-{ P_monsterinfo_walk, gladiator_walk },
-{ P_monsterinfo_walk, gunner_walk },
-{ P_monsterinfo_walk, hover_walk },
-{ P_monsterinfo_walk, infantry_walk },
-{ P_monsterinfo_walk, insane_walk },
-{ P_monsterinfo_walk, jorg_walk },
-{ P_monsterinfo_walk, makron_walk },
-{ P_monsterinfo_walk, medic_walk },
-{ P_monsterinfo_walk, mutant_walk },
-{ P_monsterinfo_walk, parasite_start_walk },
-{ P_monsterinfo_walk, soldier_walk },
-{ P_monsterinfo_walk, supertank_walk },
-{ P_monsterinfo_walk, tank_walk },
-{ P_pain, actor_pain },
-{ P_pain, berserk_pain },
-{ P_pain, boss2_pain },
-{ P_pain, brain_pain },
-{ P_pain, chick_pain },
-{ P_pain, flipper_pain },
-{ P_pain, floater_pain },
-{ P_pain, flyer_pain },
-{ P_pain, gladiator_pain },
-{ P_pain, gunner_pain },
-{ P_pain, hover_pain },
-{ P_pain, infantry_pain },
-{ P_pain, insane_pain },
-{ P_pain, jorg_pain },
-{ P_pain, makron_pain },
-{ P_pain, medic_pain },
-{ P_pain, mutant_pain },
-{ P_pain, parasite_pain },
-{ P_pain, player_pain },
-{ P_pain, soldier_pain },
-{ P_pain, supertank_pain },
-{ P_pain, tank_pain },
-{ P_prethink, misc_viper_bomb_prethink },
-{ P_think, AngleMove_Begin },
-{ P_think, AngleMove_Done },
-{ P_think, AngleMove_Final },
-{ P_think, barrel_explode },
-{ P_think, bfg_explode },
-{ P_think, bfg_think },
-{ P_think, BossExplode },
-{ P_think, button_return },
-{ P_think, commander_body_drop },
-{ P_think, commander_body_think },
-{ P_think, door_go_down },
-{ P_think, door_secret_move2 },
-{ P_think, door_secret_move4 },
-{ P_think, door_secret_move6 },
-{ P_think, DoRespawn },
-{ P_think, drop_make_touchable },
-{ P_think, droptofloor },
-{ P_think, flymonster_start_go },
-{ P_think, func_clock_think },
-{ P_think, func_object_release },
-{ P_think, func_timer_think },
-{ P_think, func_train_find },
-{ P_think, G_FreeEdict },
-{ P_think, gib_think },
-{ P_think, Grenade_Explode },
-{ P_think, hover_deadthink },
-{ P_think, MakronSpawn },
-{ P_think, makron_torso_think },
-{ P_think, M_droptofloor },
-{ P_think, MegaHealth_think },
-{ P_think, M_FliesOff },
-{ P_think, M_FliesOn },
-{ P_think, misc_banner_think },
-{ P_think, misc_blackhole_think },
-{ P_think, misc_easterchick2_think },
-{ P_think, misc_easterchick_think },
-{ P_think, misc_eastertank_think },
-{ P_think, misc_satellite_dish_think },
-{ P_think, monster_think },
-{ P_think, monster_triggered_spawn },
-{ P_think, Move_Begin },
-{ P_think, Move_Done },
-{ P_think, Move_Final },
-{ P_think, multi_wait },
-{ P_think, plat_go_down },
-{ P_think, SP_CreateCoopSpots },
-{ P_think, SP_FixCoopSpots },
-{ P_think, swimmonster_start_go },
-{ P_think, target_crosslevel_target_think },
-{ P_think, target_earthquake_think },
-{ P_think, target_explosion_explode },
-{ P_think, target_laser_start },
-{ P_think, target_laser_think },
-{ P_think, target_lightramp_think },
-{ P_think, Think_AccelMove },
-{ P_think, Think_Boss3Stand },
-{ P_think, Think_CalcMoveSpeed },
-{ P_think, Think_Delay },
-{ P_think, Think_SpawnDoorTrigger },
-{ P_think, TH_viewthing },
-{ P_think, train_next },
-{ P_think, trigger_elevator_init },
-{ P_think, turret_breach_finish_init },
-{ P_think, turret_breach_think },
-{ P_think, turret_driver_link },
-{ P_think, turret_driver_think },
-{ P_think, walkmonster_start_go },
-{ P_think, flare_think }, // Q2RTX
-{ P_touch, flare_touch }, // Q2RTX
-{ P_touch, barrel_touch },
-{ P_touch, bfg_touch },
-{ P_touch, blaster_touch },
-{ P_touch, button_touch },
-{ P_touch, door_touch },
-{ P_touch, drop_temp_touch },
-{ P_touch, func_object_touch },
-{ P_touch, gib_touch },
-{ P_touch, Grenade_Touch },
-{ P_touch, hurt_touch },
-{ P_touch, misc_viper_bomb_touch },
-{ P_touch, mutant_jump_touch },
-{ P_touch, path_corner_touch },
-{ P_touch, point_combat_touch },
-{ P_touch, rocket_touch },
-{ P_touch, rotating_touch },
-{ P_touch, target_actor_touch },
-{ P_touch, teleporter_touch },
-{ P_touch, Touch_DoorTrigger },
-{ P_touch, Touch_Item },
-{ P_touch, Touch_Multi },
-{ P_touch, Touch_Plat_Center },
-{ P_touch, trigger_gravity_touch },
-{ P_touch, trigger_monsterjump_touch },
-{ P_touch, trigger_push_touch },
-{ P_use, actor_use },
-{ P_use, button_use },
-{ P_use, commander_body_use },
-{ P_use, door_secret_use },
-{ P_use, door_use },
-{ P_use, func_clock_use },
-{ P_use, func_conveyor_use },
-{ P_use, func_explosive_spawn },
-{ P_use, func_explosive_use },
-{ P_use, func_object_use },
-{ P_use, func_timer_use },
-{ P_use, func_wall_use },
-{ P_use, hurt_use },
-{ P_use, light_use },
-{ P_use, misc_blackhole_use },
-{ P_use, misc_satellite_dish_use },
-{ P_use, misc_strogg_ship_use },
-{ P_use, misc_viper_bomb_use },
-{ P_use, misc_viper_use },
-{ P_use, monster_triggered_spawn_use },
-{ P_use, monster_use },
-{ P_use, rotating_use },
-{ P_use, target_earthquake_use },
-{ P_use, target_laser_use },
-{ P_use, target_lightramp_use },
-{ P_use, target_string_use },
-{ P_use, train_use },
-{ P_use, trigger_counter_use },
-{ P_use, trigger_crosslevel_trigger_use },
-{ P_use, trigger_elevator_use },
-{ P_use, trigger_enable },
-{ P_use, trigger_key_use },
-{ P_use, trigger_relay_use },
-{ P_use, Use_Areaportal },
-{ P_use, Use_Boss3 },
-{ P_use, Use_Item },
-{ P_use, use_killbox },
-{ P_use, Use_Multi },
-{ P_use, Use_Plat },
-{ P_use, use_target_blaster },
-{ P_use, use_target_changelevel },
-{ P_use, use_target_explosion },
-{ P_use, use_target_goal },
-{ P_use, Use_Target_Help },
-{ P_use, use_target_secret },
-{ P_use, use_target_spawner },
-{ P_use, Use_Target_Speaker },
-{ P_use, use_target_splash },
-{ P_use, Use_Target_Tent },
-{ P_moveinfo_endfunc, plat_hit_bottom },
-{ P_moveinfo_endfunc, plat_hit_top },
-{ P_moveinfo_endfunc, button_done },
-{ P_moveinfo_endfunc, button_wait },
-{ P_moveinfo_endfunc, door_hit_bottom },
-{ P_moveinfo_endfunc, door_hit_top },
-{ P_moveinfo_endfunc, train_wait },
-{ P_moveinfo_endfunc, door_secret_move1 },
-{ P_moveinfo_endfunc, door_secret_move3 },
-{ P_moveinfo_endfunc, door_secret_move5 },
-{ P_moveinfo_endfunc, door_secret_done },
+{ P_blocked, door_blocked, "door_blocked" },
+{ P_blocked, door_secret_blocked, "door_secret_blocked" },
+{ P_blocked, plat_blocked, "plat_blocked" },
+{ P_blocked, rotating_blocked, "rotating_blocked" },
+{ P_blocked, train_blocked, "train_blocked" },
+{ P_blocked, turret_blocked, "turret_blocked" },
+{ P_die, actor_die, "actor_die" },
+{ P_die, barrel_delay, "barrel_delay" },
+{ P_die, berserk_die, "berserk_die" },
+{ P_die, body_die, "body_die" },
+{ P_die, boss2_die, "boss2_die" },
+{ P_die, brain_die, "brain_die" },
+{ P_die, button_killed, "button_killed" },
+{ P_die, chick_die, "chick_die" },
+{ P_die, debris_die, "debris_die" },
+{ P_die, door_killed, "door_killed" },
+{ P_die, door_secret_die, "door_secret_die" },
+{ P_die, flipper_die, "flipper_die" },
+{ P_die, floater_die, "floater_die" },
+{ P_die, flyer_die, "flyer_die" },
+{ P_die, func_explosive_explode, "func_explosive_explode" },
+{ P_die, gib_die, "gib_die" },
+{ P_die, gladiator_die, "gladiator_die" },
+{ P_die, gunner_die, "gunner_die" },
+{ P_die, hover_die, "hover_die" },
+{ P_die, infantry_die, "infantry_die" },
+{ P_die, insane_die, "insane_die" },
+{ P_die, jorg_die, "jorg_die" },
+{ P_die, makron_die, "makron_die" },
+{ P_die, medic_die, "medic_die" },
+{ P_die, misc_deadsoldier_die, "misc_deadsoldier_die" },
+{ P_die, mutant_die, "mutant_die" },
+{ P_die, parasite_die, "parasite_die" },
+{ P_die, player_die, "player_die" },
+{ P_die, soldier_die, "soldier_die" },
+{ P_die, supertank_die, "supertank_die" },
+{ P_die, tank_die, "tank_die" },
+{ P_die, turret_driver_die, "turret_driver_die" },
+{ P_monsterinfo_attack, actor_attack, "actor_attack" },
+{ P_monsterinfo_attack, boss2_attack, "boss2_attack" },
+{ P_monsterinfo_attack, chick_attack, "chick_attack" },
+{ P_monsterinfo_attack, floater_attack, "floater_attack" },
+{ P_monsterinfo_attack, flyer_attack, "flyer_attack" },
+{ P_monsterinfo_attack, gladiator_attack, "gladiator_attack" },
+{ P_monsterinfo_attack, gunner_attack, "gunner_attack" },
+{ P_monsterinfo_attack, hover_start_attack, "hover_start_attack" },
+{ P_monsterinfo_attack, infantry_attack, "infantry_attack" },
+{ P_monsterinfo_attack, jorg_attack, "jorg_attack" },
+{ P_monsterinfo_attack, makron_attack, "makron_attack" },
+{ P_monsterinfo_attack, medic_attack, "medic_attack" },
+{ P_monsterinfo_attack, mutant_jump, "mutant_jump" },
+{ P_monsterinfo_attack, parasite_attack, "parasite_attack" },
+{ P_monsterinfo_attack, soldier_attack, "soldier_attack" },
+{ P_monsterinfo_attack, supertank_attack, "supertank_attack" },
+{ P_monsterinfo_attack, tank_attack, "tank_attack" },
+{ P_monsterinfo_checkattack, Boss2_CheckAttack, "Boss2_CheckAttack" },
+{ P_monsterinfo_checkattack, Jorg_CheckAttack, "Jorg_CheckAttack" },
+{ P_monsterinfo_checkattack, Makron_CheckAttack, "Makron_CheckAttack" },
+{ P_monsterinfo_checkattack, M_CheckAttack, "M_CheckAttack" },
+{ P_monsterinfo_checkattack, medic_checkattack, "medic_checkattack" },
+{ P_monsterinfo_checkattack, mutant_checkattack, "mutant_checkattack" },
+{ P_monsterinfo_currentmove, &actor_move_attack, "actor_move_attack" },
+{ P_monsterinfo_currentmove, &actor_move_death1, "actor_move_death1" },
+{ P_monsterinfo_currentmove, &actor_move_death2, "actor_move_death2" },
+{ P_monsterinfo_currentmove, &actor_move_flipoff, "actor_move_flipoff" },
+{ P_monsterinfo_currentmove, &actor_move_pain1, "actor_move_pain1" },
+{ P_monsterinfo_currentmove, &actor_move_pain2, "actor_move_pain2" },
+{ P_monsterinfo_currentmove, &actor_move_pain3, "actor_move_pain3" },
+{ P_monsterinfo_currentmove, &actor_move_run, "actor_move_run" },
+{ P_monsterinfo_currentmove, &actor_move_stand, "actor_move_stand" },
+{ P_monsterinfo_currentmove, &actor_move_taunt, "actor_move_taunt" },
+{ P_monsterinfo_currentmove, &actor_move_walk, "actor_move_walk" },
+{ P_monsterinfo_currentmove, &berserk_move_attack_club, "berserk_move_attack_club" },
+{ P_monsterinfo_currentmove, &berserk_move_attack_spike, "berserk_move_attack_spike" },
+{ P_monsterinfo_currentmove, &berserk_move_death1, "berserk_move_death1" },
+{ P_monsterinfo_currentmove, &berserk_move_death2, "berserk_move_death2" },
+{ P_monsterinfo_currentmove, &berserk_move_pain1, "berserk_move_pain1" },
+{ P_monsterinfo_currentmove, &berserk_move_pain2, "berserk_move_pain2" },
+{ P_monsterinfo_currentmove, &berserk_move_run1, "berserk_move_run1" },
+{ P_monsterinfo_currentmove, &berserk_move_stand, "berserk_move_stand" },
+{ P_monsterinfo_currentmove, &berserk_move_stand_fidget, "berserk_move_stand_fidget" },
+{ P_monsterinfo_currentmove, &berserk_move_walk, "berserk_move_walk" },
+{ P_monsterinfo_currentmove, &boss2_move_attack_mg, "boss2_move_attack_mg" },
+{ P_monsterinfo_currentmove, &boss2_move_attack_post_mg, "boss2_move_attack_post_mg" },
+{ P_monsterinfo_currentmove, &boss2_move_attack_pre_mg, "boss2_move_attack_pre_mg" },
+{ P_monsterinfo_currentmove, &boss2_move_attack_rocket, "boss2_move_attack_rocket" },
+{ P_monsterinfo_currentmove, &boss2_move_death, "boss2_move_death" },
+{ P_monsterinfo_currentmove, &boss2_move_pain_heavy, "boss2_move_pain_heavy" },
+{ P_monsterinfo_currentmove, &boss2_move_pain_light, "boss2_move_pain_light" },
+{ P_monsterinfo_currentmove, &boss2_move_run, "boss2_move_run" },
+{ P_monsterinfo_currentmove, &boss2_move_stand, "boss2_move_stand" },
+{ P_monsterinfo_currentmove, &boss2_move_stand, "boss2_move_stand" },
+{ P_monsterinfo_currentmove, &boss2_move_walk, "boss2_move_walk" },
+{ P_monsterinfo_currentmove, &brain_move_attack1, "brain_move_attack1" },
+{ P_monsterinfo_currentmove, &brain_move_attack2, "brain_move_attack2" },
+{ P_monsterinfo_currentmove, &brain_move_death1, "brain_move_death1" },
+{ P_monsterinfo_currentmove, &brain_move_death2, "brain_move_death2" },
+{ P_monsterinfo_currentmove, &brain_move_duck, "brain_move_duck" },
+{ P_monsterinfo_currentmove, &brain_move_idle, "brain_move_idle" },
+{ P_monsterinfo_currentmove, &brain_move_pain1, "brain_move_pain1" },
+{ P_monsterinfo_currentmove, &brain_move_pain2, "brain_move_pain2" },
+{ P_monsterinfo_currentmove, &brain_move_pain3, "brain_move_pain3" },
+{ P_monsterinfo_currentmove, &brain_move_run, "brain_move_run" },
+{ P_monsterinfo_currentmove, &brain_move_stand, "brain_move_stand" },
+{ P_monsterinfo_currentmove, &brain_move_stand, "brain_move_stand" },
+{ P_monsterinfo_currentmove, &brain_move_walk1, "brain_move_walk1" },
+{ P_monsterinfo_currentmove, &chick_move_attack1, "chick_move_attack1" },
+{ P_monsterinfo_currentmove, &chick_move_death1, "chick_move_death1" },
+{ P_monsterinfo_currentmove, &chick_move_death2, "chick_move_death2" },
+{ P_monsterinfo_currentmove, &chick_move_duck, "chick_move_duck" },
+{ P_monsterinfo_currentmove, &chick_move_end_attack1, "chick_move_end_attack1" },
+{ P_monsterinfo_currentmove, &chick_move_end_slash, "chick_move_end_slash" },
+{ P_monsterinfo_currentmove, &chick_move_fidget, "chick_move_fidget" },
+{ P_monsterinfo_currentmove, &chick_move_pain1, "chick_move_pain1" },
+{ P_monsterinfo_currentmove, &chick_move_pain2, "chick_move_pain2" },
+{ P_monsterinfo_currentmove, &chick_move_pain3, "chick_move_pain3" },
+{ P_monsterinfo_currentmove, &chick_move_run, "chick_move_run" },
+{ P_monsterinfo_currentmove, &chick_move_slash, "chick_move_slash" },
+{ P_monsterinfo_currentmove, &chick_move_stand, "chick_move_stand" },
+{ P_monsterinfo_currentmove, &chick_move_start_attack1, "chick_move_start_attack1" },
+{ P_monsterinfo_currentmove, &chick_move_start_run, "chick_move_start_run" },
+{ P_monsterinfo_currentmove, &chick_move_start_slash, "chick_move_start_slash" },
+{ P_monsterinfo_currentmove, &chick_move_walk, "chick_move_walk" },
+{ P_monsterinfo_currentmove, &flipper_move_attack, "flipper_move_attack" },
+{ P_monsterinfo_currentmove, &flipper_move_death, "flipper_move_death" },
+{ P_monsterinfo_currentmove, &flipper_move_pain1, "flipper_move_pain1" },
+{ P_monsterinfo_currentmove, &flipper_move_pain2, "flipper_move_pain2" },
+{ P_monsterinfo_currentmove, &flipper_move_run_loop, "flipper_move_run_loop" },
+{ P_monsterinfo_currentmove, &flipper_move_run_start, "flipper_move_run_start" },
+{ P_monsterinfo_currentmove, &flipper_move_stand, "flipper_move_stand" },
+{ P_monsterinfo_currentmove, &flipper_move_stand, "flipper_move_stand" },
+{ P_monsterinfo_currentmove, &flipper_move_start_run, "flipper_move_start_run" },
+{ P_monsterinfo_currentmove, &flipper_move_walk, "flipper_move_walk" },
+{ P_monsterinfo_currentmove, &floater_move_attack1, "floater_move_attack1" },
+{ P_monsterinfo_currentmove, &floater_move_attack2, "floater_move_attack2" },
+{ P_monsterinfo_currentmove, &floater_move_attack3, "floater_move_attack3" },
+{ P_monsterinfo_currentmove, &floater_move_pain1, "floater_move_pain1" },
+{ P_monsterinfo_currentmove, &floater_move_pain2, "floater_move_pain2" },
+{ P_monsterinfo_currentmove, &floater_move_run, "floater_move_run" },
+{ P_monsterinfo_currentmove, &floater_move_stand1, "floater_move_stand1" },
+{ P_monsterinfo_currentmove, &floater_move_stand1, "floater_move_stand1" },
+{ P_monsterinfo_currentmove, &floater_move_stand2, "floater_move_stand2" },
+{ P_monsterinfo_currentmove, &floater_move_stand2, "floater_move_stand2" },
+{ P_monsterinfo_currentmove, &floater_move_walk, "floater_move_walk" },
+{ P_monsterinfo_currentmove, &flyer_move_attack2, "flyer_move_attack2" },
+{ P_monsterinfo_currentmove, &flyer_move_end_melee, "flyer_move_end_melee" },
+{ P_monsterinfo_currentmove, &flyer_move_loop_melee, "flyer_move_loop_melee" },
+{ P_monsterinfo_currentmove, &flyer_move_pain1, "flyer_move_pain1" },
+{ P_monsterinfo_currentmove, &flyer_move_pain2, "flyer_move_pain2" },
+{ P_monsterinfo_currentmove, &flyer_move_pain3, "flyer_move_pain3" },
+{ P_monsterinfo_currentmove, &flyer_move_run, "flyer_move_run" },
+{ P_monsterinfo_currentmove, &flyer_move_stand, "flyer_move_stand" },
+{ P_monsterinfo_currentmove, &flyer_move_stand, "flyer_move_stand" },
+{ P_monsterinfo_currentmove, &flyer_move_start, "flyer_move_start" },
+{ P_monsterinfo_currentmove, &flyer_move_start_melee, "flyer_move_start_melee" },
+{ P_monsterinfo_currentmove, &flyer_move_stop, "flyer_move_stop" },
+{ P_monsterinfo_currentmove, &flyer_move_walk, "flyer_move_walk" },
+{ P_monsterinfo_currentmove, &gladiator_move_attack_gun, "gladiator_move_attack_gun" },
+{ P_monsterinfo_currentmove, &gladiator_move_attack_melee, "gladiator_move_attack_melee" },
+{ P_monsterinfo_currentmove, &gladiator_move_death, "gladiator_move_death" },
+{ P_monsterinfo_currentmove, &gladiator_move_pain, "gladiator_move_pain" },
+{ P_monsterinfo_currentmove, &gladiator_move_pain_air, "gladiator_move_pain_air" },
+{ P_monsterinfo_currentmove, &gladiator_move_run, "gladiator_move_run" },
+{ P_monsterinfo_currentmove, &gladiator_move_stand, "gladiator_move_stand" },
+{ P_monsterinfo_currentmove, &gladiator_move_walk, "gladiator_move_walk" },
+{ P_monsterinfo_currentmove, &gunner_move_attack_chain, "gunner_move_attack_chain" },
+{ P_monsterinfo_currentmove, &gunner_move_attack_grenade, "gunner_move_attack_grenade" },
+{ P_monsterinfo_currentmove, &gunner_move_death, "gunner_move_death" },
+{ P_monsterinfo_currentmove, &gunner_move_duck, "gunner_move_duck" },
+{ P_monsterinfo_currentmove, &gunner_move_endfire_chain, "gunner_move_endfire_chain" },
+{ P_monsterinfo_currentmove, &gunner_move_fidget, "gunner_move_fidget" },
+{ P_monsterinfo_currentmove, &gunner_move_fire_chain, "gunner_move_fire_chain" },
+{ P_monsterinfo_currentmove, &gunner_move_pain1, "gunner_move_pain1" },
+{ P_monsterinfo_currentmove, &gunner_move_pain2, "gunner_move_pain2" },
+{ P_monsterinfo_currentmove, &gunner_move_pain3, "gunner_move_pain3" },
+{ P_monsterinfo_currentmove, &gunner_move_run, "gunner_move_run" },
+{ P_monsterinfo_currentmove, &gunner_move_runandshoot, "gunner_move_runandshoot" },
+{ P_monsterinfo_currentmove, &gunner_move_stand, "gunner_move_stand" },
+{ P_monsterinfo_currentmove, &gunner_move_stand, "gunner_move_stand" },
+{ P_monsterinfo_currentmove, &gunner_move_walk, "gunner_move_walk" },
+{ P_monsterinfo_currentmove, &hover_move_attack1, "hover_move_attack1" },
+{ P_monsterinfo_currentmove, &hover_move_death1, "hover_move_death1" },
+{ P_monsterinfo_currentmove, &hover_move_end_attack, "hover_move_end_attack" },
+{ P_monsterinfo_currentmove, &hover_move_pain1, "hover_move_pain1" },
+{ P_monsterinfo_currentmove, &hover_move_pain2, "hover_move_pain2" },
+{ P_monsterinfo_currentmove, &hover_move_pain3, "hover_move_pain3" },
+{ P_monsterinfo_currentmove, &hover_move_run, "hover_move_run" },
+{ P_monsterinfo_currentmove, &hover_move_stand, "hover_move_stand" },
+{ P_monsterinfo_currentmove, &hover_move_stand, "hover_move_stand" },
+{ P_monsterinfo_currentmove, &hover_move_start_attack, "hover_move_start_attack" },
+{ P_monsterinfo_currentmove, &hover_move_walk, "hover_move_walk" },
+{ P_monsterinfo_currentmove, &infantry_move_attack1, "infantry_move_attack1" },
+{ P_monsterinfo_currentmove, &infantry_move_attack2, "infantry_move_attack2" },
+{ P_monsterinfo_currentmove, &infantry_move_death1, "infantry_move_death1" },
+{ P_monsterinfo_currentmove, &infantry_move_death2, "infantry_move_death2" },
+{ P_monsterinfo_currentmove, &infantry_move_death3, "infantry_move_death3" },
+{ P_monsterinfo_currentmove, &infantry_move_duck, "infantry_move_duck" },
+{ P_monsterinfo_currentmove, &infantry_move_fidget, "infantry_move_fidget" },
+{ P_monsterinfo_currentmove, &infantry_move_pain1, "infantry_move_pain1" },
+{ P_monsterinfo_currentmove, &infantry_move_pain2, "infantry_move_pain2" },
+{ P_monsterinfo_currentmove, &infantry_move_run, "infantry_move_run" },
+{ P_monsterinfo_currentmove, &infantry_move_stand, "infantry_move_stand" },
+{ P_monsterinfo_currentmove, &infantry_move_walk, "infantry_move_walk" },
+{ P_monsterinfo_currentmove, &insane_move_crawl, "insane_move_crawl" },
+{ P_monsterinfo_currentmove, &insane_move_crawl_death, "insane_move_crawl_death" },
+{ P_monsterinfo_currentmove, &insane_move_crawl_pain, "insane_move_crawl_pain" },
+{ P_monsterinfo_currentmove, &insane_move_cross, "insane_move_cross" },
+{ P_monsterinfo_currentmove, &insane_move_down, "insane_move_down" },
+{ P_monsterinfo_currentmove, &insane_move_downtoup, "insane_move_downtoup" },
+{ P_monsterinfo_currentmove, &insane_move_jumpdown, "insane_move_jumpdown" },
+{ P_monsterinfo_currentmove, &insane_move_runcrawl, "insane_move_runcrawl" },
+{ P_monsterinfo_currentmove, &insane_move_run_insane, "insane_move_run_insane" },
+{ P_monsterinfo_currentmove, &insane_move_run_normal, "insane_move_run_normal" },
+{ P_monsterinfo_currentmove, &insane_move_stand_death, "insane_move_stand_death" },
+{ P_monsterinfo_currentmove, &insane_move_stand_insane, "insane_move_stand_insane" },
+{ P_monsterinfo_currentmove, &insane_move_stand_normal, "insane_move_stand_normal" },
+{ P_monsterinfo_currentmove, &insane_move_stand_pain, "insane_move_stand_pain" },
+{ P_monsterinfo_currentmove, &insane_move_struggle_cross, "insane_move_struggle_cross" },
+{ P_monsterinfo_currentmove, &insane_move_struggle_cross, "insane_move_struggle_cross" },
+{ P_monsterinfo_currentmove, &insane_move_uptodown, "insane_move_uptodown" },
+{ P_monsterinfo_currentmove, &insane_move_walk_insane, "insane_move_walk_insane" },
+{ P_monsterinfo_currentmove, &insane_move_walk_normal, "insane_move_walk_normal" },
+{ P_monsterinfo_currentmove, &jorg_move_attack1, "jorg_move_attack1" },
+{ P_monsterinfo_currentmove, &jorg_move_attack2, "jorg_move_attack2" },
+{ P_monsterinfo_currentmove, &jorg_move_death, "jorg_move_death" },
+{ P_monsterinfo_currentmove, &jorg_move_end_attack1, "jorg_move_end_attack1" },
+{ P_monsterinfo_currentmove, &jorg_move_pain1, "jorg_move_pain1" },
+{ P_monsterinfo_currentmove, &jorg_move_pain2, "jorg_move_pain2" },
+{ P_monsterinfo_currentmove, &jorg_move_pain3, "jorg_move_pain3" },
+{ P_monsterinfo_currentmove, &jorg_move_run, "jorg_move_run" },
+{ P_monsterinfo_currentmove, &jorg_move_stand, "jorg_move_stand" },
+{ P_monsterinfo_currentmove, &jorg_move_start_attack1, "jorg_move_start_attack1" },
+{ P_monsterinfo_currentmove, &jorg_move_walk, "jorg_move_walk" },
+{ P_monsterinfo_currentmove, &makron_move_attack3, "makron_move_attack3" },
+{ P_monsterinfo_currentmove, &makron_move_attack4, "makron_move_attack4" },
+{ P_monsterinfo_currentmove, &makron_move_attack5, "makron_move_attack5" },
+{ P_monsterinfo_currentmove, &makron_move_death2, "makron_move_death2" },
+{ P_monsterinfo_currentmove, &makron_move_pain4, "makron_move_pain4" },
+{ P_monsterinfo_currentmove, &makron_move_pain5, "makron_move_pain5" },
+{ P_monsterinfo_currentmove, &makron_move_pain6, "makron_move_pain6" },
+{ P_monsterinfo_currentmove, &makron_move_run, "makron_move_run" },
+{ P_monsterinfo_currentmove, &makron_move_sight, "makron_move_sight" },
+{ P_monsterinfo_currentmove, &makron_move_stand, "makron_move_stand" },
+{ P_monsterinfo_currentmove, &makron_move_walk, "makron_move_walk" },
+{ P_monsterinfo_currentmove, &medic_move_attackBlaster, "medic_move_attackBlaster" },
+{ P_monsterinfo_currentmove, &medic_move_attackCable, "medic_move_attackCable" },
+{ P_monsterinfo_currentmove, &medic_move_attackHyperBlaster, "medic_move_attackHyperBlaster" },
+{ P_monsterinfo_currentmove, &medic_move_death, "medic_move_death" },
+{ P_monsterinfo_currentmove, &medic_move_duck, "medic_move_duck" },
+{ P_monsterinfo_currentmove, &medic_move_pain1, "medic_move_pain1" },
+{ P_monsterinfo_currentmove, &medic_move_pain2, "medic_move_pain2" },
+{ P_monsterinfo_currentmove, &medic_move_run, "medic_move_run" },
+{ P_monsterinfo_currentmove, &medic_move_stand, "medic_move_stand" },
+{ P_monsterinfo_currentmove, &medic_move_walk, "medic_move_walk" },
+{ P_monsterinfo_currentmove, &mutant_move_attack, "mutant_move_attack" },
+{ P_monsterinfo_currentmove, &mutant_move_death1, "mutant_move_death1" },
+{ P_monsterinfo_currentmove, &mutant_move_death2, "mutant_move_death2" },
+{ P_monsterinfo_currentmove, &mutant_move_idle, "mutant_move_idle" },
+{ P_monsterinfo_currentmove, &mutant_move_jump, "mutant_move_jump" },
+{ P_monsterinfo_currentmove, &mutant_move_pain1, "mutant_move_pain1" },
+{ P_monsterinfo_currentmove, &mutant_move_pain2, "mutant_move_pain2" },
+{ P_monsterinfo_currentmove, &mutant_move_pain3, "mutant_move_pain3" },
+{ P_monsterinfo_currentmove, &mutant_move_run, "mutant_move_run" },
+{ P_monsterinfo_currentmove, &mutant_move_stand, "mutant_move_stand" },
+{ P_monsterinfo_currentmove, &mutant_move_start_walk, "mutant_move_start_walk" },
+{ P_monsterinfo_currentmove, &mutant_move_walk, "mutant_move_walk" },
+{ P_monsterinfo_currentmove, &parasite_move_death, "parasite_move_death" },
+{ P_monsterinfo_currentmove, &parasite_move_drain, "parasite_move_drain" },
+{ P_monsterinfo_currentmove, &parasite_move_end_fidget, "parasite_move_end_fidget" },
+{ P_monsterinfo_currentmove, &parasite_move_fidget, "parasite_move_fidget" },
+{ P_monsterinfo_currentmove, &parasite_move_pain1, "parasite_move_pain1" },
+{ P_monsterinfo_currentmove, &parasite_move_run, "parasite_move_run" },
+{ P_monsterinfo_currentmove, &parasite_move_stand, "parasite_move_stand" },
+{ P_monsterinfo_currentmove, &parasite_move_stand, "parasite_move_stand" },
+{ P_monsterinfo_currentmove, &parasite_move_start_fidget, "parasite_move_start_fidget" },
+{ P_monsterinfo_currentmove, &parasite_move_start_run, "parasite_move_start_run" },
+{ P_monsterinfo_currentmove, &parasite_move_start_walk, "parasite_move_start_walk" },
+{ P_monsterinfo_currentmove, &parasite_move_walk, "parasite_move_walk" },
+{ P_monsterinfo_currentmove, &soldier_move_attack1, "soldier_move_attack1" },
+{ P_monsterinfo_currentmove, &soldier_move_attack2, "soldier_move_attack2" },
+{ P_monsterinfo_currentmove, &soldier_move_attack3, "soldier_move_attack3" },
+{ P_monsterinfo_currentmove, &soldier_move_attack4, "soldier_move_attack4" },
+{ P_monsterinfo_currentmove, &soldier_move_attack6, "soldier_move_attack6" },
+{ P_monsterinfo_currentmove, &soldier_move_death1, "soldier_move_death1" },
+{ P_monsterinfo_currentmove, &soldier_move_death2, "soldier_move_death2" },
+{ P_monsterinfo_currentmove, &soldier_move_death3, "soldier_move_death3" },
+{ P_monsterinfo_currentmove, &soldier_move_death4, "soldier_move_death4" },
+{ P_monsterinfo_currentmove, &soldier_move_death5, "soldier_move_death5" },
+{ P_monsterinfo_currentmove, &soldier_move_death6, "soldier_move_death6" },
+{ P_monsterinfo_currentmove, &soldier_move_duck, "soldier_move_duck" },
+{ P_monsterinfo_currentmove, &soldier_move_pain1, "soldier_move_pain1" },
+{ P_monsterinfo_currentmove, &soldier_move_pain2, "soldier_move_pain2" },
+{ P_monsterinfo_currentmove, &soldier_move_pain3, "soldier_move_pain3" },
+{ P_monsterinfo_currentmove, &soldier_move_pain4, "soldier_move_pain4" },
+{ P_monsterinfo_currentmove, &soldier_move_run, "soldier_move_run" },
+{ P_monsterinfo_currentmove, &soldier_move_stand1, "soldier_move_stand1" },
+{ P_monsterinfo_currentmove, &soldier_move_stand3, "soldier_move_stand3" },
+{ P_monsterinfo_currentmove, &soldier_move_start_run, "soldier_move_start_run" },
+{ P_monsterinfo_currentmove, &soldier_move_walk1, "soldier_move_walk1" },
+{ P_monsterinfo_currentmove, &soldier_move_walk2, "soldier_move_walk2" },
+{ P_monsterinfo_currentmove, &supertank_move_attack1, "supertank_move_attack1" },
+{ P_monsterinfo_currentmove, &supertank_move_attack2, "supertank_move_attack2" },
+{ P_monsterinfo_currentmove, &supertank_move_death, "supertank_move_death" },
+{ P_monsterinfo_currentmove, &supertank_move_end_attack1, "supertank_move_end_attack1" },
+{ P_monsterinfo_currentmove, &supertank_move_end_attack1, "supertank_move_end_attack1" },
+{ P_monsterinfo_currentmove, &supertank_move_forward, "supertank_move_forward" },
+{ P_monsterinfo_currentmove, &supertank_move_pain1, "supertank_move_pain1" },
+{ P_monsterinfo_currentmove, &supertank_move_pain2, "supertank_move_pain2" },
+{ P_monsterinfo_currentmove, &supertank_move_pain3, "supertank_move_pain3" },
+{ P_monsterinfo_currentmove, &supertank_move_run, "supertank_move_run" },
+{ P_monsterinfo_currentmove, &supertank_move_stand, "supertank_move_stand" },
+{ P_monsterinfo_currentmove, &tank_move_attack_blast, "tank_move_attack_blast" },
+{ P_monsterinfo_currentmove, &tank_move_attack_chain, "tank_move_attack_chain" },
+{ P_monsterinfo_currentmove, &tank_move_attack_fire_rocket, "tank_move_attack_fire_rocket" },
+{ P_monsterinfo_currentmove, &tank_move_attack_post_blast, "tank_move_attack_post_blast" },
+{ P_monsterinfo_currentmove, &tank_move_attack_post_rocket, "tank_move_attack_post_rocket" },
+{ P_monsterinfo_currentmove, &tank_move_attack_pre_rocket, "tank_move_attack_pre_rocket" },
+{ P_monsterinfo_currentmove, &tank_move_attack_strike, "tank_move_attack_strike" },
+{ P_monsterinfo_currentmove, &tank_move_death, "tank_move_death" },
+{ P_monsterinfo_currentmove, &tank_move_pain1, "tank_move_pain1" },
+{ P_monsterinfo_currentmove, &tank_move_pain2, "tank_move_pain2" },
+{ P_monsterinfo_currentmove, &tank_move_pain3, "tank_move_pain3" },
+{ P_monsterinfo_currentmove, &tank_move_reattack_blast, "tank_move_reattack_blast" },
+{ P_monsterinfo_currentmove, &tank_move_run, "tank_move_run" },
+{ P_monsterinfo_currentmove, &tank_move_stand, "tank_move_stand" },
+{ P_monsterinfo_currentmove, &tank_move_start_run, "tank_move_start_run" },
+{ P_monsterinfo_currentmove, &tank_move_walk, "tank_move_walk" },
+{ P_monsterinfo_dodge, brain_dodge, "brain_dodge" },
+{ P_monsterinfo_dodge, chick_dodge, "chick_dodge" },
+{ P_monsterinfo_dodge, gunner_dodge, "gunner_dodge" },
+{ P_monsterinfo_dodge, infantry_dodge, "infantry_dodge" },
+{ P_monsterinfo_dodge, medic_dodge, "medic_dodge" },
+{ P_monsterinfo_dodge, soldier_dodge, "soldier_dodge" },
+{ P_monsterinfo_idle, brain_idle, "brain_idle" },
+{ P_monsterinfo_idle, floater_idle, "floater_idle" },
+{ P_monsterinfo_idle, flyer_idle, "flyer_idle" },
+{ P_monsterinfo_idle, gladiator_idle, "gladiator_idle" },
+{ P_monsterinfo_idle, infantry_fidget, "infantry_fidget" },
+{ P_monsterinfo_idle, medic_idle, "medic_idle" },
+{ P_monsterinfo_idle, mutant_idle, "mutant_idle" },
+{ P_monsterinfo_idle, parasite_idle, "parasite_idle" },
+{ P_monsterinfo_idle, tank_idle, "tank_idle" },
+{ P_monsterinfo_melee, berserk_melee, "berserk_melee" },
+{ P_monsterinfo_melee, brain_melee, "brain_melee" },
+{ P_monsterinfo_melee, chick_melee, "chick_melee" },
+{ P_monsterinfo_melee, flipper_melee, "flipper_melee" },
+{ P_monsterinfo_melee, floater_melee, "floater_melee" },
+{ P_monsterinfo_melee, flyer_melee, "flyer_melee" },
+{ P_monsterinfo_melee, gladiator_melee, "gladiator_melee" },
+{ P_monsterinfo_melee, mutant_melee, "mutant_melee" },
+{ P_monsterinfo_run, actor_run, "actor_run" },
+{ P_monsterinfo_run, berserk_run, "berserk_run" },
+{ P_monsterinfo_run, boss2_run, "boss2_run" },
+{ P_monsterinfo_run, brain_run, "brain_run" },
+{ P_monsterinfo_run, chick_run, "chick_run" },
+{ P_monsterinfo_run, flipper_start_run, "flipper_start_run" },
+{ P_monsterinfo_run, floater_run, "floater_run" },
+{ P_monsterinfo_run, flyer_run, "flyer_run" },
+{ P_monsterinfo_run, gladiator_run, "gladiator_run" },
+{ P_monsterinfo_run, gunner_run, "gunner_run" },
+{ P_monsterinfo_run, hover_run, "hover_run" },
+{ P_monsterinfo_run, infantry_run, "infantry_run" },
+{ P_monsterinfo_run, insane_run, "insane_run" },
+{ P_monsterinfo_run, jorg_run, "jorg_run" },
+{ P_monsterinfo_run, makron_run, "makron_run" },
+{ P_monsterinfo_run, medic_run, "medic_run" },
+{ P_monsterinfo_run, mutant_run, "mutant_run" },
+{ P_monsterinfo_run, parasite_start_run, "parasite_start_run" },
+{ P_monsterinfo_run, soldier_run, "soldier_run" },
+{ P_monsterinfo_run, supertank_run, "supertank_run" },
+{ P_monsterinfo_run, tank_run, "tank_run" },
+{ P_monsterinfo_search, berserk_search, "berserk_search" },
+{ P_monsterinfo_search, boss2_search, "boss2_search" },
+{ P_monsterinfo_search, brain_search, "brain_search" },
+{ P_monsterinfo_search, gladiator_search, "gladiator_search" },
+{ P_monsterinfo_search, gunner_search, "gunner_search" },
+{ P_monsterinfo_search, hover_search, "hover_search" },
+{ P_monsterinfo_search, jorg_search, "jorg_search" },
+{ P_monsterinfo_search, medic_search, "medic_search" },
+{ P_monsterinfo_search, mutant_search, "mutant_search" },
+{ P_monsterinfo_search, supertank_search, "supertank_search" },
+{ P_monsterinfo_sight, berserk_sight, "berserk_sight" },
+{ P_monsterinfo_sight, brain_sight, "brain_sight" },
+{ P_monsterinfo_sight, chick_sight, "chick_sight" },
+{ P_monsterinfo_sight, flipper_sight, "flipper_sight" },
+{ P_monsterinfo_sight, floater_sight, "floater_sight" },
+{ P_monsterinfo_sight, flyer_sight, "flyer_sight" },
+{ P_monsterinfo_sight, gladiator_sight, "gladiator_sight" },
+{ P_monsterinfo_sight, gunner_sight, "gunner_sight" },
+{ P_monsterinfo_sight, hover_sight, "hover_sight" },
+{ P_monsterinfo_sight, infantry_sight, "infantry_sight" },
+{ P_monsterinfo_sight, makron_sight, "makron_sight" },
+{ P_monsterinfo_sight, medic_sight, "medic_sight" },
+{ P_monsterinfo_sight, mutant_sight, "mutant_sight" },
+{ P_monsterinfo_sight, parasite_sight, "parasite_sight" },
+{ P_monsterinfo_sight, soldier_sight, "soldier_sight" },
+{ P_monsterinfo_sight, tank_sight, "tank_sight" },
+{ P_monsterinfo_stand, actor_stand, "actor_stand" },
+{ P_monsterinfo_stand, berserk_stand, "berserk_stand" },
+{ P_monsterinfo_stand, boss2_stand, "boss2_stand" },
+{ P_monsterinfo_stand, brain_stand, "brain_stand" },
+{ P_monsterinfo_stand, chick_stand, "chick_stand" },
+{ P_monsterinfo_stand, flipper_stand, "flipper_stand" },
+{ P_monsterinfo_stand, floater_stand, "floater_stand" },
+{ P_monsterinfo_stand, flyer_stand, "flyer_stand" },
+{ P_monsterinfo_stand, gladiator_stand, "gladiator_stand" },
+{ P_monsterinfo_stand, gunner_stand, "gunner_stand" },
+{ P_monsterinfo_stand, hover_stand, "hover_stand" },
+{ P_monsterinfo_stand, infantry_stand, "infantry_stand" },
+{ P_monsterinfo_stand, insane_stand, "insane_stand" },
+{ P_monsterinfo_stand, jorg_stand, "jorg_stand" },
+{ P_monsterinfo_stand, makron_stand, "makron_stand" },
+{ P_monsterinfo_stand, medic_stand, "medic_stand" },
+{ P_monsterinfo_stand, mutant_stand, "mutant_stand" },
+{ P_monsterinfo_stand, parasite_stand, "parasite_stand" },
+{ P_monsterinfo_stand, soldier_stand, "soldier_stand" },
+{ P_monsterinfo_stand, supertank_stand, "supertank_stand" },
+{ P_monsterinfo_stand, tank_stand, "tank_stand" },
+{ P_monsterinfo_walk, actor_walk, "actor_walk" },
+{ P_monsterinfo_walk, berserk_walk, "berserk_walk" },
+{ P_monsterinfo_walk, boss2_walk, "boss2_walk" },
+{ P_monsterinfo_walk, brain_walk, "brain_walk" },
+{ P_monsterinfo_walk, chick_walk, "chick_walk" },
+{ P_monsterinfo_walk, flipper_walk, "flipper_walk" },
+{ P_monsterinfo_walk, floater_walk, "floater_walk" },
+{ P_monsterinfo_walk, flyer_walk, "flyer_walk" },
+{ P_monsterinfo_walk, gladiator_walk, "gladiator_walk" },
+{ P_monsterinfo_walk, gunner_walk, "gunner_walk" },
+{ P_monsterinfo_walk, hover_walk, "hover_walk" },
+{ P_monsterinfo_walk, infantry_walk, "infantry_walk" },
+{ P_monsterinfo_walk, insane_walk, "insane_walk" },
+{ P_monsterinfo_walk, jorg_walk, "jorg_walk" },
+{ P_monsterinfo_walk, makron_walk, "makron_walk" },
+{ P_monsterinfo_walk, medic_walk, "medic_walk" },
+{ P_monsterinfo_walk, mutant_walk, "mutant_walk" },
+{ P_monsterinfo_walk, parasite_start_walk, "parasite_start_walk" },
+{ P_monsterinfo_walk, soldier_walk, "soldier_walk" },
+{ P_monsterinfo_walk, supertank_walk, "supertank_walk" },
+{ P_monsterinfo_walk, tank_walk, "tank_walk" },
+{ P_pain, actor_pain, "actor_pain" },
+{ P_pain, berserk_pain, "berserk_pain" },
+{ P_pain, boss2_pain, "boss2_pain" },
+{ P_pain, brain_pain, "brain_pain" },
+{ P_pain, chick_pain, "chick_pain" },
+{ P_pain, flipper_pain, "flipper_pain" },
+{ P_pain, floater_pain, "floater_pain" },
+{ P_pain, flyer_pain, "flyer_pain" },
+{ P_pain, gladiator_pain, "gladiator_pain" },
+{ P_pain, gunner_pain, "gunner_pain" },
+{ P_pain, hover_pain, "hover_pain" },
+{ P_pain, infantry_pain, "infantry_pain" },
+{ P_pain, insane_pain, "insane_pain" },
+{ P_pain, jorg_pain, "jorg_pain" },
+{ P_pain, makron_pain, "makron_pain" },
+{ P_pain, medic_pain, "medic_pain" },
+{ P_pain, mutant_pain, "mutant_pain" },
+{ P_pain, parasite_pain, "parasite_pain" },
+{ P_pain, player_pain, "player_pain" },
+{ P_pain, soldier_pain, "soldier_pain" },
+{ P_pain, supertank_pain, "supertank_pain" },
+{ P_pain, tank_pain, "tank_pain" },
+{ P_prethink, misc_viper_bomb_prethink, "misc_viper_bomb_prethink" },
+{ P_think, AngleMove_Begin, "AngleMove_Begin" },
+{ P_think, AngleMove_Done, "AngleMove_Done" },
+{ P_think, AngleMove_Final, "AngleMove_Final" },
+{ P_think, barrel_explode, "barrel_explode" },
+{ P_think, bfg_explode, "bfg_explode" },
+{ P_think, bfg_think, "bfg_think" },
+{ P_think, BossExplode, "BossExplode" },
+{ P_think, button_return, "button_return" },
+{ P_think, commander_body_drop, "commander_body_drop" },
+{ P_think, commander_body_think, "commander_body_think" },
+{ P_think, door_go_down, "door_go_down" },
+{ P_think, door_secret_move2, "door_secret_move2" },
+{ P_think, door_secret_move4, "door_secret_move4" },
+{ P_think, door_secret_move6, "door_secret_move6" },
+{ P_think, DoRespawn, "DoRespawn" },
+{ P_think, drop_make_touchable, "drop_make_touchable" },
+{ P_think, droptofloor, "droptofloor" },
+{ P_think, flymonster_start_go, "flymonster_start_go" },
+{ P_think, func_clock_think, "func_clock_think" },
+{ P_think, func_object_release, "func_object_release" },
+{ P_think, func_timer_think, "func_timer_think" },
+{ P_think, func_train_find, "func_train_find" },
+{ P_think, G_FreeEdict, "G_FreeEdict" },
+{ P_think, gib_think, "gib_think" },
+{ P_think, Grenade_Explode, "Grenade_Explode" },
+{ P_think, hover_deadthink, "hover_deadthink" },
+{ P_think, MakronSpawn, "MakronSpawn" },
+{ P_think, makron_torso_think, "makron_torso_think" },
+{ P_think, M_droptofloor, "M_droptofloor" },
+{ P_think, MegaHealth_think, "MegaHealth_think" },
+{ P_think, M_FliesOff, "M_FliesOff" },
+{ P_think, M_FliesOn, "M_FliesOn" },
+{ P_think, misc_banner_think, "misc_banner_think" },
+{ P_think, misc_blackhole_think, "misc_blackhole_think" },
+{ P_think, misc_easterchick2_think, "misc_easterchick2_think" },
+{ P_think, misc_easterchick_think, "misc_easterchick_think" },
+{ P_think, misc_eastertank_think, "misc_eastertank_think" },
+{ P_think, misc_satellite_dish_think, "misc_satellite_dish_think" },
+{ P_think, monster_think, "monster_think" },
+{ P_think, monster_triggered_spawn, "monster_triggered_spawn" },
+{ P_think, Move_Begin, "Move_Begin" },
+{ P_think, Move_Done, "Move_Done" },
+{ P_think, Move_Final, "Move_Final" },
+{ P_think, multi_wait, "multi_wait" },
+{ P_think, plat_go_down, "plat_go_down" },
+{ P_think, SP_CreateCoopSpots, "SP_CreateCoopSpots" },
+{ P_think, SP_FixCoopSpots, "SP_FixCoopSpots" },
+{ P_think, swimmonster_start_go, "swimmonster_start_go" },
+{ P_think, target_crosslevel_target_think, "target_crosslevel_target_think" },
+{ P_think, target_earthquake_think, "target_earthquake_think" },
+{ P_think, target_explosion_explode, "target_explosion_explode" },
+{ P_think, target_laser_start, "target_laser_start" },
+{ P_think, target_laser_think, "target_laser_think" },
+{ P_think, target_lightramp_think, "target_lightramp_think" },
+{ P_think, Think_AccelMove, "Think_AccelMove" },
+{ P_think, Think_Boss3Stand, "Think_Boss3Stand" },
+{ P_think, Think_CalcMoveSpeed, "Think_CalcMoveSpeed" },
+{ P_think, Think_Delay, "Think_Delay" },
+{ P_think, Think_SpawnDoorTrigger, "Think_SpawnDoorTrigger" },
+{ P_think, TH_viewthing, "TH_viewthing" },
+{ P_think, train_next, "train_next" },
+{ P_think, trigger_elevator_init, "trigger_elevator_init" },
+{ P_think, turret_breach_finish_init, "turret_breach_finish_init" },
+{ P_think, turret_breach_think, "turret_breach_think" },
+{ P_think, turret_driver_link, "turret_driver_link" },
+{ P_think, turret_driver_think, "turret_driver_think" },
+{ P_think, walkmonster_start_go, "walkmonster_start_go" },
+{ P_think, flare_think, "flare_think" }, // Q2RTX
+{ P_touch, flare_touch, "flare_touch" }, // Q2RTX
+{ P_touch, barrel_touch, "barrel_touch" },
+{ P_touch, bfg_touch, "bfg_touch" },
+{ P_touch, blaster_touch, "blaster_touch" },
+{ P_touch, button_touch, "button_touch" },
+{ P_touch, door_touch, "door_touch" },
+{ P_touch, drop_temp_touch, "drop_temp_touch" },
+{ P_touch, func_object_touch, "func_object_touch" },
+{ P_touch, gib_touch, "gib_touch" },
+{ P_touch, Grenade_Touch, "Grenade_Touch" },
+{ P_touch, hurt_touch, "hurt_touch" },
+{ P_touch, misc_viper_bomb_touch, "misc_viper_bomb_touch" },
+{ P_touch, mutant_jump_touch, "mutant_jump_touch" },
+{ P_touch, path_corner_touch, "path_corner_touch" },
+{ P_touch, point_combat_touch, "point_combat_touch" },
+{ P_touch, rocket_touch, "rocket_touch" },
+{ P_touch, rotating_touch, "rotating_touch" },
+{ P_touch, target_actor_touch, "target_actor_touch" },
+{ P_touch, teleporter_touch, "teleporter_touch" },
+{ P_touch, Touch_DoorTrigger, "Touch_DoorTrigger" },
+{ P_touch, Touch_Item, "Touch_Item" },
+{ P_touch, Touch_Multi, "Touch_Multi" },
+{ P_touch, Touch_Plat_Center, "Touch_Plat_Center" },
+{ P_touch, trigger_gravity_touch, "trigger_gravity_touch" },
+{ P_touch, trigger_monsterjump_touch, "trigger_monsterjump_touch" },
+{ P_touch, trigger_push_touch, "trigger_push_touch" },
+{ P_use, actor_use, "actor_use" },
+{ P_use, button_use, "button_use" },
+{ P_use, commander_body_use, "commander_body_use" },
+{ P_use, door_secret_use, "door_secret_use" },
+{ P_use, door_use, "door_use" },
+{ P_use, func_clock_use, "func_clock_use" },
+{ P_use, func_conveyor_use, "func_conveyor_use" },
+{ P_use, func_explosive_spawn, "func_explosive_spawn" },
+{ P_use, func_explosive_use, "func_explosive_use" },
+{ P_use, func_object_use, "func_object_use" },
+{ P_use, func_timer_use, "func_timer_use" },
+{ P_use, func_wall_use, "func_wall_use" },
+{ P_use, hurt_use, "hurt_use" },
+{ P_use, light_use, "light_use" },
+{ P_use, misc_blackhole_use, "misc_blackhole_use" },
+{ P_use, misc_satellite_dish_use, "misc_satellite_dish_use" },
+{ P_use, misc_strogg_ship_use, "misc_strogg_ship_use" },
+{ P_use, misc_viper_bomb_use, "misc_viper_bomb_use" },
+{ P_use, misc_viper_use, "misc_viper_use" },
+{ P_use, monster_triggered_spawn_use, "monster_triggered_spawn_use" },
+{ P_use, monster_use, "monster_use" },
+{ P_use, rotating_use, "rotating_use" },
+{ P_use, target_earthquake_use, "target_earthquake_use" },
+{ P_use, target_laser_use, "target_laser_use" },
+{ P_use, target_lightramp_use, "target_lightramp_use" },
+{ P_use, target_string_use, "target_string_use" },
+{ P_use, train_use, "train_use" },
+{ P_use, trigger_counter_use, "trigger_counter_use" },
+{ P_use, trigger_crosslevel_trigger_use, "trigger_crosslevel_trigger_use" },
+{ P_use, trigger_elevator_use, "trigger_elevator_use" },
+{ P_use, trigger_enable, "trigger_enable" },
+{ P_use, trigger_key_use, "trigger_key_use" },
+{ P_use, trigger_relay_use, "trigger_relay_use" },
+{ P_use, Use_Areaportal, "Use_Areaportal" },
+{ P_use, Use_Boss3, "Use_Boss3" },
+{ P_use, Use_Item, "Use_Item" },
+{ P_use, use_killbox, "use_killbox" },
+{ P_use, Use_Multi, "Use_Multi" },
+{ P_use, Use_Plat, "Use_Plat" },
+{ P_use, use_target_blaster, "use_target_blaster" },
+{ P_use, use_target_changelevel, "use_target_changelevel" },
+{ P_use, use_target_explosion, "use_target_explosion" },
+{ P_use, use_target_goal, "use_target_goal" },
+{ P_use, Use_Target_Help, "Use_Target_Help" },
+{ P_use, use_target_secret, "use_target_secret" },
+{ P_use, use_target_spawner, "use_target_spawner" },
+{ P_use, Use_Target_Speaker, "Use_Target_Speaker" },
+{ P_use, use_target_splash, "use_target_splash" },
+{ P_use, Use_Target_Tent, "Use_Target_Tent" },
+{ P_moveinfo_endfunc, plat_hit_bottom, "plat_hit_bottom" },
+{ P_moveinfo_endfunc, plat_hit_top, "plat_hit_top" },
+{ P_moveinfo_endfunc, button_done, "button_done" },
+{ P_moveinfo_endfunc, button_wait, "button_wait" },
+{ P_moveinfo_endfunc, door_hit_bottom, "door_hit_bottom" },
+{ P_moveinfo_endfunc, door_hit_top, "door_hit_top" },
+{ P_moveinfo_endfunc, train_wait, "train_wait" },
+{ P_moveinfo_endfunc, door_secret_move1, "door_secret_move1" },
+{ P_moveinfo_endfunc, door_secret_move3, "door_secret_move3" },
+{ P_moveinfo_endfunc, door_secret_move5, "door_secret_move5" },
+{ P_moveinfo_endfunc, door_secret_done, "door_secret_done" },
 };
 const int num_save_ptrs = sizeof(save_ptrs) / sizeof(save_ptrs[0]);
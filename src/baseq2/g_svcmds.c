@@ -287,6 +287,8 @@ void    ServerCommand(void)
         SVCmd_ListIP_f();
     else if (Q_stricmp(cmd, "writeip") == 0)
         SVCmd_WriteIP_f();
+    else if (Q_stricmp(cmd, "profile") == 0)
+        Svcmd_Profile_f();
     else
         gi.cprintf(NULL, PRINT_HIGH, "Unknown server command \"%s\"\n", cmd);
 }
@@ -87,6 +87,7 @@ typedef struct centity_s {
     entity_state_t    prev;            // will always be valid, but might just be a copy of current
 
     vec3_t          mins, maxs;
+    vec3_t          absmin, absmax;     // world space bounds, for prediction traces
 
     int             serverframe;        // if not current, this ent isn't in the frame
 
@@ -195,7 +196,15 @@ typedef struct client_state_s {
     vec3_t      predicted_velocity;
     vec3_t      prediction_error;
 
-    // rebuilt each valid frame
+    // results of previous CL_PredictMovement runs, reused while
+    // the server agrees with them and the world doesn't change
+    pmove_state_t   predicted_states[CMD_BACKUP];
+    vec3_t          predicted_viewangles;   // for predicted_cmd
+    unsigned        predicted_cmd;          // last cmdNumber in predicted_states
+    unsigned        predicted_world;        // solid entities checksum
+    qboolean        predicted_valid;
+
+    // rebuilt each valid frame, sorted by absmin[0]
     centity_t       *solidEntities[MAX_PACKET_ENTITIES];
     int             numSolidEntities;
 
@@ -507,6 +516,7 @@ extern char        cl_cmdbuf_text[MAX_STRING_CHARS];
 extern cvar_t    *cl_gun;
 extern cvar_t    *cl_gunalpha;
 extern cvar_t    *cl_predict;
+extern cvar_t    *cl_predict_cache;
 extern cvar_t    *cl_footsteps;
 extern cvar_t    *cl_noskins;
 extern cvar_t    *cl_kickangles;
@@ -721,6 +731,7 @@ void V_Shutdown(void);
 void V_RenderView(void);
 void V_AddEntity(entity_t *ent);
 void V_AddParticle(particle_t *p);
+void V_SetParticleBudget(int budget);
 #if USE_DLIGHTS
 void V_AddLight(vec3_t org, float intensity, float r, float g, float b);
 void V_AddLightEx(vec3_t org, float intensity, float r, float g, float b, float radius);
@@ -768,6 +779,8 @@ void CL_InitTEnts(void);
 void CL_PredictAngles(void);
 void CL_PredictMovement(void);
 void CL_CheckPredictionError(void);
+void CL_LinkSolidEntities(void);
+void CL_InitPrediction(void);
 
 
 //
@@ -778,8 +791,6 @@ void CL_CheckPredictionError(void);
 #define INSTANT_PARTICLE    -10000.0
 
 typedef struct cparticle_s {
-    struct cparticle_s    *next;
-
     float   time;
 
     vec3_t  org;
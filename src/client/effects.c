@@ -831,18 +831,48 @@ void CL_MuzzleFlash2(void)
 
 PARTICLE MANAGEMENT
 
+Particles are kept as a structure of arrays, with the live ones packed at
+the start: a particle that fades out is replaced by the last one. Effects
+fill in a cparticle_t from CL_AllocParticle as before. These are staged
+and moved into the arrays by CL_AddParticles. The number of particles is
+limited by cl_maxparticles, which also sizes r_particles. The renderers
+size their particle buffers from it when they start, so changing it
+restarts the renderer.
+
 ==============================================================
 */
 
-static cparticle_t  *active_particles, *free_particles;
+typedef struct {
+    float       *org[3];
+    float       *vel[3];
+    float       *accel[3];
+    float       *time;
+    float       *alpha;
+    float       *alphavel;
+    float       *brightness;
+    int         *color;
+    color_t     *rgba;
+
+    // computed by CL_AddParticles each frame
+    float       *age;       // seconds since the particle was spawned
+    float       *fade;      // alpha after fading, not clamped
+
+    int         count;
+    int         budget;
+
+    cparticle_t *staged;    // handed out by CL_AllocParticle
+    int         num_staged;
+} cparticles_t;
+
+#define PARTICLE_ARRAYS     17
 
-static cparticle_t  particles[MAX_PARTICLES];
-static const int    cl_numparticles = MAX_PARTICLES;
+static cparticles_t cl_particles;
 
 extern uint32_t d_8to24table[256];
 
 cvar_t* cvar_pt_particle_emissive = NULL;
 static cvar_t* cl_particle_num_factor = NULL;
+static cvar_t* cl_maxparticles = NULL;
 
 void FX_Init(void)
 {
@@ -850,28 +880,94 @@ void FX_Init(void)
 	cl_particle_num_factor = Cvar_Get("cl_particle_num_factor", "1", 0);
 }
 
-static void CL_ClearParticles(void)
+static void CL_MoveParticle(cparticles_t *s, int dst, int src)
 {
-    int     i;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        s->org[i][dst] = s->org[i][src];
+        s->vel[i][dst] = s->vel[i][src];
+        s->accel[i][dst] = s->accel[i][src];
+    }
+    s->time[dst] = s->time[src];
+    s->alpha[dst] = s->alpha[src];
+    s->alphavel[dst] = s->alphavel[src];
+    s->brightness[dst] = s->brightness[src];
+    s->color[dst] = s->color[src];
+    s->rgba[dst] = s->rgba[src];
+    s->age[dst] = s->age[src];
+    s->fade[dst] = s->fade[src];
+}
 
-    free_particles = &particles[0];
-    active_particles = NULL;
+// reallocates the arrays, keeping as many live particles as fit
+static void CL_SetParticleBudget(int budget)
+{
+    cparticles_t old = cl_particles;
+    cparticles_t *s = &cl_particles;
+    float *block;
+    int i;
+
+    block = Z_Malloc(budget * (PARTICLE_ARRAYS * sizeof(float) + sizeof(cparticle_t)));
+    for (i = 0; i < 3; i++) {
+        s->org[i] = block + budget * i;
+        s->vel[i] = block + budget * (3 + i);
+        s->accel[i] = block + budget * (6 + i);
+    }
+    s->time = block + budget * 9;
+    s->alpha = block + budget * 10;
+    s->alphavel = block + budget * 11;
+    s->brightness = block + budget * 12;
+    s->color = (int *)(block + budget * 13);
+    s->rgba = (color_t *)(block + budget * 14);
+    s->age = block + budget * 15;
+    s->fade = block + budget * 16;
+    s->staged = (cparticle_t *)(block + budget * PARTICLE_ARRAYS);
+
+    s->budget = budget;
+    s->count = min(old.count, budget);
+    s->num_staged = 0;
+
+    V_SetParticleBudget(budget);
+
+    if (old.budget) {
+        for (i = 0; i < 3; i++) {
+            memcpy(s->org[i], old.org[i], s->count * sizeof(float));
+            memcpy(s->vel[i], old.vel[i], s->count * sizeof(float));
+            memcpy(s->accel[i], old.accel[i], s->count * sizeof(float));
+        }
+        memcpy(s->time, old.time, s->count * sizeof(float));
+        memcpy(s->alpha, old.alpha, s->count * sizeof(float));
+        memcpy(s->alphavel, old.alphavel, s->count * sizeof(float));
+        memcpy(s->brightness, old.brightness, s->count * sizeof(float));
+        memcpy(s->color, old.color, s->count * sizeof(int));
+        memcpy(s->rgba, old.rgba, s->count * sizeof(color_t));
+        Z_Free(old.org[0]);
+    }
+}
+
+static void cl_maxparticles_changed(cvar_t *self)
+{
+    CL_SetParticleBudget(Cvar_ClampInteger(self, MIN_PARTICLE_BUDGET, MAX_PARTICLE_BUDGET));
+}
 
-    for (i = 0; i < cl_numparticles; i++)
-        particles[i].next = &particles[i + 1];
-    particles[cl_numparticles - 1].next = NULL;
+static void CL_ClearParticles(void)
+{
+    cl_particles.count = 0;
+    cl_particles.num_staged = 0;
 }
 
 cparticle_t *CL_AllocParticle(void)
 {
+    cparticles_t *s = &cl_particles;
     cparticle_t *p;
 
-    if (!free_particles)
+    if (s->count + s->num_staged >= s->budget)
         return NULL;
-    p = free_particles;
-    free_particles = p->next;
-    p->next = active_particles;
-    active_particles = p;
+
+    // staged particles start out cleared, not with what a dead one left
+    p = &s->staged[s->num_staged++];
+    memset(p, 0, sizeof(*p));
+    p->brightness = 1.0f;
 
     return p;
 }
@@ -1988,82 +2084,171 @@ void CL_TeleportParticles(vec3_t org)
 }
 
 extern int          r_numparticles;
-extern particle_t   r_particles[MAX_PARTICLES];
+extern int          r_maxparticles;
+extern particle_t   *r_particles;
 
-/*
-===============
-CL_AddParticles
-===============
-*/
-void CL_AddParticles(void)
+#if USE_SSE2
+// float(x * 0.001), with the multiply done in double like the scalar code
+static inline __m128 CL_MsecToSec(__m128 x)
 {
-    cparticle_t     *p, *next;
-    float           alpha;
-    float           time = 0, time2;
-    int             color;
-    cparticle_t     *active, *tail;
-    particle_t      *part;
-
-    active = NULL;
-    tail = NULL;
-
-    for (p = active_particles; p; p = next) {
-        next = p->next;
-
-        if (p->alphavel != INSTANT_PARTICLE) {
-            time = (cl.time - p->time) * 0.001;
-            alpha = p->alpha + time * p->alphavel;
-            if (alpha <= 0) {
-                // faded out
-                p->next = free_particles;
-                free_particles = p;
-                continue;
-            }
-        } else {
-            alpha = p->alpha;
+    const __m128d scale = _mm_set1_pd(0.001);
+    __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(x), scale));
+    __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), scale));
+    return _mm_movelh_ps(lo, hi);
+}
+#endif
+
+// moves the particles spawned since the last frame into the arrays
+static void CL_CommitParticles(cparticles_t *s)
+{
+    cparticle_t *p;
+    int i, j;
+
+    for (i = 0; i < s->num_staged; i++) {
+        p = &s->staged[i];
+        for (j = 0; j < 3; j++) {
+            s->org[j][s->count] = p->org[j];
+            s->vel[j][s->count] = p->vel[j];
+            s->accel[j][s->count] = p->accel[j];
         }
+        s->time[s->count] = p->time;
+        s->alpha[s->count] = p->alpha;
+        s->alphavel[s->count] = p->alphavel;
+        s->brightness[s->count] = p->brightness;
+        s->color[s->count] = p->color;
+        s->rgba[s->count] = p->rgba;
+        s->count++;
+    }
+
+    s->num_staged = 0;
+}
 
-        if (r_numparticles >= MAX_PARTICLES)
-            break;
-        part = &r_particles[r_numparticles++];
+// computes age and fade, then removes the particles that faded out
+static void CL_FadeParticles(cparticles_t *s, float now)
+{
+    int i = 0;
+
+#if USE_SSE2
+    const __m128 now4 = _mm_set1_ps(now);
+    const __m128 instant = _mm_set1_ps(INSTANT_PARTICLE);
+
+    for (; i + 4 <= s->count; i += 4) {
+        __m128 age = CL_MsecToSec(_mm_sub_ps(now4, _mm_loadu_ps(s->time + i)));
+        __m128 alpha = _mm_loadu_ps(s->alpha + i);
+        __m128 alphavel = _mm_loadu_ps(s->alphavel + i);
+        __m128 fade = _mm_add_ps(alpha, _mm_mul_ps(age, alphavel));
+        __m128 is_instant = _mm_cmpeq_ps(alphavel, instant);
+
+        fade = _mm_or_ps(_mm_and_ps(is_instant, alpha), _mm_andnot_ps(is_instant, fade));
+        _mm_storeu_ps(s->age + i, age);
+        _mm_storeu_ps(s->fade + i, fade);
+    }
+#endif
+
+    for (; i < s->count; i++) {
+        s->age[i] = (now - s->time[i]) * 0.001;
+        if (s->alphavel[i] != INSTANT_PARTICLE)
+            s->fade[i] = s->alpha[i] + s->age[i] * s->alphavel[i];
+        else
+            s->fade[i] = s->alpha[i];
+    }
 
-        p->next = NULL;
-        if (!tail)
-            active = tail = p;
-        else {
-            tail->next = p;
-            tail = p;
+    for (i = 0; i < s->count; ) {
+        if (s->alphavel[i] != INSTANT_PARTICLE && s->fade[i] <= 0) {
+            CL_MoveParticle(s, i, --s->count);
+            continue;
         }
+        i++;
+    }
+}
 
-        if (alpha > 1.0)
-            alpha = 1;
-        color = p->color;
+static void CL_EmitParticle(const cparticles_t *s, int i, const vec3_t origin, particle_t *part)
+{
+    float alpha = s->fade[i];
 
-        time2 = time * time;
+    if (alpha > 1.0)
+        alpha = 1;
 
-        part->origin[0] = p->org[0] + p->vel[0] * time + p->accel[0] * time2;
-        part->origin[1] = p->org[1] + p->vel[1] * time + p->accel[1] * time2;
-        part->origin[2] = p->org[2] + p->vel[2] * time + p->accel[2] * time2;
+    VectorCopy(origin, part->origin);
 
-        if (color == -1) {
-            part->rgba.u8[0] = p->rgba.u8[0];
-            part->rgba.u8[1] = p->rgba.u8[1];
-            part->rgba.u8[2] = p->rgba.u8[2];
-            part->rgba.u8[3] = p->rgba.u8[3] * alpha;
+    if (s->color[i] == -1) {
+        part->rgba.u8[0] = s->rgba[i].u8[0];
+        part->rgba.u8[1] = s->rgba[i].u8[1];
+        part->rgba.u8[2] = s->rgba[i].u8[2];
+        part->rgba.u8[3] = s->rgba[i].u8[3] * alpha;
+    }
+
+    part->color = s->color[i];
+    part->brightness = s->brightness[i];
+    part->alpha = alpha;
+    part->radius = 0.f;
+}
+
+// moves particles [0, count) along their paths into out
+static void CL_EmitParticles(const cparticles_t *s, particle_t *out, int count)
+{
+    vec3_t origin;
+    int i = 0, j;
+
+#if USE_SSE2
+    float x[4], y[4], z[4];
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 t = _mm_loadu_ps(s->age + i);
+        __m128 t2 = _mm_mul_ps(t, t);
+
+        _mm_storeu_ps(x, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(s->org[0] + i),
+            _mm_mul_ps(_mm_loadu_ps(s->vel[0] + i), t)), _mm_mul_ps(_mm_loadu_ps(s->accel[0] + i), t2)));
+        _mm_storeu_ps(y, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(s->org[1] + i),
+            _mm_mul_ps(_mm_loadu_ps(s->vel[1] + i), t)), _mm_mul_ps(_mm_loadu_ps(s->accel[1] + i), t2)));
+        _mm_storeu_ps(z, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(s->org[2] + i),
+            _mm_mul_ps(_mm_loadu_ps(s->vel[2] + i), t)), _mm_mul_ps(_mm_loadu_ps(s->accel[2] + i), t2)));
+
+        for (j = 0; j < 4; j++) {
+            VectorSet(origin, x[j], y[j], z[j]);
+            CL_EmitParticle(s, i + j, origin, out + i + j);
         }
+    }
+#endif
+
+    for (; i < count; i++) {
+        float time = s->age[i];
+        float time2 = time * time;
+
+        for (j = 0; j < 3; j++)
+            origin[j] = s->org[j][i] + s->vel[j][i] * time + s->accel[j][i] * time2;
+
+        CL_EmitParticle(s, i, origin, out + i);
+    }
+}
+
+/*
+===============
+CL_AddParticles
+
+Particles that don't fit into r_particles stay alive, but are not drawn
+this frame.
+===============
+*/
+void CL_AddParticles(void)
+{
+    cparticles_t *s = &cl_particles;
+    int i, count;
+
+    CL_CommitParticles(s);
+    CL_FadeParticles(s, cl.time);
 
-        part->color = color;
-		part->brightness = p->brightness;
-		part->alpha = alpha;
-		part->radius = 0.f;
+    count = min(s->count, r_maxparticles - r_numparticles);
+    CL_EmitParticles(s, r_particles + r_numparticles, count);
+    r_numparticles += count;
 
-        if (p->alphavel == INSTANT_PARTICLE) {
-            p->alphavel = 0.0;
-            p->alpha = 0.0;
+    // instant particles are drawn once
+    for (i = 0; i < s->count; i++) {
+        if (s->alphavel[i] == INSTANT_PARTICLE) {
+            s->alphavel[i] = 0.0;
+            s->alpha[i] = 0.0;
         }
     }
-	
-    active_particles = active;
 }
 
 
@@ -2089,5 +2274,8 @@ void CL_InitEffects(void)
         for (j = 0; j < 3; j++)
             avelocities[i][j] = (rand() & 255) * 0.01f;
 
+    cl_maxparticles = Cvar_Get("cl_maxparticles", va("%d", MAX_PARTICLES), CVAR_REFRESH);
+    cl_maxparticles->changed = cl_maxparticles_changed;
+    cl_maxparticles_changed(cl_maxparticles);
 }
 
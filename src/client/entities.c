@@ -394,6 +394,9 @@ void CL_DeltaFrame(void)
         entity_event(state->number);
     }
 
+    // prepare solid entities for prediction traces
+    CL_LinkSolidEntities();
+
     if (cls.demo.recording && !cls.demo.paused && !cls.demo.seeking && CL_FRAMESYNC) {
         CL_EmitDemoFrame();
     }
@@ -26,6 +26,7 @@ cvar_t  *cl_noskins;
 cvar_t  *cl_footsteps;
 cvar_t  *cl_timeout;
 cvar_t  *cl_predict;
+cvar_t  *cl_predict_cache;
 cvar_t  *cl_gun;
 cvar_t  *cl_gunalpha;
 cvar_t  *cl_warn_on_fps_rounding;
@@ -2760,6 +2761,7 @@ static void CL_InitLocal(void)
     CL_InitAscii();
     CL_InitEffects();
     CL_InitTEnts();
+    CL_InitPrediction();
     CL_InitDownloads();
     CL_GTV_Init();
 
@@ -2782,6 +2784,7 @@ static void CL_InitLocal(void)
     cl_noskins->changed = cl_noskins_changed;
     cl_predict = Cvar_Get("cl_predict", "1", 0);
     cl_predict->changed = cl_predict_changed;
+    cl_predict_cache = Cvar_Get("cl_predict_cache", "1", 0);
     cl_kickangles = Cvar_Get("cl_kickangles", "1", CVAR_CHEAT);
     cl_warn_on_fps_rounding = Cvar_Get("cl_warn_on_fps_rounding", "1", 0);
     cl_maxfps = Cvar_Get("cl_maxfps", "62", 0);
@@ -3421,6 +3424,11 @@ CL_Init
 */
 void CL_Init(void)
 {
+#if REF_VKPT
+    // renderer tools don't need a window, so a dedicated session gets them too
+    R_RegisterToolsRTX();
+#endif
+
     if (dedicated->integer) {
         return; // nothing running on the client
     }
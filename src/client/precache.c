@@ -195,6 +195,42 @@ void CL_LoadClientinfo(clientinfo_t *ci, const char *s)
     }
 }
 
+/*
+=================
+CL_PrefetchMedia
+
+Starts inflating models and sounds listed in configstrings on worker
+threads, so that they are ready by the time registration loads them.
+=================
+*/
+static void CL_PrefetchMedia(void)
+{
+    char    buffer[MAX_QPATH];
+    char    *name;
+    int     i;
+
+    for (i = 2; i < MAX_MODELS; i++) {
+        name = cl.configstrings[CS_MODELS + i];
+        if (!name[0])
+            break;
+        if (name[0] == '*' || name[0] == '#')
+            continue;
+        FS_PrefetchFile(name);
+    }
+
+    for (i = 1; i < MAX_SOUNDS; i++) {
+        name = cl.configstrings[CS_SOUNDS + i];
+        if (!name[0])
+            break;
+        if (name[0] == '*')
+            continue;   // sexed sounds are resolved per player model
+        if (name[0] == '#')
+            FS_PrefetchFile(name + 1);
+        else if (Q_concat(buffer, sizeof(buffer), "sound/", name, NULL) < sizeof(buffer))
+            FS_PrefetchFile(buffer);
+    }
+}
+
 /*
 =================
 CL_RegisterSounds
@@ -214,6 +250,9 @@ void CL_RegisterSounds(void)
         cl.sound_precache[i] = S_RegisterSound(s);
     }
     S_EndRegistration();
+
+    // this is the last registration step, drop unused prefetches
+    FS_FlushAsync();
 }
 
 /*
@@ -229,6 +268,9 @@ void CL_RegisterBspModels(void)
     char *name;
     int i;
 
+    // inflate the rest of media while BSP is being loaded
+    CL_PrefetchMedia();
+
     ret = BSP_Load(cl.configstrings[CS_MODELS + 1], &cl.bsp);
     if (cl.bsp == NULL) {
         Com_Error(ERR_DROP, "Couldn't load %s: %s",
@@ -340,6 +382,8 @@ void CL_PrepRefresh(void)
     if (!cl.mapname[0])
         return;     // no map loaded
 
+    CL_PrefetchMedia();
+
     // register models, pics, and skins
     R_BeginRegistration(cl.mapname);
 
@@ -361,6 +405,19 @@ void CL_PrepRefresh(void)
 		cl_dev_shaderballs = -1;
 #endif
 
+    for (i = 2; i < MAX_MODELS; i++) {
+        name = cl.configstrings[CS_MODELS + i];
+        if (!name[0]) {
+            break;
+        }
+        if (name[0] == '#') {
+            continue;
+        }
+        R_PrefetchModel(name);
+    }
+
+    R_LoadPrefetchedModels();
+
     for (i = 2; i < MAX_MODELS; i++) {
         name = cl.configstrings[CS_MODELS + i];
         if (!name[0]) {
@@ -71,6 +71,83 @@ void CL_CheckPredictionError(void)
     VectorScale(delta, 0.125f, cl.prediction_error);
 }
 
+static int solidcmp(const void *p1, const void *p2)
+{
+    const centity_t *e1 = *(const centity_t **)p1;
+    const centity_t *e2 = *(const centity_t **)p2;
+
+    if (e1->absmin[0] < e2->absmin[0])
+        return -1;
+    if (e1->absmin[0] > e2->absmin[0])
+        return 1;
+    return e1->current.number - e2->current.number;
+}
+
+/*
+====================
+CL_LinkSolidEntities
+
+Computes world space bounds of solid entities received in this frame
+and sorts them along X axis, so that traces can stop scanning at the
+first entity past their swept bounds.
+====================
+*/
+void CL_LinkSolidEntities(void)
+{
+    centity_t   *ent;
+    mmodel_t    *cmodel;
+    vec_t       *mins, *maxs;
+    float       max, v;
+    int         i, j;
+
+    for (i = 0; i < cl.numSolidEntities; i++) {
+        ent = cl.solidEntities[i];
+
+        if (ent->current.solid == PACKED_BSP) {
+            cmodel = cl.model_clip[ent->current.modelindex];
+            if (!cmodel) {
+                VectorCopy(ent->current.origin, ent->absmin);
+                VectorCopy(ent->current.origin, ent->absmax);
+                continue;
+            }
+            mins = cmodel->mins;
+            maxs = cmodel->maxs;
+        } else {
+            mins = ent->mins;
+            maxs = ent->maxs;
+        }
+
+        if (ent->current.solid == PACKED_BSP &&
+            (ent->current.angles[0] || ent->current.angles[1] || ent->current.angles[2])) {
+            // expand for rotation
+            max = 0;
+            for (j = 0; j < 3; j++) {
+                v = fabs(mins[j]);
+                if (v > max)
+                    max = v;
+                v = fabs(maxs[j]);
+                if (v > max)
+                    max = v;
+            }
+            for (j = 0; j < 3; j++) {
+                ent->absmin[j] = ent->current.origin[j] - max;
+                ent->absmax[j] = ent->current.origin[j] + max;
+            }
+        } else {
+            VectorAdd(ent->current.origin, mins, ent->absmin);
+            VectorAdd(ent->current.origin, maxs, ent->absmax);
+        }
+
+        // same epsilon as SV_LinkEdict
+        for (j = 0; j < 3; j++) {
+            ent->absmin[j] -= 1;
+            ent->absmax[j] += 1;
+        }
+    }
+
+    qsort(cl.solidEntities, cl.numSolidEntities, sizeof(cl.solidEntities[0]), solidcmp);
+}
+
 /*
 ====================
 CL_ClipMoveToEntities
@@ -84,10 +161,33 @@ static void CL_ClipMoveToEntities(vec3_t start, vec3_t mins, vec3_t maxs, vec3_t
     mnode_t     *headnode;
     centity_t   *ent;
     mmodel_t    *cmodel;
+    vec3_t      boxmins, boxmaxs;
+
+    // bounds of the whole move
+    for (i = 0; i < 3; i++) {
+        if (end[i] > start[i]) {
+            boxmins[i] = start[i] + mins[i] - 1;
+            boxmaxs[i] = end[i] + maxs[i] + 1;
+        } else {
+            boxmins[i] = end[i] + mins[i] - 1;
+            boxmaxs[i] = start[i] + maxs[i] + 1;
+        }
+    }
 
     for (i = 0; i < cl.numSolidEntities; i++) {
         ent = cl.solidEntities[i];
 
+        // list is sorted on X, nothing past this one can be touched
+        if (ent->absmin[0] > boxmaxs[0])
+            break;
+
+        if (ent->absmax[0] < boxmins[0]
+            || ent->absmin[1] > boxmaxs[1]
+            || ent->absmin[2] > boxmaxs[2]
+            || ent->absmax[1] < boxmins[1]
+            || ent->absmax[2] < boxmins[2])
+            continue;
+
         if (ent->current.solid == PACKED_BSP) {
             // special value for bmodel
             cmodel = cl.model_clip[ent->current.modelindex];
@@ -142,9 +242,19 @@ static int CL_PointContents(vec3_t point)
     for (i = 0; i < cl.numSolidEntities; i++) {
         ent = cl.solidEntities[i];
 
+        if (ent->absmin[0] > point[0])
+            break;
+
         if (ent->current.solid != PACKED_BSP) // special value for bmodel
             continue;
 
+        if (ent->absmax[0] < point[0]
+            || ent->absmin[1] > point[1]
+            || ent->absmin[2] > point[2]
+            || ent->absmax[1] < point[1]
+            || ent->absmax[2] < point[2])
+            continue;
+
         cmodel = cl.model_clip[ent->current.modelindex];
         if (!cmodel)
             continue;
@@ -172,6 +282,87 @@ void CL_PredictAngles(void)
     cl.predicted_angles[2] = cl.viewangles[2] + SHORT2ANGLE(cl.frame.ps.pmove.delta_angles[2]);
 }
 
+/*
+=================
+CL_WorldChecksum
+
+Cached prediction results are only valid as long as nothing that
+pmove traces against has moved.
+=================
+*/
+static unsigned CL_WorldChecksum(void)
+{
+    unsigned    hash = 2166136261u;
+    centity_t   *ent;
+    const byte  *p;
+    int         i, j;
+
+    for (i = 0; i < cl.numSolidEntities; i++) {
+        ent = cl.solidEntities[i];
+        hash = (hash ^ ent->current.number) * 16777619u;
+        hash = (hash ^ ent->current.modelindex) * 16777619u;
+        hash = (hash ^ ent->current.solid) * 16777619u;
+        p = (const byte *)ent->current.origin;
+        for (j = 0; j < sizeof(vec3_t); j++)
+            hash = (hash ^ p[j]) * 16777619u;
+        p = (const byte *)ent->current.angles;
+        for (j = 0; j < sizeof(vec3_t); j++)
+            hash = (hash ^ p[j]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+=================
+CL_RunPrediction
+
+Runs usercmds (ack, current] on top of the given acknowledged state.
+If the state matches what was predicted for `ack' last time and the
+world is unchanged, resimulation starts from the last cached command
+instead. Returns number of commands actually simulated.
+=================
+*/
+static int CL_RunPrediction(pmove_t *pm, unsigned ack, unsigned current)
+{
+    unsigned    world, start;
+    int         count = 0;
+
+    world = CL_WorldChecksum();
+    start = ack;
+
+    if (cl_predict_cache->integer && cl.predicted_valid &&
+        cl.predicted_world == world &&
+        cl.predicted_cmd - ack < CMD_BACKUP &&
+        !memcmp(&cl.predicted_states[ack & CMD_MASK], &pm->s, sizeof(pm->s))) {
+        // server agrees with the chain, skip commands already simulated
+        start = min(cl.predicted_cmd, current);
+        pm->s = cl.predicted_states[start & CMD_MASK];
+        if (start == cl.predicted_cmd)
+            VectorCopy(cl.predicted_viewangles, pm->viewangles);
+    } else {
+        cl.predicted_states[ack & CMD_MASK] = pm->s;
+    }
+
+    while (++start <= current) {
+        pm->cmd = cl.cmds[start & CMD_MASK];
+        Pmove(pm, &cl.pmp);
+        count++;
+
+        cl.predicted_states[start & CMD_MASK] = pm->s;
+
+        // save for debug checking
+        VectorCopy(pm->s.origin, cl.predicted_origins[start & CMD_MASK]);
+    }
+
+    VectorCopy(pm->viewangles, cl.predicted_viewangles);
+    cl.predicted_cmd = current;
+    cl.predicted_world = world;
+    cl.predicted_valid = qtrue;
+
+    return count;
+}
+
 void CL_PredictMovement(void)
 {
     unsigned    ack, current, frame;
@@ -224,13 +415,7 @@ void CL_PredictMovement(void)
 #endif
 
     // run frames
-    while (++ack <= current) {
-        pm.cmd = cl.cmds[ack & CMD_MASK];
-        Pmove(&pm, &cl.pmp);
-
-        // save for debug checking
-        VectorCopy(pm.s.origin, cl.predicted_origins[ack & CMD_MASK]);
-    }
+    CL_RunPrediction(&pm, ack, current);
 
     // run pending cmd
     if (cl.cmd.msec) {
@@ -269,3 +454,86 @@ void CL_PredictMovement(void)
     VectorCopy(pm.viewangles, cl.predicted_angles);
 }
 
+/*
+=================
+CL_PredictBench_f
+
+Replays the recorded usercmd stream as if `latency' commands were
+always in flight, with and without the prediction cache, advancing
+the acknowledged command by one each frame.
+=================
+*/
+static void CL_PredictBench_f(void)
+{
+    unsigned    first, ack, start, end;
+    int         latency, passes, pass, pmoves[2], msec[2], cache, saved;
+    short       origins[CMD_BACKUP][3];
+    pmove_t     pm;
+
+    if (cls.state != ca_active || cls.demo.playback) {
+        Com_Printf("Must be in a local or network game.\n");
+        return;
+    }
+
+    latency = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : CMD_BACKUP / 2;
+    passes = Cmd_Argc() > 2 ? atoi(Cmd_Argv(2)) : 100;
+    clamp(latency, 1, CMD_BACKUP - 2);
+    clamp(passes, 1, 100000);
+
+    if (cl.cmdNumber < CMD_BACKUP) {
+        Com_Printf("Not enough usercmds recorded yet.\n");
+        return;
+    }
+
+    // oldest command still in the ring is the base
+    first = cl.cmdNumber - CMD_BACKUP + 1;
+    saved = cl_predict_cache->integer;
+
+    // these are compared against server frames, don't clobber them
+    memcpy(origins, cl.predicted_origins, sizeof(origins));
+
+    X86_PUSH_FPCW;
+    X86_SINGLE_FPCW;
+
+    for (cache = 0; cache < 2; cache++) {
+        cl_predict_cache->integer = cache;
+        pmoves[cache] = 0;
+        start = Sys_Milliseconds();
+
+        for (pass = 0; pass < passes; pass++) {
+            cl.predicted_valid = qfalse;
+
+            for (ack = first; ack + latency <= cl.cmdNumber; ack++) {
+                memset(&pm, 0, sizeof(pm));
+                pm.trace = CL_Trace;
+                pm.pointcontents = CL_PointContents;
+
+                // pretend the server confirmed our prediction
+                if (cl.predicted_valid)
+                    pm.s = cl.predicted_states[ack & CMD_MASK];
+                else
+                    pm.s = cl.frame.ps.pmove;
+
+                pmoves[cache] += CL_RunPrediction(&pm, ack, ack + latency);
+            }
+        }
+
+        end = Sys_Milliseconds();
+        msec[cache] = end - start;
+    }
+
+    X86_POP_FPCW;
+
+    cl_predict_cache->integer = saved;
+    cl.predicted_valid = qfalse;
+    memcpy(cl.predicted_origins, origins, sizeof(origins));
+
+    Com_Printf("latency %d cmds, %d passes\n", latency, passes);
+    Com_Printf("uncached: %d msec, %d pmoves\n", msec[0], pmoves[0]);
+    Com_Printf("cached:   %d msec, %d pmoves\n", msec[1], pmoves[1]);
+}
+
+void CL_InitPrediction(void)
+{
+    Cmd_AddCommand("predbench", CL_PredictBench_f);
+}
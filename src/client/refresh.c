@@ -440,6 +440,11 @@ qerror_t(*MOD_LoadMD3)(model_t *model, const void *rawdata, size_t length, const
 #endif
 qerror_t(*MOD_LoadIQM)(model_t* model, const void* rawdata, size_t length, const char* mod_name) = NULL;
 void(*MOD_Reference)(model_t *model) = NULL;
+mod_load_t MOD_ParseMD2 = NULL, MOD_FinalizeMD2 = NULL;
+#if USE_MD3
+mod_load_t MOD_ParseMD3 = NULL, MOD_FinalizeMD3 = NULL;
+#endif
+mod_load_t MOD_ParseIQM = NULL, MOD_FinalizeIQM = NULL;
 
 float R_ClampScale(cvar_t *var)
 {
@@ -59,7 +59,8 @@ int         r_numentities;
 entity_t    r_entities[MAX_ENTITIES];
 
 int         r_numparticles;
-particle_t  r_particles[MAX_PARTICLES];
+int         r_maxparticles;
+particle_t  *r_particles;
 
 #if USE_LIGHTSTYLES
 lightstyle_t    r_lightstyles[MAX_LIGHTSTYLES];
@@ -105,11 +106,25 @@ V_AddParticle
 */
 void V_AddParticle(particle_t *p)
 {
-    if (r_numparticles >= MAX_PARTICLES)
+    if (r_numparticles >= r_maxparticles)
         return;
     r_particles[r_numparticles++] = *p;
 }
 
+/*
+=====================
+V_SetParticleBudget
+
+Called by the effects code when cl_maxparticles changes
+=====================
+*/
+void V_SetParticleBudget(int budget)
+{
+    r_particles = Z_Realloc(r_particles, budget * sizeof(particle_t));
+    r_maxparticles = budget;
+    r_numparticles = min(r_numparticles, budget);
+}
+
 #if USE_DLIGHTS
 /*
 =====================
@@ -131,7 +146,7 @@ void V_AddLightEx(vec3_t org, float intensity, float r, float g, float b, float
     dl->color[2] = b;
 	dl->radius = radius;
 
-	if (cl_show_lights->integer && r_numparticles < MAX_PARTICLES)
+	if (cl_show_lights->integer && r_numparticles < r_maxparticles)
 	{
 		particle_t* part = &r_particles[r_numparticles++];
 
@@ -191,7 +206,7 @@ static void V_TestParticles(void)
     int         i, j;
     float       d, r, u;
 
-    r_numparticles = MAX_PARTICLES;
+    r_numparticles = r_maxparticles;
     for (i = 0; i < r_numparticles; i++) {
         d = i * 0.25;
         r = 4 * ((i & 7) - 3.5);
@@ -30,7 +30,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/math.h"
 #include "common/utils.h"
 #include "common/mdfour.h"
+#include "common/jobs.h"
 #include "system/hunk.h"
+#include "system/system.h"
 
 extern mtexinfo_t nulltexinfo;
 
@@ -44,15 +46,19 @@ static cvar_t *map_visibility_patch;
 ===============================================================================
 */
 
-#define ALLOC(size) \
-    Hunk_Alloc(&bsp->hunk, size)
-
+// Lump arrays and their counts are set up by BSP_Load before any lump is
+// loaded, so loaders may run in parallel. Each one only writes to its own
+// array and reads nothing but the array pointers and counts of the others.
 #define LOAD(func) \
-    static qerror_t BSP_Load##func(bsp_t *bsp, void *base, size_t count)
+    static qerror_t BSP_Load##func(bsp_t *bsp, void *base, size_t count, const char **debug)
 
 // QBSP
 #define LOAD_EXT(func) \
-    static qerror_t BSP_QBSP_Load##func(bsp_t *bsp, void *base, size_t count)
+    static qerror_t BSP_QBSP_Load##func(bsp_t *bsp, void *base, size_t count, const char **debug)
+
+// loaders can't print from worker threads, BSP_Load prints for them
+#define LUMP_DEBUG(msg) \
+    (*debug = msg)
 
 #define DEBUG(msg) \
     Com_DPrintf("%s: %s\n", __func__, msg)
@@ -67,22 +73,20 @@ LOAD(Visibility)
     }
 
     if (count < 4) {
-        DEBUG("too small header");
+        LUMP_DEBUG("too small header");
         return Q_ERR_TOO_FEW;
     }
 
-    bsp->numvisibility = count;
-    bsp->vis = ALLOC(count);
     memcpy(bsp->vis, base, count);
 
     numclusters = LittleLong(bsp->vis->numclusters);
     if (numclusters > MAX_MAP_LEAFS) {
-        DEBUG("bad numclusters");
+        LUMP_DEBUG("bad numclusters");
         return Q_ERR_TOO_MANY;
     }
 
     if (numclusters > (count - 4) / 8) {
-        DEBUG("too small header");
+        LUMP_DEBUG("too small header");
         return Q_ERR_TOO_FEW;
     }
 
@@ -93,7 +97,7 @@ LOAD(Visibility)
         for (j = 0; j < 2; j++) {
             bitofs = LittleLong(bsp->vis->bitofs[i][j]);
             if (bitofs >= count) {
-                DEBUG("bad bitofs");
+                LUMP_DEBUG("bad bitofs");
                 return Q_ERR_BAD_INDEX;
             }
             bsp->vis->bitofs[i][j] = bitofs;
@@ -114,9 +118,6 @@ LOAD(Texinfo)
     mtexinfo_t  *step;
 #endif
 
-    bsp->numtexinfo = count;
-    bsp->texinfo = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->texinfo;
     for (i = 0; i < count; i++, in++, out++) {
@@ -139,7 +140,7 @@ LOAD(Texinfo)
         next = (int32_t)LittleLong(in->nexttexinfo);
         if (next > 0) {
             if (next >= count) {
-                DEBUG("bad anim chain");
+                LUMP_DEBUG("bad anim chain");
                 return Q_ERR_BAD_INDEX;
             }
             out->next = bsp->texinfo + next;
@@ -156,7 +157,7 @@ LOAD(Texinfo)
         out->numframes = 1;
         for (step = out->next; step && step != out; step = step->next) {
             if (out->numframes == count) {
-                DEBUG("infinite anim chain");
+                LUMP_DEBUG("infinite anim chain");
                 return Q_ERR_INFINITE_LOOP;
             }
             out->numframes++;
@@ -173,9 +174,6 @@ LOAD(Planes)
     cplane_t    *out;
     int         i, j;
 
-    bsp->numplanes = count;
-    bsp->planes = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->planes;
     for (i = 0; i < count; i++, in++, out++) {
@@ -197,15 +195,12 @@ LOAD(BrushSides)
     int         i;
     uint16_t    planenum, texinfo;
 
-    bsp->numbrushsides = count;
-    bsp->brushsides = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->brushsides;
     for (i = 0; i < count; i++, in++, out++) {
         planenum = LittleShort(in->planenum);
         if (planenum >= bsp->numplanes) {
-            DEBUG("bad planenum");
+            LUMP_DEBUG("bad planenum");
             return Q_ERR_BAD_INDEX;
         }
         out->plane = bsp->planes + planenum;
@@ -214,7 +209,7 @@ LOAD(BrushSides)
             out->texinfo = &nulltexinfo;
         } else {
             if (texinfo >= bsp->numtexinfo) {
-                DEBUG("bad texinfo");
+                LUMP_DEBUG("bad texinfo");
                 return Q_ERR_BAD_INDEX;
             }
             out->texinfo = bsp->texinfo + texinfo;
@@ -231,15 +226,12 @@ LOAD_EXT(BrushSides)
     int         i;
     uint32_t    planenum, texinfo;
 
-    bsp->numbrushsides = count;
-    bsp->brushsides = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->brushsides;
     for (i = 0; i < count; i++, in++, out++) {
         planenum = LittleLong(in->planenum);
         if (planenum >= bsp->numplanes) {
-            DEBUG("bad planenum");
+            LUMP_DEBUG("bad planenum");
             return Q_ERR_BAD_INDEX;
         }
         out->plane = bsp->planes + planenum;
@@ -248,7 +240,7 @@ LOAD_EXT(BrushSides)
             out->texinfo = &nulltexinfo;
         } else {
             if (texinfo >= bsp->numtexinfo) {
-                DEBUG("bad texinfo");
+                LUMP_DEBUG("bad texinfo");
                 return Q_ERR_BAD_INDEX;
             }
             out->texinfo = bsp->texinfo + texinfo;
@@ -265,9 +257,6 @@ LOAD(Brushes)
     int         i;
     uint32_t    firstside, numsides, lastside;
 
-    bsp->numbrushes = count;
-    bsp->brushes = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->brushes;
     for (i = 0; i < count; i++, out++, in++) {
@@ -275,7 +264,7 @@ LOAD(Brushes)
         numsides = LittleLong(in->numsides);
         lastside = firstside + numsides;
         if (lastside < firstside || lastside > bsp->numbrushsides) {
-            DEBUG("bad brushsides");
+            LUMP_DEBUG("bad brushsides");
             return Q_ERR_BAD_INDEX;
         }
         out->firstbrushside = bsp->brushsides + firstside;
@@ -294,15 +283,12 @@ LOAD(LeafBrushes)
     int         i;
     uint16_t    brushnum;
 
-    bsp->numleafbrushes = count;
-    bsp->leafbrushes = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->leafbrushes;
     for (i = 0; i < count; i++, in++, out++) {
         brushnum = LittleShort(*in);
         if (brushnum >= bsp->numbrushes) {
-            DEBUG("bad brushnum");
+            LUMP_DEBUG("bad brushnum");
             return Q_ERR_BAD_INDEX;
         }
         *out = bsp->brushes + brushnum;
@@ -318,15 +304,12 @@ LOAD_EXT(LeafBrushes)
     int         i;
     uint32_t    brushnum;
 
-    bsp->numleafbrushes = count;
-    bsp->leafbrushes = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->leafbrushes;
     for (i = 0; i < count; i++, in++, out++) {
         brushnum = LittleLong(*in);
         if (brushnum >= bsp->numbrushes) {
-            DEBUG("bad brushnum");
+            LUMP_DEBUG("bad brushnum");
             return Q_ERR_BAD_INDEX;
         }
         *out = bsp->brushes + brushnum;
@@ -343,8 +326,6 @@ LOAD(Lightmap)
         return Q_ERR_SUCCESS;
     }
 
-    bsp->numlightmapbytes = count;
-    bsp->lightmap = ALLOC(count);
 
     memcpy(bsp->lightmap, base, count);
 
@@ -357,9 +338,6 @@ LOAD(Vertices)
     mvertex_t   *out;
     int         i, j;
 
-    bsp->numvertices = count;
-    bsp->vertices = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->vertices;
     for (i = 0; i < count; i++, out++, in++) {
@@ -378,16 +356,13 @@ LOAD(Edges)
     int         i, j;
     uint16_t    vertnum;
 
-    bsp->numedges = count;
-    bsp->edges = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->edges;
     for (i = 0; i < count; i++, out++, in++) {
         for (j = 0; j < 2; j++) {
             vertnum = LittleShort(in->v[j]);
             if (vertnum >= bsp->numvertices) {
-                DEBUG("bad vertnum");
+                LUMP_DEBUG("bad vertnum");
                 return Q_ERR_BAD_INDEX;
             }
             out->v[j] = bsp->vertices + vertnum;
@@ -404,16 +379,13 @@ LOAD_EXT(Edges)
     int         i, j;
     uint32_t    vertnum;
 
-    bsp->numedges = count;
-    bsp->edges = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->edges;
     for (i = 0; i < count; i++, out++, in++) {
         for (j = 0; j < 2; j++) {
             vertnum = LittleLong(in->v[j]);
             if (vertnum >= bsp->numvertices) {
-                DEBUG("bad vertnum");
+                LUMP_DEBUG("bad vertnum");
                 return Q_ERR_BAD_INDEX;
             }
             out->v[j] = bsp->vertices + vertnum;
@@ -430,9 +402,6 @@ LOAD(SurfEdges)
     int         i, vert;
     int32_t     index;
 
-    bsp->numsurfedges = count;
-    bsp->surfedges = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->surfedges;
     for (i = 0; i < count; i++, out++, in++) {
@@ -445,7 +414,7 @@ LOAD(SurfEdges)
         }
 
         if (index >= bsp->numedges) {
-            DEBUG("bad edgenum");
+            LUMP_DEBUG("bad edgenum");
             return Q_ERR_BAD_INDEX;
         }
 
@@ -465,9 +434,6 @@ LOAD(Faces)
     uint16_t    planenum, texinfo, side;
     uint32_t    lightofs;
 
-    bsp->numfaces = count;
-    bsp->faces = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->faces;
     for (i = 0; i < count; i++, in++, out++) {
@@ -475,15 +441,15 @@ LOAD(Faces)
         numedges = LittleShort(in->numedges);
         lastedge = firstedge + numedges;
         if (numedges < 3) {
-            DEBUG("bad surfedges");
+            LUMP_DEBUG("bad surfedges");
             return Q_ERR_TOO_FEW;
         }
         if (numedges > 4096) {
-            DEBUG("bad surfedges");
+            LUMP_DEBUG("bad surfedges");
             return Q_ERR_TOO_MANY;
         }
         if (lastedge < firstedge || lastedge > bsp->numsurfedges) {
-            DEBUG("bad surfedges");
+            LUMP_DEBUG("bad surfedges");
             return Q_ERR_BAD_INDEX;
         }
         out->firstsurfedge = bsp->surfedges + firstedge;
@@ -491,14 +457,14 @@ LOAD(Faces)
 
         planenum = LittleShort(in->planenum);
         if (planenum >= bsp->numplanes) {
-            DEBUG("bad planenum");
+            LUMP_DEBUG("bad planenum");
             return Q_ERR_BAD_INDEX;
         }
         out->plane = bsp->planes + planenum;
 
         texinfo = LittleShort(in->texinfo);
         if (texinfo >= bsp->numtexinfo) {
-            DEBUG("bad texinfo");
+            LUMP_DEBUG("bad texinfo");
             return Q_ERR_BAD_INDEX;
         }
         out->texinfo = bsp->texinfo + texinfo;
@@ -516,7 +482,7 @@ LOAD(Faces)
             out->lightmap = NULL;
         } else {
             if (lightofs >= bsp->numlightmapbytes) {
-                DEBUG("bad lightofs");
+                LUMP_DEBUG("bad lightofs");
                 return Q_ERR_BAD_INDEX;
             }
             out->lightmap = bsp->lightmap + lightofs;
@@ -538,9 +504,6 @@ LOAD_EXT(Faces)
     uint32_t    planenum, texinfo, side;
     uint32_t    lightofs;
 
-    bsp->numfaces = count;
-    bsp->faces = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->faces;
     for (i = 0; i < count; i++, in++, out++) {
@@ -548,15 +511,15 @@ LOAD_EXT(Faces)
         numedges = LittleLong(in->numedges);
         lastedge = firstedge + numedges;
         if (numedges < 3) {
-            DEBUG("bad surfedges");
+            LUMP_DEBUG("bad surfedges");
             return Q_ERR_TOO_FEW;
         }
         if (numedges > 4096) {
-            DEBUG("bad surfedges");
+            LUMP_DEBUG("bad surfedges");
             return Q_ERR_TOO_MANY;
         }
         if (lastedge < firstedge || lastedge > bsp->numsurfedges) {
-            DEBUG("bad surfedges");
+            LUMP_DEBUG("bad surfedges");
             return Q_ERR_BAD_INDEX;
         }
         out->firstsurfedge = bsp->surfedges + firstedge;
@@ -564,14 +527,14 @@ LOAD_EXT(Faces)
 
         planenum = LittleLong(in->planenum);
         if (planenum >= bsp->numplanes) {
-            DEBUG("bad planenum");
+            LUMP_DEBUG("bad planenum");
             return Q_ERR_BAD_INDEX;
         }
         out->plane = bsp->planes + planenum;
 
         texinfo = LittleLong(in->texinfo);
         if (texinfo >= bsp->numtexinfo) {
-            DEBUG("bad texinfo");
+            LUMP_DEBUG("bad texinfo");
             return Q_ERR_BAD_INDEX;
         }
         out->texinfo = bsp->texinfo + texinfo;
@@ -589,7 +552,7 @@ LOAD_EXT(Faces)
             out->lightmap = NULL;
         } else {
             if (lightofs >= bsp->numlightmapbytes) {
-                DEBUG("bad lightofs");
+                LUMP_DEBUG("bad lightofs");
                 return Q_ERR_BAD_INDEX;
             }
             out->lightmap = bsp->lightmap + lightofs;
@@ -609,15 +572,12 @@ LOAD(LeafFaces)
     int         i;
     uint16_t    facenum;
 
-    bsp->numleaffaces = count;
-    bsp->leaffaces = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->leaffaces;
     for (i = 0; i < count; i++, in++, out++) {
         facenum = LittleShort(*in);
         if (facenum >= bsp->numfaces) {
-            DEBUG("bad facenum");
+            LUMP_DEBUG("bad facenum");
             return Q_ERR_BAD_INDEX;
         }
         *out = bsp->faces + facenum;
@@ -633,15 +593,12 @@ LOAD_EXT(LeafFaces)
     int         i;
     uint32_t    facenum;
 
-    bsp->numleaffaces = count;
-    bsp->leaffaces = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->leaffaces;
     for (i = 0; i < count; i++, in++, out++) {
         facenum = LittleLong(*in);
         if (facenum >= bsp->numfaces) {
-            DEBUG("bad facenum");
+            LUMP_DEBUG("bad facenum");
             return Q_ERR_BAD_INDEX;
         }
         *out = bsp->faces + facenum;
@@ -664,13 +621,10 @@ LOAD(Leafs)
 #endif
 
     if (!count) {
-        DEBUG("map with no leafs");
+        LUMP_DEBUG("map with no leafs");
         return Q_ERR_TOO_FEW;
     }
 
-    bsp->numleafs = count;
-    bsp->leafs = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->leafs;
     for (i = 0; i < count; i++, in++, out++) {
@@ -686,7 +640,7 @@ LOAD(Leafs)
         } else {
             // validate cluster
             if (cluster >= bsp->vis->numclusters) {
-                DEBUG("bad cluster");
+                LUMP_DEBUG("bad cluster");
                 return Q_ERR_BAD_INDEX;
             }
             out->cluster = cluster;
@@ -694,7 +648,7 @@ LOAD(Leafs)
 
         area = LittleShort(in->area);
         if (area >= bsp->numareas) {
-            DEBUG("bad area");
+            LUMP_DEBUG("bad area");
             return Q_ERR_BAD_INDEX;
         }
         out->area = area;
@@ -703,7 +657,7 @@ LOAD(Leafs)
         numleafbrushes = LittleShort(in->numleafbrushes);
         lastleafbrush = firstleafbrush + numleafbrushes;
         if (lastleafbrush < firstleafbrush || lastleafbrush > bsp->numleafbrushes) {
-            DEBUG("bad leafbrushes");
+            LUMP_DEBUG("bad leafbrushes");
             return Q_ERR_BAD_INDEX;
         }
         out->firstleafbrush = bsp->leafbrushes + firstleafbrush;
@@ -714,7 +668,7 @@ LOAD(Leafs)
         numleaffaces = LittleShort(in->numleaffaces);
         lastleafface = firstleafface + numleaffaces;
         if (lastleafface < firstleafface || lastleafface > bsp->numleaffaces) {
-            DEBUG("bad leaffaces");
+            LUMP_DEBUG("bad leaffaces");
             return Q_ERR_BAD_INDEX;
         }
         out->firstleafface = bsp->leaffaces + firstleafface;
@@ -731,7 +685,7 @@ LOAD(Leafs)
     }
 
     if (bsp->leafs[0].contents != CONTENTS_SOLID) {
-        DEBUG("map leaf 0 is not CONTENTS_SOLID");
+        LUMP_DEBUG("map leaf 0 is not CONTENTS_SOLID");
         return Q_ERR_INVALID_FORMAT;
     }
 
@@ -751,13 +705,10 @@ LOAD_EXT(Leafs)
 #endif
 
     if (!count) {
-        DEBUG("map with no leafs");
+        LUMP_DEBUG("map with no leafs");
         return Q_ERR_TOO_FEW;
     }
 
-    bsp->numleafs = count;
-    bsp->leafs = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->leafs;
     for (i = 0; i < count; i++, in++, out++) {
@@ -773,7 +724,7 @@ LOAD_EXT(Leafs)
         } else {
             // validate cluster
             if (cluster >= bsp->vis->numclusters) {
-                DEBUG("bad cluster");
+                LUMP_DEBUG("bad cluster");
                 return Q_ERR_BAD_INDEX;
             }
             out->cluster = cluster;
@@ -781,7 +732,7 @@ LOAD_EXT(Leafs)
 
         area = LittleLong(in->area);
         if (area >= bsp->numareas) {
-            DEBUG("bad area");
+            LUMP_DEBUG("bad area");
             return Q_ERR_BAD_INDEX;
         }
         out->area = area;
@@ -790,7 +741,7 @@ LOAD_EXT(Leafs)
         numleafbrushes = LittleLong(in->numleafbrushes);
         lastleafbrush = firstleafbrush + numleafbrushes;
         if (lastleafbrush < firstleafbrush || lastleafbrush > bsp->numleafbrushes) {
-            DEBUG("bad leafbrushes");
+            LUMP_DEBUG("bad leafbrushes");
             return Q_ERR_BAD_INDEX;
         }
         out->firstleafbrush = bsp->leafbrushes + firstleafbrush;
@@ -801,7 +752,7 @@ LOAD_EXT(Leafs)
         numleaffaces = LittleLong(in->numleaffaces);
         lastleafface = firstleafface + numleaffaces;
         if (lastleafface < firstleafface || lastleafface > bsp->numleaffaces) {
-            DEBUG("bad leaffaces");
+            LUMP_DEBUG("bad leaffaces");
             return Q_ERR_BAD_INDEX;
         }
         out->firstleafface = bsp->leaffaces + firstleafface;
@@ -818,7 +769,7 @@ LOAD_EXT(Leafs)
     }
 
     if (bsp->leafs[0].contents != CONTENTS_SOLID) {
-        DEBUG("map leaf 0 is not CONTENTS_SOLID");
+        LUMP_DEBUG("map leaf 0 is not CONTENTS_SOLID");
         return Q_ERR_INVALID_FORMAT;
     }
 
@@ -836,19 +787,16 @@ LOAD(Nodes)
 #endif
 
     if (!count) {
-        DEBUG("map with no nodes");
+        LUMP_DEBUG("map with no nodes");
         return Q_ERR_TOO_FEW;
     }
 
-    bsp->numnodes = count;
-    bsp->nodes = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->nodes;
     for (i = 0; i < count; i++, out++, in++) {
         planenum = LittleLong(in->planenum);
         if (planenum >= bsp->numplanes) {
-            DEBUG("bad planenum");
+            LUMP_DEBUG("bad planenum");
             return Q_ERR_BAD_INDEX;
         }
         out->plane = bsp->planes + planenum;
@@ -858,13 +806,13 @@ LOAD(Nodes)
             if (child & 0x80000000) {
                 child = ~child;
                 if (child >= bsp->numleafs) {
-                    DEBUG("bad leafnum");
+                    LUMP_DEBUG("bad leafnum");
                     return Q_ERR_BAD_INDEX;
                 }
                 out->children[j] = (mnode_t *)(bsp->leafs + child);
             } else {
                 if (child >= count) {
-                    DEBUG("bad nodenum");
+                    LUMP_DEBUG("bad nodenum");
                     return Q_ERR_BAD_INDEX;
                 }
                 out->children[j] = bsp->nodes + child;
@@ -876,7 +824,7 @@ LOAD(Nodes)
         numfaces = LittleShort(in->numfaces);
         lastface = firstface + numfaces;
         if (lastface < firstface || lastface > bsp->numfaces) {
-            DEBUG("bad faces");
+            LUMP_DEBUG("bad faces");
             return Q_ERR_BAD_INDEX;
         }
         out->firstface = bsp->faces + firstface;
@@ -906,19 +854,16 @@ LOAD_EXT(Nodes)
 #endif
 
     if (!count) {
-        DEBUG("map with no nodes");
+        LUMP_DEBUG("map with no nodes");
         return Q_ERR_TOO_FEW;
     }
 
-    bsp->numnodes = count;
-    bsp->nodes = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->nodes;
     for (i = 0; i < count; i++, out++, in++) {
         planenum = LittleLong(in->planenum);
         if (planenum >= bsp->numplanes) {
-            DEBUG("bad planenum");
+            LUMP_DEBUG("bad planenum");
             return Q_ERR_BAD_INDEX;
         }
         out->plane = bsp->planes + planenum;
@@ -928,13 +873,13 @@ LOAD_EXT(Nodes)
             if (child & 0x80000000) {
                 child = ~child;
                 if (child >= bsp->numleafs) {
-                    DEBUG("bad leafnum");
+                    LUMP_DEBUG("bad leafnum");
                     return Q_ERR_BAD_INDEX;
                 }
                 out->children[j] = (mnode_t *)(bsp->leafs + child);
             } else {
                 if (child >= count) {
-                    DEBUG("bad nodenum");
+                    LUMP_DEBUG("bad nodenum");
                     return Q_ERR_BAD_INDEX;
                 }
                 out->children[j] = bsp->nodes + child;
@@ -946,7 +891,7 @@ LOAD_EXT(Nodes)
         numfaces = LittleLong(in->numfaces);
         lastface = firstface + numfaces;
         if (lastface < firstface || lastface > bsp->numfaces) {
-            DEBUG("bad faces");
+            LUMP_DEBUG("bad faces");
             return Q_ERR_BAD_INDEX;
         }
         out->firstface = bsp->faces + firstface;
@@ -976,13 +921,10 @@ LOAD(Submodels)
 #endif
 
     if (!count) {
-        DEBUG("map with no models");
+        LUMP_DEBUG("map with no models");
         return Q_ERR_TOO_FEW;
     }
 
-    bsp->models = ALLOC(sizeof(*out) * count);
-    bsp->nummodels = count;
-
     in = base;
     out = bsp->models;
     for (i = 0; i < count; i++, in++, out++) {
@@ -997,13 +939,13 @@ LOAD(Submodels)
             // be careful, some models have no nodes, just a leaf
             headnode = ~headnode;
             if (headnode >= bsp->numleafs) {
-                DEBUG("bad headleaf");
+                LUMP_DEBUG("bad headleaf");
                 return Q_ERR_BAD_INDEX;
             }
             out->headnode = (mnode_t *)(bsp->leafs + headnode);
         } else {
             if (headnode >= bsp->numnodes) {
-                DEBUG("bad headnode");
+                LUMP_DEBUG("bad headnode");
                 return Q_ERR_BAD_INDEX;
             }
             out->headnode = bsp->nodes + headnode;
@@ -1016,7 +958,7 @@ LOAD(Submodels)
         numfaces = LittleLong(in->numfaces);
         lastface = firstface + numfaces;
         if (lastface < firstface || lastface > bsp->numfaces) {
-            DEBUG("bad faces");
+            LUMP_DEBUG("bad faces");
             return Q_ERR_BAD_INDEX;
         }
         out->firstface = bsp->faces + firstface;
@@ -1036,9 +978,6 @@ LOAD(AreaPortals)
     mareaportal_t   *out;
     int         i;
 
-    bsp->numareaportals = count;
-    bsp->areaportals = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->areaportals;
     for (i = 0; i < count; i++, in++, out++) {
@@ -1056,9 +995,6 @@ LOAD(Areas)
     int         i;
     uint32_t    numareaportals, firstareaportal, lastareaportal;
 
-    bsp->numareas = count;
-    bsp->areas = ALLOC(sizeof(*out) * count);
-
     in = base;
     out = bsp->areas;
     for (i = 0; i < count; i++, in++, out++) {
@@ -1066,7 +1002,7 @@ LOAD(Areas)
         firstareaportal = LittleLong(in->firstareaportal);
         lastareaportal = firstareaportal + numareaportals;
         if (lastareaportal < firstareaportal || lastareaportal > bsp->numareaportals) {
-            DEBUG("bad areaportals");
+            LUMP_DEBUG("bad areaportals");
             return Q_ERR_BAD_INDEX;
         }
         out->numareaportals = numareaportals;
@@ -1079,8 +1015,6 @@ LOAD(Areas)
 
 LOAD(EntString)
 {
-    bsp->numentitychars = count;
-    bsp->entitystring = ALLOC(count + 1);
     memcpy(bsp->entitystring, base, count);
     bsp->entitystring[count] = 0;
 
@@ -1096,37 +1030,43 @@ LOAD(EntString)
 */
 
 typedef struct {
-    qerror_t (*load)(bsp_t *, void *, size_t);
+    qerror_t (*load)(bsp_t *, void *, size_t, const char **);
+    const char *name;
     unsigned lump;
     size_t disksize;
     size_t memsize;
     size_t maxcount;
+    size_t numofs;      // count and array fields in bsp_t
+    size_t ptrofs;
 } lump_info_t;
 
-#define L(func, lump, disk_t, mem_t) \
-    { BSP_Load##func, LUMP_##lump, sizeof(disk_t), sizeof(mem_t), MAX_MAP_##lump }
+#define F(num, ptr) \
+    q_offsetof(bsp_t, num), q_offsetof(bsp_t, ptr)
+
+#define L(func, lump, disk_t, mem_t, fields) \
+    { BSP_Load##func, #func, LUMP_##lump, sizeof(disk_t), sizeof(mem_t), MAX_MAP_##lump, fields }
 
 static const lump_info_t bsp_lumps[] = {
-    L(Visibility,   VISIBILITY,     byte,           byte),
-    L(Texinfo,      TEXINFO,        dtexinfo_t,     mtexinfo_t),
-    L(Planes,       PLANES,         dplane_t,       cplane_t),
-    L(BrushSides,   BRUSHSIDES,     dbrushside_t,   mbrushside_t),
-    L(Brushes,      BRUSHES,        dbrush_t,       mbrush_t),
-    L(LeafBrushes,  LEAFBRUSHES,    uint16_t,       mbrush_t *),
-    L(AreaPortals,  AREAPORTALS,    dareaportal_t,  mareaportal_t),
-    L(Areas,        AREAS,          darea_t,        marea_t),
+    L(Visibility,   VISIBILITY,     byte,           byte,           F(numvisibility, vis)),
+    L(Texinfo,      TEXINFO,        dtexinfo_t,     mtexinfo_t,     F(numtexinfo, texinfo)),
+    L(Planes,       PLANES,         dplane_t,       cplane_t,       F(numplanes, planes)),
+    L(BrushSides,   BRUSHSIDES,     dbrushside_t,   mbrushside_t,   F(numbrushsides, brushsides)),
+    L(Brushes,      BRUSHES,        dbrush_t,       mbrush_t,       F(numbrushes, brushes)),
+    L(LeafBrushes,  LEAFBRUSHES,    uint16_t,       mbrush_t *,     F(numleafbrushes, leafbrushes)),
+    L(AreaPortals,  AREAPORTALS,    dareaportal_t,  mareaportal_t,  F(numareaportals, areaportals)),
+    L(Areas,        AREAS,          darea_t,        marea_t,        F(numareas, areas)),
 #if USE_REF
-    L(Lightmap,     LIGHTING,       byte,           byte),
-    L(Vertices,     VERTEXES,       dvertex_t,      mvertex_t),
-    L(Edges,        EDGES,          dedge_t,        medge_t),
-    L(SurfEdges,    SURFEDGES,      uint32_t,       msurfedge_t),
-    L(Faces,        FACES,          dface_t,        mface_t),
-    L(LeafFaces,    LEAFFACES,      uint16_t,       mface_t *),
+    L(Lightmap,     LIGHTING,       byte,           byte,           F(numlightmapbytes, lightmap)),
+    L(Vertices,     VERTEXES,       dvertex_t,      mvertex_t,      F(numvertices, vertices)),
+    L(Edges,        EDGES,          dedge_t,        medge_t,        F(numedges, edges)),
+    L(SurfEdges,    SURFEDGES,      uint32_t,       msurfedge_t,    F(numsurfedges, surfedges)),
+    L(Faces,        FACES,          dface_t,        mface_t,        F(numfaces, faces)),
+    L(LeafFaces,    LEAFFACES,      uint16_t,       mface_t *,      F(numleaffaces, leaffaces)),
 #endif
-    L(Leafs,        LEAFS,          dleaf_t,        mleaf_t),
-    L(Nodes,        NODES,          dnode_t,        mnode_t),
-    L(Submodels,    MODELS,         dmodel_t,       mmodel_t),
-    L(EntString,    ENTSTRING,      char,           char),
+    L(Leafs,        LEAFS,          dleaf_t,        mleaf_t,        F(numleafs, leafs)),
+    L(Nodes,        NODES,          dnode_t,        mnode_t,        F(numnodes, nodes)),
+    L(Submodels,    MODELS,         dmodel_t,       mmodel_t,       F(nummodels, models)),
+    L(EntString,    ENTSTRING,      char,           char,           F(numentitychars, entitystring)),
     { NULL }
 };
 
@@ -1134,40 +1074,59 @@ static const lump_info_t bsp_lumps[] = {
 
 // QBSP
 
-#define LS(func, lump, disk_t, mem_t) \
-    { BSP_Load##func, LUMP_##lump, sizeof(disk_t), sizeof(mem_t), MAX_QBSP_MAP_##lump }
-#define L(func, lump, disk_t, mem_t) \
-    { BSP_QBSP_Load##func, LUMP_##lump, sizeof(disk_t), sizeof(mem_t), MAX_QBSP_MAP_##lump }
+#define LS(func, lump, disk_t, mem_t, fields) \
+    { BSP_Load##func, #func, LUMP_##lump, sizeof(disk_t), sizeof(mem_t), MAX_QBSP_MAP_##lump, fields }
+#define L(func, lump, disk_t, mem_t, fields) \
+    { BSP_QBSP_Load##func, "QBSP_" #func, LUMP_##lump, sizeof(disk_t), sizeof(mem_t), MAX_QBSP_MAP_##lump, fields }
 
 static const lump_info_t qbsp_lumps[] = {
-    LS(Visibility,  VISIBILITY,     byte,           byte),
-    LS(Texinfo,     TEXINFO,        dtexinfo_t,     mtexinfo_t),
-    LS(Planes,      PLANES,         dplane_t,       cplane_t),
-    L(BrushSides,   BRUSHSIDES,     dbrushside_qbsp_t, mbrushside_t),
-    LS(Brushes,     BRUSHES,        dbrush_t,       mbrush_t),
-    L(LeafBrushes,  LEAFBRUSHES,    uint32_t,       mbrush_t *),
-    LS(AreaPortals, AREAPORTALS,    dareaportal_t,  mareaportal_t),
-    LS(Areas,       AREAS,          darea_t,        marea_t),
+    LS(Visibility,  VISIBILITY,     byte,           byte,           F(numvisibility, vis)),
+    LS(Texinfo,     TEXINFO,        dtexinfo_t,     mtexinfo_t,     F(numtexinfo, texinfo)),
+    LS(Planes,      PLANES,         dplane_t,       cplane_t,       F(numplanes, planes)),
+    L(BrushSides,   BRUSHSIDES,     dbrushside_qbsp_t, mbrushside_t, F(numbrushsides, brushsides)),
+    LS(Brushes,     BRUSHES,        dbrush_t,       mbrush_t,       F(numbrushes, brushes)),
+    L(LeafBrushes,  LEAFBRUSHES,    uint32_t,       mbrush_t *,     F(numleafbrushes, leafbrushes)),
+    LS(AreaPortals, AREAPORTALS,    dareaportal_t,  mareaportal_t,  F(numareaportals, areaportals)),
+    LS(Areas,       AREAS,          darea_t,        marea_t,        F(numareas, areas)),
 #if USE_REF
-    LS(Lightmap,    LIGHTING,       byte,           byte),
-    LS(Vertices,    VERTEXES,       dvertex_t,      mvertex_t),
-    L(Edges,        EDGES,          dedge_qbsp_t,   medge_t),
-    LS(SurfEdges,   SURFEDGES,      uint32_t,       msurfedge_t),
-    L(Faces,        FACES,          dface_qbsp_t,   mface_t),
-    L(LeafFaces,    LEAFFACES,      uint32_t,       mface_t *),
+    LS(Lightmap,    LIGHTING,       byte,           byte,           F(numlightmapbytes, lightmap)),
+    LS(Vertices,    VERTEXES,       dvertex_t,      mvertex_t,      F(numvertices, vertices)),
+    L(Edges,        EDGES,          dedge_qbsp_t,   medge_t,        F(numedges, edges)),
+    LS(SurfEdges,   SURFEDGES,      uint32_t,       msurfedge_t,    F(numsurfedges, surfedges)),
+    L(Faces,        FACES,          dface_qbsp_t,   mface_t,        F(numfaces, faces)),
+    L(LeafFaces,    LEAFFACES,      uint32_t,       mface_t *,      F(numleaffaces, leaffaces)),
 #endif
-    L(Leafs,        LEAFS,          dleaf_qbsp_t,   mleaf_t),
-    L(Nodes,        NODES,          dnode_qbsp_t,   mnode_t),
-    LS(Submodels,   MODELS,         dmodel_t,       mmodel_t),
-    LS(EntString,   ENTSTRING,      char,           char),
+    L(Leafs,        LEAFS,          dleaf_qbsp_t,   mleaf_t,        F(numleafs, leafs)),
+    L(Nodes,        NODES,          dnode_qbsp_t,   mnode_t,        F(numnodes, nodes)),
+    LS(Submodels,   MODELS,         dmodel_t,       mmodel_t,       F(nummodels, models)),
+    LS(EntString,   ENTSTRING,      char,           char,           F(numentitychars, entitystring)),
     { NULL }
 };
 
 #undef LS
 #undef L
+#undef F
 
 static list_t   bsp_cache;
 
+// timing of the last map loaded from disk
+typedef struct {
+    char                name[MAX_QPATH];
+    const lump_info_t   *lumps;
+    size_t              counts[HEADER_LUMPS];   // indexed like lumps
+    uint64_t            usec[HEADER_LUMPS];
+    uint64_t            read_usec;
+    uint64_t            checksum_usec;
+    uint64_t            lumps_usec;             // wall clock of the parallel part
+    uint64_t            validate_usec;
+    uint64_t            pvs_usec;
+    uint64_t            total_usec;
+    int                 threads;
+    qboolean            pvs_patched;
+} bsp_load_stats_t;
+
+static bsp_load_stats_t bsp_stats;
+
 static void BSP_List_f(void)
 {
     bsp_t *bsp;
@@ -1189,6 +1148,31 @@ static void BSP_List_f(void)
     Com_Printf("Total resident: %"PRIz"\n", bytes);
 }
 
+static void BSP_LoadStats_f(void)
+{
+    const bsp_load_stats_t *st = &bsp_stats;
+    int i;
+
+    if (!st->lumps) {
+        Com_Printf("No map loaded yet\n");
+        return;
+    }
+
+    Com_Printf("%s, %d threads\n", st->name, st->threads);
+    Com_Printf("%-16s %8s %8s\n", "lump", "count", "usec");
+    for (i = 0; st->lumps[i].load; i++) {
+        Com_Printf("%-16s %8"PRIz" %8"PRIu64"\n",
+                   st->lumps[i].name, st->counts[i], st->usec[i]);
+    }
+    Com_Printf("%-16s %8s %8"PRIu64"\n", "checksum", "", st->checksum_usec);
+    Com_Printf("------------------\n");
+    Com_Printf("%-16s %8"PRIu64"\n", "read", st->read_usec);
+    Com_Printf("%-16s %8"PRIu64"\n", "lumps", st->lumps_usec);
+    Com_Printf("%-16s %8"PRIu64"\n", "validate", st->validate_usec);
+    Com_Printf("%-16s %8"PRIu64"%s\n", "pvs", st->pvs_usec, st->pvs_patched ? " (patched)" : "");
+    Com_Printf("%-16s %8"PRIu64"\n", "total", st->total_usec);
+}
+
 static bsp_t *BSP_Find(const char *name)
 {
     bsp_t *bsp;
@@ -1327,6 +1311,25 @@ void BSP_Free(bsp_t *bsp)
     }
 }
 
+#define PVS_ROWS_PER_JOB    64
+
+typedef struct {
+	bsp_t *bsp;
+	byte *matrix;
+} pvsjob_t;
+
+static void BSP_DecompressPvsRows(void *arg, int index)
+{
+	pvsjob_t *job = arg;
+	int first = index * PVS_ROWS_PER_JOB;
+	int last = min(first + PVS_ROWS_PER_JOB, job->bsp->vis->numclusters);
+
+	for (int cluster = first; cluster < last; cluster++)
+	{
+		BSP_ClusterVis(job->bsp, job->matrix + job->bsp->visrowsize * cluster, cluster, DVIS_PVS);
+	}
+}
+
 static void BSP_BuildPvsMatrix(bsp_t *bsp)
 {
 	if (!bsp->vis)
@@ -1337,14 +1340,15 @@ static void BSP_BuildPvsMatrix(bsp_t *bsp)
 
 	// allocate the matrix but don't set it in the BSP structure yet: 
 	// we want BSP_CluterVis to use the old PVS data here, and not the new empty matrix
-	byte* pvs_matrix = Z_Mallocz(matrix_size);
-	
-	for (int cluster = 0; cluster < bsp->vis->numclusters; cluster++)
-	{
-		BSP_ClusterVis(bsp, pvs_matrix + bsp->visrowsize * cluster, cluster, DVIS_PVS);
-	}
+	pvsjob_t job;
+	job.bsp = bsp;
+	job.matrix = Z_Mallocz(matrix_size);
+
+	// rows are independent
+	Job_ParallelFor(BSP_DecompressPvsRows, &job,
+		(bsp->vis->numclusters + PVS_ROWS_PER_JOB - 1) / PVS_ROWS_PER_JOB);
 
-	bsp->pvs_matrix = pvs_matrix;
+	bsp->pvs_matrix = job.matrix;
 }
 
 byte* BSP_GetPvs(bsp_t *bsp, int cluster)
@@ -1453,6 +1457,47 @@ qboolean BSP_SavePatchedPVS(bsp_t *bsp)
 		return qfalse;
 }
 
+typedef struct {
+    bsp_t               *bsp;
+    const lump_info_t   *lumps;
+    int                 numlumps;
+    byte                *buf;
+    size_t              filelen;
+    byte                *data[HEADER_LUMPS];    // indexed like lumps
+    size_t              counts[HEADER_LUMPS];
+    qerror_t            ret[HEADER_LUMPS];
+    const char          *debug[HEADER_LUMPS];
+    uint64_t            usec[HEADER_LUMPS];
+    uint64_t            checksum_usec;
+} lumpjob_t;
+
+static void BSP_LoadLump(lumpjob_t *job, int index)
+{
+    const lump_info_t *info = &job->lumps[index];
+    uint64_t start = Sys_Microseconds();
+
+    job->ret[index] = info->load(job->bsp, job->data[index], job->counts[index], &job->debug[index]);
+    job->usec[index] = Sys_Microseconds() - start;
+}
+
+// index 0 calculates the checksum, the rest load all lumps but visibility
+static void BSP_LoadLumpJob(void *arg, int index)
+{
+    lumpjob_t *job = arg;
+    uint64_t start;
+
+    if (index == 0) {
+        start = Sys_Microseconds();
+        job->bsp->checksum = LittleLong(Com_BlockChecksum(job->buf, job->filelen));
+        job->checksum_usec = Sys_Microseconds() - start;
+        return;
+    }
+
+    if (job->lumps[index - 1].lump != LUMP_VISIBILITY) {
+        BSP_LoadLump(job, index - 1);
+    }
+}
+
 /*
 ==================
 BSP_Load
@@ -1468,9 +1513,10 @@ qerror_t BSP_Load(const char *name, bsp_t **bsp_p)
     const lump_info_t *info;
     size_t          filelen, ofs, len, end, count;
     qerror_t        ret;
-    byte            *lumpdata[HEADER_LUMPS];
-    size_t          lumpcount[HEADER_LUMPS];
+    lumpjob_t       job;
     size_t          memsize;
+    uint64_t        start, stage;
+    int             i;
 
     if (!name || !bsp_p)
         Com_Error(ERR_FATAL, "%s: NULL", __func__);
@@ -1487,10 +1533,13 @@ qerror_t BSP_Load(const char *name, bsp_t **bsp_p)
         return Q_ERR_SUCCESS;
     }
 
+    start = Sys_Microseconds();
+
     //
     // load the file
     //
-    filelen = FS_LoadFile(name, (void **)&buf);
+    // lumps are only read from, so the file may be mapped
+    filelen = FS_LoadFileEx(name, (void **)&buf, FS_FLAG_MAPPED, TAG_FILESYSTEM);
     if (!buf) {
         return filelen;
     }
@@ -1509,9 +1558,14 @@ qerror_t BSP_Load(const char *name, bsp_t **bsp_p)
 
     const lump_info_t *lumps = LittleLong(header->ident) == IDBSPHEADER ? bsp_lumps : qbsp_lumps;
 
+    memset(&job, 0, sizeof(job));
+    job.lumps = lumps;
+    job.buf = buf;
+    job.filelen = filelen;
+
     // byte swap and validate all lumps
     memsize = 0;
-    for (info = lumps; info->load; info++) {
+    for (i = 0, info = lumps; info->load; i++, info++) {
         ofs = LittleLong(header->lumps[info->lump].fileofs);
         len = LittleLong(header->lumps[info->lump].filelen);
         end = ofs + len;
@@ -1529,32 +1583,64 @@ qerror_t BSP_Load(const char *name, bsp_t **bsp_p)
             goto fail2;
         }
 
-        lumpdata[info->lump] = buf + ofs;
-        lumpcount[info->lump] = count;
+        job.data[i] = buf + ofs;
+        job.counts[i] = count;
 
         memsize += count * info->memsize;
     }
+    job.numlumps = i;
+
+    bsp_stats.read_usec = Sys_Microseconds() - start;
 
     // load into hunk
     len = strlen(name);
     bsp = Z_Mallocz(sizeof(*bsp) + len);
     memcpy(bsp->name, name, len + 1);
     bsp->refcount = 1;
+    job.bsp = bsp;
 
     // add an extra page for cacheline alignment overhead
     Hunk_Begin(&bsp->hunk, memsize + 4096);
 
-    // calculate the checksum
-    bsp->checksum = LittleLong(Com_BlockChecksum(buf, filelen));
+    // set up all arrays and counts, empty lumps get NULL arrays
+    for (i = 0, info = lumps; info->load; i++, info++) {
+        len = job.counts[i] * info->memsize;
+        if (info->lump == LUMP_ENTSTRING) {
+            len++;  // terminator
+        }
+        *(int *)((byte *)bsp + info->numofs) = job.counts[i];
+        *(void **)((byte *)bsp + info->ptrofs) = len ? Hunk_Alloc(&bsp->hunk, len) : NULL;
+    }
 
-    // load all lumps
-    for (info = lumps; info->load; info++) {
-        ret = info->load(bsp, lumpdata[info->lump], lumpcount[info->lump]);
+    // leafs check their clusters against the visibility header, so it is
+    // loaded first, the rest in parallel along with the checksum
+    stage = Sys_Microseconds();
+    for (i = 0; i < job.numlumps; i++) {
+        if (lumps[i].lump == LUMP_VISIBILITY) {
+            BSP_LoadLump(&job, i);
+            if (job.ret[i]) {
+                break;
+            }
+        }
+    }
+    if (i == job.numlumps) {
+        Job_ParallelFor(BSP_LoadLumpJob, &job, job.numlumps + 1);
+    }
+    bsp_stats.lumps_usec = Sys_Microseconds() - stage;
+
+    // report the first failure in table order
+    for (i = 0; i < job.numlumps; i++) {
+        ret = job.ret[i];
         if (ret) {
+            if (job.debug[i]) {
+                Com_DPrintf("BSP_Load%s: %s\n", lumps[i].name, job.debug[i]);
+            }
             goto fail1;
         }
     }
 
+    stage = Sys_Microseconds();
+
     ret = BSP_ValidateAreaPortals(bsp);
     if (ret) {
         goto fail1;
@@ -1565,6 +1651,9 @@ qerror_t BSP_Load(const char *name, bsp_t **bsp_p)
         goto fail1;
     }
 
+    bsp_stats.validate_usec = Sys_Microseconds() - stage;
+    stage = Sys_Microseconds();
+
 	if (!BSP_LoadPatchedPVS(bsp))
 	{
 		BSP_BuildPvsMatrix(bsp);
@@ -1574,12 +1663,23 @@ qerror_t BSP_Load(const char *name, bsp_t **bsp_p)
 		bsp->pvs_patched = qtrue;
 	}
 
+    bsp_stats.pvs_usec = Sys_Microseconds() - stage;
+
     Hunk_End(&bsp->hunk);
 
     List_Append(&bsp_cache, &bsp->entry);
 
     FS_FreeFile(buf);
 
+    Q_strlcpy(bsp_stats.name, name, sizeof(bsp_stats.name));
+    bsp_stats.lumps = lumps;
+    memcpy(bsp_stats.counts, job.counts, sizeof(bsp_stats.counts));
+    memcpy(bsp_stats.usec, job.usec, sizeof(bsp_stats.usec));
+    bsp_stats.checksum_usec = job.checksum_usec;
+    bsp_stats.total_usec = Sys_Microseconds() - start;
+    bsp_stats.threads = Job_NumWorkers() + 1;
+    bsp_stats.pvs_patched = bsp->pvs_patched;
+
     *bsp_p = bsp;
     return Q_ERR_SUCCESS;
 
@@ -1854,6 +1954,7 @@ void BSP_Init(void)
     map_visibility_patch = Cvar_Get("map_visibility_patch", "1", 0);
 
     Cmd_AddCommand("bsplist", BSP_List_f);
+    Cmd_AddCommand("bsp_load_stats", BSP_LoadStats_f);
 
     List_Init(&bsp_cache);
 }
@@ -32,6 +32,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/field.h"
 #include "common/fifo.h"
 #include "common/files.h"
+#include "common/jobs.h"
 #include "common/math.h"
 #include "common/mdfour.h"
 #include "common/msg.h"
@@ -624,6 +625,7 @@ void Com_Quit(const char *reason, error_type_t type)
     NET_Shutdown();
     logfile_close();
     FS_Shutdown();
+    Job_Shutdown();
 
     Sys_Quit();
     // doesn't get there
@@ -989,6 +991,8 @@ void Qcommon_Init(int argc, char **argv)
 
     Sys_RunConsole();
 
+    Job_Init();
+
     FS_Init();
 
     Sys_RunConsole();
@@ -1151,6 +1155,9 @@ void Qcommon_Frame(void)
     // run system console
     Sys_RunConsole();
 
+    // finish asynchronous file loads
+    FS_PollAsync();
+
     NET_UpdateStats();
 
     remaining = SV_Frame(msec);
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/cvar.h"
 #include "common/error.h"
 #include "common/files.h"
+#include "common/jobs.h"
 #include "common/prompt.h"
 #include "system/system.h"
 #include "client/client.h"
@@ -34,7 +35,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <sys/stat.h>
 #ifndef WIN32
     #include <unistd.h>
+    #include <sys/mman.h>
 #else
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+    #include <io.h>
     #define stat _stat
 #endif
 
@@ -135,6 +140,10 @@ typedef struct {
     unsigned    hash_size;
     char        *names;
     char        *filename;
+    time_t      mtime;      // modification time of the pack file
+    byte        *map;       // read-only mapping of the whole file, or NULL
+    size_t      map_size;
+    list_t      entry;      // in fs_mapped_packs while mapped
 } pack_t;
 
 typedef struct searchpath_s {
@@ -157,6 +166,7 @@ typedef struct {
     qerror_t    error;      // stream error indicator from read/write operation
     size_t      rest_out;   // remaining unread length for FS_PAK/FS_ZIP
     size_t      length;     // total cached file length
+    const byte  *map;       // raw entry data if pack is memory mapped
 } file_t;
 
 typedef struct {
@@ -167,6 +177,23 @@ typedef struct {
     char    name[1];
 } symlink_t;
 
+// listing of a single physical directory, see dir_cache_lookup
+typedef struct dirfile_s {
+    struct dirfile_s *hash_next;
+    char        name[1];
+} dirfile_t;
+
+typedef struct dirindex_s {
+    struct dirindex_s *hash_next;
+    qboolean    complete;   // false if listing was truncated
+    unsigned    num_files;
+    dirfile_t   **file_hash;
+    unsigned    hash_size;
+    char        path[1];
+} dirindex_t;
+
+#define DIR_HASH_SIZE   256
+
 // these point to user home directory
 char                fs_gamedir[MAX_OSPATH];
 //static char       fs_basedir[MAX_OSPATH];
@@ -179,20 +206,35 @@ static list_t       fs_soft_links;
 
 static file_t       fs_files[MAX_FILE_HANDLES];
 
+static dirindex_t   *fs_dirs[DIR_HASH_SIZE];
+
+static LIST_DECL(fs_mapped_packs);
+
+static LIST_DECL(fs_async_loads);
+
 #ifdef _DEBUG
 static int          fs_count_read;
 static int          fs_count_open;
 static int          fs_count_strcmp;
 static int          fs_count_strlwr;
+static int          fs_count_dirhit;
+static int          fs_count_dirmiss;
+static int          fs_count_dirscan;
 #define FS_COUNT_READ       fs_count_read++
 #define FS_COUNT_OPEN       fs_count_open++
 #define FS_COUNT_STRCMP     fs_count_strcmp++
 #define FS_COUNT_STRLWR     fs_count_strlwr++
+#define FS_COUNT_DIRHIT     fs_count_dirhit++
+#define FS_COUNT_DIRMISS    fs_count_dirmiss++
+#define FS_COUNT_DIRSCAN    fs_count_dirscan++
 #else
 #define FS_COUNT_READ       (void)0
 #define FS_COUNT_OPEN       (void)0
 #define FS_COUNT_STRCMP     (void)0
 #define FS_COUNT_STRLWR     (void)0
+#define FS_COUNT_DIRHIT     (void)0
+#define FS_COUNT_DIRMISS    (void)0
+#define FS_COUNT_DIRSCAN    (void)0
 #endif
 
 #ifdef _DEBUG
@@ -201,6 +243,9 @@ static cvar_t       *fs_debug;
 
 cvar_t              *fs_game;
 
+static cvar_t       *fs_dircache;
+static cvar_t       *fs_mmap;
+
 cvar_t              *fs_shareware;
 
 #if USE_ZLIB
@@ -218,6 +263,12 @@ static ssize_t read_zip_file(file_t *file, void *buf, size_t len);
 static pack_t *pack_get(pack_t *pack);
 static void pack_put(pack_t *pack);
 
+static void pack_map(pack_t *pack);
+static void pack_unmap(pack_t *pack);
+static const byte *pack_map_entry(pack_t *pack, size_t pos, size_t len);
+
+static byte *claim_prefetch(packfile_t *entry);
+
 /*
 
 All of Quake's data access is through a hierchal file system,
@@ -546,7 +597,7 @@ static qerror_t seek_pak_file(file_t *file, off_t offset)
         return Q_ERR_INVAL;
 
     filepos = entry->filepos + offset;
-    if (fseek(file->fp, filepos, SEEK_SET) == -1)
+    if (!file->map && fseek(file->fp, filepos, SEEK_SET) == -1)
         return Q_Errno();
 
     file->rest_out = entry->filelen - offset;
@@ -841,6 +892,200 @@ static qerror_t get_fp_info(FILE *fp, file_info_t *info)
     return Q_ERR_SUCCESS;
 }
 
+/*
+============================================================================
+
+DIRECTORY CACHE
+
+Physical directories are listed once, on first lookup of a file in them,
+and kept in memory until the filesystem is restarted. Lookups of files
+missing from loose directories (e.g. probing image extensions) then
+never reach the kernel. Files created through FS functions invalidate
+their directory. Lookups explicitly restricted to FS_TYPE_REAL (configs,
+savegames, demos) always go to disk, as these may be written behind
+our back by the game library.
+
+============================================================================
+*/
+
+static unsigned dir_hash(const char *path, size_t len)
+{
+    return FS_HashPathLen(path, len, DIR_HASH_SIZE);
+}
+
+static dirindex_t *dir_cache_find(const char *path, size_t len, dirindex_t ***prev_p)
+{
+    dirindex_t *dir, **prev;
+
+    prev = &fs_dirs[dir_hash(path, len)];
+    for (dir = *prev; dir; prev = &dir->hash_next, dir = dir->hash_next) {
+        if (!strncmp(dir->path, path, len) && !dir->path[len]) {
+            break;
+        }
+    }
+
+    if (prev_p) {
+        *prev_p = prev;
+    }
+
+    return dir;
+}
+
+static dirindex_t *dir_cache_scan(const char *path, size_t len)
+{
+    void        *files[MAX_LISTED_FILES];
+    char        dirpath[MAX_OSPATH];
+    dirindex_t  *dir;
+    dirfile_t   *file;
+    unsigned    hash;
+    size_t      namelen;
+    int         i, count;
+
+    FS_COUNT_DIRSCAN;
+
+    memcpy(dirpath, path, len);
+    dirpath[len] = 0;
+
+    count = 0;
+    Sys_ListFiles_r(dirpath, NULL, 0, len + 1, &count, files, 0);
+
+    dir = FS_Malloc(sizeof(*dir) + len);
+    memcpy(dir->path, path, len);
+    dir->path[len] = 0;
+    dir->complete = count < MAX_LISTED_FILES;
+    dir->num_files = count;
+    dir->hash_size = npot32(count / 3 + 1);
+    dir->file_hash = FS_Mallocz(dir->hash_size * sizeof(dir->file_hash[0]));
+
+    for (i = 0; i < count; i++) {
+        namelen = strlen(files[i]);
+        file = FS_Malloc(sizeof(*file) + namelen);
+        memcpy(file->name, files[i], namelen + 1);
+        hash = FS_HashPath(file->name, dir->hash_size);
+        file->hash_next = dir->file_hash[hash];
+        dir->file_hash[hash] = file;
+        Z_Free(files[i]);
+    }
+
+    hash = dir_hash(path, len);
+    dir->hash_next = fs_dirs[hash];
+    fs_dirs[hash] = dir;
+
+    return dir;
+}
+
+static void dir_cache_free(dirindex_t *dir)
+{
+    dirfile_t *file, *next;
+    unsigned i;
+
+    for (i = 0; i < dir->hash_size; i++) {
+        for (file = dir->file_hash[i]; file; file = next) {
+            next = file->hash_next;
+            Z_Free(file);
+        }
+    }
+
+    Z_Free(dir->file_hash);
+    Z_Free(dir);
+}
+
+static void dir_cache_flush(void)
+{
+    dirindex_t *dir, *next;
+    int i;
+
+    for (i = 0; i < DIR_HASH_SIZE; i++) {
+        for (dir = fs_dirs[i]; dir; dir = next) {
+            next = dir->hash_next;
+            dir_cache_free(dir);
+        }
+        fs_dirs[i] = NULL;
+    }
+}
+
+// forget directory containing the given file
+static void dir_cache_invalidate(const char *fullpath)
+{
+    dirindex_t *dir, **prev;
+    const char *sep;
+
+    sep = strrchr(fullpath, '/');
+    if (!sep) {
+        return;
+    }
+
+    dir = dir_cache_find(fullpath, sep - fullpath, &prev);
+    if (dir) {
+        *prev = dir->hash_next;
+        dir_cache_free(dir);
+    }
+}
+
+// returns false if the file is known not to exist
+static qboolean dir_cache_lookup(file_t *file, const char *fullpath)
+{
+    dirindex_t  *dir;
+    dirfile_t   *entry;
+    const char  *sep, *name;
+
+    if (!fs_dircache->integer) {
+        return qtrue;
+    }
+
+    if ((file->mode & FS_TYPE_MASK) == FS_TYPE_REAL) {
+        return qtrue;
+    }
+
+    sep = strrchr(fullpath, '/');
+    if (!sep) {
+        return qtrue;
+    }
+
+    // Sys_ListFiles_r skips dot files, so the listing can't tell
+    if (sep[1] == '.') {
+        return qtrue;
+    }
+
+    dir = dir_cache_find(fullpath, sep - fullpath, NULL);
+    if (!dir) {
+        dir = dir_cache_scan(fullpath, sep - fullpath);
+    }
+
+    if (!dir->complete) {
+        return qtrue;
+    }
+
+    name = sep + 1;
+    entry = dir->file_hash[FS_HashPath(name, dir->hash_size)];
+    for (; entry; entry = entry->hash_next) {
+#ifdef _WIN32
+        if (!Q_stricmp(entry->name, name)) {
+#else
+        if (!strcmp(entry->name, name)) {
+#endif
+            FS_COUNT_DIRHIT;
+            return qtrue;
+        }
+    }
+
+    FS_COUNT_DIRMISS;
+    return qfalse;
+}
+
+/*
+================
+FS_InvalidateDirCache
+
+Must be called after creating a file under the game directory by
+other means than FS functions.
+================
+*/
+void FS_InvalidateDirCache(const char *fullpath)
+{
+    dir_cache_invalidate(fullpath);
+}
+
 static inline FILE *fopen_hack(const char *path, const char *mode)
 {
 #ifndef _GNU_SOURCE
@@ -965,6 +1210,8 @@ static ssize_t open_file_write(file_t *file, const char *name)
         goto fail1;
     }
 
+    dir_cache_invalidate(fullpath);
+
 #ifndef _WIN32
     // check if this is a regular file
     ret = get_fp_info(fp, NULL);
@@ -1154,23 +1401,35 @@ static ssize_t read_zip_file(file_t *file, void *buf, size_t len)
                 break;
             }
 
-            // fill in the temp buffer
-            block = ZIP_BUFSIZE;
-            if (block > s->rest_in) {
+            if (file->map) {
+                // inflate straight from the mapping
                 block = s->rest_in;
-            }
+                if (block > INT_MAX) {
+                    block = INT_MAX;
+                }
 
-            result = fread(s->buffer, 1, block, file->fp);
-            if (result != block) {
-                file->error = FS_ERR_READ(file->fp);
-                if (!result) {
-                    break;
+                z->next_in = (Bytef *)file->map + file->entry->complen - s->rest_in;
+                z->avail_in = (uInt)block;
+                s->rest_in -= block;
+            } else {
+                // fill in the temp buffer
+                block = ZIP_BUFSIZE;
+                if (block > s->rest_in) {
+                    block = s->rest_in;
                 }
-            }
 
-            s->rest_in -= result;
-            z->next_in = s->buffer;
-            z->avail_in = result;
+                result = fread(s->buffer, 1, block, file->fp);
+                if (result != block) {
+                    file->error = FS_ERR_READ(file->fp);
+                    if (!result) {
+                        break;
+                    }
+                }
+
+                s->rest_in -= result;
+                z->next_in = s->buffer;
+                z->avail_in = result;
+            }
         }
 
         ret = inflate(z, Z_SYNC_FLUSH);
@@ -1237,9 +1496,11 @@ static ssize_t open_from_pak(file_t *file, pack_t *pack, packfile_t *entry, qboo
     file->error = Q_ERR_SUCCESS;
     file->rest_out = entry->filelen;
     file->length = entry->filelen;
+    file->map = pack_map_entry(pack, entry->filepos, entry->filelen);
 
 #if USE_ZLIB
     if (pack->type == FS_ZIP) {
+        file->map = pack_map_entry(pack, entry->filepos, entry->complen);
         if (file->mode & FS_FLAG_DEFLATE) {
             // server wants raw deflated data for downloads
             file->type = FS_PAK;
@@ -1353,6 +1614,58 @@ qerror_t FS_LastModified(char const * file, uint64_t * last_modified)
     return Q_ERR_INVALID_PATH;
 }
 
+/*
+================
+FS_FileStamp
+
+Identifies the current contents of a file without reading them: the
+modification time and size of a loose file, or the path and modification
+time of the pack and the position of the entry for a file in a pack.
+The stamp changes whenever the file or its pack is replaced.
+================
+*/
+qerror_t FS_FileStamp(const char *path, uint64_t *stamp)
+{
+    qhandle_t   f;
+    file_t      *file;
+    file_info_t info;
+    ssize_t     ret;
+    uint64_t    hash = 14695981039346656037ULL;
+    uint64_t    values[3];
+    const byte  *p;
+    size_t      i;
+
+    ret = FS_FOpenFile(path, &f, FS_MODE_READ);
+    if (!f)
+        return ret;
+
+    file = file_for_handle(f);
+    if (file->pack) {
+        for (p = (const byte *)file->pack->filename; *p; p++)
+            hash = (hash ^ *p) * 1099511628211ULL;
+        values[0] = file->pack->mtime;
+        values[1] = file->entry->filepos;
+        values[2] = file->entry->filelen;
+    } else {
+        ret = get_fp_info(file->fp, &info);
+        if (ret) {
+            FS_FCloseFile(f);
+            return ret;
+        }
+        values[0] = info.mtime;
+        values[1] = info.size;
+        values[2] = 0;
+    }
+    FS_FCloseFile(f);
+
+    // FNV-1a
+    for (p = (const byte *)values, i = 0; i < sizeof(values); i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+
+    *stamp = hash;
+    return Q_ERR_SUCCESS;
+}
+
 // Finds the file in the search path.
 // Fills file_t and returns file length.
 // Used for streaming data out of either a pak file or a seperate file.
@@ -1439,18 +1752,22 @@ static ssize_t open_file_read(file_t *file, const char *normalized, size_t namel
                 goto fail;
             }
 
-            ret = open_from_disk(file, fullpath);
-            if (ret != Q_ERR_NOENT)
-                return ret;
+            if (dir_cache_lookup(file, fullpath)) {
+                ret = open_from_disk(file, fullpath);
+                if (ret != Q_ERR_NOENT)
+                    return ret;
+            }
 
 #ifndef _WIN32
             if (valid == PATH_MIXED_CASE) {
                 // convert to lower case and retry
                 FS_COUNT_STRLWR;
                 Q_strlwr(fullpath + strlen(search->filename) + 1);
-                ret = open_from_disk(file, fullpath);
-                if (ret != Q_ERR_NOENT)
-                    return ret;
+                if (dir_cache_lookup(file, fullpath)) {
+                    ret = open_from_disk(file, fullpath);
+                    if (ret != Q_ERR_NOENT)
+                        return ret;
+                }
             }
 #endif
         }
@@ -1512,6 +1829,12 @@ static ssize_t read_pak_file(file_t *file, void *buf, size_t len)
         return 0;
     }
 
+    if (file->map) {
+        memcpy(buf, file->map + file->length - file->rest_out, len);
+        file->rest_out -= len;
+        return len;
+    }
+
     result = fread(buf, 1, len, file->fp);
     if (result != len) {
         file->error = FS_ERR_READ(file->fp);
@@ -1905,6 +2228,23 @@ ssize_t FS_LoadFileEx(const char *path, void **buffer, unsigned flags, memtag_t
         goto done;
     }
 
+    // take over buffer inflated in background by FS_PrefetchFile
+    if (file->type == FS_ZIP && tag == TAG_FILESYSTEM) {
+        buf = claim_prefetch(file->entry);
+        if (buf) {
+            *buffer = buf;
+            goto done;
+        }
+    }
+
+    // return raw and stored entries of mapped packs without copying,
+    // the buffer keeps the pack referenced until FS_FreeFile
+    if ((flags & FS_FLAG_MAPPED) && file->type == FS_PAK && file->map) {
+        *buffer = (void *)file->map;
+        pack_get(file->pack);
+        goto done;
+    }
+
     // allocate chunk of memory, +1 for NUL
     buf = Z_TagMalloc(len + 1, tag);
 
@@ -1924,6 +2264,243 @@ done:
     return len;
 }
 
+/*
+============================================================================
+
+ASYNCHRONOUS LOADING
+
+Deflated members of memory mapped pkz files are inflated on worker threads.
+Output buffer is allocated and the pack referenced by the main thread up
+front, so jobs only touch zlib and memory owned by the request.
+
+FS_LoadFileAsync completes through a callback run from FS_PollAsync on the
+main thread. Files that can't be inflated in background are loaded
+synchronously and complete on the next poll as well.
+
+FS_PrefetchFile queues a request without callback. When the file is later
+loaded with FS_LoadFileEx, the inflated buffer is taken over instead of
+reading the file again. Unclaimed prefetches are dropped by FS_FlushAsync.
+
+============================================================================
+*/
+
+typedef struct {
+    job_t       job;
+    list_t      entry;
+    pack_t      *pack;      // non-NULL if inflated by a job
+    packfile_t  *file;
+    const byte  *src;
+    byte        *buffer;
+    ssize_t     len;        // file length or error code
+    fsasync_t   callback;   // NULL for prefetches
+    void        *arg;
+    char        path[1];
+} asyncload_t;
+
+#if USE_ZLIB
+static void inflate_job(job_t *job)
+{
+    asyncload_t *load = (asyncload_t *)job;
+    z_stream z;
+    int ret;
+
+    // default allocators: FS_zalloc would call Com_Error on this thread
+    // when out of memory, while inflateInit2 reports it as an error
+    memset(&z, 0, sizeof(z));
+    if (inflateInit2(&z, -MAX_WBITS) != Z_OK) {
+        load->len = Q_ERR_INFLATE_FAILED;
+        return;
+    }
+
+    z.next_in = (Bytef *)load->src;
+    z.avail_in = (uInt)load->file->complen;
+    z.next_out = load->buffer;
+    z.avail_out = (uInt)load->file->filelen;
+
+    ret = inflate(&z, Z_FINISH);
+    if (ret != Z_STREAM_END || z.total_out != load->file->filelen)
+        load->len = Q_ERR_INFLATE_FAILED;
+
+    inflateEnd(&z);
+}
+#endif
+
+static asyncload_t *alloc_async(const char *path, fsasync_t callback, void *arg)
+{
+    asyncload_t *load;
+    size_t len;
+
+    len = strlen(path);
+    load = FS_Mallocz(sizeof(*load) + len);
+    memcpy(load->path, path, len + 1);
+    load->callback = callback;
+    load->arg = arg;
+    List_Append(&fs_async_loads, &load->entry);
+
+    return load;
+}
+
+static void free_async(asyncload_t *load)
+{
+    List_Remove(&load->entry);
+    pack_put(load->pack);
+    Z_Free(load->buffer);
+    Z_Free(load);
+}
+
+static void complete_async(asyncload_t *load)
+{
+    void *buffer = NULL;
+
+    if (load->len >= 0) {
+        buffer = load->buffer;
+        load->buffer = NULL;
+    }
+
+    // unlink first, callback may start or claim other loads
+    List_Delete(&load->entry);
+    load->callback(load->path, buffer, load->len, load->arg);
+    free_async(load);
+}
+
+// starts background inflate of file opened for reading, if possible
+static asyncload_t *queue_inflate(file_t *file, const char *path, fsasync_t callback, void *arg)
+{
+#if USE_ZLIB
+    asyncload_t *load;
+
+    if (file->type != FS_ZIP || !file->map || file->length > MAX_LOADFILE)
+        return NULL;
+
+    // don't prefetch the same entry twice
+    if (!callback) {
+        LIST_FOR_EACH(asyncload_t, load, &fs_async_loads, entry) {
+            if (load->file == file->entry && !load->callback)
+                return load;
+        }
+    }
+
+    load = alloc_async(path, callback, arg);
+    load->pack = pack_get(file->pack);
+    load->file = file->entry;
+    load->src = file->map;
+    load->len = file->length;
+    load->buffer = FS_Malloc(file->length + 1);
+    load->buffer[file->length] = 0;
+    load->job.func = inflate_job;
+    Job_Submit(&load->job);
+
+    return load;
+#else
+    return NULL;
+#endif
+}
+
+static byte *claim_prefetch(packfile_t *entry)
+{
+    asyncload_t *load;
+    byte *buffer;
+
+    LIST_FOR_EACH(asyncload_t, load, &fs_async_loads, entry) {
+        if (load->file != entry || load->callback)
+            continue;
+
+        Job_Wait(&load->job);
+
+        buffer = NULL;
+        if (load->len >= 0) {
+            buffer = load->buffer;
+            load->buffer = NULL;
+        }
+
+        free_async(load);
+        return buffer;
+    }
+
+    return NULL;
+}
+
+/*
+================
+FS_LoadFileAsync
+
+Callback owns the buffer, which is NULL on error with len set to error
+code. Callbacks must not call FS_FlushAsync.
+================
+*/
+void FS_LoadFileAsync(const char *path, unsigned flags, fsasync_t callback, void *arg)
+{
+    asyncload_t *load = NULL;
+    file_t *file;
+    qhandle_t f;
+
+    if (!path) {
+        Com_Error(ERR_FATAL, "%s: NULL", __func__);
+    }
+
+    if (fs_searchpaths && (file = alloc_handle(&f)) != NULL) {
+        file->mode = (flags & ~FS_MODE_MASK) | FS_MODE_READ;
+        if (expand_open_file_read(file, path, qfalse) >= 0) {
+            load = queue_inflate(file, path, callback, arg);
+            FS_FCloseFile(f);
+        }
+    }
+
+    // prefetching only makes sense for inflated files
+    if (load || !callback) {
+        return;
+    }
+
+    load = alloc_async(path, callback, arg);
+    load->len = FS_LoadFileEx(path, (void **)&load->buffer, flags, TAG_FILESYSTEM);
+}
+
+/*
+================
+FS_PollAsync
+
+Runs callbacks of finished loads, called once per frame.
+================
+*/
+void FS_PollAsync(void)
+{
+    asyncload_t *load;
+
+    // rescan after each callback, it may have modified the list
+    while (1) {
+        LIST_FOR_EACH(asyncload_t, load, &fs_async_loads, entry) {
+            if (load->callback && (!load->pack || Job_Done(&load->job)))
+                break;
+        }
+        if (LIST_TERM(load, &fs_async_loads, entry))
+            break;
+        complete_async(load);
+    }
+}
+
+/*
+================
+FS_FlushAsync
+
+Waits for all pending loads and runs their callbacks. Buffers of
+unclaimed prefetches are freed.
+================
+*/
+void FS_FlushAsync(void)
+{
+    asyncload_t *load;
+
+    while (!LIST_EMPTY(&fs_async_loads)) {
+        load = LIST_FIRST(asyncload_t, &fs_async_loads, entry);
+        if (load->pack)
+            Job_Wait(&load->job);
+        if (load->callback)
+            complete_async(load);
+        else
+            free_async(load);
+    }
+}
+
 /*
 ================
 FS_WriteFile
@@ -2026,6 +2603,9 @@ qerror_t FS_RenameFile(const char *from, const char *to)
     if (rename(frompath, topath))
         return Q_Errno();
 
+    dir_cache_invalidate(frompath);
+    dir_cache_invalidate(topath);
+
     return Q_ERR_SUCCESS;
 }
 
@@ -2071,16 +2651,121 @@ static void pack_put(pack_t *pack)
     }
     if (!--pack->refcount) {
         FS_DPrintf("Freeing packfile %s\n", pack->filename);
+        pack_unmap(pack);
         fclose(pack->fp);
         Z_Free(pack);
     }
 }
 
+/*
+============================================================================
+
+MEMORY MAPPED PACKS
+
+With fs_mmap enabled, pak and pkz files are mapped read-only in their
+entirety when loaded. Raw pak entries and stored zip members are then read
+by copying from the mapping, deflated members are inflated straight from
+it, and FS_LoadFileEx with FS_FLAG_MAPPED returns a pointer into the
+mapping instead of a copy. Such buffers hold a pack reference which is
+dropped by FS_FreeFile, so the mapping outlives filesystem restarts.
+
+If the mapping fails for any reason, stdio is used as before.
+
+============================================================================
+*/
+
+static void pack_map(pack_t *pack)
+{
+    file_info_t info;
+    void *map;
+
+    if (!fs_mmap->integer)
+        return;
+
+    if (get_fp_info(pack->fp, &info) || !info.size)
+        return;
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileMapping((HANDLE)_get_osfhandle(os_fileno(pack->fp)),
+                                      NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!handle)
+        return;
+
+    map = MapViewOfFile(handle, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(handle);
+    if (!map)
+        return;
+#else
+    map = mmap(NULL, info.size, PROT_READ, MAP_SHARED, os_fileno(pack->fp), 0);
+    if (map == MAP_FAILED)
+        return;
+#endif
+
+    pack->map = map;
+    pack->map_size = info.size;
+    List_Append(&fs_mapped_packs, &pack->entry);
+
+    FS_DPrintf("%s: mapped %"PRIz" bytes\n", pack->filename, pack->map_size);
+}
+
+static void pack_unmap(pack_t *pack)
+{
+    if (!pack->map)
+        return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(pack->map);
+#else
+    munmap(pack->map, pack->map_size);
+#endif
+
+    List_Remove(&pack->entry);
+    pack->map = NULL;
+    pack->map_size = 0;
+}
+
+// returns pointer to raw entry data, or NULL if not mapped or out of bounds
+static const byte *pack_map_entry(pack_t *pack, size_t pos, size_t len)
+{
+    if (!pack->map)
+        return NULL;
+
+    if (pos > pack->map_size || len > pack->map_size - pos)
+        return NULL;
+
+    return pack->map + pos;
+}
+
+/*
+================
+FS_FreeFile
+
+Releases buffer returned by FS_LoadFileEx.
+================
+*/
+void FS_FreeFile(void *buf)
+{
+    pack_t *pack;
+
+    if (!buf)
+        return;
+
+    LIST_FOR_EACH(pack_t, pack, &fs_mapped_packs, entry) {
+        if ((byte *)buf >= pack->map && (byte *)buf < pack->map + pack->map_size) {
+            pack_put(pack);
+            return;
+        }
+    }
+
+    Z_Free(buf);
+}
+
 // allocates pack_t instance along with filenames and hashes in one chunk of memory
 static pack_t *pack_alloc(FILE *fp, filetype_t type, const char *name,
                           unsigned num_files, size_t names_len)
 {
     pack_t *pack;
+    file_info_t info;
     unsigned hash_size;
     size_t len;
 
@@ -2100,6 +2785,9 @@ static pack_t *pack_alloc(FILE *fp, filetype_t type, const char *name,
     pack->file_hash = (packfile_t **)(pack->files + num_files);
     pack->filename = (char *)(pack->file_hash + hash_size);
     pack->names = pack->filename + len;
+    pack->mtime = get_fp_info(fp, &info) ? 0 : info.mtime;
+    pack->map = NULL;
+    pack->map_size = 0;
     memcpy(pack->filename, name, len);
     memset(pack->file_hash, 0, hash_size * sizeof(packfile_t *));
 
@@ -2215,6 +2903,7 @@ static pack_t *load_pak_file(const char *packfile)
     FS_DPrintf("%s: %u files, %u hash\n",
                packfile, pack->num_files, pack->hash_size);
 
+    pack_map(pack);
     return pack;
 
 fail:
@@ -2471,6 +3160,7 @@ static pack_t *load_zip_file(const char *packfile)
     FS_DPrintf("%s: %u files, %u skipped, %u hash\n",
                packfile, pack->num_files, num_files_cd - pack->num_files, pack->hash_size);
 
+    pack_map(pack);
     return pack;
 
 fail1:
@@ -3296,6 +3986,8 @@ static void FS_Stats_f(void)
     Com_Printf("Total path comparsions: %d\n", fs_count_strcmp);
     Com_Printf("Total calls to open_from_disk: %d\n", fs_count_open);
     Com_Printf("Total mixed-case reopens: %d\n", fs_count_strlwr);
+    Com_Printf("Directory cache: %d hits, %d misses, %d scans\n",
+               fs_count_dirhit, fs_count_dirmiss, fs_count_dirscan);
 
     if (!totalHashSize) {
         Com_Printf("No stats to display\n");
@@ -3557,6 +4249,11 @@ void FS_Restart(qboolean total)
 {
     Com_Printf("----- FS_Restart -----\n");
 
+    FS_FlushAsync();
+
+    // directories may have changed
+    dir_cache_flush();
+
     if (total) {
         // perform full reset
         free_all_paths();
@@ -3620,6 +4317,8 @@ void FS_Shutdown(void)
         return;
     }
 
+    FS_FlushAsync();
+
     // close file handles
     for (i = 0, file = fs_files; i < MAX_FILE_HANDLES; i++, file++) {
         if (file->type != FS_FREE) {
@@ -3635,6 +4334,8 @@ void FS_Shutdown(void)
     // free search paths
     free_all_paths();
 
+    dir_cache_flush();
+
 #if USE_ZLIB
     inflateEnd(&fs_zipstream.stream);
 #endif
@@ -3728,6 +4429,9 @@ void FS_Init(void)
 
 	fs_shareware = Cvar_Get("fs_shareware", "0", CVAR_ROM);
 
+    fs_dircache = Cvar_Get("fs_dircache", "1", 0);
+    fs_mmap = Cvar_Get("fs_mmap", "1", 0);
+
     // get the game cvar and start the filesystem
     fs_game = Cvar_Get("game", DEFGAME, CVAR_LATCH | CVAR_SERVERINFO);
     fs_game->changed = fs_game_changed;
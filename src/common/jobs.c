@@ -0,0 +1,366 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "shared/shared.h"
+#include "common/common.h"
+#include "common/cvar.h"
+#include "common/jobs.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define MAX_WORKERS     16
+
+#ifdef _WIN32
+typedef SRWLOCK             job_mutex_t;
+typedef CONDITION_VARIABLE  job_cond_t;
+typedef HANDLE              job_thread_t;
+
+#define mutex_init(m)       InitializeSRWLock(m)
+#define mutex_lock(m)       AcquireSRWLockExclusive(m)
+#define mutex_unlock(m)     ReleaseSRWLockExclusive(m)
+#define cond_init(c)        InitializeConditionVariable(c)
+#define cond_wait(c, m)     SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define cond_signal(c)      WakeConditionVariable(c)
+#define cond_broadcast(c)   WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t     job_mutex_t;
+typedef pthread_cond_t      job_cond_t;
+typedef pthread_t           job_thread_t;
+
+#define mutex_init(m)       pthread_mutex_init(m, NULL)
+#define mutex_lock(m)       pthread_mutex_lock(m)
+#define mutex_unlock(m)     pthread_mutex_unlock(m)
+#define cond_init(c)        pthread_cond_init(c, NULL)
+#define cond_wait(c, m)     pthread_cond_wait(c, m)
+#define cond_signal(c)      pthread_cond_signal(c)
+#define cond_broadcast(c)   pthread_cond_broadcast(c)
+#endif
+
+enum {
+    JOB_IDLE,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+};
+
+typedef struct {
+    jobfor_t    func;
+    void        *arg;
+    int         count;
+    int         next;
+} jobfor_batch_t;
+
+typedef struct {
+    job_t           job;
+    jobfor_batch_t  *batch;
+} jobfor_helper_t;
+
+static job_mutex_t  job_mutex;
+static job_cond_t   job_work_cond;      // signaled when a job is queued
+static job_cond_t   job_done_cond;      // broadcast when a job finishes
+static job_t        *job_head, *job_tail;
+static qboolean     job_quit;
+
+static job_thread_t job_threads[MAX_WORKERS];
+static int          job_num_workers;
+
+static cvar_t       *com_workers;
+
+static void run_job(job_t *job)
+{
+    job->func(job);
+
+    mutex_lock(&job_mutex);
+    job->state = JOB_DONE;
+    cond_broadcast(&job_done_cond);
+    mutex_unlock(&job_mutex);
+}
+
+static void worker_loop(void)
+{
+    job_t *job;
+
+    mutex_lock(&job_mutex);
+    while (1) {
+        while (!job_head && !job_quit)
+            cond_wait(&job_work_cond, &job_mutex);
+
+        if (job_quit)
+            break;
+
+        job = job_head;
+        job_head = job->next;
+        if (!job_head)
+            job_tail = NULL;
+        job->state = JOB_RUNNING;
+        mutex_unlock(&job_mutex);
+
+        run_job(job);
+
+        mutex_lock(&job_mutex);
+    }
+    mutex_unlock(&job_mutex);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread(LPVOID arg)
+{
+    worker_loop();
+    return 0;
+}
+#else
+static void *worker_thread(void *arg)
+{
+    worker_loop();
+    return NULL;
+}
+#endif
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? count : 1;
+#endif
+}
+
+/*
+=================
+Job_Init
+
+com_workers sets the number of worker threads, -1 picks one less than
+the number of CPUs, 0 runs all jobs inline on the submitting thread.
+Only settable from the command line.
+=================
+*/
+void Job_Init(void)
+{
+    int i, count;
+
+    com_workers = Cvar_Get("com_workers", "-1", CVAR_NOSET);
+
+    count = com_workers->integer;
+    if (count < 0)
+        count = cpu_count() - 1;
+    clamp(count, 0, MAX_WORKERS);
+
+    mutex_init(&job_mutex);
+    cond_init(&job_work_cond);
+    cond_init(&job_done_cond);
+
+    for (i = 0; i < count; i++) {
+#ifdef _WIN32
+        job_threads[i] = CreateThread(NULL, 0, worker_thread, NULL, 0, NULL);
+        if (!job_threads[i])
+            break;
+#else
+        if (pthread_create(&job_threads[i], NULL, worker_thread, NULL))
+            break;
+#endif
+    }
+
+    job_num_workers = i;
+    if (job_num_workers < count)
+        Com_WPrintf("Couldn't create all worker threads, using %d\n", job_num_workers);
+
+    Com_DPrintf("%d worker threads\n", job_num_workers);
+}
+
+void Job_Shutdown(void)
+{
+    int i;
+
+    if (!job_num_workers)
+        return;
+
+    mutex_lock(&job_mutex);
+    job_quit = qtrue;
+    cond_broadcast(&job_work_cond);
+    mutex_unlock(&job_mutex);
+
+    for (i = 0; i < job_num_workers; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(job_threads[i], INFINITE);
+        CloseHandle(job_threads[i]);
+#else
+        pthread_join(job_threads[i], NULL);
+#endif
+    }
+
+    job_num_workers = 0;
+}
+
+int Job_NumWorkers(void)
+{
+    return job_num_workers;
+}
+
+void Job_Submit(job_t *job)
+{
+    job->next = NULL;
+
+    if (!job_num_workers) {
+        job->state = JOB_RUNNING;
+        job->func(job);
+        job->state = JOB_DONE;
+        return;
+    }
+
+    mutex_lock(&job_mutex);
+    job->state = JOB_QUEUED;
+    if (job_tail)
+        job_tail->next = job;
+    else
+        job_head = job;
+    job_tail = job;
+    cond_signal(&job_work_cond);
+    mutex_unlock(&job_mutex);
+}
+
+qboolean Job_Done(job_t *job)
+{
+    qboolean done;
+
+    if (!job_num_workers)
+        return job->state == JOB_DONE;
+
+    mutex_lock(&job_mutex);
+    done = job->state == JOB_DONE;
+    mutex_unlock(&job_mutex);
+
+    return done;
+}
+
+// removes job from the queue if no worker picked it up yet
+static qboolean unqueue_job(job_t *job)
+{
+    job_t *prev, *cur;
+
+    for (prev = NULL, cur = job_head; cur; prev = cur, cur = cur->next) {
+        if (cur != job)
+            continue;
+        if (prev)
+            prev->next = cur->next;
+        else
+            job_head = cur->next;
+        if (job_tail == cur)
+            job_tail = prev;
+        return qtrue;
+    }
+
+    return qfalse;
+}
+
+/*
+=================
+Job_Wait
+
+Jobs still sitting in the queue are run on the calling thread rather
+than waited for, so waiting never depends on a free worker.
+=================
+*/
+void Job_Wait(job_t *job)
+{
+    if (!job_num_workers || job->state == JOB_IDLE)
+        return;
+
+    mutex_lock(&job_mutex);
+    if (job->state == JOB_QUEUED && unqueue_job(job)) {
+        job->state = JOB_RUNNING;
+        mutex_unlock(&job_mutex);
+        run_job(job);
+        return;
+    }
+
+    while (job->state != JOB_DONE)
+        cond_wait(&job_done_cond, &job_mutex);
+    mutex_unlock(&job_mutex);
+}
+
+static void run_batch(jobfor_batch_t *batch)
+{
+    int index;
+
+    while (1) {
+        mutex_lock(&job_mutex);
+        index = batch->next++;
+        mutex_unlock(&job_mutex);
+
+        if (index >= batch->count)
+            break;
+
+        batch->func(batch->arg, index);
+    }
+}
+
+static void run_batch_helper(job_t *job)
+{
+    run_batch(((jobfor_helper_t *)job)->batch);
+}
+
+void Job_ParallelForEx(jobfor_t func, void *arg, int count, int threads)
+{
+    jobfor_helper_t helpers[MAX_WORKERS];
+    jobfor_batch_t batch;
+    int i, num_helpers;
+
+    if (count <= 0)
+        return;
+
+    // calling thread counts as one
+    num_helpers = min(job_num_workers, threads - 1);
+    num_helpers = min(num_helpers, count - 1);
+    if (num_helpers <= 0) {
+        for (i = 0; i < count; i++)
+            func(arg, i);
+        return;
+    }
+
+    batch.func = func;
+    batch.arg = arg;
+    batch.count = count;
+    batch.next = 0;
+
+    for (i = 0; i < num_helpers; i++) {
+        helpers[i].job.func = run_batch_helper;
+        helpers[i].batch = &batch;
+        Job_Submit(&helpers[i].job);
+    }
+
+    run_batch(&batch);
+
+    for (i = 0; i < num_helpers; i++)
+        Job_Wait(&helpers[i].job);
+}
+
+void Job_ParallelFor(jobfor_t func, void *arg, int count)
+{
+    Job_ParallelForEx(func, arg, count, job_num_workers + 1);
+}
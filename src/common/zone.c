@@ -20,6 +20,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/common.h"
 #include "common/zone.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
 #define Z_MAGIC     0x1d0d
 #define Z_TAIL      0x5b7b
 
@@ -48,6 +55,17 @@ typedef struct zhead_s {
 
 static zhead_t      z_chain;
 
+// chain and stats are shared with worker threads
+#ifdef _WIN32
+static SRWLOCK          z_lock = SRWLOCK_INIT;
+#define Z_LOCK()        AcquireSRWLockExclusive(&z_lock)
+#define Z_UNLOCK()      ReleaseSRWLockExclusive(&z_lock)
+#else
+static pthread_mutex_t  z_lock = PTHREAD_MUTEX_INITIALIZER;
+#define Z_LOCK()        pthread_mutex_lock(&z_lock)
+#define Z_UNLOCK()      pthread_mutex_unlock(&z_lock)
+#endif
+
 typedef struct {
     zhead_t     z;
     char        data[2];
@@ -95,25 +113,46 @@ static const char z_tagnames[TAG_MAX][8] = {
     "cmodel"
 };
 
-static inline void Z_Validate(zhead_t *z, const char *func)
+// returns NULL if the block is intact. Com_Error frees zone memory, so
+// callers holding z_lock must release it before reporting the error.
+static inline const char *Z_BadBlock(zhead_t *z)
 {
     if (z->magic != Z_MAGIC) {
-        Com_Error(ERR_FATAL, "%s: bad magic", func);
+        return "bad magic";
     }
     if (Z_TAIL_F(z) != Z_TAIL) {
-        Com_Error(ERR_FATAL, "%s: bad tail", func);
+        return "bad tail";
     }
     if (z->tag == TAG_FREE) {
-        Com_Error(ERR_FATAL, "%s: bad tag", func);
+        return "bad tag";
+    }
+    return NULL;
+}
+
+static inline void Z_Validate(zhead_t *z, const char *func)
+{
+    const char *err = Z_BadBlock(z);
+
+    if (err) {
+        Com_Error(ERR_FATAL, "%s: %s", func, err);
     }
 }
 
 void Z_Check(void)
 {
     zhead_t *z;
+    const char *err = NULL;
 
+    Z_LOCK();
     Z_FOR_EACH(z) {
-        Z_Validate(z, __func__);
+        if ((err = Z_BadBlock(z)) != NULL) {
+            break;
+        }
+    }
+    Z_UNLOCK();
+
+    if (err) {
+        Com_Error(ERR_FATAL, "%s: %s", __func__, err);
     }
 }
 
@@ -121,14 +160,23 @@ void Z_LeakTest(memtag_t tag)
 {
     zhead_t *z;
     size_t numLeaks = 0, numBytes = 0;
+    const char *err = NULL;
 
+    Z_LOCK();
     Z_FOR_EACH(z) {
-        Z_Validate(z, __func__);
+        if ((err = Z_BadBlock(z)) != NULL) {
+            break;
+        }
         if (z->tag == tag) {
             numLeaks++;
             numBytes += z->size;
         }
     }
+    Z_UNLOCK();
+
+    if (err) {
+        Com_Error(ERR_FATAL, "%s: %s", __func__, err);
+    }
 
     if (numLeaks) {
         Com_WPrintf("************* Z_LeakTest *************\n"
@@ -139,6 +187,24 @@ void Z_LeakTest(memtag_t tag)
     }
 }
 
+// must be called with z_lock held
+static void Z_FreeLocked(zhead_t *z)
+{
+    zstats_t *s;
+
+    s = &z_stats[z->tag < TAG_MAX ? z->tag : TAG_FREE];
+    s->count--;
+    s->bytes -= z->size;
+
+    if (z->tag != TAG_STATIC) {
+        z->prev->next = z->next;
+        z->next->prev = z->prev;
+        z->magic = 0xdead;
+        z->tag = TAG_FREE;
+        free(z);
+    }
+}
+
 /*
 ========================
 Z_Free
@@ -147,7 +213,6 @@ Z_Free
 void Z_Free(void *ptr)
 {
     zhead_t *z;
-    zstats_t *s;
 
     if (!ptr) {
         return;
@@ -157,17 +222,9 @@ void Z_Free(void *ptr)
 
     Z_Validate(z, __func__);
 
-    s = &z_stats[z->tag < TAG_MAX ? z->tag : TAG_FREE];
-    s->count--;
-    s->bytes -= z->size;
-
-    if (z->tag != TAG_STATIC) {
-        z->prev->next = z->next;
-        z->next->prev = z->prev;
-        z->magic = 0xdead;
-        z->tag = TAG_FREE;
-        free(z);
-    }
+    Z_LOCK();
+    Z_FreeLocked(z);
+    Z_UNLOCK();
 }
 
 /*
@@ -177,7 +234,7 @@ Z_Realloc
 */
 void *Z_Realloc(void *ptr, size_t size)
 {
-    zhead_t *z;
+    zhead_t *z, *n;
     zstats_t *s;
 
     if (!ptr) {
@@ -197,24 +254,29 @@ void *Z_Realloc(void *ptr, size_t size)
         Com_Error(ERR_FATAL, "%s: couldn't realloc static memory", __func__);
     }
 
-    s = &z_stats[z->tag < TAG_MAX ? z->tag : TAG_FREE];
-    s->bytes -= z->size;
-
     if (size > SIZE_MAX - Z_EXTRA - 3) {
         Com_Error(ERR_FATAL, "%s: bad size", __func__);
     }
 
     size = (size + Z_EXTRA + 3) & ~3;
-    z = realloc(z, size);
-    if (!z) {
+
+    // neighbours point to the block, so hold the lock while it moves
+    Z_LOCK();
+    n = realloc(z, size);
+    if (!n) {
+        // the old block is still linked and intact
+        Z_UNLOCK();
         Com_Error(ERR_FATAL, "%s: couldn't realloc %"PRIz" bytes", __func__, size);
     }
 
+    s = &z_stats[n->tag < TAG_MAX ? n->tag : TAG_FREE];
+    s->bytes += size - n->size;
+
+    z = n;
     z->size = size;
     z->prev->next = z;
     z->next->prev = z;
-
-    s->bytes += size;
+    Z_UNLOCK();
 
     Z_TAIL_F(z) = Z_TAIL;
 
@@ -257,14 +319,23 @@ Z_FreeTags
 void Z_FreeTags(memtag_t tag)
 {
     zhead_t *z, *n;
+    const char *err = NULL;
 
+    Z_LOCK();
     Z_FOR_EACH_SAFE(z, n) {
-        Z_Validate(z, __func__);
+        if ((err = Z_BadBlock(z)) != NULL) {
+            break;
+        }
         n = z->next;
         if (z->tag == tag) {
-            Z_Free(z + 1);
+            Z_FreeLocked(z);
         }
     }
+    Z_UNLOCK();
+
+    if (err) {
+        Com_Error(ERR_FATAL, "%s: %s", __func__, err);
+    }
 }
 
 /*
@@ -309,20 +380,22 @@ void *Z_TagMalloc(size_t size, memtag_t tag)
     z->time = time(NULL);
 #endif
 
-    z->next = z_chain.next;
-    z->prev = &z_chain;
-    z_chain.next->prev = z;
-    z_chain.next = z;
-
     if (z_perturb && z_perturb->integer) {
         memset(z + 1, z_perturb->integer, size - Z_EXTRA);
     }
 
     Z_TAIL_F(z) = Z_TAIL;
 
+    Z_LOCK();
+    z->next = z_chain.next;
+    z->prev = &z_chain;
+    z_chain.next->prev = z;
+    z_chain.next = z;
+
     s = &z_stats[tag < TAG_MAX ? tag : TAG_FREE];
     s->count++;
     s->bytes += size;
+    Z_UNLOCK();
 
     return z + 1;
 }
@@ -438,9 +511,11 @@ char *Z_CvarCopyString(const char *in)
 
     // return static storage
     z = (zstatic_t *)&z_static[i];
+    Z_LOCK();
     s = &z_stats[TAG_STATIC];
     s->count++;
     s->bytes += z->z.size;
+    Z_UNLOCK();
     return z->data;
 }
 
@@ -1176,4 +1176,7 @@ void R_RegisterFunctionsGL()
 	MOD_LoadMD3 = MOD_LoadMD3_GL;
     MOD_LoadIQM = NULL;
 	MOD_Reference = MOD_Reference_GL;
+	MOD_ParseMD2 = MOD_FinalizeMD2 = NULL;
+	MOD_ParseMD3 = MOD_FinalizeMD3 = NULL;
+	MOD_ParseIQM = MOD_FinalizeIQM = NULL;
 }
@@ -26,9 +26,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/common.h"
 #include "common/cvar.h"
 #include "common/files.h"
+#include "common/jobs.h"
 #include "refresh/images.h"
+#include "refresh/texcomp.h"
+#include "system/system.h"
 #include "format/pcx.h"
 #include "format/wal.h"
+#include "format/dds.h"
 #include "stb_image.h"
 #include "stb_image_write.h"
 
@@ -360,6 +364,104 @@ IMG_LOAD(STB)
 }
 
 
+/*
+=================================================================
+
+DDS LOADING
+
+=================================================================
+*/
+
+// The top level is decompressed to RGBA like any other format. The RTX
+// renderer also keeps the blocks of all levels in the file and uploads them
+// as they are, see compress_texture.
+IMG_LOAD(DDS)
+{
+    dds_t       *dds;
+    tcformat_t  format;
+    size_t      w, h, size, i;
+#if USE_REF == REF_VKPT
+    size_t      total, levels;
+#endif
+
+    if (rawlen < sizeof(dds_t)) {
+        return Q_ERR_FILE_TOO_SMALL;
+    }
+
+    dds = (dds_t *)rawdata;
+    if (LittleLong(dds->ident) != DDS_IDENT || LittleLong(dds->size) != sizeof(dds_t) - 4) {
+        return Q_ERR_UNKNOWN_FORMAT;
+    }
+
+    if (!(LittleLong(dds->pf.flags) & DDPF_FOURCC)) {
+        return Q_ERR_INVALID_FORMAT;
+    }
+
+    switch (LittleLong(dds->pf.fourcc)) {
+    case DDS_FOURCC_DXT1:
+        format = TC_BC1;
+        break;
+    case DDS_FOURCC_DXT5:
+        format = TC_BC3;
+        break;
+    default:
+        return Q_ERR_INVALID_FORMAT;
+    }
+
+    w = LittleLong(dds->width);
+    h = LittleLong(dds->height);
+    if (w < 1 || h < 1 || w > 16384 || h > 16384) {
+        return Q_ERR_INVALID_FORMAT;
+    }
+
+    size = TC_LevelSize(format, w, h);
+    if (size > rawlen - sizeof(dds_t)) {
+        return Q_ERR_BAD_EXTENT;
+    }
+
+    *pic = IMG_AllocPixels(w * h * 4);
+    TC_Decode(format, rawdata + sizeof(dds_t), w, h, *pic);
+
+    image->upload_width = image->width = w;
+    image->upload_height = image->height = h;
+
+    // DXT1 blocks may still use the punch through alpha mode
+    if (format == TC_BC1) {
+        for (i = 0; i < w * h; i++) {
+            if ((*pic)[i * 4 + 3] != 255) {
+                break;
+            }
+        }
+        if (i == w * h) {
+            image->flags |= IF_OPAQUE;
+        }
+    }
+
+#if USE_REF == REF_VKPT
+    levels = 1;
+    if (LittleLong(dds->flags) & DDSD_MIPMAPCOUNT) {
+        levels = max(1, (int)LittleLong(dds->mipmap_count));
+    }
+
+    // keep the levels that are actually there
+    for (i = 1, total = size; i < levels && (max(w, h) >> i); i++) {
+        size = TC_LevelSize(format, max(1, w >> i), max(1, h >> i));
+        if (total + size > rawlen - sizeof(dds_t)) {
+            break;
+        }
+        total += size;
+    }
+
+    image->dds_blocks = R_Malloc(total);
+    memcpy(image->dds_blocks, rawdata + sizeof(dds_t), total);
+    image->dds_size = total;
+    image->dds_format = format;
+    image->dds_levels = (int)i;
+#endif
+
+    return Q_ERR_SUCCESS;
+}
+
 /*
 =================================================================
 
@@ -577,65 +679,149 @@ IMAGE PROCESSING
 =========================================================
 */
 
+// images below this many output pixels are not worth splitting into jobs
+#define PARALLEL_MIN_PIXELS     (256 * 256)
+
+typedef struct {
+    const byte  *in;
+    byte        *out;
+    int         inwidth, inheight;
+    int         outwidth, outheight;
+    float       heightScale;
+    unsigned    p1[MAX_TEXTURE_SIZE], p2[MAX_TEXTURE_SIZE];
+} resample_t;
+
+static void resample_row(void *arg, int i)
+{
+    const resample_t *r = arg;
+    const byte  *inrow1, *inrow2;
+    const byte  *pix1, *pix2, *pix3, *pix4;
+    byte        *out;
+    int         j, stride;
+
+    stride = r->inwidth << 2;
+    inrow1 = r->in + stride * (int)((i + 0.25f) * r->heightScale);
+    inrow2 = r->in + stride * (int)((i + 0.75f) * r->heightScale);
+    out = r->out + i * r->outwidth * 4;
+    for (j = 0; j < r->outwidth; j++) {
+        pix1 = inrow1 + r->p1[j];
+        pix2 = inrow1 + r->p2[j];
+        pix3 = inrow2 + r->p1[j];
+        pix4 = inrow2 + r->p2[j];
+        out[0] = (pix1[0] + pix2[0] + pix3[0] + pix4[0]) >> 2;
+        out[1] = (pix1[1] + pix2[1] + pix3[1] + pix4[1]) >> 2;
+        out[2] = (pix1[2] + pix2[2] + pix3[2] + pix4[2]) >> 2;
+        out[3] = (pix1[3] + pix2[3] + pix3[3] + pix4[3]) >> 2;
+        out += 4;
+    }
+}
+
 void IMG_ResampleTexture(const byte *in, int inwidth, int inheight,
                          byte *out, int outwidth, int outheight)
 {
-    int i, j;
-    const byte  *inrow1, *inrow2;
+    resample_t  r;
     unsigned    frac, fracstep;
-    unsigned    p1[MAX_TEXTURE_SIZE], p2[MAX_TEXTURE_SIZE];
-    const byte  *pix1, *pix2, *pix3, *pix4;
-    float       heightScale;
+    int         i;
 
     if (outwidth > MAX_TEXTURE_SIZE) {
         Com_Error(ERR_FATAL, "%s: outwidth > %d", __func__, MAX_TEXTURE_SIZE);
     }
 
+    r.in = in;
+    r.out = out;
+    r.inwidth = inwidth;
+    r.inheight = inheight;
+    r.outwidth = outwidth;
+    r.outheight = outheight;
+
     fracstep = inwidth * 0x10000 / outwidth;
 
     frac = fracstep >> 2;
     for (i = 0; i < outwidth; i++) {
-        p1[i] = 4 * (frac >> 16);
+        r.p1[i] = 4 * (frac >> 16);
         frac += fracstep;
     }
     frac = 3 * (fracstep >> 2);
     for (i = 0; i < outwidth; i++) {
-        p2[i] = 4 * (frac >> 16);
+        r.p2[i] = 4 * (frac >> 16);
         frac += fracstep;
     }
 
-    heightScale = (float)inheight / outheight;
-    inwidth <<= 2;
+    r.heightScale = (float)inheight / outheight;
+
+    // output rows are independent
+    if (outwidth * outheight >= PARALLEL_MIN_PIXELS) {
+        Job_ParallelFor(resample_row, &r, outheight);
+        return;
+    }
+
     for (i = 0; i < outheight; i++) {
-        inrow1 = in + inwidth * (int)((i + 0.25f) * heightScale);
-        inrow2 = in + inwidth * (int)((i + 0.75f) * heightScale);
-        for (j = 0; j < outwidth; j++) {
-            pix1 = inrow1 + p1[j];
-            pix2 = inrow1 + p2[j];
-            pix3 = inrow2 + p1[j];
-            pix4 = inrow2 + p2[j];
-            out[0] = (pix1[0] + pix2[0] + pix3[0] + pix4[0]) >> 2;
-            out[1] = (pix1[1] + pix2[1] + pix3[1] + pix4[1]) >> 2;
-            out[2] = (pix1[2] + pix2[2] + pix3[2] + pix4[2]) >> 2;
-            out[3] = (pix1[3] + pix2[3] + pix3[3] + pix4[3]) >> 2;
-            out += 4;
-        }
+        resample_row(&r, i);
     }
 }
 
+// averages 2x2 blocks of one pair of input rows into one output row
+static void mipmap_row(byte *out, const byte *in, int width)
+{
+    int j = 0;
+
+#if USE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+
+    // 4 input pixels from each row make 2 output pixels
+    for (; j + 16 <= width; j += 16, out += 8, in += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)in);
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + width));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+        hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+        lo = _mm_srli_epi16(_mm_unpacklo_epi64(lo, hi), 2);
+        _mm_storel_epi64((__m128i *)out, _mm_packus_epi16(lo, lo));
+    }
+#endif
+
+    for (; j < width; j += 8, out += 4, in += 8) {
+        out[0] = (in[0] + in[4] + in[width + 0] + in[width + 4]) >> 2;
+        out[1] = (in[1] + in[5] + in[width + 1] + in[width + 5]) >> 2;
+        out[2] = (in[2] + in[6] + in[width + 2] + in[width + 6]) >> 2;
+        out[3] = (in[3] + in[7] + in[width + 3] + in[width + 7]) >> 2;
+    }
+}
+
+typedef struct {
+    byte        *out;
+    const byte  *in;
+    int         width;
+} mipmap_t;
+
+static void mipmap_job(void *arg, int i)
+{
+    const mipmap_t *m = arg;
+
+    mipmap_row(m->out + i * (m->width >> 1), m->in + i * m->width * 2, m->width);
+}
+
 void IMG_MipMap(byte *out, byte *in, int width, int height)
 {
-    int     i, j;
+    mipmap_t    m;
+    int         i;
 
     width <<= 2;
     height >>= 1;
-    for (i = 0; i < height; i++, in += width) {
-        for (j = 0; j < width; j += 8, out += 4, in += 8) {
-            out[0] = (in[0] + in[4] + in[width + 0] + in[width + 4]) >> 2;
-            out[1] = (in[1] + in[5] + in[width + 1] + in[width + 5]) >> 2;
-            out[2] = (in[2] + in[6] + in[width + 2] + in[width + 6]) >> 2;
-            out[3] = (in[3] + in[7] + in[width + 3] + in[width + 7]) >> 2;
-        }
+
+    // rows can only be split across threads when not working in place,
+    // otherwise each row overwrites input that later rows still need
+    if (out != in && (width >> 2) * height >= PARALLEL_MIN_PIXELS) {
+        m.out = out;
+        m.in = in;
+        m.width = width;
+        Job_ParallelFor(mipmap_job, &m, height);
+        return;
+    }
+
+    for (i = 0; i < height; i++, in += width * 2, out += width >> 1) {
+        mipmap_row(out, in, width);
     }
 }
 
@@ -664,7 +850,8 @@ static const struct {
     { "wal", IMG_LoadWAL },
     { "tga", IMG_LoadSTB },
     { "jpg", IMG_LoadSTB },
-    { "png", IMG_LoadSTB }
+    { "png", IMG_LoadSTB },
+    { "dds", IMG_LoadDDS }
 };
 
 static imageformat_t    img_search[IM_MAX];
@@ -787,6 +974,152 @@ static image_t *lookup_image(const char *name,
     return NULL;
 }
 
+/*
+=================================================================
+
+PARALLEL DECODING
+
+IMG_Prefetch runs the same file lookup as IMG_Find, but only records the
+raw file it resolves to. IMG_DecodePrefetched then decodes all recorded
+files on worker threads. When IMG_Find later tries one of these files,
+decoded pixels are taken over and uploaded on the main thread as usual.
+Files that failed to decode are retried by the regular path.
+
+=================================================================
+*/
+
+#define PREFETCH_HASH   256
+
+typedef struct imgprefetch_s {
+    struct imgprefetch_s *hash_next;
+    imageformat_t   fmt;
+    int             fs_flags;
+    byte            *data;
+    ssize_t         len;
+    byte            *pic;
+    qerror_t        ret;
+    image_t         image;      // name and type as input, decoder output
+} imgprefetch_t;
+
+static imgprefetch_t    *img_prefetch_hash[PREFETCH_HASH];
+static imgprefetch_t    **img_prefetch_list;    // pending decode
+static int              img_num_prefetch;
+static qboolean         img_probing;    // set while IMG_Prefetch resolves files
+
+static imgprefetch_t **find_prefetch(const image_t *image, int fs_flags)
+{
+    imgprefetch_t **p, *e;
+
+    p = &img_prefetch_hash[FS_HashPath(image->name, PREFETCH_HASH)];
+    for (; (e = *p) != NULL; p = &e->hash_next) {
+        if (e->fs_flags == fs_flags && e->image.type == image->type &&
+            !FS_pathcmp(e->image.name, image->name)) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+static void add_prefetch(const image_t *image, imageformat_t fmt, int fs_flags, byte *data, ssize_t len)
+{
+    imgprefetch_t *e;
+    unsigned hash;
+
+    if (find_prefetch(image, fs_flags)) {
+        FS_FreeFile(data);
+        return;
+    }
+
+    if (!(img_num_prefetch & 63)) {
+        img_prefetch_list = Z_Realloc(img_prefetch_list,
+            (img_num_prefetch + 64) * sizeof(img_prefetch_list[0]));
+    }
+
+    e = R_Mallocz(sizeof(*e));
+    e->fmt = fmt;
+    e->fs_flags = fs_flags;
+    e->data = data;
+    e->len = len;
+    e->ret = Q_ERR_AGAIN;
+    strcpy(e->image.name, image->name);
+    e->image.type = image->type;
+
+    hash = FS_HashPath(e->image.name, PREFETCH_HASH);
+    e->hash_next = img_prefetch_hash[hash];
+    img_prefetch_hash[hash] = e;
+    img_prefetch_list[img_num_prefetch++] = e;
+}
+
+// takes over decoded pixels, returns qfalse if not prefetched
+static qboolean claim_prefetch(image_t *image, int fs_flags, byte **pic)
+{
+    imgprefetch_t **p, *e;
+
+    p = find_prefetch(image, fs_flags);
+    if (!p || (*p)->ret < 0) {
+        return qfalse;
+    }
+
+    e = *p;
+    *p = e->hash_next;
+
+    image->width = e->image.width;
+    image->height = e->image.height;
+    image->upload_width = e->image.upload_width;
+    image->upload_height = e->image.upload_height;
+    image->flags |= e->image.flags;
+    *pic = e->pic;
+
+    Z_Free(e);
+    return qtrue;
+}
+
+// runs on worker threads
+static void decode_prefetch(void *arg, int index)
+{
+    imgprefetch_t *e = ((imgprefetch_t **)arg)[index];
+
+    e->ret = img_loaders[e->fmt].load(e->data, e->len, &e->image, &e->pic);
+}
+
+void IMG_DecodePrefetched(void)
+{
+    imgprefetch_t *e;
+    int i;
+
+    Job_ParallelFor(decode_prefetch, img_prefetch_list, img_num_prefetch);
+
+    for (i = 0; i < img_num_prefetch; i++) {
+        e = img_prefetch_list[i];
+        FS_FreeFile(e->data);
+        e->data = NULL;
+    }
+
+    img_num_prefetch = 0;
+}
+
+void IMG_FlushPrefetched(void)
+{
+    imgprefetch_t *e, *next;
+    int i;
+
+    for (i = 0; i < PREFETCH_HASH; i++) {
+        for (e = img_prefetch_hash[i]; e; e = next) {
+            next = e->hash_next;
+            FS_FreeFile(e->data);
+            if (e->pic)
+                IMG_FreePixels(e->pic);
+            Z_Free(e);
+        }
+        img_prefetch_hash[i] = NULL;
+    }
+
+    Z_Free(img_prefetch_list);
+    img_prefetch_list = NULL;
+    img_num_prefetch = 0;
+}
+
 #define TRY_IMAGE_SRC_GAME      1
 #define TRY_IMAGE_SRC_BASE      0
 
@@ -796,10 +1129,16 @@ static int _try_image_format(imageformat_t fmt, image_t *image, int try_src, byt
     ssize_t     len;
     qerror_t    ret;
 
-    // load the file
-    int fs_flags = 0;
+    // load the file, loaders don't modify raw data so it may be mapped
+    int fs_flags = FS_FLAG_MAPPED;
     if (try_src > 0)
-        fs_flags = try_src == TRY_IMAGE_SRC_GAME ? FS_PATH_GAME : FS_PATH_BASE;
+        fs_flags |= try_src == TRY_IMAGE_SRC_GAME ? FS_PATH_GAME : FS_PATH_BASE;
+
+    if (!img_probing && claim_prefetch(image, fs_flags, pic)) {
+        ret = Q_ERR_SUCCESS;
+        goto done;
+    }
+
     len = FS_LoadFileFlags(image->name, (void **)&data, fs_flags);
     if (!data) {
         return len;
@@ -813,7 +1152,7 @@ static int _try_image_format(imageformat_t fmt, image_t *image, int try_src, byt
     if (try_src == TRY_IMAGE_SRC_GAME) {
         byte *data_base;
         ssize_t len_base;
-        len_base = FS_LoadFileFlags(image->name, (void **)&data_base, FS_PATH_BASE);
+        len_base = FS_LoadFileFlags(image->name, (void **)&data_base, FS_PATH_BASE | FS_FLAG_MAPPED);
         if((len == len_base) && (memcmp(data, data_base, len) == 0)) {
             // Identical data in game, pretend file doesn't exist
             FS_FreeFile(data);
@@ -823,11 +1162,18 @@ static int _try_image_format(imageformat_t fmt, image_t *image, int try_src, byt
         FS_FreeFile(data_base);
     }
 
+    // just record the file, decoding is done later in parallel
+    if (img_probing) {
+        add_prefetch(image, fmt, fs_flags, data, len);
+        return fmt;
+    }
+
     // decompress the image
     ret = img_loaders[fmt].load(data, len, image, pic);
 
     FS_FreeFile(data);
 
+done:
     image->filepath[0] = 0;
     if (ret >= 0) {
         strcpy(image->filepath, image->name);
@@ -960,6 +1306,7 @@ static void r_texture_formats_changed(cvar_t *self)
             case 't': case 'T': i = IM_TGA; break;
             case 'j': case 'J': i = IM_JPG; break;
             case 'p': case 'P': i = IM_PNG; break;
+            case 'd': case 'D': i = IM_DDS; break;
             default: continue;
         }
 
@@ -1115,41 +1462,12 @@ static qerror_t try_load_image_candidate(image_t *image, const char *orig_name,
     return ret;
 }
 
-// finds or loads the given image, adding it to the hash table.
-static qerror_t find_or_load_image(const char *name, size_t len,
-                                   imagetype_t type, imageflags_t flags,
-                                   image_t **image_p)
+// runs override and game/base directory search for the image
+static qerror_t load_image_candidates(image_t *image, const char *name, size_t len,
+                                      imagetype_t type, imageflags_t flags, byte **pic_p)
 {
-    image_t         *image;
-    byte            *pic;
-    unsigned        hash;
     qerror_t        ret = Q_ERR_NOENT;
-
-    *image_p = NULL;
-
-    // must have an extension and at least 1 char of base name
-    if (len <= 4) {
-        return Q_ERR_NAMETOOSHORT;
-    }
-    if (name[len - 4] != '.') {
-        return Q_ERR_INVALID_PATH;
-    }
-
-    hash = FS_HashPathLen(name, len - 4, RIMAGES_HASH);
-
-    // look for it
-    if ((image = lookup_image(name, type, hash, len - 4)) != NULL) {
-        image->flags |= flags & IF_PERMANENT;
-        image->registration_sequence = registration_sequence;
-        *image_p = image;
-        return Q_ERR_SUCCESS;
-    }
-
-    // allocate image slot
-    image = alloc_image();
-    if (!image) {
-        return Q_ERR_OUT_OF_SLOTS;
-    }
+    byte            *pic = NULL;
 
 	int override_textures = !!r_override_textures->integer;
 	if (!vid_rtx->integer && (type != IT_PIC))
@@ -1198,6 +1516,47 @@ static qerror_t find_or_load_image(const char *name, size_t len,
         }
     }
 
+    *pic_p = pic;
+    return ret;
+}
+
+// finds or loads the given image, adding it to the hash table.
+static qerror_t find_or_load_image(const char *name, size_t len,
+                                   imagetype_t type, imageflags_t flags,
+                                   image_t **image_p)
+{
+    image_t         *image;
+    byte            *pic;
+    unsigned        hash;
+    qerror_t        ret = Q_ERR_NOENT;
+
+    *image_p = NULL;
+
+    // must have an extension and at least 1 char of base name
+    if (len <= 4) {
+        return Q_ERR_NAMETOOSHORT;
+    }
+    if (name[len - 4] != '.') {
+        return Q_ERR_INVALID_PATH;
+    }
+
+    hash = FS_HashPathLen(name, len - 4, RIMAGES_HASH);
+
+    // look for it
+    if ((image = lookup_image(name, type, hash, len - 4)) != NULL) {
+        image->flags |= flags & IF_PERMANENT;
+        image->registration_sequence = registration_sequence;
+        *image_p = image;
+        return Q_ERR_SUCCESS;
+    }
+
+    // allocate image slot
+    image = alloc_image();
+    if (!image) {
+        return Q_ERR_OUT_OF_SLOTS;
+    }
+
+    ret = load_image_candidates(image, name, len, type, flags, &pic);
     if (ret < 0) {
         memset(image, 0, sizeof(*image));
         return ret;
@@ -1214,6 +1573,37 @@ static qerror_t find_or_load_image(const char *name, size_t len,
     return Q_ERR_SUCCESS;
 }
 
+/*
+=================
+IMG_Prefetch
+
+Resolves the file IMG_Find would load for this name and queues it for
+IMG_DecodePrefetched.
+=================
+*/
+void IMG_Prefetch(const char *name, imagetype_t type, imageflags_t flags)
+{
+    static image_t  scratch;
+    byte            *pic;
+    size_t          len;
+    unsigned        hash;
+
+    len = strlen(name);
+    if (len >= MAX_QPATH || len <= 4 || name[len - 4] != '.') {
+        return;
+    }
+
+    hash = FS_HashPathLen(name, len - 4, RIMAGES_HASH);
+    if (lookup_image(name, type, hash, len - 4)) {
+        return;
+    }
+
+    memset(&scratch, 0, sizeof(scratch));
+    img_probing = qtrue;
+    load_image_candidates(&scratch, name, len, type, flags, &pic);
+    img_probing = qfalse;
+}
+
 image_t *IMG_Find(const char *name, imagetype_t type, imageflags_t flags)
 {
     image_t *image;
@@ -1300,6 +1690,11 @@ image_t *IMG_Clone(image_t *image, const char* new_name)
         new_image->pix_data = IMG_AllocPixels(image_size);
         memcpy(new_image->pix_data, image->pix_data, image_size);
     }
+    if(image->dds_blocks != NULL)
+    {
+        new_image->dds_blocks = R_Malloc(image->dds_size);
+        memcpy(new_image->dds_blocks, image->dds_blocks, image->dds_size);
+    }
 #else
     for (int m = 0; m < 4; m++)
     {
@@ -1474,6 +1869,16 @@ qboolean R_GetPicSize(int *w, int *h, qhandle_t pic)
     return !!(image->flags & IF_TRANSPARENT);
 }
 
+// The blocks kept by the .dds loader, in case IMG_Unload didn't take them.
+// The GL renderer never does.
+static void IMG_FreeBlocks(image_t *image)
+{
+#if USE_REF == REF_VKPT
+    Z_Free(image->dds_blocks);
+    image->dds_blocks = NULL;
+#endif
+}
+
 /*
 ================
 IMG_FreeUnused
@@ -1505,6 +1910,7 @@ void IMG_FreeUnused(void)
 
         // free it
         IMG_Unload(image);
+        IMG_FreeBlocks(image);
 
         memset(image, 0, sizeof(*image));
         count++;
@@ -1525,6 +1931,7 @@ void IMG_FreeAll(void)
             continue;        // free image_t slot
         // free it
         IMG_Unload(image);
+        IMG_FreeBlocks(image);
 
         memset(image, 0, sizeof(*image));
         count++;
@@ -1540,6 +1947,8 @@ void IMG_FreeAll(void)
 
     // &r_images[0] == R_NOTEXTURE
     r_numImages = 1;
+
+    IMG_FlushPrefetched();
 }
 
 /*
@@ -1582,7 +1991,338 @@ fail:
     Com_Error(ERR_FATAL, "Couldn't load %s: %s", R_COLORMAP_PCX, Q_ErrorString(ret));
 }
 
+static void free_bench_pics(imgprefetch_t *list, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (list[i].pic)
+            IMG_FreePixels(list[i].pic);
+        list[i].pic = NULL;
+    }
+}
+
+/*
+===============
+IMG_Bench_f
+
+imagebench <listfile> [maxthreads]
+
+Decodes every image named in listfile (one path per line) with an
+increasing number of threads. Files are loaded once up front, so only
+decoding is timed; nothing is uploaded.
+===============
+*/
+static void IMG_Bench_f(void)
+{
+    imgprefetch_t   *list, *e, **ptrs;
+    char            *data, *s, *p;
+    ssize_t         len;
+    size_t          namelen;
+    int             i, count, threads, maxthreads, msec;
+    uint64_t        inbytes, outbytes;
+
+    if (Cmd_Argc() < 2) {
+        Com_Printf("Usage: %s <listfile> [maxthreads]\n", Cmd_Argv(0));
+        return;
+    }
+
+    len = FS_LoadFile(Cmd_Argv(1), (void **)&data);
+    if (!data) {
+        Com_EPrintf("Couldn't load %s: %s\n", Cmd_Argv(1), Q_ErrorString(len));
+        return;
+    }
+
+    maxthreads = Job_NumWorkers() + 1;
+    if (Cmd_Argc() > 2) {
+        i = atoi(Cmd_Argv(2));
+        clamp(i, 1, maxthreads);
+        maxthreads = i;
+    }
+
+    for (count = 0, s = data; *s; s++)
+        count += *s == '\n';
+    list = R_Mallocz((count + 1) * (sizeof(*list) + sizeof(*ptrs)));
+    ptrs = (imgprefetch_t **)(list + count + 1);
+
+    count = 0;
+    inbytes = 0;
+    for (s = data; s; s = p) {
+        p = strchr(s, '\n');
+        if (p)
+            *p++ = 0;
+
+        namelen = strlen(s);
+        while (namelen && Q_isspace(s[namelen - 1]))
+            s[--namelen] = 0;
+        if (namelen <= 4 || namelen >= MAX_QPATH || *s == '#')
+            continue;
+
+        e = &list[count];
+        for (e->fmt = 0; e->fmt < IM_MAX; e->fmt++)
+            if (!Q_stricmp(s + namelen - 3, img_loaders[e->fmt].ext))
+                break;
+        if (e->fmt == IM_MAX) {
+            Com_WPrintf("%s: unknown format\n", s);
+            continue;
+        }
+
+        e->len = FS_LoadFileFlags(s, (void **)&e->data, FS_FLAG_MAPPED);
+        if (!e->data) {
+            Com_WPrintf("Couldn't load %s: %s\n", s, Q_ErrorString(e->len));
+            continue;
+        }
+
+        strcpy(e->image.name, s);
+        e->image.type = IT_SKIN;
+        ptrs[count++] = e;
+        inbytes += e->len;
+    }
+
+    FS_FreeFile(data);
+
+    Com_Printf("%d images, %.1f MB compressed\n", count, inbytes / (1024.0 * 1024.0));
+    Com_Printf("threads     msec   in MB/s  out MB/s\n");
+
+    for (threads = 1; count; threads *= 2) {
+        if (threads > maxthreads)
+            threads = maxthreads;
+
+        msec = Sys_Milliseconds();
+        Job_ParallelForEx(decode_prefetch, ptrs, count, threads);
+        msec = Sys_Milliseconds() - msec;
+
+        outbytes = 0;
+        for (i = 0; i < count; i++) {
+            if (list[i].ret >= 0)
+                outbytes += list[i].image.upload_width * list[i].image.upload_height * 4;
+        }
+        free_bench_pics(list, count);
+
+        msec = max(msec, 1);
+        Com_Printf("%7d %8d %9.1f %9.1f\n", threads, msec,
+                   inbytes * 1000.0 / (msec * 1024.0 * 1024.0),
+                   outbytes * 1000.0 / (msec * 1024.0 * 1024.0));
+
+        if (threads == maxthreads)
+            break;
+    }
+
+    for (i = 0; i < count; i++)
+        FS_FreeFile(list[i].data);
+    Z_Free(list);
+}
+
+// plain C versions of the kernels above, for checking results
+static void mipmap_ref(byte *out, const byte *in, int width, int height)
+{
+    int i, j;
+
+    width <<= 2;
+    height >>= 1;
+    for (i = 0; i < height; i++, in += width) {
+        for (j = 0; j < width; j += 8, out += 4, in += 8) {
+            out[0] = (in[0] + in[4] + in[width + 0] + in[width + 4]) >> 2;
+            out[1] = (in[1] + in[5] + in[width + 1] + in[width + 5]) >> 2;
+            out[2] = (in[2] + in[6] + in[width + 2] + in[width + 6]) >> 2;
+            out[3] = (in[3] + in[7] + in[width + 3] + in[width + 7]) >> 2;
+        }
+    }
+}
+
+static int count_mismatches(const byte *a, const byte *b, size_t size)
+{
+    int count = 0;
+
+    while (size--)
+        count += *a++ != *b++;
+
+    return count;
+}
+
+/*
+===============
+IMG_ProcTest_f
+
+imageproctest [size] [iterations]
+
+Checks IMG_MipMap and IMG_ResampleTexture against plain C versions on
+random data and times them. Runs on the CPU only.
+===============
+*/
+static void IMG_ProcTest_f(void)
+{
+    byte        *src, *out, *ref;
+    int         i, n, size, iterations, failures = 0;
+    unsigned    start, ref_msec, msec;
+    size_t      bytes;
+
+    size = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 1024;
+    iterations = Cmd_Argc() > 2 ? atoi(Cmd_Argv(2)) : 10;
+    clamp(size, 2, MAX_TEXTURE_SIZE);
+    clamp(iterations, 1, 1000);
+    size &= ~1;
+
+    bytes = size * size * 4;
+    src = R_Malloc(bytes);
+    out = R_Malloc(bytes);
+    ref = R_Malloc(bytes);
+
+    srand(size);
+    for (i = 0; i < bytes; i++)
+        src[i] = rand();
+
+    // mipmap, separate output
+    start = Sys_Milliseconds();
+    for (i = 0; i < iterations; i++)
+        mipmap_ref(ref, src, size, size);
+    ref_msec = Sys_Milliseconds() - start;
+
+    start = Sys_Milliseconds();
+    for (i = 0; i < iterations; i++)
+        IMG_MipMap(out, src, size, size);
+    msec = Sys_Milliseconds() - start;
+
+    n = count_mismatches(out, ref, bytes / 4);
+    failures += n;
+    Com_Printf("mipmap    %4dx%-4d %6u msec ref %6u msec, %d mismatches\n",
+               size, size, msec, ref_msec, n);
+
+    // mipmap, in place
+    memcpy(out, src, bytes);
+    IMG_MipMap(out, out, size, size);
+    n = count_mismatches(out, ref, bytes / 4);
+    failures += n;
+    Com_Printf("mipmap in place: %d mismatches\n", n);
+
+    // resample to 3/4 size, serial version is the reference
+    n = size * 3 / 4;
+    start = Sys_Milliseconds();
+    for (i = 0; i < iterations; i++)
+        IMG_ResampleTexture(src, size, size, out, n, n);
+    msec = Sys_Milliseconds() - start;
+
+    {
+        resample_t *r = R_Malloc(sizeof(*r));
+        unsigned frac, fracstep = size * 0x10000 / n;
+        int j;
+
+        r->in = src;
+        r->out = ref;
+        r->inwidth = r->inheight = size;
+        r->outwidth = r->outheight = n;
+        r->heightScale = (float)size / n;
+        for (j = 0, frac = fracstep >> 2; j < n; j++, frac += fracstep)
+            r->p1[j] = 4 * (frac >> 16);
+        for (j = 0, frac = 3 * (fracstep >> 2); j < n; j++, frac += fracstep)
+            r->p2[j] = 4 * (frac >> 16);
+
+        start = Sys_Milliseconds();
+        for (i = 0; i < iterations; i++)
+            for (j = 0; j < n; j++)
+                resample_row(r, j);
+        ref_msec = Sys_Milliseconds() - start;
+
+        Z_Free(r);
+    }
+
+    i = count_mismatches(out, ref, n * n * 4);
+    failures += i;
+    Com_Printf("resample  %4dx%-4d %6u msec ref %6u msec, %d mismatches\n",
+               n, n, msec, ref_msec, i);
+
+    Com_Printf("%s\n", failures ? "FAILED" : "passed");
+
+    Z_Free(src);
+    Z_Free(out);
+    Z_Free(ref);
+}
+
+static double psnr(const byte *a, const byte *b, int count, int first, int channels)
+{
+    double err = 0, d;
+    int i, c;
+
+    for (i = 0; i < count; i++) {
+        for (c = first; c < first + channels; c++) {
+            d = a[i * 4 + c] - b[i * 4 + c];
+            err += d * d;
+        }
+    }
+
+    err /= (double)count * channels;
+    return err ? 10 * log10(255.0 * 255.0 / err) : 99;
+}
+
+/*
+===============
+IMG_TexCompTest_f
+
+texcomptest [size]
+
+Compresses a synthetic image with smooth gradients, noise and hard edges
+to every supported block format, then reports speed and quality.
+===============
+*/
+static void IMG_TexCompTest_f(void)
+{
+    static const char *const names[] = { NULL, "BC1", "BC3" };
+    byte        *src, *dec, *out, *p;
+    int         x, y, size, levels;
+    size_t      bytes, chain_size;
+    unsigned    start, msec, chain_msec;
+    tcformat_t  format;
+
+    size = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 1024;
+    clamp(size, 4, MAX_TEXTURE_SIZE);
+
+    bytes = size * size * 4;
+    src = R_Malloc(bytes);
+    dec = R_Malloc(bytes);
+    out = R_Malloc(TC_LevelSize(TC_BC3, size, size));
+
+    srand(size);
+    for (y = 0, p = src; y < size; y++) {
+        for (x = 0; x < size; x++, p += 4) {
+            int edge = ((x / 37) ^ (y / 29)) & 1 ? 64 : 0;
+            p[0] = min(255, x * 256 / size + edge);
+            p[1] = min(255, y * 256 / size + (rand() & 15));
+            p[2] = 255 - max(p[0], p[1]) + edge / 2;
+            p[3] = ((x + y) / 8) & 1 ? 255 : (x * 255 / size);
+        }
+    }
+
+    Com_Printf("%dx%d, %d worker threads\n", size, size, Job_NumWorkers());
+
+    for (format = TC_BC1; format <= TC_BC3; format++) {
+        start = Sys_Milliseconds();
+        TC_Encode(format, src, size, size, out);
+        msec = Sys_Milliseconds() - start;
+
+        TC_Decode(format, out, size, size, dec);
+
+        start = Sys_Milliseconds();
+        Z_Free(TC_EncodeMipChain(format, src, size, size, qtrue, &levels, &chain_size));
+        chain_msec = Sys_Milliseconds() - start;
+
+        Com_Printf("%s: %4u msec, %6.1f MB/s, rgb %.2f dB", names[format], msec,
+                   bytes / (1024.0 * 1024.0) / (max(msec, 1) / 1000.0),
+                   psnr(src, dec, size * size, 0, 3));
+        if (format == TC_BC3)
+            Com_Printf(", alpha %.2f dB", psnr(src, dec, size * size, 3, 1));
+        Com_Printf(", %.0f:1, %d level chain %u msec\n",
+                   (double)bytes / TC_LevelSize(format, size, size), levels, chain_msec);
+    }
+
+    Z_Free(src);
+    Z_Free(dec);
+    Z_Free(out);
+}
+
 static const cmdreg_t img_cmd[] = {
+    { "imagebench", IMG_Bench_f },
+    { "imageproctest", IMG_ProcTest_f },
+    { "texcomptest", IMG_TexCompTest_f },
     { "imagelist", IMG_List_f },
     { "screenshot", IMG_ScreenShot_f },
     { "screenshottga", IMG_ScreenShotTGA_f },
@@ -1624,5 +2364,6 @@ void IMG_Init(void)
 void IMG_Shutdown(void)
 {
     Cmd_Deregister(img_cmd);
+    IMG_FlushPrefetched();
     r_numImages = 0;
 }
@@ -26,6 +26,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include <format/iqm.h>
 #include <refresh/models.h>
 #include <refresh/refresh.h>
+#include <refresh/images.h>
+#include <common/common.h>
+#include <common/zone.h>
+#include <system/system.h>
 
 static qboolean IQM_CheckRange(const iqmHeader_t* header, uint32_t offset, uint32_t count, size_t size)
 {
@@ -169,14 +173,17 @@ static vec_t QuatNormalize2(const quat_t v, quat_t out)
 
 // ReSharper disable CppClangTidyClangDiagnosticCastAlign
 
+// format problems are only reported when loading on the main thread
+#define IQM_Warning(...) do { if (!quiet) Com_WPrintf(__VA_ARGS__); } while (0)
+
 /*
 =================
-MOD_LoadIQM_Base
+IQM_LoadBase
 
 Load an IQM model and compute the joint poses for every frame.
 =================
 */
-qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+static qerror_t IQM_LoadBase(model_t* model, const void* rawdata, size_t length, const char* mod_name, qboolean quiet)
 {
 	iqm_transform_t* transform;
 	float* mat, * matInv;
@@ -198,7 +205,7 @@ qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, co
 
 	if (header->version != IQM_VERSION)
 	{
-		Com_WPrintf("R_LoadIQM: %s is a unsupported IQM version (%d), only version %d is supported.\n",
+		IQM_Warning("R_LoadIQM: %s is a unsupported IQM version (%d), only version %d is supported.\n",
 			mod_name, header->version, IQM_VERSION);
 		return Q_ERR_UNKNOWN_FORMAT;
 	}
@@ -211,7 +218,7 @@ qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, co
 	// check ioq3 joint limit
 	if (header->num_joints > IQM_MAX_JOINTS)
 	{
-		Com_WPrintf("R_LoadIQM: %s has more than %d joints (%d).\n",
+		IQM_Warning("R_LoadIQM: %s has more than %d joints (%d).\n",
 			mod_name, IQM_MAX_JOINTS, header->num_joints);
 		return Q_ERR_INVALID_FORMAT;
 	}
@@ -321,7 +328,7 @@ qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, co
 		// check for required vertex arrays
 		if (vertexArrayFormat[IQM_POSITION] == -1 || vertexArrayFormat[IQM_NORMAL] == -1 || vertexArrayFormat[IQM_TEXCOORD] == -1)
 		{
-			Com_WPrintf("R_LoadIQM: %s is missing IQM_POSITION, IQM_NORMAL, and/or IQM_TEXCOORD array.\n", mod_name);
+			IQM_Warning("R_LoadIQM: %s is missing IQM_POSITION, IQM_NORMAL, and/or IQM_TEXCOORD array.\n", mod_name);
 			return Q_ERR_INVALID_FORMAT;
 		}
 
@@ -329,7 +336,7 @@ qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, co
 		{
 			if (vertexArrayFormat[IQM_BLENDINDEXES] == -1 || vertexArrayFormat[IQM_BLENDWEIGHTS] == -1)
 			{
-				Com_WPrintf("R_LoadIQM: %s is missing IQM_BLENDINDEXES and/or IQM_BLENDWEIGHTS array.\n", mod_name);
+				IQM_Warning("R_LoadIQM: %s is missing IQM_BLENDINDEXES and/or IQM_BLENDWEIGHTS array.\n", mod_name);
 				return Q_ERR_INVALID_FORMAT;
 			}
 		}
@@ -386,7 +393,7 @@ qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, co
 
 	if (header->num_poses != header->num_joints && header->num_poses != 0)
 	{
-		Com_WPrintf("R_LoadIQM: %s has %d poses and %d joints, must have the same number or 0 poses\n",
+		IQM_Warning("R_LoadIQM: %s has %d poses and %d joints, must have the same number or 0 poses\n",
 			mod_name, header->num_poses, header->num_joints);
 		return Q_ERR_INVALID_FORMAT;
 	}
@@ -736,22 +743,45 @@ qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, co
 	return Q_ERR_SUCCESS;
 }
 
+qerror_t MOD_LoadIQM_Base(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+{
+	return IQM_LoadBase(model, rawdata, length, mod_name, qfalse);
+}
+
+// Same without console output, so it can run on worker threads. Models that
+// fail here are loaded again by R_RegisterModel, which prints the warnings.
+qerror_t MOD_ParseIQM_Base(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+{
+	return IQM_LoadBase(model, rawdata, length, mod_name, qtrue);
+}
+
 /*
 =================
-R_ComputeIQMTransforms
+R_IQMPoseKey
 
-Compute matrices for this model, returns [model->num_poses] 3x4 matrices in the (pose_matrices) array
+Fills in the values that the pose of this entity depends on. Frame numbers
+are wrapped, and backlerp is ignored when both frames are the same.
 =================
 */
-qboolean R_ComputeIQMTransforms(const iqm_model_t* model, const entity_t* entity, float* pose_matrices)
+void R_IQMPoseKey(const iqm_model_t* model, const entity_t* entity, iqm_pose_key_t* key)
 {
+	key->model = model;
+	key->frame = model->num_frames ? entity->frame % (int)model->num_frames : 0;
+	key->oldframe = model->num_frames ? entity->oldframe % (int)model->num_frames : 0;
+	key->backlerp = (key->frame != key->oldframe) ? entity->backlerp : 0.0f;
+}
+
+// Original scalar version, kept as a reference for iqmposetest.
+static void ComputePose_Reference(const iqm_pose_key_t* key, float* pose_matrices)
+{
+	const iqm_model_t* model = key->model;
 	iqm_transform_t relativeJoints[IQM_MAX_JOINTS];
 
 	iqm_transform_t* relativeJoint = relativeJoints;
 
-	const int frame = model->num_frames ? entity->frame % (int)model->num_frames : 0;
-	const int oldframe = model->num_frames ? entity->oldframe % (int)model->num_frames : 0;
-	const float backlerp = entity->backlerp;
+	const int frame = key->frame;
+	const int oldframe = key->oldframe;
+	const float backlerp = key->backlerp;
 
 	// copy or lerp animation frame pose
 	if (oldframe == frame)
@@ -805,6 +835,388 @@ qboolean R_ComputeIQMTransforms(const iqm_model_t* model, const entity_t* entity
 			Matrix34Multiply(mat1, invBindMat, poseMat);
 		}
 	}
+}
+
+// SSE2 only, see USE_SSE2 in shared/shared.h
+#if USE_SSE2
+
+// Same operation order as Matrix34Multiply, so the results are bit exact.
+// Adding -0 keeps the first three columns unchanged, including zero signs.
+static void Matrix34Multiply_SSE2(const float* a, const float* b, float* out)
+{
+	const __m128 b0 = _mm_loadu_ps(b + 0);
+	const __m128 b1 = _mm_loadu_ps(b + 4);
+	const __m128 b2 = _mm_loadu_ps(b + 8);
+
+	for (int row = 0; row < 3; row++, a += 4, out += 4)
+	{
+		__m128 r = _mm_mul_ps(_mm_set1_ps(a[0]), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[1]), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a[2]), b2));
+		r = _mm_add_ps(r, _mm_set_ps(a[3], -0.0f, -0.0f, -0.0f));
+		_mm_storeu_ps(out, r);
+	}
+}
+
+static void ComputePose_SSE2(const iqm_pose_key_t* key, float* pose_matrices)
+{
+	const iqm_model_t* model = key->model;
+	iqm_transform_t relativeJoints[IQM_MAX_JOINTS];
+	const iqm_transform_t* pose = &model->poses[key->frame * model->num_poses];
+	const iqm_transform_t* joints = pose;
+
+	// the pose of a single frame is used as is
+	if (key->oldframe != key->frame)
+	{
+		const iqm_transform_t* oldpose = &model->poses[key->oldframe * model->num_poses];
+		const float lerp = 1.0f - key->backlerp;
+		const __m128 backlerp_v = _mm_set1_ps(key->backlerp);
+		const __m128 lerp_v = _mm_set1_ps(lerp);
+
+		for (uint32_t pose_idx = 0; pose_idx < model->num_poses; pose_idx++)
+		{
+			const float* a = (const float*)&oldpose[pose_idx];
+			const float* b = (const float*)&pose[pose_idx];
+			float* out = (float*)&relativeJoints[pose_idx];
+
+			// translate and scale are the first and last three of ten floats,
+			// the rotation lanes that come along are overwritten by the slerp
+			_mm_storeu_ps(out + 0, _mm_add_ps(
+				_mm_mul_ps(_mm_loadu_ps(a + 0), backlerp_v),
+				_mm_mul_ps(_mm_loadu_ps(b + 0), lerp_v)));
+			_mm_storeu_ps(out + 6, _mm_add_ps(
+				_mm_mul_ps(_mm_loadu_ps(a + 6), backlerp_v),
+				_mm_mul_ps(_mm_loadu_ps(b + 6), lerp_v)));
+
+			QuatSlerp(oldpose[pose_idx].rotate, pose[pose_idx].rotate, lerp, relativeJoints[pose_idx].rotate);
+		}
+
+		joints = relativeJoints;
+	}
+
+	const int* jointParent = model->jointParents;
+	const float* invBindMat = model->invBindJoints;
+	float* poseMat = pose_matrices;
+	for (uint32_t pose_idx = 0; pose_idx < model->num_poses; pose_idx++, joints++, jointParent++, invBindMat += 12, poseMat += 12)
+	{
+		float mat1[12], mat2[12];
+
+		JointToMatrix(joints->rotate, joints->scale, joints->translate, mat1);
+
+		if (*jointParent >= 0)
+		{
+			Matrix34Multiply_SSE2(&model->bindJoints[(*jointParent) * 12], mat1, mat2);
+			Matrix34Multiply_SSE2(mat2, invBindMat, mat1);
+			Matrix34Multiply_SSE2(&pose_matrices[(*jointParent) * 12], mat1, poseMat);
+		}
+		else
+		{
+			Matrix34Multiply_SSE2(mat1, invBindMat, poseMat);
+		}
+	}
+}
+
+#define ComputePose ComputePose_SSE2
+
+#else
+
+#define ComputePose ComputePose_Reference
+
+#endif // USE_SSE2
+
+/*
+=================
+R_ComputeIQMTransforms
+
+Compute matrices for this model, returns [model->num_poses] 3x4 matrices in the (pose_matrices) array
+=================
+*/
+qboolean R_ComputeIQMTransforms(const iqm_model_t* model, const entity_t* entity, float* pose_matrices)
+{
+	iqm_pose_key_t key;
+
+	R_IQMPoseKey(model, entity, &key);
+	ComputePose(&key, pose_matrices);
 
 	return qtrue;
 }
+
+static uint32_t IQM_HashPoseKey(const iqm_pose_key_t* key)
+{
+	uint32_t backlerp;
+	memcpy(&backlerp, &key->backlerp, sizeof(backlerp));
+
+	uint32_t hash = (uint32_t)((uintptr_t)key->model >> 4);
+	hash = hash * 31 + (uint32_t)key->frame;
+	hash = hash * 31 + (uint32_t)key->oldframe;
+	hash = hash * 31 + backlerp;
+	hash ^= hash >> 15;
+	hash *= 0x2c1b3c6d;
+	hash ^= hash >> 12;
+
+	return hash & (IQM_POSE_CACHE_SIZE - 1);
+}
+
+static qboolean IQM_PoseKeysEqual(const iqm_pose_key_t* a, const iqm_pose_key_t* b)
+{
+	// compare backlerp bitwise, -0 and 0 don't give exactly the same pose
+	return a->model == b->model
+		&& a->frame == b->frame
+		&& a->oldframe == b->oldframe
+		&& !memcmp(&a->backlerp, &b->backlerp, sizeof(a->backlerp));
+}
+
+void R_ClearIQMPoseCache(iqm_pose_cache_t* cache)
+{
+	if (++cache->sequence == 0)
+	{
+		memset(cache->entries, 0, sizeof(cache->entries));
+		cache->sequence = 1;
+	}
+
+	cache->num_entries = 0;
+	cache->num_lookups = 0;
+	cache->num_hits = 0;
+}
+
+/*
+=================
+R_CacheIQMPose
+
+Returns the matrix offset stored for an equal key. Otherwise remembers the
+given offset for this key and returns -1, the caller then has to compute
+the pose there. A negative offset only looks the key up.
+=================
+*/
+int R_CacheIQMPose(iqm_pose_cache_t* cache, const iqm_pose_key_t* key, int offset)
+{
+	uint32_t index = IQM_HashPoseKey(key);
+
+	cache->num_lookups++;
+
+	for (;;)
+	{
+		iqm_pose_entry_t* entry = cache->entries + index;
+
+		if (entry->sequence != cache->sequence)
+		{
+			// keep the table at most half full so that probe chains stay short
+			if (offset >= 0 && cache->num_entries < IQM_POSE_CACHE_SIZE / 2)
+			{
+				entry->key = *key;
+				entry->offset = offset;
+				entry->sequence = cache->sequence;
+				cache->num_entries++;
+			}
+			return -1;
+		}
+
+		if (IQM_PoseKeysEqual(&entry->key, key))
+		{
+			cache->num_hits++;
+			return entry->offset;
+		}
+
+		index = (index + 1) & (IQM_POSE_CACHE_SIZE - 1);
+	}
+}
+
+#define TEST_MODELS         4
+#define TEST_FRAMES         40
+#define TEST_ANIM_PHASES    16
+
+static void IQM_RandomQuat(quat_t q, const quat_t base, float noise)
+{
+	quat_t r;
+	for (int i = 0; i < 4; i++)
+		r[i] = (base ? base[i] : 0.0f) + noise * (float)(frand() * 2.0 - 1.0);
+	QuatNormalize2(r, q);
+}
+
+// random skeleton with parents before children, like the loader produces
+static iqm_model_t* IQM_CreateTestModel(int num_joints, int num_frames)
+{
+	iqm_model_t* model = Z_Mallocz(sizeof(*model));
+
+	model->num_joints = model->num_poses = num_joints;
+	model->num_frames = num_frames;
+	model->jointParents = Z_Malloc(num_joints * sizeof(int));
+	model->bindJoints = Z_Malloc(num_joints * 12 * sizeof(float));
+	model->invBindJoints = Z_Malloc(num_joints * 12 * sizeof(float));
+	model->poses = Z_Malloc(num_joints * num_frames * sizeof(iqm_transform_t));
+
+	for (int j = 0; j < num_joints; j++)
+	{
+		quat_t rot;
+		vec3_t scale = { 1.0f, 1.0f, 1.0f };
+		vec3_t trans = { (float)crand() * 8.0f, (float)crand() * 8.0f, (float)crand() * 8.0f };
+		float mat[12];
+
+		model->jointParents[j] = j ? rand() % j : -1;
+
+		IQM_RandomQuat(rot, NULL, 1.0f);
+		JointToMatrix(rot, scale, trans, mat);
+		if (model->jointParents[j] >= 0)
+			Matrix34Multiply(&model->bindJoints[model->jointParents[j] * 12], mat, &model->bindJoints[j * 12]);
+		else
+			memcpy(&model->bindJoints[j * 12], mat, sizeof(mat));
+		Matrix34Invert(&model->bindJoints[j * 12], &model->invBindJoints[j * 12]);
+
+		// consecutive frames are close, so both slerp paths get used
+		for (int f = 0; f < num_frames; f++)
+		{
+			iqm_transform_t* pose = &model->poses[f * num_joints + j];
+			const iqm_transform_t* prev = f ? pose - num_joints : NULL;
+
+			IQM_RandomQuat(pose->rotate, prev ? prev->rotate : NULL, prev ? ((f & 3) ? 0.2f : 0.0f) : 1.0f);
+			for (int i = 0; i < 3; i++)
+			{
+				pose->translate[i] = (prev ? prev->translate[i] : trans[i]) + (float)crand();
+				pose->scale[i] = 1.0f + (float)crand() * 0.05f;
+			}
+		}
+	}
+
+	return model;
+}
+
+static void IQM_FreeTestModel(iqm_model_t* model)
+{
+	Z_Free(model->jointParents);
+	Z_Free(model->bindJoints);
+	Z_Free(model->invBindJoints);
+	Z_Free(model->poses);
+	Z_Free(model);
+}
+
+static int IQM_CountMismatches(const float* a, const float* b, int count)
+{
+	int mismatches = 0;
+
+	for (int i = 0; i < count; i++)
+		mismatches += memcmp(a + i, b + i, sizeof(float)) != 0;
+
+	return mismatches;
+}
+
+/*
+=================
+IQM_PoseTest_f
+
+iqmposetest [entities] [iterations]
+
+Animates a crowd of synthetic IQM models the way the renderer does, and
+checks the SIMD pose math and the pose cache against the scalar reference.
+Runs on the CPU only.
+=================
+*/
+void IQM_PoseTest_f(void)
+{
+	iqm_model_t* models[TEST_MODELS];
+	iqm_pose_cache_t* cache;
+	entity_t* entities;
+	float* ref, * out;
+	int* offsets, * shared_offsets;
+	int num_entities, iterations, num_matrices = 0, failures = 0;
+	int64_t computed_poses = 0;
+	uint64_t start, ref_usec = 0, simd_usec = 0, cache_usec = 0;
+
+	num_entities = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 256;
+	iterations = Cmd_Argc() > 2 ? atoi(Cmd_Argv(2)) : 100;
+	clamp(num_entities, 1, MAX_ENTITIES);
+	clamp(iterations, 1, 10000);
+
+	srand(num_entities);
+
+	for (int m = 0; m < TEST_MODELS; m++)
+	{
+		models[m] = IQM_CreateTestModel(32 + m * 24, TEST_FRAMES);
+		num_matrices += models[m]->num_poses * (num_entities / TEST_MODELS + 1);
+	}
+
+	entities = Z_Mallocz(num_entities * sizeof(entity_t));
+	offsets = Z_Malloc(num_entities * sizeof(int));
+	shared_offsets = Z_Malloc(num_entities * sizeof(int));
+	ref = Z_Malloc(num_matrices * 12 * sizeof(float));
+	out = Z_Malloc(num_matrices * 12 * sizeof(float));
+	cache = Z_Mallocz(sizeof(*cache));
+
+	for (int iter = 0; iter < iterations; iter++)
+	{
+		// a few animation phases per model and one lerp fraction per frame,
+		// like monsters that run the same animation in step
+		const float backlerp = (iter % 10) * 0.1f;
+		int num_floats = 0;
+
+		for (int e = 0; e < num_entities; e++)
+		{
+			entity_t* entity = entities + e;
+			const int frame = iter / 10 + (e / TEST_MODELS % TEST_ANIM_PHASES) * 3;
+
+			entity->frame = frame + 1;
+			entity->oldframe = (e % 7) ? frame : frame + 1;
+			entity->backlerp = backlerp;
+
+			offsets[e] = num_floats / 12;
+			num_floats += models[e % TEST_MODELS]->num_poses * 12;
+		}
+
+		start = Sys_Microseconds();
+		for (int e = 0; e < num_entities; e++)
+		{
+			iqm_pose_key_t key;
+			R_IQMPoseKey(models[e % TEST_MODELS], entities + e, &key);
+			ComputePose_Reference(&key, ref + offsets[e] * 12);
+		}
+		ref_usec += Sys_Microseconds() - start;
+
+		start = Sys_Microseconds();
+		for (int e = 0; e < num_entities; e++)
+			R_ComputeIQMTransforms(models[e % TEST_MODELS], entities + e, out + offsets[e] * 12);
+		simd_usec += Sys_Microseconds() - start;
+
+		failures += IQM_CountMismatches(out, ref, num_floats);
+
+		// same as prepare_entities, entities with equal poses share the matrices
+		memset(out, 0, num_floats * sizeof(float));
+		start = Sys_Microseconds();
+		R_ClearIQMPoseCache(cache);
+		for (int e = 0; e < num_entities; e++)
+		{
+			iqm_pose_key_t key;
+			R_IQMPoseKey(models[e % TEST_MODELS], entities + e, &key);
+
+			shared_offsets[e] = R_CacheIQMPose(cache, &key, offsets[e]);
+			if (shared_offsets[e] < 0)
+			{
+				ComputePose(&key, out + offsets[e] * 12);
+				shared_offsets[e] = offsets[e];
+			}
+		}
+		cache_usec += Sys_Microseconds() - start;
+
+		computed_poses += cache->num_lookups - cache->num_hits;
+		for (int e = 0; e < num_entities; e++)
+		{
+			failures += IQM_CountMismatches(out + shared_offsets[e] * 12, ref + offsets[e] * 12,
+				models[e % TEST_MODELS]->num_poses * 12);
+		}
+	}
+
+	Com_Printf("%d entities, %d iterations, %.1f poses computed per frame\n",
+		num_entities, iterations, (double)computed_poses / iterations);
+	Com_Printf("reference %8"PRIu64" usec\n", ref_usec);
+	Com_Printf("simd      %8"PRIu64" usec%s\n", simd_usec, USE_SSE2 ? "" : " (not available)");
+	Com_Printf("cached    %8"PRIu64" usec\n", cache_usec);
+	Com_Printf("%d mismatches\n", failures);
+	Com_Printf("%s\n", failures ? "FAILED" : "passed");
+
+	for (int m = 0; m < TEST_MODELS; m++)
+		IQM_FreeTestModel(models[m]);
+	Z_Free(entities);
+	Z_Free(offsets);
+	Z_Free(shared_offsets);
+	Z_Free(ref);
+	Z_Free(out);
+	Z_Free(cache);
+}
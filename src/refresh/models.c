@@ -31,6 +31,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "format/iqm.h"
 #include "refresh/images.h"
 #include "refresh/models.h"
+#include "common/jobs.h"
+#include "system/system.h"
 
 // during registration it is possible to have more models than could actually
 // be referenced during gameplay, because we don't want to free anything until
@@ -306,6 +308,60 @@ static qerror_t MOD_LoadSP2(model_t *model, const void *rawdata, size_t length,
 #define TRY_MODEL_SRC_GAME      1
 #define TRY_MODEL_SRC_BASE      0
 
+// returns the file length, or an error if rawdata is NULL
+static ssize_t MOD_LoadFile(char *normalized, size_t namelen, byte **rawdata)
+{
+    ssize_t filelen = Q_ERR_NOENT;
+
+    *rawdata = NULL;
+
+    // Always prefer models from the game dir, even if format might be 'inferior'
+    for (int try_location = Q_stricmp(fs_game->string, BASEGAME) ? TRY_MODEL_SRC_GAME : TRY_MODEL_SRC_BASE;
+         try_location >= TRY_MODEL_SRC_BASE;
+         try_location--)
+    {
+        int fs_flags = FS_FLAG_MAPPED;
+        if (try_location > 0)
+            fs_flags |= try_location == TRY_MODEL_SRC_GAME ? FS_PATH_GAME : FS_PATH_BASE;
+
+        char* extension = normalized + namelen - 4;
+        if (namelen > 4 && (strcmp(extension, ".md2") == 0) && vid_rtx->integer)
+        {
+            memcpy(extension, ".md3", 4);
+
+            filelen = FS_LoadFileFlags(normalized, (void **)rawdata, fs_flags);
+
+            memcpy(extension, ".md2", 4);
+        }
+        if (!*rawdata)
+        {
+            filelen = FS_LoadFileFlags(normalized, (void **)rawdata, fs_flags);
+        }
+        if (*rawdata)
+            return filelen;
+    }
+
+    return FS_LoadFileFlags(normalized, (void **)rawdata, FS_FLAG_MAPPED);
+}
+
+static mod_load_t MOD_LoaderForIdent(uint32_t ident)
+{
+    switch (ident) {
+    case MD2_IDENT:
+        return MOD_LoadMD2;
+#if USE_MD3
+    case MD3_IDENT:
+        return MOD_LoadMD3;
+#endif
+    case SP2_IDENT:
+        return MOD_LoadSP2;
+    case IQM_IDENT:
+        return MOD_LoadIQM;
+    default:
+        return NULL;
+    }
+}
+
 qhandle_t R_RegisterModel(const char *name)
 {
     char normalized[MAX_QPATH];
@@ -313,8 +369,7 @@ qhandle_t R_RegisterModel(const char *name)
     size_t namelen;
     ssize_t filelen;
     model_t *model;
-    byte *rawdata = NULL;
-    uint32_t ident;
+    byte *rawdata;
     mod_load_t load;
     qerror_t ret;
 
@@ -348,45 +403,16 @@ qhandle_t R_RegisterModel(const char *name)
         goto done;
     }
 
-    // Always prefer models from the game dir, even if format might be 'inferior'
-    for (int try_location = Q_stricmp(fs_game->string, BASEGAME) ? TRY_MODEL_SRC_GAME : TRY_MODEL_SRC_BASE;
-         try_location >= TRY_MODEL_SRC_BASE;
-         try_location--)
-    {
-        int fs_flags = 0;
-        if (try_location > 0)
-            fs_flags = try_location == TRY_MODEL_SRC_GAME ? FS_PATH_GAME : FS_PATH_BASE;
-
-        char* extension = normalized + namelen - 4;
-        if (namelen > 4 && (strcmp(extension, ".md2") == 0) && vid_rtx->integer)
-        {
-            memcpy(extension, ".md3", 4);
-
-            filelen = FS_LoadFileFlags(normalized, (void **)&rawdata, fs_flags);
-
-            memcpy(extension, ".md2", 4);
+    filelen = MOD_LoadFile(normalized, namelen, &rawdata);
+    if (!rawdata) {
+        // don't spam about missing models
+        if (filelen == Q_ERR_NOENT) {
+            return 0;
         }
-        if (!rawdata)
-        {
-            filelen = FS_LoadFileFlags(normalized, (void **)&rawdata, fs_flags);
-        }
-        if (rawdata)
-            break;
-    }
-
-	if (!rawdata)
-	{
-		filelen = FS_LoadFile(normalized, (void **)&rawdata);
-		if (!rawdata) {
-			// don't spam about missing models
-			if (filelen == Q_ERR_NOENT) {
-				return 0;
-			}
 
-			ret = filelen;
-			goto fail1;
-		}
-	}
+        ret = filelen;
+        goto fail1;
+    }
 
     if (filelen < 4) {
         ret = Q_ERR_FILE_TOO_SMALL;
@@ -394,27 +420,7 @@ qhandle_t R_RegisterModel(const char *name)
     }
 
     // check ident
-    ident = LittleLong(*(uint32_t *)rawdata);
-    switch (ident) {
-    case MD2_IDENT:
-        load = MOD_LoadMD2;
-        break;
-#if USE_MD3
-    case MD3_IDENT:
-        load = MOD_LoadMD3;
-        break;
-#endif
-    case SP2_IDENT:
-        load = MOD_LoadSP2;
-        break;
-    case IQM_IDENT:
-        load = MOD_LoadIQM;
-        break;
-    default:
-        ret = Q_ERR_UNKNOWN_FORMAT;
-        goto fail2;
-    }
-
+    load = MOD_LoaderForIdent(LittleLong(*(uint32_t *)rawdata));
     if (!load)
     {
         ret = Q_ERR_UNKNOWN_FORMAT;
@@ -452,6 +458,331 @@ fail1:
     return 0;
 }
 
+/*
+=================================================================
+
+PARALLEL LOADING
+
+R_PrefetchModel runs the same file lookup as R_RegisterModel and keeps the
+file data. R_LoadPrefetchedModels parses them in batches on worker threads
+with the split loaders of the renderer. After each batch it finalizes them
+in order on the main thread and adds them to the model list, where
+R_RegisterModel finds them. Models that fail are left to R_RegisterModel, which reports errors.
+
+=================================================================
+*/
+
+typedef struct {
+    model_t     model;
+    char        mod_name[MAX_QPATH];    // as given to R_PrefetchModel
+    byte        *rawdata;
+    ssize_t     filelen;
+    mod_load_t  parse;
+    mod_load_t  finalize;
+    qerror_t    ret;
+} modprefetch_t;
+
+static modprefetch_t    *mod_prefetch_list;
+static int              mod_num_prefetch;
+
+// models parsed per thread before the main thread finalizes them
+#define MOD_PREFETCH_BATCH  4
+
+static qboolean MOD_SplitLoader(const byte *rawdata, ssize_t filelen, mod_load_t *parse, mod_load_t *finalize)
+{
+    if (filelen < 4) {
+        return qfalse;
+    }
+
+    switch (LittleLong(*(uint32_t *)rawdata)) {
+    case MD2_IDENT:
+        *parse = MOD_ParseMD2;
+        *finalize = MOD_FinalizeMD2;
+        break;
+#if USE_MD3
+    case MD3_IDENT:
+        *parse = MOD_ParseMD3;
+        *finalize = MOD_FinalizeMD3;
+        break;
+#endif
+    case IQM_IDENT:
+        *parse = MOD_ParseIQM;
+        *finalize = MOD_FinalizeIQM;
+        break;
+    default:
+        return qfalse;
+    }
+
+    return *parse && *finalize;
+}
+
+// the GL renderer has none, its models are read by R_RegisterModel
+static qboolean MOD_HaveSplitLoaders(void)
+{
+#if USE_MD3
+    if (MOD_ParseMD3 && MOD_FinalizeMD3)
+        return qtrue;
+#endif
+    return (MOD_ParseMD2 && MOD_FinalizeMD2) || (MOD_ParseIQM && MOD_FinalizeIQM);
+}
+
+// runs on worker threads
+static void parse_prefetch(void *arg, int index)
+{
+    modprefetch_t *e = (modprefetch_t *)arg + index;
+
+    e->ret = e->parse(&e->model, e->rawdata, e->filelen, e->mod_name);
+}
+
+void R_PrefetchModel(const char *name)
+{
+    char normalized[MAX_QPATH];
+    size_t namelen;
+    ssize_t filelen;
+    byte *rawdata;
+    mod_load_t parse, finalize;
+    modprefetch_t *e;
+    int i;
+
+    if (!MOD_HaveSplitLoaders())
+        return;
+
+    // inline bsp models have no file
+    if (!*name || *name == '*')
+        return;
+
+    namelen = FS_NormalizePathBuffer(normalized, name, MAX_QPATH);
+    if (namelen == 0 || namelen >= MAX_QPATH)
+        return;
+
+    if (MOD_Find(normalized))
+        return;
+
+    for (i = 0; i < mod_num_prefetch; i++) {
+        if (!FS_pathcmp(mod_prefetch_list[i].model.name, normalized))
+            return;
+    }
+
+    filelen = MOD_LoadFile(normalized, namelen, &rawdata);
+    if (!rawdata)
+        return;
+
+    if (!MOD_SplitLoader(rawdata, filelen, &parse, &finalize)) {
+        FS_FreeFile(rawdata);
+        return;
+    }
+
+    if (!(mod_num_prefetch & 63)) {
+        mod_prefetch_list = Z_Realloc(mod_prefetch_list,
+            (mod_num_prefetch + 64) * sizeof(mod_prefetch_list[0]));
+    }
+
+    e = &mod_prefetch_list[mod_num_prefetch++];
+    memset(e, 0, sizeof(*e));
+    memcpy(e->model.name, normalized, namelen + 1);
+    Q_strlcpy(e->mod_name, name, sizeof(e->mod_name));
+    e->rawdata = rawdata;
+    e->filelen = filelen;
+    e->parse = parse;
+    e->finalize = finalize;
+}
+
+void R_LoadPrefetchedModels(void)
+{
+    modprefetch_t *e;
+    model_t *model;
+    int i, first, count, batch;
+
+    // a parsed model keeps its whole hunk reservation until the finalizer
+    // calls Hunk_End, so only a few models per thread are parsed at a time
+    batch = MOD_PREFETCH_BATCH * (Job_NumWorkers() + 1);
+
+    for (first = 0; first < mod_num_prefetch; first += count) {
+        count = min(batch, mod_num_prefetch - first);
+
+        Job_ParallelFor(parse_prefetch, mod_prefetch_list + first, count);
+
+        // finalize in prefetch order, so materials are found in the same
+        // order as when the models are registered one by one
+        for (i = first; i < first + count; i++) {
+            e = &mod_prefetch_list[i];
+
+            if (e->ret == Q_ERR_SUCCESS) {
+                e->model.registration_sequence = registration_sequence;
+                e->ret = e->finalize(&e->model, e->rawdata, e->filelen, e->mod_name);
+            }
+
+            FS_FreeFile(e->rawdata);
+
+            if (e->ret) {
+                Hunk_Free(&e->model.hunk);
+                continue;
+            }
+
+            model = MOD_Alloc();
+            if (!model) {
+                Hunk_Free(&e->model.hunk);
+                continue;
+            }
+
+            *model = e->model;
+            model->model_class = get_model_class(model->name);
+        }
+    }
+
+    mod_num_prefetch = 0;
+}
+
+static void MOD_FlushPrefetched(void)
+{
+    int i;
+
+    for (i = 0; i < mod_num_prefetch; i++)
+        FS_FreeFile(mod_prefetch_list[i].rawdata);
+
+    Z_Free(mod_prefetch_list);
+    mod_prefetch_list = NULL;
+    mod_num_prefetch = 0;
+}
+
+// hashes the hunk with pointers into it replaced by offsets,
+// so that loading the same file twice gives the same sum
+static uint64_t MOD_Checksum(const model_t *model)
+{
+    const uintptr_t *p = model->hunk.base;
+    const uintptr_t base = (uintptr_t)model->hunk.base;
+    const size_t count = model->hunk.cursize / sizeof(*p);
+    uint64_t sum = 14695981039346656037ULL;
+    size_t i;
+
+    sum = (sum ^ model->type) * 1099511628211ULL;
+    sum = (sum ^ model->numframes) * 1099511628211ULL;
+
+    for (i = 0; i < count; i++) {
+        uintptr_t v = p[i];
+        if (v >= base && v < base + model->hunk.cursize)
+            v -= base;
+        sum = (sum ^ v) * 1099511628211ULL;
+    }
+
+    return sum;
+}
+
+static void MOD_ResetPrefetched(modprefetch_t *e)
+{
+    char name[MAX_QPATH];
+
+    if (e->model.hunk.base)
+        Hunk_Free(&e->model.hunk);
+
+    memcpy(name, e->model.name, sizeof(name));
+    memset(&e->model, 0, sizeof(e->model));
+    memcpy(e->model.name, name, sizeof(name));
+}
+
+/*
+===============
+MOD_LoadTest_f
+
+modelloadtest [maxthreads]
+
+Parses every model under models/ serially and then on worker threads, and
+compares checksums of the results. Only the parse step runs, so materials
+are not looked up and nothing is uploaded.
+===============
+*/
+static void MOD_LoadTest_f(void)
+{
+    void        **list;
+    modprefetch_t *tests, *e;
+    uint64_t    *sums;
+    size_t      bytes = 0;
+    unsigned    start, serial_msec, msec;
+    int         i, count, num_tests = 0, threads, errors = 0, mismatches = 0;
+
+    threads = Job_NumWorkers() + 1;
+    if (Cmd_Argc() > 1) {
+        i = atoi(Cmd_Argv(1));
+        clamp(i, 1, threads);
+        threads = i;
+    }
+
+    list = FS_ListFiles("models", ".md2;.md3;.iqm", FS_SEARCH_SAVEPATH, &count);
+    if (!list) {
+        Com_Printf("No models found\n");
+        return;
+    }
+
+    tests = R_Mallocz(count * sizeof(*tests));
+    sums = R_Malloc(count * sizeof(*sums));
+
+    for (i = 0; i < count; i++) {
+        e = &tests[num_tests];
+        e->filelen = FS_LoadFileFlags(list[i], (void **)&e->rawdata, FS_FLAG_MAPPED);
+        if (!e->rawdata) {
+            Com_WPrintf("Couldn't load %s: %s\n", (char *)list[i], Q_ErrorString(e->filelen));
+            continue;
+        }
+
+        if (!MOD_SplitLoader(e->rawdata, e->filelen, &e->parse, &e->finalize)) {
+            FS_FreeFile(e->rawdata);
+            continue;
+        }
+
+        Q_strlcpy(e->model.name, list[i], sizeof(e->model.name));
+        Q_strlcpy(e->mod_name, list[i], sizeof(e->mod_name));
+        bytes += e->filelen;
+        num_tests++;
+    }
+
+    FS_FreeList(list);
+
+    if (!num_tests) {
+        Com_Printf("The renderer doesn't support parallel model loading\n");
+        Z_Free(tests);
+        Z_Free(sums);
+        return;
+    }
+
+    start = Sys_Milliseconds();
+    for (i = 0; i < num_tests; i++)
+        parse_prefetch(tests, i);
+    serial_msec = Sys_Milliseconds() - start;
+
+    for (i = 0; i < num_tests; i++) {
+        e = &tests[i];
+        sums[i] = e->ret ? 0 : MOD_Checksum(&e->model);
+        if (e->ret) {
+            Com_Printf("%s: %s\n", e->model.name, Q_ErrorString(e->ret));
+            errors++;
+        }
+        MOD_ResetPrefetched(e);
+    }
+
+    start = Sys_Milliseconds();
+    Job_ParallelForEx(parse_prefetch, tests, num_tests, threads);
+    msec = Sys_Milliseconds() - start;
+
+    for (i = 0; i < num_tests; i++) {
+        e = &tests[i];
+        if ((e->ret ? 0 : MOD_Checksum(&e->model)) != sums[i]) {
+            Com_Printf("%s: checksum mismatch\n", e->model.name);
+            mismatches++;
+        }
+        MOD_ResetPrefetched(e);
+        FS_FreeFile(e->rawdata);
+    }
+
+    Com_Printf("%d models, %.1f MB, %d failed to parse\n",
+               num_tests, bytes / (1024.0 * 1024.0), errors);
+    Com_Printf("serial %u msec, %d threads %u msec, %d mismatches\n",
+               serial_msec, threads, msec, mismatches);
+    Com_Printf("%s\n", mismatches ? "FAILED" : "passed");
+
+    Z_Free(tests);
+    Z_Free(sums);
+}
+
 model_t *MOD_ForHandle(qhandle_t h)
 {
     model_t *model;
@@ -479,11 +810,16 @@ void MOD_Init(void)
     }
 
     Cmd_AddCommand("modellist", MOD_List_f);
+    Cmd_AddCommand("iqmposetest", IQM_PoseTest_f);
+    Cmd_AddCommand("modelloadtest", MOD_LoadTest_f);
 }
 
 void MOD_Shutdown(void)
 {
+    MOD_FlushPrefetched();
     MOD_FreeAll();
     Cmd_RemoveCommand("modellist");
+    Cmd_RemoveCommand("iqmposetest");
+    Cmd_RemoveCommand("modelloadtest");
 }
 
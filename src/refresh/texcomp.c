@@ -0,0 +1,544 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+//
+// texcomp.c -- BC1 and BC3 block compression
+//
+// Color endpoints are fit along the principal axis of the block colors and
+// then refined once by least squares over the chosen indices. Alpha uses
+// the 8 value mode of BC3 between the block minimum and maximum.
+//
+
+#include "shared/shared.h"
+#include "common/common.h"
+#include "common/jobs.h"
+#include "common/zone.h"
+#include "refresh/texcomp.h"
+
+static inline void write_short(byte *p, uint16_t v)
+{
+    p[0] = v & 255;
+    p[1] = v >> 8;
+}
+
+static inline void write_long(byte *p, uint32_t v)
+{
+    write_short(p, v & 0xffff);
+    write_short(p + 2, v >> 16);
+}
+
+size_t TC_LevelSize(tcformat_t format, int width, int height)
+{
+    size_t blocks = (size_t)((width + 3) >> 2) * ((height + 3) >> 2);
+
+    return blocks * (format == TC_BC1 ? 8 : 16);
+}
+
+/*
+=================================================================
+
+COLOR BLOCKS
+
+=================================================================
+*/
+
+static uint16_t pack_565(const vec3_t c)
+{
+    int r = (int)(c[0] * (31.0f / 255.0f) + 0.5f);
+    int g = (int)(c[1] * (63.0f / 255.0f) + 0.5f);
+    int b = (int)(c[2] * (31.0f / 255.0f) + 0.5f);
+
+    clamp(r, 0, 31);
+    clamp(g, 0, 63);
+    clamp(b, 0, 31);
+
+    return (r << 11) | (g << 5) | b;
+}
+
+static void unpack_565(uint16_t v, int c[3])
+{
+    int r = (v >> 11) & 31;
+    int g = (v >> 5) & 63;
+    int b = v & 31;
+
+    c[0] = (r << 3) | (r >> 2);
+    c[1] = (g << 2) | (g >> 4);
+    c[2] = (b << 3) | (b >> 2);
+}
+
+static void color_palette(uint16_t c0, uint16_t c1, qboolean four_color, int pal[4][3])
+{
+    int i;
+
+    unpack_565(c0, pal[0]);
+    unpack_565(c1, pal[1]);
+
+    for (i = 0; i < 3; i++) {
+        if (four_color) {
+            pal[2][i] = (2 * pal[0][i] + pal[1][i]) / 3;
+            pal[3][i] = (pal[0][i] + 2 * pal[1][i]) / 3;
+        } else {
+            pal[2][i] = (pal[0][i] + pal[1][i]) / 2;
+            pal[3][i] = 0;
+        }
+    }
+}
+
+// picks indices for the given endpoints, returns squared error
+static int write_color_block(uint16_t c0, uint16_t c1, const byte *block, byte *out)
+{
+    int pal[4][3], i, j, best, error = 0;
+    uint32_t indices = 0;
+
+    // always use 4 color mode, which BC3 requires anyway
+    if (c0 < c1) {
+        uint16_t t = c0;
+        c0 = c1;
+        c1 = t;
+    }
+
+    color_palette(c0, c1, qtrue, pal);
+
+    for (i = 0; i < 16 && c0 != c1; i++) {
+        const byte *p = block + i * 4;
+        int best_dist = INT_MAX;
+
+        for (j = 0, best = 0; j < 4; j++) {
+            int dr = p[0] - pal[j][0];
+            int dg = p[1] - pal[j][1];
+            int db = p[2] - pal[j][2];
+            int dist = dr * dr + dg * dg + db * db;
+            if (dist < best_dist) {
+                best_dist = dist;
+                best = j;
+            }
+        }
+
+        indices |= (uint32_t)best << (i * 2);
+        error += best_dist;
+    }
+
+    // equal endpoints: every texel uses index 0
+    if (c0 == c1) {
+        for (i = 0; i < 16; i++) {
+            const byte *p = block + i * 4;
+            error += (p[0] - pal[0][0]) * (p[0] - pal[0][0]) +
+                     (p[1] - pal[0][1]) * (p[1] - pal[0][1]) +
+                     (p[2] - pal[0][2]) * (p[2] - pal[0][2]);
+        }
+    }
+
+    write_short(out + 0, c0);
+    write_short(out + 2, c1);
+    write_long(out + 4, indices);
+
+    return error;
+}
+
+// least squares endpoints for the indices already in out
+static qboolean refit_endpoints(const byte *block, const byte *out, vec3_t a, vec3_t b)
+{
+    static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    uint32_t indices = (uint32_t)LittleLongMem(out + 4);
+    float aa = 0, ab = 0, bb = 0, det;
+    vec3_t xa = { 0 }, xb = { 0 };
+    int i, j;
+
+    for (i = 0; i < 16; i++) {
+        float w = weights[(indices >> (i * 2)) & 3];
+        const byte *p = block + i * 4;
+
+        aa += w * w;
+        ab += w * (1 - w);
+        bb += (1 - w) * (1 - w);
+        for (j = 0; j < 3; j++) {
+            xa[j] += w * p[j];
+            xb[j] += (1 - w) * p[j];
+        }
+    }
+
+    det = aa * bb - ab * ab;
+    if (fabsf(det) < 1e-6f)
+        return qfalse;
+
+    for (j = 0; j < 3; j++) {
+        a[j] = (bb * xa[j] - ab * xb[j]) / det;
+        b[j] = (aa * xb[j] - ab * xa[j]) / det;
+    }
+
+    return qtrue;
+}
+
+static void encode_color_block(const byte *block, byte *out)
+{
+    vec3_t mean = { 0 }, axis, lo, hi;
+    float cov[6] = { 0 }, t, tmin = 0, tmax = 0;
+    byte refined[8];
+    int i, it, error;
+
+    for (i = 0; i < 16; i++) {
+        mean[0] += block[i * 4 + 0];
+        mean[1] += block[i * 4 + 1];
+        mean[2] += block[i * 4 + 2];
+    }
+    VectorScale(mean, 1.0f / 16, mean);
+
+    for (i = 0; i < 16; i++) {
+        vec3_t d;
+        d[0] = block[i * 4 + 0] - mean[0];
+        d[1] = block[i * 4 + 1] - mean[1];
+        d[2] = block[i * 4 + 2] - mean[2];
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+
+    // principal axis by power iteration
+    VectorSet(axis, 1, 1, 1);
+    for (it = 0; it < 4; it++) {
+        vec3_t v;
+        v[0] = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+        v[1] = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+        v[2] = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+        if (VectorNormalize(v) < 1e-6f)
+            break;
+        VectorCopy(v, axis);
+    }
+    VectorNormalize(axis);
+
+    for (i = 0; i < 16; i++) {
+        vec3_t d;
+        d[0] = block[i * 4 + 0] - mean[0];
+        d[1] = block[i * 4 + 1] - mean[1];
+        d[2] = block[i * 4 + 2] - mean[2];
+        t = DotProduct(d, axis);
+        tmin = min(tmin, t);
+        tmax = max(tmax, t);
+    }
+
+    VectorMA(mean, tmax, axis, hi);
+    VectorMA(mean, tmin, axis, lo);
+    error = write_color_block(pack_565(hi), pack_565(lo), block, out);
+
+    if (error && refit_endpoints(block, out, hi, lo)) {
+        if (write_color_block(pack_565(hi), pack_565(lo), block, refined) < error)
+            memcpy(out, refined, sizeof(refined));
+    }
+}
+
+static void decode_color_block(const byte *in, qboolean bc1, byte *block)
+{
+    uint16_t c0 = LittleShortMem(in + 0);
+    uint16_t c1 = LittleShortMem(in + 2);
+    uint32_t indices = (uint32_t)LittleLongMem(in + 4);
+    qboolean four_color = !bc1 || c0 > c1;
+    int pal[4][3], i, j;
+
+    color_palette(c0, c1, four_color, pal);
+
+    for (i = 0; i < 16; i++) {
+        j = (indices >> (i * 2)) & 3;
+        block[i * 4 + 0] = pal[j][0];
+        block[i * 4 + 1] = pal[j][1];
+        block[i * 4 + 2] = pal[j][2];
+        block[i * 4 + 3] = (!four_color && j == 3) ? 0 : 255;
+    }
+}
+
+/*
+=================================================================
+
+ALPHA BLOCKS
+
+=================================================================
+*/
+
+static void alpha_palette(int a0, int a1, int pal[8])
+{
+    int i;
+
+    pal[0] = a0;
+    pal[1] = a1;
+    if (a0 > a1) {
+        for (i = 1; i < 7; i++)
+            pal[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+    } else {
+        for (i = 1; i < 5; i++)
+            pal[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+        pal[6] = 0;
+        pal[7] = 255;
+    }
+}
+
+static void encode_alpha_block(const byte *block, byte *out)
+{
+    int a0 = 0, a1 = 255, pal[8], i, j, best;
+    uint64_t indices = 0;
+
+    for (i = 0; i < 16; i++) {
+        a0 = max(a0, block[i * 4 + 3]);
+        a1 = min(a1, block[i * 4 + 3]);
+    }
+
+    if (a0 > a1) {
+        alpha_palette(a0, a1, pal);
+        for (i = 0; i < 16; i++) {
+            int a = block[i * 4 + 3];
+            int best_dist = INT_MAX;
+            for (j = 0, best = 0; j < 8; j++) {
+                if (abs(a - pal[j]) < best_dist) {
+                    best_dist = abs(a - pal[j]);
+                    best = j;
+                }
+            }
+            indices |= (uint64_t)best << (i * 3);
+        }
+    }
+
+    out[0] = a0;
+    out[1] = a1;
+    for (i = 0; i < 6; i++)
+        out[2 + i] = indices >> (i * 8);
+}
+
+static void decode_alpha_block(const byte *in, byte *block)
+{
+    uint64_t indices = 0;
+    int pal[8], i;
+
+    alpha_palette(in[0], in[1], pal);
+    for (i = 0; i < 6; i++)
+        indices |= (uint64_t)in[2 + i] << (i * 8);
+
+    for (i = 0; i < 16; i++)
+        block[i * 4 + 3] = pal[(indices >> (i * 3)) & 7];
+}
+
+/*
+=================================================================
+
+IMAGES
+
+=================================================================
+*/
+
+typedef struct {
+    tcformat_t  format;
+    const byte  *rgba;
+    int         width, height;
+    byte        *out;
+} tcjob_t;
+
+// copies a 4x4 block, repeating the last row and column at the edges
+static void fetch_block(const byte *rgba, int width, int height, int bx, int by, byte *block)
+{
+    int x, y, sx, sy;
+
+    for (y = 0; y < 4; y++) {
+        sy = min(by * 4 + y, height - 1);
+        for (x = 0; x < 4; x++) {
+            sx = min(bx * 4 + x, width - 1);
+            memcpy(block + (y * 4 + x) * 4, rgba + (sy * width + sx) * 4, 4);
+        }
+    }
+}
+
+static void encode_block_row(void *arg, int by)
+{
+    const tcjob_t *job = arg;
+    int bx, blocks_x = (job->width + 3) >> 2;
+    int block_size = job->format == TC_BC1 ? 8 : 16;
+    byte block[64], *out;
+
+    out = job->out + by * blocks_x * block_size;
+    for (bx = 0; bx < blocks_x; bx++, out += block_size) {
+        fetch_block(job->rgba, job->width, job->height, bx, by, block);
+        if (job->format == TC_BC1) {
+            encode_color_block(block, out);
+        } else {
+            encode_alpha_block(block, out);
+            encode_color_block(block, out + 8);
+        }
+    }
+}
+
+void TC_Encode(tcformat_t format, const byte *rgba, int width, int height, byte *out)
+{
+    tcjob_t job = { format, rgba, width, height, out };
+
+    Job_ParallelFor(encode_block_row, &job, (height + 3) >> 2);
+}
+
+void TC_Decode(tcformat_t format, const byte *in, int width, int height, byte *rgba)
+{
+    int bx, by, x, y, w, h;
+    byte block[64];
+
+    for (by = 0; by < height; by += 4) {
+        for (bx = 0; bx < width; bx += 4) {
+            if (format == TC_BC1) {
+                decode_color_block(in, qtrue, block);
+                in += 8;
+            } else {
+                decode_color_block(in + 8, qfalse, block);
+                decode_alpha_block(in, block);
+                in += 16;
+            }
+
+            w = min(4, width - bx);
+            h = min(4, height - by);
+            for (y = 0; y < h; y++)
+                for (x = 0; x < w; x++)
+                    memcpy(rgba + ((by + y) * width + bx + x) * 4, block + (y * 4 + x) * 4, 4);
+        }
+    }
+}
+
+/*
+=================================================================
+
+MIP CHAINS
+
+=================================================================
+*/
+
+static float srgb_to_linear[256];
+
+static void init_srgb_table(void)
+{
+    int i;
+
+    if (srgb_to_linear[255])
+        return;
+
+    for (i = 0; i < 256; i++) {
+        float x = i / 255.0f;
+        srgb_to_linear[i] = x < 0.04045f ? x / 12.92f : powf((x + 0.055f) / 1.055f, 2.4f);
+    }
+}
+
+static byte linear_to_srgb(float x)
+{
+    if (x <= 0.0031308f)
+        x *= 12.92f;
+    else
+        x = 1.055f * powf(x, 1.0f / 2.4f) - 0.055f;
+
+    clamp(x, 0, 1);
+    return (byte)(x * 255.0f + 0.5f);
+}
+
+// 2x2 box filter, odd sizes repeat the last row or column
+static void downsample(const byte *in, int width, int height, byte *out, qboolean srgb)
+{
+    int out_w = max(1, width >> 1);
+    int out_h = max(1, height >> 1);
+    int x, y, c;
+
+    for (y = 0; y < out_h; y++) {
+        const byte *row0 = in + (y * 2) * width * 4;
+        const byte *row1 = in + min(y * 2 + 1, height - 1) * width * 4;
+
+        for (x = 0; x < out_w; x++, out += 4) {
+            int x0 = x * 2 * 4;
+            int x1 = min(x * 2 + 1, width - 1) * 4;
+
+            for (c = 0; c < 4; c++) {
+                if (srgb && c < 3) {
+                    float sum = srgb_to_linear[row0[x0 + c]] + srgb_to_linear[row0[x1 + c]] +
+                                srgb_to_linear[row1[x0 + c]] + srgb_to_linear[row1[x1 + c]];
+                    out[c] = linear_to_srgb(sum * 0.25f);
+                } else {
+                    out[c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) >> 2;
+                }
+            }
+        }
+    }
+}
+
+static byte *encode_chain(tcformat_t format, const byte *rgba, const byte *blocks, int num_blocks,
+                          int width, int height, qboolean srgb, int *num_levels, size_t *size)
+{
+    byte *chain, *out, *level, *owned;
+    const byte *cur;
+    int i, w, h, levels;
+    size_t total, level_size;
+
+    if (srgb)
+        init_srgb_table();
+
+    levels = 1;
+    total = TC_LevelSize(format, width, height);
+    for (w = width, h = height; w > 1 || h > 1; levels++) {
+        w = max(1, w >> 1);
+        h = max(1, h >> 1);
+        total += TC_LevelSize(format, w, h);
+    }
+
+    num_blocks = min(num_blocks, levels);
+    chain = out = Z_Malloc(total);
+    cur = rgba;
+    owned = NULL;
+
+    for (i = 0, w = width, h = height; i < levels; i++) {
+        level_size = TC_LevelSize(format, w, h);
+        if (i < num_blocks) {
+            memcpy(out, blocks, level_size);
+            blocks += level_size;
+
+            // the rest of the chain is filtered from the last given level
+            if (i == num_blocks - 1 && i + 1 < levels) {
+                cur = owned = Z_Malloc(w * h * 4);
+                TC_Decode(format, out, w, h, owned);
+            }
+        } else {
+            TC_Encode(format, cur, w, h, out);
+        }
+        out += level_size;
+
+        if (i + 1 < levels && i + 1 >= num_blocks) {
+            level = Z_Malloc(max(1, w >> 1) * max(1, h >> 1) * 4);
+            downsample(cur, w, h, level, srgb);
+            Z_Free(owned);
+            cur = owned = level;
+        }
+
+        w = max(1, w >> 1);
+        h = max(1, h >> 1);
+    }
+    Z_Free(owned);
+
+    *num_levels = levels;
+    *size = total;
+    return chain;
+}
+
+byte *TC_EncodeMipChain(tcformat_t format, const byte *rgba, int width, int height,
+                        qboolean srgb, int *num_levels, size_t *size)
+{
+    return encode_chain(format, rgba, NULL, 0, width, height, srgb, num_levels, size);
+}
+
+byte *TC_CompleteMipChain(tcformat_t format, const byte *blocks, int num_blocks,
+                          int width, int height, qboolean srgb, int *num_levels, size_t *size)
+{
+    return encode_chain(format, NULL, blocks, num_blocks, width, height, srgb, num_levels, size);
+}
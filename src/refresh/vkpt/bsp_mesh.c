@@ -20,6 +20,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "vkpt.h"
 #include "shader/global_textures.h"
 #include "material.h"
+#include "common/jobs.h"
+#include "system/system.h"
 
 #include <assert.h>
 #include <float.h>
@@ -31,6 +33,8 @@ extern cvar_t *cvar_pt_enable_nodraw;
 extern cvar_t *cvar_pt_enable_surface_lights;
 extern cvar_t *cvar_pt_enable_surface_lights_warp;
 extern cvar_t *cvar_pt_bsp_radiance_scale;
+extern cvar_t *cvar_pt_world_cache;
+extern cvar_t *cvar_pt_cluster_light_cutoff;
 
 static void
 remove_collinear_edges(float* positions, float* tex_coords, int* num_vertices)
@@ -483,51 +487,84 @@ static void build_pvs2(bsp_t* bsp)
 
 }
 
-static void
-collect_surfaces(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, int model_idx, int (*filter)(int))
+// Returns the material flags the surface is drawn with, or qfalse if it is not drawn at all.
+static qboolean
+get_surf_material_id(const mface_t *surf, uint32_t *material_id_out)
+{
+	uint32_t material_id = surf->texinfo->material ? surf->texinfo->material->flags : 0;
+	uint32_t surf_flags = surf->drawflags | surf->texinfo->c.flags;
+
+	// ugly hacks for situations when the same texture is used with different effects
+
+	if ((MAT_IsKind(material_id, MATERIAL_KIND_WATER) || MAT_IsKind(material_id, MATERIAL_KIND_SLIME)) && !(surf_flags & SURF_WARP))
+		material_id = MAT_SetKind(material_id, MATERIAL_KIND_REGULAR);
+
+	if (MAT_IsKind(material_id, MATERIAL_KIND_GLASS) && !(surf_flags & SURF_TRANS_MASK))
+		material_id = MAT_SetKind(material_id, MATERIAL_KIND_REGULAR);
+
+	if ((surf_flags & SURF_NODRAW) && cvar_pt_enable_nodraw->integer)
+		return qfalse;
+
+	// custom transparent surfaces
+	if (surf_flags & SURF_SKY)
+		material_id = MAT_SetKind(material_id, MATERIAL_KIND_SKY);
+
+	if (MAT_IsKind(material_id, MATERIAL_KIND_REGULAR) && (surf_flags & SURF_TRANS_MASK) && !(material_id & MATERIAL_FLAG_LIGHT))
+		material_id = MAT_SetKind(material_id, MATERIAL_KIND_TRANSPARENT);
+
+	if (MAT_IsKind(material_id, MATERIAL_KIND_SCREEN) && (surf_flags & SURF_TRANS_MASK))
+		material_id = MAT_SetKind(material_id, MATERIAL_KIND_GLASS);
+
+	if (surf_flags & SURF_WARP)
+		material_id |= MATERIAL_FLAG_WARP;
+
+	if (surf_flags & SURF_FLOWING)
+		material_id |= MATERIAL_FLAG_FLOWING;
+
+	*material_id_out = material_id;
+	return qtrue;
+}
+
+// Number of vertices collect_surfaces will emit for the same arguments
+static int
+count_surfaces(bsp_t *bsp, int model_idx, int (*filter)(int))
 {
 	mface_t *surfaces = model_idx < 0 ? bsp->faces : bsp->models[model_idx].firstface;
 	int num_faces = model_idx < 0 ? bsp->numfaces : bsp->models[model_idx].numfaces;
-	qboolean any_pvs_patches = qfalse;
+	int count = 0;
 
 	for (int i = 0; i < num_faces; i++) {
 		mface_t *surf = surfaces + i;
+		uint32_t material_id;
 
-		if (model_idx < 0 && belongs_to_model(bsp, surf)) {
+		if (model_idx < 0 && belongs_to_model(bsp, surf))
 			continue;
-		}
-
-		uint32_t material_id = surf->texinfo->material ? surf->texinfo->material->flags : 0;
-		uint32_t surf_flags = surf->drawflags | surf->texinfo->c.flags;
-
-		// ugly hacks for situations when the same texture is used with different effects
 
-		if ((MAT_IsKind(material_id, MATERIAL_KIND_WATER) || MAT_IsKind(material_id, MATERIAL_KIND_SLIME)) && !(surf_flags & SURF_WARP))
-			material_id = MAT_SetKind(material_id, MATERIAL_KIND_REGULAR);
-
-		if (MAT_IsKind(material_id, MATERIAL_KIND_GLASS) && !(surf_flags & SURF_TRANS_MASK))
-			material_id = MAT_SetKind(material_id, MATERIAL_KIND_REGULAR);
-
-		if ((surf_flags & SURF_NODRAW) && cvar_pt_enable_nodraw->integer)
+		if (!get_surf_material_id(surf, &material_id) || !filter(material_id))
 			continue;
 
-		// custom transparent surfaces
-		if (surf_flags & SURF_SKY)
-			material_id = MAT_SetKind(material_id, MATERIAL_KIND_SKY);
+		count += create_poly(surf, material_id, NULL, NULL, NULL, NULL);
+	}
 
-		if (MAT_IsKind(material_id, MATERIAL_KIND_REGULAR) && (surf_flags & SURF_TRANS_MASK) && !(material_id & MATERIAL_FLAG_LIGHT))
-			material_id = MAT_SetKind(material_id, MATERIAL_KIND_TRANSPARENT);
+	return count;
+}
 
-		if (MAT_IsKind(material_id, MATERIAL_KIND_SCREEN) && (surf_flags & SURF_TRANS_MASK))
-			material_id = MAT_SetKind(material_id, MATERIAL_KIND_GLASS);
+static void
+collect_surfaces(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, int model_idx, int (*filter)(int))
+{
+	mface_t *surfaces = model_idx < 0 ? bsp->faces : bsp->models[model_idx].firstface;
+	int num_faces = model_idx < 0 ? bsp->numfaces : bsp->models[model_idx].numfaces;
+	qboolean any_pvs_patches = qfalse;
 
-		if (surf_flags & SURF_WARP)
-			material_id |= MATERIAL_FLAG_WARP;
+	for (int i = 0; i < num_faces; i++) {
+		mface_t *surf = surfaces + i;
+		uint32_t material_id;
 
-		if (surf_flags & SURF_FLOWING)
-			material_id |= MATERIAL_FLAG_FLOWING;
+		if (model_idx < 0 && belongs_to_model(bsp, surf)) {
+			continue;
+		}
 
-		if (!filter(material_id))
+		if (!get_surf_material_id(surf, &material_id) || !filter(material_id))
 			continue;
 
 		if ((material_id & MATERIAL_FLAG_LIGHT) && surf->texinfo->material->light_styles)
@@ -543,10 +580,6 @@ collect_surfaces(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, int model_idx, int (*
 			material_id = (material_id & ~MATERIAL_LIGHT_STYLE_MASK) | ((camera_id << MATERIAL_LIGHT_STYLE_SHIFT) & MATERIAL_LIGHT_STYLE_MASK);
 		}
 
-		if (*idx_ctr + create_poly(surf, material_id, NULL, NULL, NULL, NULL) >= MAX_VERT_BSP) {
-			Com_Error(ERR_FATAL, "error: exceeding max vertex limit\n");
-		}
-
 		int cnt = create_poly(surf, material_id,
 			&wm->positions[*idx_ctr * 3],
 			&wm->tex_coords[*idx_ctr * 2],
@@ -608,6 +641,7 @@ collect_surfaces(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, int model_idx, int (*
 		}
 
 		*idx_ctr += cnt;
+		assert(*idx_ctr <= wm->num_vertices);
 	}
 
 	if (any_pvs_patches)
@@ -1264,8 +1298,8 @@ compute_world_tangents(bsp_mesh_t* wm)
 
 	// tangent space is co-planar to triangle : only need to compute
 	// 1 vertex because all 3 verts share the same tangent space
-	wm->tangents = Z_Malloc(MAX_VERT_BSP * sizeof(uint32_t) / 3);
-	wm->texel_density = Z_Malloc(MAX_VERT_BSP * sizeof(float) / 3);
+	wm->tangents = Z_Malloc(ntriangles * sizeof(uint32_t));
+	wm->texel_density = Z_Malloc(ntriangles * sizeof(float));
 
 	for (int idx_tri = 0; idx_tri < ntriangles; ++idx_tri)
 	{
@@ -1557,7 +1591,7 @@ get_aabb_corner(aabb_t* aabb, int corner_idx, vec3_t corner)
 }
 
 static qboolean
-light_affects_cluster(light_poly_t* light, aabb_t* aabb)
+light_affects_cluster_reference(light_poly_t* light, aabb_t* aabb)
 {
 	// Empty cluster, nothing is visible
 	if (aabb->mins[0] > aabb->maxs[0])
@@ -1597,10 +1631,12 @@ light_affects_cluster(light_poly_t* light, aabb_t* aabb)
 	return qtrue;
 }
 
+#define MAX_LIGHTS_PER_CLUSTER  1024
+
+// Original serial version, kept as a reference for pt_cluster_lights_bench.
 static void
-collect_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp)
+collect_cluster_lights_reference(bsp_mesh_t *wm, bsp_t *bsp)
 {
-#define MAX_LIGHTS_PER_CLUSTER 1024
 	int* cluster_lights = Z_Malloc(MAX_LIGHTS_PER_CLUSTER * wm->num_clusters * sizeof(int));
 	int* cluster_light_counts = Z_Mallocz(wm->num_clusters * sizeof(int));
 
@@ -1618,7 +1654,7 @@ collect_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp)
 
 		FOREACH_BIT_BEGIN(pvs, bsp->visrowsize, other_cluster)
 			aabb_t* cluster_aabb = wm->cluster_aabbs + other_cluster;
-			if (light_affects_cluster(light, cluster_aabb))
+			if (light_affects_cluster_reference(light, cluster_aabb))
 			{
 				int* num_cluster_lights = cluster_light_counts + other_cluster;
 				if (*num_cluster_lights < MAX_LIGHTS_PER_CLUSTER)
@@ -1661,11 +1697,256 @@ collect_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp)
 
 	Z_Free(cluster_lights);
 	Z_Free(cluster_light_counts);
-#undef MAX_LIGHTS_PER_CLUSTER
 }
 
+// light polygon data needed for culling against cluster bounds
+typedef struct {
+	vec3_t normal;
+	float plane_distance;
+	vec3_t center;
+	float radius;
+	float area;
+} light_bounds_t;
+
+static void
+get_light_bounds(const light_poly_t* light, light_bounds_t* bounds)
+{
+	const float* v0 = light->positions + 0;
+	const float* v1 = light->positions + 3;
+	const float* v2 = light->positions + 6;
+
+	vec3_t e1, e2;
+	VectorSubtract(v1, v0, e1);
+	VectorSubtract(v2, v0, e2);
+	CrossProduct(e1, e2, bounds->normal);
+	bounds->area = VectorNormalize(bounds->normal) * 0.5f;
+	bounds->plane_distance = -DotProduct(bounds->normal, v0);
+
+	VectorAdd(v0, v1, bounds->center);
+	VectorAdd(bounds->center, v2, bounds->center);
+	VectorScale(bounds->center, 1.f / 3.f, bounds->center);
+
+	bounds->radius = 0.f;
+	for (int i = 0; i < 3; i++)
+		bounds->radius = max(bounds->radius, Distance(bounds->center, light->positions + i * 3));
+}
+
+// Culls clusters entirely behind the light plane, which is the emission
+// cone of a one sided polygon, and clusters where the light covers a solid
+// angle below cutoff. Sky polygons are portals and skip the distance test.
 static qboolean
-bsp_mesh_load_custom_sky(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
+light_affects_cluster(const light_bounds_t* bounds, const aabb_t* aabb, qboolean sky, float cutoff)
+{
+	// Empty cluster, nothing is visible
+	if (aabb->mins[0] > aabb->maxs[0])
+		return qfalse;
+
+	// The AABB corner furthest in front of the plane
+	vec3_t corner;
+	for (int i = 0; i < 3; i++)
+		corner[i] = bounds->normal[i] > 0.f ? aabb->maxs[i] : aabb->mins[i];
+
+	if (DotProduct(bounds->normal, corner) + bounds->plane_distance <= 0.f)
+		return qfalse;
+
+	if (cutoff <= 0.f || sky)
+		return qtrue;
+
+	float dist_sq = 0.f;
+	for (int i = 0; i < 3; i++)
+	{
+		float d = max(aabb->mins[i] - bounds->center[i], bounds->center[i] - aabb->maxs[i]);
+		if (d > 0.f)
+			dist_sq += d * d;
+	}
+
+	float dist = sqrtf(dist_sq) - bounds->radius;
+	if (dist <= 0.f)
+		return qtrue;
+
+	return bounds->area >= cutoff * dist * dist;
+}
+
+#define LIGHTS_PER_JOB          64
+
+typedef struct {
+	bsp_mesh_t *wm;
+	bsp_t *bsp;
+	float cutoff;
+	qboolean fill;
+	int *counts;        // per job and cluster, lights left to write when filling
+	int *starts;        // per job and cluster, next slot in wm->cluster_lights
+} clusterlightjob_t;
+
+// Counts the lights of the chunk affecting each cluster, or writes them
+// out in the second pass. Each job only touches its own row of counts.
+static void
+collect_cluster_lights_job(void *arg, int index)
+{
+	clusterlightjob_t *job = arg;
+	bsp_mesh_t *wm = job->wm;
+	bsp_t *bsp = job->bsp;
+	int first = index * LIGHTS_PER_JOB;
+	int last = min(first + LIGHTS_PER_JOB, wm->num_light_polys);
+	int *counts = job->counts + index * wm->num_clusters;
+	int *starts = job->starts + index * wm->num_clusters;
+
+	for (int nlight = first; nlight < last; nlight++)
+	{
+		light_poly_t* light = wm->light_polys + nlight;
+
+		if (light->cluster < 0)
+			continue;
+
+		light_bounds_t bounds;
+		get_light_bounds(light, &bounds);
+		qboolean sky = light->color[0] < 0.f;
+
+		const byte* pvs = (const byte*)BSP_GetPvs(bsp, light->cluster);
+
+		FOREACH_BIT_BEGIN(pvs, bsp->visrowsize, other_cluster)
+			if (other_cluster < wm->num_clusters &&
+				light_affects_cluster(&bounds, wm->cluster_aabbs + other_cluster, sky, job->cutoff))
+			{
+				if (!job->fill)
+				{
+					counts[other_cluster]++;
+				}
+				else if (counts[other_cluster] > 0)
+				{
+					wm->cluster_lights[starts[other_cluster]++] = nlight;
+					counts[other_cluster]--;
+				}
+			}
+		FOREACH_BIT_END
+	}
+}
+
+// Builds the list of lights affecting each cluster. The lights are split
+// into fixed chunks that are tested in parallel twice: once to count the
+// lights of every chunk and cluster, and once more to write them to the
+// slots given by a prefix sum over those counts. Chunks are laid out in
+// order within each cluster, so every list is sorted by light index no
+// matter how many threads ran. Returns the number of clusters that had
+// more than MAX_LIGHTS_PER_CLUSTER lights and were truncated.
+static int
+collect_cluster_lights(bsp_mesh_t *wm, bsp_t *bsp, float cutoff, int threads)
+{
+	clusterlightjob_t job;
+	int num_jobs = (wm->num_light_polys + LIGHTS_PER_JOB - 1) / LIGHTS_PER_JOB;
+	int num_clusters = wm->num_clusters;
+	int num_truncated = 0;
+	size_t table_size = max((size_t)num_jobs * num_clusters, 1) * sizeof(int);
+
+	job.wm = wm;
+	job.bsp = bsp;
+	job.cutoff = cutoff;
+	job.fill = qfalse;
+	job.counts = Z_Mallocz(table_size);
+	job.starts = Z_Malloc(table_size);
+
+	Job_ParallelForEx(collect_cluster_lights_job, &job, num_jobs, threads);
+
+	// prefix sum in cluster, then chunk order, keeping the first lights of
+	// clusters over the limit
+	int *offsets = Z_Malloc((num_clusters + 1) * sizeof(int));
+	int offset = 0;
+
+	for (int cluster = 0; cluster < num_clusters; cluster++)
+	{
+		int count = 0;
+		qboolean truncated = qfalse;
+
+		offsets[cluster] = offset;
+		for (int j = 0; j < num_jobs; j++)
+		{
+			int *c = job.counts + j * num_clusters + cluster;
+
+			job.starts[j * num_clusters + cluster] = offset + count;
+			if (*c > MAX_LIGHTS_PER_CLUSTER - count)
+			{
+				*c = MAX_LIGHTS_PER_CLUSTER - count;
+				truncated = qtrue;
+			}
+			count += *c;
+		}
+
+		num_truncated += truncated;
+		offset += count;
+	}
+	offsets[num_clusters] = offset;
+
+	wm->num_cluster_lights = offset;
+	wm->cluster_lights = Z_Mallocz(offset * sizeof(int));
+	wm->cluster_light_offsets = offsets;
+
+	job.fill = qtrue;
+	Job_ParallelForEx(collect_cluster_lights_job, &job, num_jobs, threads);
+
+	Z_Free(job.counts);
+	Z_Free(job.starts);
+
+	return num_truncated;
+}
+
+static int
+material_key_cmp(const void *a, const void *b)
+{
+	uint32_t ka = *(const uint32_t *)a;
+	uint32_t kb = *(const uint32_t *)b;
+	return ka < kb ? -1 : ka > kb;
+}
+
+// Builds the list of distinct materials used by the triangles of each
+// cluster. Triangles outside of any cluster (inline models) go into an
+// extra list at index num_clusters.
+static void
+collect_cluster_materials(bsp_mesh_t *wm)
+{
+	int num_tris = wm->num_indices / 3;
+	uint32_t *keys = Z_Malloc(max(num_tris, 1) * sizeof(uint32_t));
+
+	for (int tri = 0; tri < num_tris; tri++)
+	{
+		int cluster = wm->clusters[tri];
+		if (cluster < 0 || cluster >= wm->num_clusters)
+			cluster = wm->num_clusters;
+
+		keys[tri] = ((uint32_t)cluster << 12) | (wm->materials[tri] & MATERIAL_INDEX_MASK);
+	}
+
+	qsort(keys, num_tris, sizeof(uint32_t), material_key_cmp);
+
+	wm->cluster_materials = Z_Malloc(max(num_tris, 1) * sizeof(uint16_t));
+	wm->cluster_material_offsets = Z_Mallocz((wm->num_clusters + 2) * sizeof(int));
+
+	int count = 0;
+	for (int i = 0; i < num_tris; i++)
+	{
+		if (i > 0 && keys[i] == keys[i - 1])
+			continue;
+
+		wm->cluster_materials[count++] = keys[i] & MATERIAL_INDEX_MASK;
+		wm->cluster_material_offsets[(keys[i] >> 12) + 1] = count;
+	}
+
+	// clusters without triangles start where the previous one ended
+	for (int cluster = 1; cluster <= wm->num_clusters + 1; cluster++)
+		wm->cluster_material_offsets[cluster] = max(wm->cluster_material_offsets[cluster], wm->cluster_material_offsets[cluster - 1]);
+
+	Z_Free(keys);
+}
+
+typedef struct {
+	tinyobj_attrib_t attrib;
+	tinyobj_shape_t* shapes;
+	size_t num_shapes;
+	tinyobj_material_t* materials;
+	size_t num_materials;
+} custom_sky_t;
+
+static qboolean
+bsp_mesh_load_custom_sky(custom_sky_t *sky, const char* map_name)
 {
 	char filename[MAX_QPATH];
 	Q_snprintf(filename, sizeof(filename), "maps/sky/%s.obj", map_name);
@@ -1675,15 +1956,12 @@ bsp_mesh_load_custom_sky(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, const char* m
 	if (!file_buffer)
 		return qfalse;
 
-	tinyobj_attrib_t attrib;
-	tinyobj_shape_t* shapes = NULL;
-	size_t num_shapes;
-	tinyobj_material_t* materials = NULL;
-	size_t num_materials;
+	sky->shapes = NULL;
+	sky->materials = NULL;
 
 	unsigned int flags = TINYOBJ_FLAG_TRIANGULATE;
-	int ret = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials,
-		&num_materials, (const char*)file_buffer, file_size, flags);
+	int ret = tinyobj_parse_obj(&sky->attrib, &sky->shapes, &sky->num_shapes, &sky->materials,
+		&sky->num_materials, (const char*)file_buffer, file_size, flags);
 
 	FS_FreeFile(file_buffer);
 
@@ -1692,18 +1970,34 @@ bsp_mesh_load_custom_sky(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, const char* m
 		return qfalse;
 	}
 
+	return qtrue;
+}
+
+static void
+bsp_mesh_free_custom_sky(custom_sky_t *sky)
+{
+	tinyobj_attrib_free(&sky->attrib);
+	tinyobj_shapes_free(sky->shapes, sky->num_shapes);
+	tinyobj_materials_free(sky->materials, sky->num_materials);
+}
+
+static void
+bsp_mesh_add_custom_sky(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, const custom_sky_t *sky)
+{
+	const tinyobj_attrib_t *attrib = &sky->attrib;
+
 	int face_offset = 0;
-	for (int nprim = 0; nprim < attrib.num_face_num_verts; nprim++)
+	for (int nprim = 0; nprim < attrib->num_face_num_verts; nprim++)
 	{
-		int face_num_verts = attrib.face_num_verts[nprim];
-		int i0 = attrib.faces[face_offset + 0].v_idx;
-		int i1 = attrib.faces[face_offset + 1].v_idx;
-		int i2 = attrib.faces[face_offset + 2].v_idx;
+		int face_num_verts = attrib->face_num_verts[nprim];
+		int i0 = attrib->faces[face_offset + 0].v_idx;
+		int i1 = attrib->faces[face_offset + 1].v_idx;
+		int i2 = attrib->faces[face_offset + 2].v_idx;
 
 		vec3_t v0, v1, v2;
-		VectorCopy(attrib.vertices + i0 * 3, v0);
-		VectorCopy(attrib.vertices + i1 * 3, v1);
-		VectorCopy(attrib.vertices + i2 * 3, v2);
+		VectorCopy(attrib->vertices + i0 * 3, v0);
+		VectorCopy(attrib->vertices + i1 * 3, v1);
+		VectorCopy(attrib->vertices + i2 * 3, v2);
 
 		int wm_index = *idx_ctr;
 		int wm_prim = wm_index / 3;
@@ -1741,48 +2035,45 @@ bsp_mesh_load_custom_sky(int *idx_ctr, bsp_mesh_t *wm, bsp_t *bsp, const char* m
 
 		face_offset += face_num_verts;
 	}
-
-	tinyobj_attrib_free(&attrib);
-	tinyobj_shapes_free(shapes, num_shapes);
-	tinyobj_materials_free(materials, num_materials);
-
-	return qtrue;
 }
 
-void
-bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
+// Builds everything from the BSP and the registered materials. Only needs
+// the CPU side of the renderer, sky clusters and cameras are loaded already.
+static void
+build_world_mesh(bsp_mesh_t *wm, bsp_t *bsp, const char* full_game_map_name)
 {
-	const char* full_game_map_name = map_name;
-	if (strcmp(map_name, "demo1") == 0)
-		full_game_map_name = "base1";
-	else if (strcmp(map_name, "demo2") == 0)
-		full_game_map_name = "base2";
-	else if (strcmp(map_name, "demo3") == 0)
-		full_game_map_name = "base3";
-
-	load_sky_and_lava_clusters(wm, full_game_map_name);
-	load_cameras(wm, full_game_map_name);
-
 	wm->models = Z_Malloc(bsp->nummodels * sizeof(bsp_model_t));
 	memset(wm->models, 0, bsp->nummodels * sizeof(bsp_model_t));
 
-    wm->num_models = bsp->nummodels;
-	wm->num_clusters = bsp->vis->numclusters;
+	custom_sky_t custom_sky;
+	qboolean have_custom_sky = bsp_mesh_load_custom_sky(&custom_sky, full_game_map_name);
 
-	if (wm->num_clusters + 1 >= MAX_LIGHT_LISTS)
-	{
-		Com_Error(ERR_FATAL, "The BSP model has too many clusters (%d)", wm->num_clusters);
+	// count first so that the vertex arrays can be allocated at their exact size,
+	// the passes below must select the same surfaces as the ones filling them
+	int num_vertices = count_surfaces(bsp, -1, filter_static_opaque)
+		+ count_surfaces(bsp, -1, filter_static_transparent)
+		+ count_surfaces(bsp, -1, filter_static_masked)
+		+ count_surfaces(bsp, -1, filter_static_sky);
+
+	if (have_custom_sky)
+		num_vertices += custom_sky.attrib.num_face_num_verts * 3;
+
+	for (int k = 0; k < bsp->nummodels; k++)
+		num_vertices += count_surfaces(bsp, k, filter_all);
+
+	if (num_vertices >= MAX_VERT_BSP) {
+		Com_Error(ERR_FATAL, "The BSP model has too many vertices (%d)", num_vertices);
 	}
 
-    wm->num_vertices = 0;
-    wm->num_indices = 0;
-    wm->positions = Z_Malloc(MAX_VERT_BSP * 3 * sizeof(*wm->positions));
-    wm->tex_coords = Z_Malloc(MAX_VERT_BSP * 2 * sizeof(*wm->tex_coords));
-    wm->materials = Z_Malloc(MAX_VERT_BSP / 3 * sizeof(*wm->materials));
-    wm->clusters = Z_Malloc(MAX_VERT_BSP / 3 * sizeof(*wm->clusters));
-	wm->emissive_factors = Z_Malloc(MAX_VERT_BSP / 3 * sizeof(*wm->emissive_factors));
+	wm->num_vertices = num_vertices;
+	wm->num_indices = 0;
+	wm->positions = Z_Malloc(num_vertices * 3 * sizeof(*wm->positions));
+	wm->tex_coords = Z_Malloc(num_vertices * 2 * sizeof(*wm->tex_coords));
+	wm->materials = Z_Malloc(num_vertices / 3 * sizeof(*wm->materials));
+	wm->clusters = Z_Malloc(num_vertices / 3 * sizeof(*wm->clusters));
+	wm->emissive_factors = Z_Malloc(num_vertices / 3 * sizeof(*wm->emissive_factors));
 
-	// clear these here because `bsp_mesh_load_custom_sky` creates lights before `collect_light_polys`
+	// clear these here because `bsp_mesh_add_custom_sky` creates lights before `collect_light_polys`
 	wm->num_light_polys = 0;
 	wm->allocated_light_polys = 0;
 	wm->light_polys = NULL;
@@ -1814,7 +2105,11 @@ bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
 	wm->world_sky_count = idx_ctr - wm->world_sky_offset;
 
 	wm->world_custom_sky_offset = idx_ctr;
-	bsp_mesh_load_custom_sky(&idx_ctr, wm, bsp, full_game_map_name);
+	if (have_custom_sky)
+	{
+		bsp_mesh_add_custom_sky(&idx_ctr, wm, bsp, &custom_sky);
+		bsp_mesh_free_custom_sky(&custom_sky);
+	}
 	wm->world_custom_sky_count = idx_ctr - wm->world_custom_sky_offset;
 
     for (int k = 0; k < bsp->nummodels; k++) {
@@ -1839,6 +2134,8 @@ bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
 		}
 	}
 
+	assert(idx_ctr == wm->num_vertices);
+
     wm->num_indices = idx_ctr;
     wm->num_vertices = idx_ctr;
 
@@ -1847,10 +2144,6 @@ bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
         wm->indices[i] = i;
 
 	compute_world_tangents(wm);
-	
-    if (wm->num_vertices >= MAX_VERT_BSP) {
-		Com_Error(ERR_FATAL, "The BSP model has too many vertices (%d)", wm->num_vertices);
-	}
 
 	for(int i = 0; i < wm->num_models; i++) 
 	{
@@ -1887,11 +2180,721 @@ bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
 		model->masked = is_model_masked(wm, model);
 	}
 
-	collect_cluster_lights(wm, bsp);
+	int num_truncated = collect_cluster_lights(wm, bsp, cvar_pt_cluster_light_cutoff->value, Job_NumWorkers() + 1);
+	if (num_truncated)
+		Com_WPrintf("%d clusters have more than %d lights, the rest are ignored\n", num_truncated, MAX_LIGHTS_PER_CLUSTER);
+	collect_cluster_materials(wm);
 
 	compute_sky_visibility(wm, bsp);
 }
 
+/*
+================
+WORLD MESH CACHE
+
+The finished world mesh, light polygons and cluster lists are stored in
+the write directory as meshcache/<map>.bin. Entries are keyed by the BSP
+checksum and a hash of everything else the builder reads: the materials
+and emissive images of all texinfos, the light cvars, and the sky
+cluster, camera and custom sky files. A hit is a single file read.
+
+Material indices depend on registration order, so the file refers to
+materials by their position in a table built from the texinfo list.
+================
+*/
+
+#define MESHCACHE_IDENT         (('C'<<24)+('M'<<16)+('W'<<8)+'Q')
+#define MESHCACHE_VERSION       2
+
+#define MESHCACHE_NO_MATERIAL   0xffffffff
+
+typedef struct {
+	uint32_t ident;
+	uint32_t version;
+	uint32_t checksum;
+	uint32_t num_materials;
+	uint64_t settings;
+	uint32_t num_vertices;
+	uint32_t num_models;
+	uint32_t num_clusters;
+	uint32_t num_light_polys;           // world lights, model lights follow
+	uint32_t num_model_light_polys;
+	uint32_t num_cluster_lights;
+	uint32_t num_cluster_materials;
+	uint32_t world_idx_count;
+	uint32_t world_transparent_offset;
+	uint32_t world_transparent_count;
+	uint32_t world_masked_offset;
+	uint32_t world_masked_count;
+	uint32_t world_sky_offset;
+	uint32_t world_sky_count;
+	uint32_t world_custom_sky_offset;
+	uint32_t world_custom_sky_count;
+	aabb_t   world_aabb;
+} meshcache_header_t;
+
+typedef struct {
+	uint32_t idx_offset;
+	uint32_t idx_count;
+	vec3_t   center;
+	vec3_t   aabb_min;
+	vec3_t   aabb_max;
+	uint32_t num_light_polys;
+	uint32_t transparent;
+	uint32_t masked;
+} meshcache_model_t;
+
+typedef struct {
+	float    positions[9];
+	vec3_t   off_center;
+	vec3_t   color;
+	uint32_t material;                  // local index or MESHCACHE_NO_MATERIAL
+	int32_t  cluster;
+	int32_t  style;
+	float    emissive_factor;
+} meshcache_light_t;
+
+typedef struct {
+	char     path[MAX_QPATH];
+	uint64_t settings;
+	int      num_materials;             // local 0 stands for material index 0
+	uint16_t local_to_global[MAX_PBR_MATERIALS];
+	uint16_t global_to_local[MAX_PBR_MATERIALS];
+} meshcache_key_t;
+
+// serialization cursor, measures only while data is NULL
+typedef struct {
+	byte   *data;
+	size_t pos;
+} meshcache_buf_t;
+
+static uint64_t
+hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+	const byte *p = data;
+
+	// FNV-1a
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	return hash;
+}
+
+#define HASH_VALUE(hash, value)  hash_bytes(hash, &(value), sizeof(value))
+
+static uint64_t
+hash_image(uint64_t hash, const image_t *image)
+{
+	uint32_t present = image != NULL;
+
+	hash = HASH_VALUE(hash, present);
+	if (!image)
+		return hash;
+
+	hash = HASH_VALUE(hash, image->width);
+	hash = HASH_VALUE(hash, image->height);
+	hash = HASH_VALUE(hash, image->light_color);
+	hash = HASH_VALUE(hash, image->min_light_texcoord);
+	hash = HASH_VALUE(hash, image->max_light_texcoord);
+	hash = HASH_VALUE(hash, image->entire_texture_emissive);
+	return hash;
+}
+
+static uint64_t
+hash_material(uint64_t hash, const meshcache_key_t *key, const pbr_material_t *mat)
+{
+	uint32_t flags = mat->flags & ~MATERIAL_INDEX_MASK;
+	uint32_t next_frame = key->global_to_local[mat->next_frame & MATERIAL_INDEX_MASK];
+
+	hash = hash_bytes(hash, mat->name, strlen(mat->name) + 1);
+	hash = HASH_VALUE(hash, flags);
+	hash = HASH_VALUE(hash, next_frame);
+	hash = HASH_VALUE(hash, mat->num_frames);
+	hash = HASH_VALUE(hash, mat->light_styles);
+	hash = HASH_VALUE(hash, mat->bsp_radiance);
+	hash = HASH_VALUE(hash, mat->emissive_factor);
+	hash = hash_image(hash, mat->image_base);
+	hash = hash_image(hash, mat->image_emissive);
+	hash = hash_image(hash, mat->image_mask);
+	return hash;
+}
+
+static qboolean
+meshcache_init_key(meshcache_key_t *key, bsp_mesh_t *wm, bsp_t *bsp, const char *map_name, const char *full_game_map_name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	char filename[MAX_QPATH];
+
+	if (Q_snprintf(key->path, sizeof(key->path), "meshcache/%s.bin", map_name) >= sizeof(key->path))
+		return qfalse;
+
+	memset(key->global_to_local, 0, sizeof(key->global_to_local));
+	key->local_to_global[0] = 0;
+	key->num_materials = 1;
+
+	for (int i = 0; i < bsp->numtexinfo; i++)
+	{
+		const pbr_material_t *mat = bsp->texinfo[i].material;
+		if (!mat)
+			continue;
+
+		int index = mat - r_materials;
+		if (key->global_to_local[index])
+			continue;
+
+		key->global_to_local[index] = key->num_materials;
+		key->local_to_global[key->num_materials++] = index;
+	}
+
+	for (int i = 1; i < key->num_materials; i++)
+		hash = hash_material(hash, key, r_materials + key->local_to_global[i]);
+
+	for (int i = 0; i < bsp->numtexinfo; i++)
+	{
+		const mtexinfo_t *texinfo = bsp->texinfo + i;
+		uint32_t material = texinfo->material ? key->global_to_local[texinfo->material - r_materials] : 0;
+
+		hash = HASH_VALUE(hash, material);
+		hash = HASH_VALUE(hash, texinfo->radiance);
+	}
+
+	hash = HASH_VALUE(hash, cvar_pt_enable_nodraw->integer);
+	hash = HASH_VALUE(hash, cvar_pt_bsp_radiance_scale->value);
+	hash = HASH_VALUE(hash, cvar_pt_cluster_light_cutoff->value);
+
+	hash = HASH_VALUE(hash, wm->num_sky_clusters);
+	hash = hash_bytes(hash, wm->sky_clusters, wm->num_sky_clusters * sizeof(wm->sky_clusters[0]));
+	hash = HASH_VALUE(hash, wm->all_lava_emissive);
+	hash = HASH_VALUE(hash, wm->num_cameras);
+	hash = hash_bytes(hash, wm->cameras, wm->num_cameras * sizeof(wm->cameras[0]));
+
+	// custom sky geometry goes straight into the mesh
+	uint64_t stamp = 0;
+	Q_snprintf(filename, sizeof(filename), "maps/sky/%s.obj", full_game_map_name);
+	FS_FileStamp(filename, &stamp);
+	hash = HASH_VALUE(hash, stamp);
+
+	key->settings = hash;
+	return qtrue;
+}
+
+static void
+meshcache_write(meshcache_buf_t *buf, const void *src, size_t size)
+{
+	if (buf->data)
+		memcpy(buf->data + buf->pos, src, size);
+	buf->pos += size;
+}
+
+static void *
+meshcache_read(meshcache_buf_t *buf, size_t size)
+{
+	void *dst = Z_Malloc(size);
+
+	if (size)
+		memcpy(dst, buf->data + buf->pos, size);
+	buf->pos += size;
+	return dst;
+}
+
+static void
+meshcache_write_lights(meshcache_buf_t *buf, const meshcache_key_t *key, const light_poly_t *lights, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		const light_poly_t *light = lights + i;
+		meshcache_light_t out;
+
+		memcpy(out.positions, light->positions, sizeof(out.positions));
+		VectorCopy(light->off_center, out.off_center);
+		VectorCopy(light->color, out.color);
+		out.material = light->material ? key->global_to_local[light->material - r_materials] : MESHCACHE_NO_MATERIAL;
+		out.cluster = light->cluster;
+		out.style = light->style;
+		out.emissive_factor = light->emissive_factor;
+
+		meshcache_write(buf, &out, sizeof(out));
+	}
+}
+
+static light_poly_t *
+meshcache_read_lights(meshcache_buf_t *buf, const meshcache_key_t *key, int count)
+{
+	const meshcache_light_t *in = (const meshcache_light_t *)(buf->data + buf->pos);
+	light_poly_t *lights = Z_Malloc(count * sizeof(light_poly_t));
+
+	for (int i = 0; i < count; i++, in++)
+	{
+		light_poly_t *light = lights + i;
+
+		memcpy(light->positions, in->positions, sizeof(light->positions));
+		VectorCopy(in->off_center, light->off_center);
+		VectorCopy(in->color, light->color);
+		light->material = in->material == MESHCACHE_NO_MATERIAL ? NULL : r_materials + key->local_to_global[in->material];
+		light->cluster = in->cluster;
+		light->style = in->style;
+		light->emissive_factor = in->emissive_factor;
+	}
+
+	buf->pos += count * sizeof(meshcache_light_t);
+	return lights;
+}
+
+// writes everything after the header, measuring only if buf->data is NULL
+static void
+meshcache_write_data(meshcache_buf_t *buf, const meshcache_key_t *key, const bsp_mesh_t *wm)
+{
+	int num_prims = wm->num_vertices / 3;
+
+	meshcache_write(buf, wm->positions, wm->num_vertices * 3 * sizeof(float));
+	meshcache_write(buf, wm->tex_coords, wm->num_vertices * 2 * sizeof(float));
+	meshcache_write(buf, wm->tangents, num_prims * sizeof(uint32_t));
+	meshcache_write(buf, wm->texel_density, num_prims * sizeof(float));
+	meshcache_write(buf, wm->emissive_factors, num_prims * sizeof(float));
+	meshcache_write(buf, wm->clusters, num_prims * sizeof(int));
+
+	for (int i = 0; i < num_prims; i++)
+	{
+		uint32_t material = wm->materials[i];
+		material = (material & ~MATERIAL_INDEX_MASK) | key->global_to_local[material & MATERIAL_INDEX_MASK];
+		meshcache_write(buf, &material, sizeof(material));
+	}
+
+	for (int i = 0; i < wm->num_models; i++)
+	{
+		const bsp_model_t *model = wm->models + i;
+		meshcache_model_t out;
+
+		out.idx_offset = model->idx_offset;
+		out.idx_count = model->idx_count;
+		VectorCopy(model->center, out.center);
+		VectorCopy(model->aabb_min, out.aabb_min);
+		VectorCopy(model->aabb_max, out.aabb_max);
+		out.num_light_polys = model->num_light_polys;
+		out.transparent = model->transparent;
+		out.masked = model->masked;
+
+		meshcache_write(buf, &out, sizeof(out));
+	}
+
+	meshcache_write_lights(buf, key, wm->light_polys, wm->num_light_polys);
+	for (int i = 0; i < wm->num_models; i++)
+		meshcache_write_lights(buf, key, wm->models[i].light_polys, wm->models[i].num_light_polys);
+
+	meshcache_write(buf, wm->cluster_aabbs, wm->num_clusters * sizeof(aabb_t));
+	meshcache_write(buf, wm->cluster_light_offsets, (wm->num_clusters + 1) * sizeof(int));
+	meshcache_write(buf, wm->cluster_lights, wm->num_cluster_lights * sizeof(int));
+	meshcache_write(buf, wm->cluster_material_offsets, (wm->num_clusters + 2) * sizeof(int));
+
+	int num_cluster_materials = wm->cluster_material_offsets[wm->num_clusters + 1];
+	for (int i = 0; i < num_cluster_materials; i++)
+	{
+		uint16_t material = key->global_to_local[wm->cluster_materials[i]];
+		meshcache_write(buf, &material, sizeof(material));
+	}
+
+	meshcache_write(buf, wm->sky_visibility, sizeof(wm->sky_visibility));
+}
+
+// expected file size for the counts in the header
+static size_t
+meshcache_data_size(const meshcache_header_t *hdr)
+{
+	size_t num_prims = hdr->num_vertices / 3;
+
+	return sizeof(*hdr)
+		+ hdr->num_vertices * 5 * sizeof(float)
+		+ num_prims * 5 * sizeof(uint32_t)
+		+ hdr->num_models * sizeof(meshcache_model_t)
+		+ ((size_t)hdr->num_light_polys + hdr->num_model_light_polys) * sizeof(meshcache_light_t)
+		+ hdr->num_clusters * sizeof(aabb_t)
+		+ (hdr->num_clusters + 1) * sizeof(int)
+		+ hdr->num_cluster_lights * sizeof(int)
+		+ (hdr->num_clusters + 2) * sizeof(int)
+		+ hdr->num_cluster_materials * sizeof(uint16_t)
+		+ VIS_MAX_BYTES;
+}
+
+static void
+meshcache_save(const meshcache_key_t *key, const bsp_mesh_t *wm, const bsp_t *bsp)
+{
+	meshcache_header_t hdr;
+	meshcache_buf_t buf;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ident = MESHCACHE_IDENT;
+	hdr.version = MESHCACHE_VERSION;
+	hdr.checksum = bsp->checksum;
+	hdr.num_materials = key->num_materials;
+	hdr.settings = key->settings;
+	hdr.num_vertices = wm->num_vertices;
+	hdr.num_models = wm->num_models;
+	hdr.num_clusters = wm->num_clusters;
+	hdr.num_light_polys = wm->num_light_polys;
+	for (int i = 0; i < wm->num_models; i++)
+		hdr.num_model_light_polys += wm->models[i].num_light_polys;
+	hdr.num_cluster_lights = wm->num_cluster_lights;
+	hdr.num_cluster_materials = wm->cluster_material_offsets[wm->num_clusters + 1];
+	hdr.world_idx_count = wm->world_idx_count;
+	hdr.world_transparent_offset = wm->world_transparent_offset;
+	hdr.world_transparent_count = wm->world_transparent_count;
+	hdr.world_masked_offset = wm->world_masked_offset;
+	hdr.world_masked_count = wm->world_masked_count;
+	hdr.world_sky_offset = wm->world_sky_offset;
+	hdr.world_sky_count = wm->world_sky_count;
+	hdr.world_custom_sky_offset = wm->world_custom_sky_offset;
+	hdr.world_custom_sky_count = wm->world_custom_sky_count;
+	hdr.world_aabb = wm->world_aabb;
+
+	buf.data = NULL;
+	buf.pos = sizeof(hdr);
+	meshcache_write_data(&buf, key, wm);
+	assert(buf.pos == meshcache_data_size(&hdr));
+
+	buf.data = Z_Malloc(buf.pos);
+	buf.pos = 0;
+	meshcache_write(&buf, &hdr, sizeof(hdr));
+	meshcache_write_data(&buf, key, wm);
+
+	if (FS_WriteFile(key->path, buf.data, buf.pos) < 0)
+		Com_EPrintf("Couldn't save world mesh cache %s.\n", key->path);
+
+	Z_Free(buf.data);
+}
+
+static qboolean
+meshcache_load(const meshcache_key_t *key, bsp_mesh_t *wm, const bsp_t *bsp)
+{
+	meshcache_header_t *hdr;
+	meshcache_buf_t buf;
+	ssize_t len;
+
+	len = FS_LoadFile(key->path, (void **)&buf.data);
+	if (!buf.data)
+		return qfalse;
+
+	hdr = (meshcache_header_t *)buf.data;
+	if (len < sizeof(*hdr) ||
+		hdr->ident != MESHCACHE_IDENT || hdr->version != MESHCACHE_VERSION ||
+		hdr->checksum != bsp->checksum || hdr->settings != key->settings ||
+		hdr->num_materials != key->num_materials ||
+		hdr->num_models != wm->num_models || hdr->num_clusters != wm->num_clusters ||
+		hdr->num_vertices >= MAX_VERT_BSP || hdr->num_vertices % 3 ||
+		len != meshcache_data_size(hdr)) {
+		Com_DPrintf("Ignoring stale %s\n", key->path);
+		FS_FreeFile(buf.data);
+		return qfalse;
+	}
+
+	int num_prims = hdr->num_vertices / 3;
+
+	buf.pos = sizeof(*hdr);
+	wm->num_vertices = hdr->num_vertices;
+	wm->num_indices = hdr->num_vertices;
+	wm->positions = meshcache_read(&buf, wm->num_vertices * 3 * sizeof(float));
+	wm->tex_coords = meshcache_read(&buf, wm->num_vertices * 2 * sizeof(float));
+	wm->tangents = meshcache_read(&buf, num_prims * sizeof(uint32_t));
+	wm->texel_density = meshcache_read(&buf, num_prims * sizeof(float));
+	wm->emissive_factors = meshcache_read(&buf, num_prims * sizeof(float));
+	wm->clusters = meshcache_read(&buf, num_prims * sizeof(int));
+	wm->materials = meshcache_read(&buf, num_prims * sizeof(uint32_t));
+
+	for (int i = 0; i < num_prims; i++)
+	{
+		uint32_t material = wm->materials[i];
+		wm->materials[i] = (material & ~MATERIAL_INDEX_MASK) | key->local_to_global[min(material & MATERIAL_INDEX_MASK, key->num_materials - 1)];
+	}
+
+	wm->indices = Z_Malloc(wm->num_indices * sizeof(int));
+	for (int i = 0; i < wm->num_indices; i++)
+		wm->indices[i] = i;
+
+	wm->models = Z_Mallocz(wm->num_models * sizeof(bsp_model_t));
+	for (int i = 0; i < wm->num_models; i++)
+	{
+		const meshcache_model_t *in = (const meshcache_model_t *)(buf.data + buf.pos);
+		bsp_model_t *model = wm->models + i;
+
+		model->idx_offset = in->idx_offset;
+		model->idx_count = in->idx_count;
+		VectorCopy(in->center, model->center);
+		VectorCopy(in->aabb_min, model->aabb_min);
+		VectorCopy(in->aabb_max, model->aabb_max);
+		model->num_light_polys = in->num_light_polys;
+		model->allocated_light_polys = in->num_light_polys;
+		model->transparent = in->transparent;
+		model->masked = in->masked;
+
+		buf.pos += sizeof(*in);
+	}
+
+	wm->num_light_polys = wm->allocated_light_polys = hdr->num_light_polys;
+	wm->light_polys = meshcache_read_lights(&buf, key, wm->num_light_polys);
+	for (int i = 0; i < wm->num_models; i++)
+		wm->models[i].light_polys = meshcache_read_lights(&buf, key, wm->models[i].num_light_polys);
+
+	wm->world_idx_count = hdr->world_idx_count;
+	wm->world_transparent_offset = hdr->world_transparent_offset;
+	wm->world_transparent_count = hdr->world_transparent_count;
+	wm->world_masked_offset = hdr->world_masked_offset;
+	wm->world_masked_count = hdr->world_masked_count;
+	wm->world_sky_offset = hdr->world_sky_offset;
+	wm->world_sky_count = hdr->world_sky_count;
+	wm->world_custom_sky_offset = hdr->world_custom_sky_offset;
+	wm->world_custom_sky_count = hdr->world_custom_sky_count;
+	wm->world_aabb = hdr->world_aabb;
+
+	wm->cluster_aabbs = meshcache_read(&buf, wm->num_clusters * sizeof(aabb_t));
+	wm->num_cluster_lights = hdr->num_cluster_lights;
+	wm->cluster_light_offsets = meshcache_read(&buf, (wm->num_clusters + 1) * sizeof(int));
+	wm->cluster_lights = meshcache_read(&buf, wm->num_cluster_lights * sizeof(int));
+	wm->cluster_material_offsets = meshcache_read(&buf, (wm->num_clusters + 2) * sizeof(int));
+	wm->cluster_materials = meshcache_read(&buf, hdr->num_cluster_materials * sizeof(uint16_t));
+
+	for (int i = 0; i < hdr->num_cluster_materials; i++)
+		wm->cluster_materials[i] = key->local_to_global[min(wm->cluster_materials[i], key->num_materials - 1)];
+
+	memcpy(wm->sky_visibility, buf.data + buf.pos, sizeof(wm->sky_visibility));
+
+	FS_FreeFile(buf.data);
+	return qtrue;
+}
+
+// returns qtrue if the mesh came from the cache
+qboolean
+bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name)
+{
+	const char* full_game_map_name = map_name;
+	if (strcmp(map_name, "demo1") == 0)
+		full_game_map_name = "base1";
+	else if (strcmp(map_name, "demo2") == 0)
+		full_game_map_name = "base2";
+	else if (strcmp(map_name, "demo3") == 0)
+		full_game_map_name = "base3";
+
+	load_sky_and_lava_clusters(wm, full_game_map_name);
+	load_cameras(wm, full_game_map_name);
+
+    wm->num_models = bsp->nummodels;
+	wm->num_clusters = bsp->vis->numclusters;
+
+	if (wm->num_clusters + 1 >= MAX_LIGHT_LISTS)
+	{
+		Com_Error(ERR_FATAL, "The BSP model has too many clusters (%d)", wm->num_clusters);
+	}
+
+	uint64_t start = Sys_Microseconds();
+	meshcache_key_t *key = NULL;
+
+	// the cache skips collect_surfaces, which is where the PVS gets patched,
+	// so it is only valid together with a patched PVS file
+	if (cvar_pt_world_cache->integer)
+	{
+		key = Z_Malloc(sizeof(*key));
+		if (!meshcache_init_key(key, wm, bsp, map_name, full_game_map_name))
+		{
+			Z_Free(key);
+			key = NULL;
+		}
+	}
+
+	if (key && bsp->pvs_patched && meshcache_load(key, wm, bsp))
+	{
+		Com_DPrintf("Loaded world mesh from %s in %"PRIu64" us\n", key->path, Sys_Microseconds() - start);
+		Z_Free(key);
+		return qtrue;
+	}
+
+	build_world_mesh(wm, bsp, full_game_map_name);
+	Com_DPrintf("Built world mesh for %s in %"PRIu64" us\n", map_name, Sys_Microseconds() - start);
+
+	if (key)
+	{
+		meshcache_save(key, wm, bsp);
+		Z_Free(key);
+	}
+
+	return qfalse;
+}
+
+/*
+================
+bsp_mesh_build_cache_f
+
+Pre-generates world mesh caches for the given maps, or for all of them.
+Only the CPU side of the renderer is used, so this can run on a build
+machine without a GPU with "+set dedicated 1 +pt_build_world_cache +quit".
+================
+*/
+void
+bsp_mesh_build_cache_f(void)
+{
+	void **list = NULL;
+	int count = Cmd_Argc() - 1;
+	int built = 0;
+
+	if (vkpt_refdef.bsp_mesh_world_loaded)
+	{
+		// registering another map's textures would clobber the current materials
+		Com_Printf("Can't build world mesh caches while a map is loaded.\n");
+		return;
+	}
+
+	if (!cvar_pt_world_cache->integer)
+	{
+		Com_Printf("World mesh cache is disabled, set pt_world_cache 1 to enable.\n");
+		return;
+	}
+
+	if (!count)
+		list = FS_ListFiles("maps", ".bsp", FS_SEARCH_STRIPEXT, &count);
+
+	for (int i = 0; i < count; i++)
+	{
+		const char *map_name = list ? (const char *)list[i] : Cmd_Argv(i + 1);
+		char bsp_path[MAX_QPATH];
+		bsp_mesh_t wm;
+		bsp_t *bsp;
+
+		Q_concat(bsp_path, sizeof(bsp_path), "maps/", map_name, ".bsp", NULL);
+		qerror_t ret = BSP_Load(bsp_path, &bsp);
+		if (!bsp)
+		{
+			Com_EPrintf("Couldn't load %s: %s\n", bsp_path, Q_ErrorString(ret));
+			continue;
+		}
+
+		memset(&wm, 0, sizeof(wm));
+		bsp_mesh_register_textures(bsp);
+		if (!bsp_mesh_create_from_bsp(&wm, bsp, map_name))
+			built++;
+
+		bsp_mesh_destroy(&wm);
+		BSP_Free(bsp);
+	}
+
+	if (list)
+		FS_FreeList(list);
+
+	Com_Printf("Built %d world mesh caches, %d up to date.\n", built, count - built);
+}
+
+static void
+free_cluster_lights(bsp_mesh_t *wm)
+{
+	Z_Free(wm->cluster_lights);
+	Z_Free(wm->cluster_light_offsets);
+	wm->cluster_lights = NULL;
+	wm->cluster_light_offsets = NULL;
+}
+
+/*
+================
+bsp_mesh_cluster_lights_bench_f
+
+Times the cluster light lists of the given maps, or of all of them:
+the serial reference, the chunked version on one and on all threads,
+and the chunked version with the pt_cluster_light_cutoff culling.
+Without culling the lists must match the reference exactly.
+================
+*/
+void
+bsp_mesh_cluster_lights_bench_f(void)
+{
+	void **list = NULL;
+	int count = Cmd_Argc() - 1;
+	int threads = Job_NumWorkers() + 1;
+	float cutoff = cvar_pt_cluster_light_cutoff->value;
+	uint64_t total_ref = 0, total_one = 0, total_all = 0, total_cull = 0;
+	int64_t total_lists = 0, total_culled = 0;
+	int failures = 0;
+
+	if (vkpt_refdef.bsp_mesh_world_loaded)
+	{
+		Com_Printf("Can't run the benchmark while a map is loaded.\n");
+		return;
+	}
+
+	if (!count)
+		list = FS_ListFiles("maps", ".bsp", FS_SEARCH_STRIPEXT, &count);
+
+	Com_Printf("%-12s %6s %6s %9s %9s %9s %9s %9s %9s %s\n", "map", "lights", "clust",
+		"ref us", "1 thr us", "all us", "cull us", "entries", "culled", "match");
+
+	for (int i = 0; i < count; i++)
+	{
+		const char *map_name = list ? (const char *)list[i] : Cmd_Argv(i + 1);
+		char bsp_path[MAX_QPATH];
+		bsp_mesh_t wm;
+		bsp_t *bsp;
+
+		Q_concat(bsp_path, sizeof(bsp_path), "maps/", map_name, ".bsp", NULL);
+		qerror_t ret = BSP_Load(bsp_path, &bsp);
+		if (!bsp)
+		{
+			Com_EPrintf("Couldn't load %s: %s\n", bsp_path, Q_ErrorString(ret));
+			continue;
+		}
+
+		memset(&wm, 0, sizeof(wm));
+		bsp_mesh_register_textures(bsp);
+		bsp_mesh_create_from_bsp(&wm, bsp, map_name);
+		free_cluster_lights(&wm);
+
+		uint64_t start = Sys_Microseconds();
+		collect_cluster_lights_reference(&wm, bsp);
+		uint64_t ref_usec = Sys_Microseconds() - start;
+
+		int ref_count = wm.num_cluster_lights;
+		int *ref_lights = wm.cluster_lights;
+		int *ref_offsets = wm.cluster_light_offsets;
+		wm.cluster_lights = NULL;
+		wm.cluster_light_offsets = NULL;
+
+		start = Sys_Microseconds();
+		collect_cluster_lights(&wm, bsp, 0.f, 1);
+		uint64_t one_usec = Sys_Microseconds() - start;
+		free_cluster_lights(&wm);
+
+		start = Sys_Microseconds();
+		collect_cluster_lights(&wm, bsp, 0.f, threads);
+		uint64_t all_usec = Sys_Microseconds() - start;
+
+		qboolean match = wm.num_cluster_lights == ref_count &&
+			!memcmp(wm.cluster_light_offsets, ref_offsets, (wm.num_clusters + 1) * sizeof(int)) &&
+			!memcmp(wm.cluster_lights, ref_lights, ref_count * sizeof(int));
+		free_cluster_lights(&wm);
+
+		start = Sys_Microseconds();
+		collect_cluster_lights(&wm, bsp, cutoff, threads);
+		uint64_t cull_usec = Sys_Microseconds() - start;
+
+		Com_Printf("%-12s %6d %6d %9"PRIu64" %9"PRIu64" %9"PRIu64" %9"PRIu64" %9d %9d %s\n", map_name,
+			wm.num_light_polys, wm.num_clusters, ref_usec, one_usec, all_usec, cull_usec,
+			ref_count, ref_count - wm.num_cluster_lights, match ? "yes" : "NO");
+
+		total_ref += ref_usec;
+		total_one += one_usec;
+		total_all += all_usec;
+		total_cull += cull_usec;
+		total_lists += ref_count;
+		total_culled += ref_count - wm.num_cluster_lights;
+		failures += !match;
+
+		Z_Free(ref_lights);
+		Z_Free(ref_offsets);
+		bsp_mesh_destroy(&wm);
+		BSP_Free(bsp);
+	}
+
+	if (list)
+		FS_FreeList(list);
+
+	Com_Printf("%-12s %6s %6s %9"PRIu64" %9"PRIu64" %9"PRIu64" %9"PRIu64" %9"PRId64" %9"PRId64" %d mismatches\n", "total", "", "",
+		total_ref, total_one, total_all, total_cull, total_lists, total_culled, failures);
+	Com_Printf("%d threads, cutoff %g sr\n", threads, cutoff);
+}
+
 void
 bsp_mesh_destroy(bsp_mesh_t *wm)
 {
@@ -1909,6 +2912,8 @@ bsp_mesh_destroy(bsp_mesh_t *wm)
 	Z_Free(wm->light_polys);
 	Z_Free(wm->cluster_lights);
 	Z_Free(wm->cluster_light_offsets);
+	Z_Free(wm->cluster_materials);
+	Z_Free(wm->cluster_material_offsets);
 	Z_Free(wm->cluster_aabbs);
 
 	memset(wm, 0, sizeof(*wm));
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common/common.h"
 #include "common/cvar.h"
 #include "common/files.h"
+#include "common/jobs.h"
 #include "common/math.h"
 #include "client/video.h"
 #include "client/client.h"
@@ -30,9 +31,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "refresh/images.h"
 #include "refresh/models.h"
 #include "system/hunk.h"
+#include "system/system.h"
 #include "vkpt.h"
 #include "material.h"
 #include "physical_sky.h"
+#include "residency.h"
 #include "../../client/client.h"
 #include "../../client/ui/ui.h"
 
@@ -62,6 +65,15 @@ cvar_t *cvar_pt_projection = NULL;
 cvar_t *cvar_pt_dof = NULL;
 cvar_t* cvar_pt_freecam = NULL;
 cvar_t *cvar_pt_nearest = NULL;
+cvar_t *cvar_pt_texture_cache = NULL;
+cvar_t *cvar_pt_texture_cache_size = NULL;
+cvar_t *cvar_pt_world_cache = NULL;
+cvar_t *cvar_pt_cluster_light_cutoff = NULL;
+cvar_t *cvar_pt_texture_compression = NULL;
+cvar_t *cvar_pt_texture_budget = NULL;
+cvar_t *cvar_pt_texture_stream_size = NULL;
+cvar_t *cvar_pt_texture_upload_limit = NULL;
+cvar_t *cvar_pt_material_db = NULL;
 cvar_t *cvar_drs_enable = NULL;
 cvar_t *cvar_drs_target = NULL;
 cvar_t *cvar_drs_minscale = NULL;
@@ -993,6 +1005,12 @@ init_vulkan()
 
 	qvk.physical_device = devices[picked_device];
 
+	{
+		VkPhysicalDeviceFeatures dev_features;
+		vkGetPhysicalDeviceFeatures(qvk.physical_device, &dev_features);
+		qvk.supports_texture_compression_bc = dev_features.textureCompressionBC;
+	}
+
 	{
 		VkPhysicalDeviceDriverProperties driver_properties = {
 			.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRIVER_PROPERTIES,
@@ -1188,7 +1206,7 @@ init_vulkan()
 			.samplerAnisotropy = 1,
 			.textureCompressionETC2 = 0,
 			.textureCompressionASTC_LDR = 0,
-			.textureCompressionBC = 0,
+			.textureCompressionBC = qvk.supports_texture_compression_bc,
 			.occlusionQueryPrecise = 0,
 			.pipelineStatisticsQuery = 1,
 			.vertexPipelineStoresAndAtomics = 0,
@@ -1494,8 +1512,10 @@ static pbr_material_t const * get_mesh_material(const entity_t* entity, const ma
 	return mesh->materials[skinnum];
 }
 
-static inline uint32_t fill_model_instance(const entity_t* entity, const model_t* model, const maliasmesh_t* mesh,
-	const float* transform, int model_instance_index, qboolean is_viewer_weapon, qboolean is_double_sided, int iqm_matrix_index)
+// Material the mesh is instanced with, or 0 if the mesh is skipped.
+// Looks up and touches the material, so it has to run on the main thread.
+static uint32_t get_model_instance_material(const entity_t* entity, const model_t* model, const maliasmesh_t* mesh,
+	qboolean is_viewer_weapon, qboolean is_double_sided)
 {
 	pbr_material_t const * material = get_mesh_material(entity, mesh);
 
@@ -1505,6 +1525,8 @@ static inline uint32_t fill_model_instance(const entity_t* entity, const model_t
 		return 0;
 	}
 
+	vkpt_textures_touch_material(material);
+
 	int material_id = material->flags;
 
 	if(MAT_IsKind(material_id, MATERIAL_KIND_INVISIBLE))
@@ -1535,6 +1557,12 @@ static inline uint32_t fill_model_instance(const entity_t* entity, const model_t
 			material_id |= MATERIAL_FLAG_SHELL_BLUE;
 	}
 
+	return material_id;
+}
+
+static inline void fill_model_instance(const entity_t* entity, const model_t* model, const maliasmesh_t* mesh,
+	const float* transform, int model_instance_index, uint32_t material_id, int iqm_matrix_index)
+{
 	ModelInstance* instance = &vkpt_refdef.uniform_instance_buffer.model_instances[model_instance_index];
 
 	int frame = entity->frame;
@@ -1553,8 +1581,6 @@ static inline uint32_t fill_model_instance(const entity_t* entity, const model_t
 	instance->is_iqm = (model->iqmData) ? 1 : 0;
 	if (instance->is_iqm)
 		instance->offset_prev = iqm_matrix_index;
-
-	return material_id;
 }
 
 static void
@@ -1580,6 +1606,50 @@ add_dlights(const dlight_t* lights, int num_lights, QVKUniformBuffer_t* ubo)
 	}
 }
 
+// Instances are added in two steps. prepare_entities queues an entity_work_t
+// for every entity in each pass and assigns all output slots on the main thread,
+// in pass order. The transforms, instance data and model lights are then written
+// in parallel by process_entity_work, so the result doesn't depend on threading.
+typedef struct {
+	const entity_t* entity;
+	const model_t* model;         // NULL for BSP entities
+	int mesh_filter;              // 0 if only the model lights are instanced
+	qboolean is_viewer_weapon;
+	qboolean is_double_sided;
+	qboolean add_model_lights;
+	int bsp_mesh_idx;
+	int model_instance_idx;
+	int num_model_instances;
+	int instance_idx;
+	int num_instanced_vert;
+	int iqm_matrix_index;
+	qboolean compute_iqm_pose;    // unset if the matrices are shared with an earlier item
+	int light_offset;             // first slot in entity_lights
+	int num_lights;               // lights written, some may be culled
+} entity_work_t;
+
+// next free output slots while queueing
+typedef struct {
+	int model_instance_idx;
+	int bsp_mesh_idx;
+	int instance_idx;
+	int num_instanced_vert;
+	int iqm_matrix_offset;
+	int light_offset;
+} entity_slots_t;
+
+#define MAX_ENTITY_WORK         (MAX_ENTITIES * 3) // opaque, transparent and masked pass
+#define ENTITY_WORK_PER_JOB     16
+#define CYLINDER_LIGHT_POLYS    6
+
+static entity_work_t entity_work[MAX_ENTITY_WORK];
+static int num_entity_work;
+static int instance_mesh_index[SHADER_MAX_ENTITIES];
+static uint32_t instance_material[SHADER_MAX_ENTITIES];
+static light_poly_t* entity_lights;
+static int allocated_entity_lights;
+static iqm_pose_cache_t iqm_pose_cache;
+
 static inline void transform_point(const float* p, const float* matrix, float* result)
 {
 	vec4_t point = { p[0], p[1], p[2], 1.f };
@@ -1588,18 +1658,14 @@ static inline void transform_point(const float* p, const float* matrix, float* r
 	VectorCopy(transformed, result); // vec4 -> vec3
 }
 
-static void instance_model_lights(int num_light_polys, const light_poly_t* light_polys, const float* transform)
+static int instance_model_lights(int num_light_polys, const light_poly_t* light_polys, const float* transform, light_poly_t* dst_lights)
 {
+	int num_lights = 0;
+
 	for (int nlight = 0; nlight < num_light_polys; nlight++)
 	{
-		if (num_model_lights >= MAX_MODEL_LIGHTS)
-		{
-			assert(!"Model light count overflow");
-			break;
-		}
-
 		const light_poly_t* src_light = light_polys + nlight;
-		light_poly_t* dst_light = model_lights + num_model_lights;
+		light_poly_t* dst_light = dst_lights + num_lights;
 
 		// Transform the light's positions and center
 		transform_point(src_light->positions + 0, transform, dst_light->positions + 0);
@@ -1618,38 +1684,29 @@ static void instance_model_lights(int num_light_polys, const light_poly_t* light
 		VectorCopy(src_light->color, dst_light->color);
 		dst_light->material = src_light->material;
 		dst_light->style = src_light->style;
+		dst_light->emissive_factor = src_light->emissive_factor;
 
-		num_model_lights++;
+		num_lights++;
 	}
+
+	return num_lights;
 }
 
-static void process_bsp_entity(const entity_t* entity, int* bsp_mesh_idx, int* instance_idx, int* num_instanced_vert)
+static int process_bsp_entity(const entity_work_t* work, const float* transform, light_poly_t* lights)
 {
+	const entity_t* entity = work->entity;
 	QVKInstanceBuffer_t* uniform_instance_buffer = &vkpt_refdef.uniform_instance_buffer;
 	uint32_t* ubo_bsp_cluster_id = (uint32_t*)uniform_instance_buffer->bsp_cluster_id;
 	uint32_t* ubo_bsp_prim_offset = (uint32_t*)uniform_instance_buffer->bsp_prim_offset;
 	uint32_t* ubo_instance_buf_offset = (uint32_t*)uniform_instance_buffer->bsp_instance_buf_offset;
 	uint32_t* ubo_instance_buf_size = (uint32_t*)uniform_instance_buffer->bsp_instance_buf_size;
 
-	const int current_bsp_mesh_index = *bsp_mesh_idx;
-	if (current_bsp_mesh_index >= SHADER_MAX_BSP_ENTITIES)
-	{
-		assert(!"BSP entity count overflow");
-		return;
-	}
-
-	if (*instance_idx >= (SHADER_MAX_ENTITIES + SHADER_MAX_BSP_ENTITIES))
-	{
-		assert(!"Total entity count overflow");
-		return;
-	}
+	const int current_bsp_mesh_index = work->bsp_mesh_idx;
 
 	world_entity_ids[entity_frame_num][current_bsp_mesh_index] = entity->id;
 
-	float transform[16];
-	create_entity_matrix(transform, (entity_t*)entity, qfalse);
 	BspMeshInstance* ubo_instance_info = uniform_instance_buffer->bsp_mesh_instances + current_bsp_mesh_index;
-	memcpy(&ubo_instance_info->M, transform, sizeof(transform));
+	memcpy(&ubo_instance_info->M, transform, sizeof(float) * 16);
 	ubo_instance_info->frame = entity->frame;
 	memset(ubo_instance_info->padding, 0, sizeof(ubo_instance_info->padding));
 
@@ -1688,17 +1745,155 @@ static void process_bsp_entity(const entity_t* entity, int* bsp_mesh_idx, int* i
 	
 	const int mesh_vertex_num = model->idx_count;
 
-	ubo_instance_buf_offset[current_bsp_mesh_index] = *num_instanced_vert / 3;
+	ubo_instance_buf_offset[current_bsp_mesh_index] = work->num_instanced_vert / 3;
 	ubo_instance_buf_size[current_bsp_mesh_index] = mesh_vertex_num / 3;
 	
-	((int*)uniform_instance_buffer->model_indices)[*instance_idx] = ~current_bsp_mesh_index;
+	((int*)uniform_instance_buffer->model_indices)[work->instance_idx] = ~current_bsp_mesh_index;
 
-	*num_instanced_vert += mesh_vertex_num;
-	
-	instance_model_lights(model->num_light_polys, model->light_polys, transform);
+	return instance_model_lights(model->num_light_polys, model->light_polys, transform, lights);
+}
+
+static int process_regular_entity(const entity_work_t* work, const float* transform, light_poly_t* lights)
+{
+	const entity_t* entity = work->entity;
+	const model_t* model = work->model;
+	QVKInstanceBuffer_t* uniform_instance_buffer = &vkpt_refdef.uniform_instance_buffer;
+	uint32_t* ubo_instance_buf_offset = (uint32_t*)uniform_instance_buffer->model_instance_buf_offset;
+	uint32_t* ubo_instance_buf_size = (uint32_t*)uniform_instance_buffer->model_instance_buf_size;
+	uint32_t* ubo_model_idx_offset = (uint32_t*)uniform_instance_buffer->model_idx_offset;
+	uint32_t* ubo_model_cluster_id = (uint32_t*)uniform_instance_buffer->model_cluster_id;
+	int num_lights = 0;
+
+	if (work->compute_iqm_pose)
+		R_ComputeIQMTransforms(model->iqmData, entity, qvk.iqm_matrices_shadow + (work->iqm_matrix_index * 12));
+
+	uint32_t cluster_id = ~0u;
+	if (bsp_world_model && work->num_model_instances)
+		cluster_id = BSP_PointLeaf(bsp_world_model->nodes, ((entity_t*)entity)->origin)->cluster;
+
+	int current_num_instanced_vert = work->num_instanced_vert;
+
+	for (int n = 0; n < work->num_model_instances; n++)
+	{
+		const int current_model_instance_index = work->model_instance_idx + n;
+		const int mesh_index = instance_mesh_index[current_model_instance_index];
+		const maliasmesh_t* mesh = model->meshes + mesh_index;
+
+		fill_model_instance(entity, model, mesh, transform, current_model_instance_index,
+			instance_material[current_model_instance_index], work->iqm_matrix_index);
+
+		entity_hash_t hash;
+		hash.entity = entity->id;
+		hash.model = entity->model;
+		hash.mesh = mesh_index;
+
+		model_entity_ids[entity_frame_num][current_model_instance_index] = *(uint32_t*)&hash;
+
+		ubo_model_cluster_id[current_model_instance_index] = cluster_id;
 
-	(*bsp_mesh_idx)++;
-	(*instance_idx)++;
+		ubo_model_idx_offset[current_model_instance_index] = mesh->idx_offset;
+
+		ubo_instance_buf_offset[current_model_instance_index] = current_num_instanced_vert / 3;
+		ubo_instance_buf_size[current_model_instance_index] = mesh->numtris;
+
+		((int*)uniform_instance_buffer->model_indices)[work->instance_idx + n] = current_model_instance_index;
+
+		current_num_instanced_vert += mesh->numtris * 3;
+	}
+
+	// add cylinder lights for wall lamps
+	if (model->model_class == MCLASS_STATIC_LIGHT)
+	{
+		vec4_t begin, end, color;
+		vec4_t offset1 = { 0.f, 0.5f, -10.f, 1.f };
+		vec4_t offset2 = { 0.f, 0.5f,  10.f, 1.f };
+
+		mult_matrix_vector(begin, transform, offset1);
+		mult_matrix_vector(end, transform, offset2);
+		VectorSet(color, 0.25f, 0.5f, 0.07f);
+
+		vkpt_build_cylinder_light(lights, &num_lights, CYLINDER_LIGHT_POLYS, bsp_world_model, begin, end, color, 1.5f);
+	}
+
+	return num_lights;
+}
+
+static void process_entity_work(entity_work_t* work)
+{
+	light_poly_t* lights = entity_lights + work->light_offset;
+	float transform[16];
+
+	create_entity_matrix(transform, (entity_t*)work->entity, work->is_viewer_weapon);
+
+	if (!work->model)
+	{
+		work->num_lights = process_bsp_entity(work, transform, lights);
+		return;
+	}
+
+	work->num_lights = 0;
+
+	if (work->mesh_filter)
+		work->num_lights += process_regular_entity(work, transform, lights);
+
+	if (work->add_model_lights)
+		work->num_lights += instance_model_lights(work->model->num_light_polys, work->model->light_polys, transform, lights + work->num_lights);
+}
+
+static void process_entity_work_job(void* arg, int index)
+{
+	int first = index * ENTITY_WORK_PER_JOB;
+	int last = min(first + ENTITY_WORK_PER_JOB, num_entity_work);
+
+	for (int i = first; i < last; i++)
+		process_entity_work(entity_work + i);
+}
+
+static entity_work_t* alloc_entity_work(const entity_t* entity, const model_t* model)
+{
+	if (num_entity_work >= MAX_ENTITY_WORK)
+	{
+		assert(!"Entity work overflow");
+		return NULL;
+	}
+
+	entity_work_t* work = entity_work + num_entity_work++;
+	memset(work, 0, sizeof(*work));
+	work->entity = entity;
+	work->model = model;
+	work->bsp_mesh_idx = -1;
+	work->iqm_matrix_index = -1;
+
+	return work;
+}
+
+static void queue_bsp_entity(const entity_t* entity, entity_slots_t* slots)
+{
+	if (slots->bsp_mesh_idx >= SHADER_MAX_BSP_ENTITIES)
+	{
+		assert(!"BSP entity count overflow");
+		return;
+	}
+
+	if (slots->instance_idx >= (SHADER_MAX_ENTITIES + SHADER_MAX_BSP_ENTITIES))
+	{
+		assert(!"Total entity count overflow");
+		return;
+	}
+
+	entity_work_t* work = alloc_entity_work(entity, NULL);
+	if (!work)
+		return;
+
+	const bsp_model_t* model = vkpt_refdef.bsp_mesh_world.models + (~entity->model);
+
+	work->bsp_mesh_idx = slots->bsp_mesh_idx++;
+	work->instance_idx = slots->instance_idx++;
+	work->num_instanced_vert = slots->num_instanced_vert;
+	work->light_offset = slots->light_offset;
+
+	slots->num_instanced_vert += model->idx_count;
+	slots->light_offset += model->num_light_polys;
 }
 
 static inline qboolean is_transparent_material(uint32_t material)
@@ -1721,63 +1916,77 @@ static inline qboolean is_masked_material(uint32_t material)
 #define MESH_FILTER_MASKED 4
 #define MESH_FILTER_ALL 7
 
-static void process_regular_entity(
+// mesh_filter 0 only instances the model lights, add_model_lights appends them
+// after the instances of the filtered meshes
+static void queue_regular_entity(
 	const entity_t* entity, 
 	const model_t* model, 
 	qboolean is_viewer_weapon, 
 	qboolean is_double_sided, 
-	int* model_instance_idx, 
-	int* instance_idx, 
-	int* num_instanced_vert, 
 	int mesh_filter, 
+	qboolean add_model_lights,
 	qboolean* contains_transparent,
 	qboolean* contains_masked,
-	int* iqm_matrix_offset,
-	float* iqm_matrix_data)
+	entity_slots_t* slots)
 {
-	QVKInstanceBuffer_t* uniform_instance_buffer = &vkpt_refdef.uniform_instance_buffer;
-	uint32_t* ubo_instance_buf_offset = (uint32_t*)uniform_instance_buffer->model_instance_buf_offset;
-	uint32_t* ubo_instance_buf_size = (uint32_t*)uniform_instance_buffer->model_instance_buf_size;
-	uint32_t* ubo_model_idx_offset = (uint32_t*)uniform_instance_buffer->model_idx_offset;
-	uint32_t* ubo_model_cluster_id = (uint32_t*)uniform_instance_buffer->model_cluster_id;
+	entity_work_t* work = alloc_entity_work(entity, model);
+	if (!work)
+		return;
 
-	float transform[16];
-	create_entity_matrix(transform, (entity_t*)entity, is_viewer_weapon);
-	
-	int current_model_instance_index = *model_instance_idx;
-	int current_instance_index = *instance_idx;
-	int current_num_instanced_vert = *num_instanced_vert;
+	work->is_viewer_weapon = is_viewer_weapon;
+	work->is_double_sided = is_double_sided;
+	work->add_model_lights = add_model_lights;
+	work->light_offset = slots->light_offset;
+
+	if (add_model_lights)
+		slots->light_offset += model->num_light_polys;
+
+	if (!mesh_filter)
+		return;
 
 	if (contains_transparent)
 		*contains_transparent = qfalse;
 
-	int iqm_matrix_index = -1;
 	if (model->iqmData && model->iqmData->num_poses)
 	{
-		iqm_matrix_index = *iqm_matrix_offset;
-		
-		if (iqm_matrix_index + model->iqmData->num_poses > MAX_IQM_MATRICES)
+		const int num_poses = (int)model->iqmData->num_poses;
+		const qboolean fits = slots->iqm_matrix_offset + num_poses <= MAX_IQM_MATRICES;
+		iqm_pose_key_t key;
+
+		// entities in the same pose, and the other passes of this entity, share the matrices
+		R_IQMPoseKey(model->iqmData, entity, &key);
+		work->iqm_matrix_index = R_CacheIQMPose(&iqm_pose_cache, &key, fits ? slots->iqm_matrix_offset : -1);
+
+		if (work->iqm_matrix_index < 0)
 		{
-			assert(!"IQM matrix buffer overflow");
-			return;
+			if (!fits)
+			{
+				assert(!"IQM matrix buffer overflow");
+				return;
+			}
+
+			work->iqm_matrix_index = slots->iqm_matrix_offset;
+			work->compute_iqm_pose = qtrue;
+			slots->iqm_matrix_offset += num_poses;
 		}
-		
-		R_ComputeIQMTransforms(model->iqmData, entity, iqm_matrix_data + (iqm_matrix_index * 12));
-		
-		*iqm_matrix_offset += (int)model->iqmData->num_poses;
 	}
 
+	work->mesh_filter = mesh_filter;
+	work->model_instance_idx = slots->model_instance_idx;
+	work->instance_idx = slots->instance_idx;
+	work->num_instanced_vert = slots->num_instanced_vert;
+
 	for (int i = 0; i < model->nummeshes; i++)
 	{
 		const maliasmesh_t* mesh = model->meshes + i;
 
-		if (current_model_instance_index >= SHADER_MAX_ENTITIES)
+		if (slots->model_instance_idx >= SHADER_MAX_ENTITIES)
 		{
 			assert(!"Model entity count overflow");
 			break;
 		}
 
-		if (current_instance_index >= (SHADER_MAX_ENTITIES + SHADER_MAX_BSP_ENTITIES))
+		if (slots->instance_idx >= (SHADER_MAX_ENTITIES + SHADER_MAX_BSP_ENTITIES))
 		{
 			assert(!"Total entity count overflow");
 			break;
@@ -1789,8 +1998,7 @@ static void process_regular_entity(
 			continue;
 		}
 
-		uint32_t material_id = fill_model_instance(entity, model, mesh, transform,
-			current_model_instance_index,is_viewer_weapon, is_double_sided, iqm_matrix_index);
+		uint32_t material_id = get_model_instance_material(entity, model, mesh, is_viewer_weapon, is_double_sided);
 		
 		if (!material_id)
 			continue;
@@ -1817,47 +2025,45 @@ static void process_regular_entity(
 				continue;
 		}
 
-		entity_hash_t hash;
-		hash.entity = entity->id;
-		hash.model = entity->model;
-		hash.mesh = i;
-
-		model_entity_ids[entity_frame_num][current_model_instance_index] = *(uint32_t*)&hash;
+		instance_mesh_index[slots->model_instance_idx] = i;
+		instance_material[slots->model_instance_idx] = material_id;
 
-		uint32_t cluster_id = ~0u;
-		if(bsp_world_model) 
-			cluster_id = BSP_PointLeaf(bsp_world_model->nodes, ((entity_t*)entity)->origin)->cluster;
-		ubo_model_cluster_id[current_model_instance_index] = cluster_id;
-
-		ubo_model_idx_offset[current_model_instance_index] = mesh->idx_offset;
-
-		ubo_instance_buf_offset[current_model_instance_index] = current_num_instanced_vert / 3;
-		ubo_instance_buf_size[current_model_instance_index] = mesh->numtris;
+		work->num_model_instances++;
+		slots->model_instance_idx++;
+		slots->instance_idx++;
+		slots->num_instanced_vert += mesh->numtris * 3;
+	}
 
-		((int*)uniform_instance_buffer->model_indices)[current_instance_index] = current_model_instance_index;
+	if (model->model_class == MCLASS_STATIC_LIGHT)
+		slots->light_offset += CYLINDER_LIGHT_POLYS;
+}
 
-		current_model_instance_index++;
-		current_instance_index++;
-		current_num_instanced_vert += mesh->numtris * 3;
+// runs the queued entity work and appends the lights in queue order
+static void process_queued_entities(const entity_slots_t* slots)
+{
+	if (slots->light_offset > allocated_entity_lights)
+	{
+		Z_Free(entity_lights);
+		allocated_entity_lights = slots->light_offset;
+		entity_lights = Z_Malloc(allocated_entity_lights * sizeof(light_poly_t));
 	}
 
-	// add cylinder lights for wall lamps
-	if (model->model_class == MCLASS_STATIC_LIGHT)
+	Job_ParallelFor(process_entity_work_job, NULL, (num_entity_work + ENTITY_WORK_PER_JOB - 1) / ENTITY_WORK_PER_JOB);
+
+	for (int i = 0; i < num_entity_work; i++)
 	{
-		vec4_t begin, end, color;
-		vec4_t offset1 = { 0.f, 0.5f, -10.f, 1.f };
-		vec4_t offset2 = { 0.f, 0.5f,  10.f, 1.f };
+		const entity_work_t* work = entity_work + i;
+		int count = work->num_lights;
 
-		mult_matrix_vector(begin, transform, offset1);
-		mult_matrix_vector(end, transform, offset2);
-		VectorSet(color, 0.25f, 0.5f, 0.07f);
+		if (num_model_lights + count > MAX_MODEL_LIGHTS)
+		{
+			assert(!"Model light count overflow");
+			count = MAX_MODEL_LIGHTS - num_model_lights;
+		}
 
-		vkpt_build_cylinder_light(model_lights, &num_model_lights, MAX_MODEL_LIGHTS, bsp_world_model, begin, end, color, 1.5f);
+		memcpy(model_lights + num_model_lights, entity_lights + work->light_offset, count * sizeof(light_poly_t));
+		num_model_lights += count;
 	}
-
-	*model_instance_idx = current_model_instance_index;
-	*instance_idx = current_instance_index;
-	*num_instanced_vert = current_num_instanced_vert;
 }
 
 #if CL_RTX_SHADERBALLS
@@ -1897,13 +2103,12 @@ prepare_entities(EntityUploadInfo* upload_info)
 	int viewer_weapon_num = 0;
 	int explosion_num = 0;
 
-	int model_instance_idx = 0;
-	int bsp_mesh_idx = 0;
-	int num_instanced_vert = 0; /* need to track this here to find lights */
-	int instance_idx = 0;
-	int iqm_matrix_offset = 0;
+	entity_slots_t slots = { 0 }; /* need to track num_instanced_vert here to find lights */
+	num_entity_work = 0;
+	R_ClearIQMPoseCache(&iqm_pose_cache);
 
-	const qboolean first_person_model = (cl_player_model->integer == CL_PLAYER_MODEL_FIRST_PERSON) && cl.baseclientinfo.model;
+	// cl_player_model is missing in the offline tools, which run without a client
+	const qboolean first_person_model = cl_player_model && (cl_player_model->integer == CL_PLAYER_MODEL_FIRST_PERSON) && cl.baseclientinfo.model;
 
 	for (int i = 0; i < vkpt_refdef.fd->num_entities; i++)
 	{
@@ -1917,7 +2122,7 @@ prepare_entities(EntityUploadInfo* upload_info)
 			else if (model->transparent)
 				transparent_model_indices[transparent_model_num++] = i;
 			else
-				process_bsp_entity(entity, &bsp_mesh_idx, &instance_idx, &num_instanced_vert); /* embedded in bsp */
+				queue_bsp_entity(entity, &slots); /* embedded in bsp */
 		}
 		else
 		{
@@ -1925,131 +2130,128 @@ prepare_entities(EntityUploadInfo* upload_info)
 			if (model == NULL || model->meshes == NULL)
 				continue;
 
-			if (entity->flags & RF_VIEWERMODEL)
-				viewer_model_indices[viewer_model_num++] = i;
-			else if (entity->flags & RF_WEAPONMODEL)
-				viewer_weapon_indices[viewer_weapon_num++] = i;
-			else if (model->model_class == MCLASS_EXPLOSION || model->model_class == MCLASS_SMOKE)
-				explosion_indices[explosion_num++] = i;
+			if ((entity->flags & (RF_VIEWERMODEL | RF_WEAPONMODEL)) || model->model_class == MCLASS_EXPLOSION || model->model_class == MCLASS_SMOKE)
+			{
+				if (entity->flags & RF_VIEWERMODEL)
+					viewer_model_indices[viewer_model_num++] = i;
+				else if (entity->flags & RF_WEAPONMODEL)
+					viewer_weapon_indices[viewer_weapon_num++] = i;
+				else
+					explosion_indices[explosion_num++] = i;
+
+				if (model->num_light_polys > 0)
+				{
+					const qboolean is_viewer_weapon = (entity->flags & RF_WEAPONMODEL) != 0;
+					queue_regular_entity(entity, model, is_viewer_weapon, qfalse, 0, qtrue, NULL, NULL, &slots);
+				}
+			}
 			else
 			{
 				qboolean contains_transparent = qfalse;
 				qboolean contains_masked = qfalse;
-				process_regular_entity(entity, model, qfalse, qfalse, &model_instance_idx, &instance_idx, &num_instanced_vert,
-					MESH_FILTER_OPAQUE, &contains_transparent, &contains_masked, &iqm_matrix_offset, qvk.iqm_matrices_shadow);
+				queue_regular_entity(entity, model, qfalse, qfalse, MESH_FILTER_OPAQUE, qtrue,
+					&contains_transparent, &contains_masked, &slots);
 
 				if (contains_transparent)
 					transparent_model_indices[transparent_model_num++] = i;
 				if (contains_masked)
 					masked_model_indices[masked_model_num++] = i;
 			}
-
-			if (model->num_light_polys > 0)
-			{
-				float transform[16];
-				const qboolean is_viewer_weapon = (entity->flags & RF_WEAPONMODEL) != 0;
-				create_entity_matrix(transform, (entity_t*)entity, is_viewer_weapon);
-
-				instance_model_lights(model->num_light_polys, model->light_polys, transform);
-			}
 		}
 	}
 
-	upload_info->dynamic_vertex_num = num_instanced_vert;
+	upload_info->dynamic_vertex_num = slots.num_instanced_vert;
 
-	const uint32_t transparent_model_base_vertex_num = num_instanced_vert;
+	const uint32_t transparent_model_base_vertex_num = slots.num_instanced_vert;
 	for (int i = 0; i < transparent_model_num; i++)
 	{
 		const entity_t* entity = vkpt_refdef.fd->entities + transparent_model_indices[i];
 
 		if (entity->model & 0x80000000)
 		{
-			process_bsp_entity(entity, &bsp_mesh_idx, &instance_idx, &num_instanced_vert);
+			queue_bsp_entity(entity, &slots);
 		}
 		else
 		{
 			const model_t* model = MOD_ForHandle(entity->model);
-			process_regular_entity(entity, model, qfalse, qfalse, &model_instance_idx, &instance_idx, &num_instanced_vert,
-				MESH_FILTER_TRANSPARENT, NULL, NULL, &iqm_matrix_offset, qvk.iqm_matrices_shadow);
+			queue_regular_entity(entity, model, qfalse, qfalse, MESH_FILTER_TRANSPARENT, qfalse, NULL, NULL, &slots);
 		}
 	}
 
 	upload_info->transparent_model_vertex_offset = transparent_model_base_vertex_num;
-	upload_info->transparent_model_vertex_num = num_instanced_vert - transparent_model_base_vertex_num;
+	upload_info->transparent_model_vertex_num = slots.num_instanced_vert - transparent_model_base_vertex_num;
 
-	const uint32_t masked_model_base_vertex_num = num_instanced_vert;
+	const uint32_t masked_model_base_vertex_num = slots.num_instanced_vert;
 	for (int i = 0; i < masked_model_num; i++)
 	{
 		const entity_t* entity = vkpt_refdef.fd->entities + masked_model_indices[i];
 
 		if (entity->model & 0x80000000)
 		{
-			process_bsp_entity(entity, &bsp_mesh_idx, &instance_idx, &num_instanced_vert);
+			queue_bsp_entity(entity, &slots);
 		}
 		else
 		{
 			const model_t* model = MOD_ForHandle(entity->model);
-			process_regular_entity(entity, model, qfalse, qtrue, &model_instance_idx, &instance_idx, &num_instanced_vert,
-				MESH_FILTER_MASKED, NULL, NULL, &iqm_matrix_offset, qvk.iqm_matrices_shadow);
+			queue_regular_entity(entity, model, qfalse, qtrue, MESH_FILTER_MASKED, qfalse, NULL, NULL, &slots);
 		}
 	}
 
 	upload_info->masked_model_vertex_offset = masked_model_base_vertex_num;
-	upload_info->masked_model_vertex_num = num_instanced_vert - masked_model_base_vertex_num;
+	upload_info->masked_model_vertex_num = slots.num_instanced_vert - masked_model_base_vertex_num;
 
-	const uint32_t viewer_model_base_vertex_num = num_instanced_vert;
+	const uint32_t viewer_model_base_vertex_num = slots.num_instanced_vert;
 	if (first_person_model)
 	{
 		for (int i = 0; i < viewer_model_num; i++)
 		{
 			const entity_t* entity = vkpt_refdef.fd->entities + viewer_model_indices[i];
 			const model_t* model = MOD_ForHandle(entity->model);
-			process_regular_entity(entity, model, qfalse, qtrue, &model_instance_idx, &instance_idx, &num_instanced_vert,
-				MESH_FILTER_ALL, NULL, NULL, &iqm_matrix_offset, qvk.iqm_matrices_shadow);
+			queue_regular_entity(entity, model, qfalse, qtrue, MESH_FILTER_ALL, qfalse, NULL, NULL, &slots);
 		}
 	}
 
 	upload_info->viewer_model_vertex_offset = viewer_model_base_vertex_num;
-	upload_info->viewer_model_vertex_num = num_instanced_vert - viewer_model_base_vertex_num;
+	upload_info->viewer_model_vertex_num = slots.num_instanced_vert - viewer_model_base_vertex_num;
 
 	upload_info->weapon_left_handed = qfalse;
 
-	const uint32_t viewer_weapon_base_vertex_num = num_instanced_vert;
+	const uint32_t viewer_weapon_base_vertex_num = slots.num_instanced_vert;
 	for (int i = 0; i < viewer_weapon_num; i++)
 	{
 		const entity_t* entity = vkpt_refdef.fd->entities + viewer_weapon_indices[i];
 		const model_t* model = MOD_ForHandle(entity->model);
-		process_regular_entity(entity, model, qtrue, qfalse, &model_instance_idx, &instance_idx, &num_instanced_vert,
-			MESH_FILTER_ALL, NULL, NULL, &iqm_matrix_offset, qvk.iqm_matrices_shadow);
+		queue_regular_entity(entity, model, qtrue, qfalse, MESH_FILTER_ALL, qfalse, NULL, NULL, &slots);
 
 		if (entity->flags & RF_LEFTHAND)
 			upload_info->weapon_left_handed = qtrue;
 	}
 
 	upload_info->viewer_weapon_vertex_offset = viewer_weapon_base_vertex_num;
-	upload_info->viewer_weapon_vertex_num = num_instanced_vert - viewer_weapon_base_vertex_num;
+	upload_info->viewer_weapon_vertex_num = slots.num_instanced_vert - viewer_weapon_base_vertex_num;
 
-	const uint32_t explosion_base_vertex_num = num_instanced_vert;
+	const uint32_t explosion_base_vertex_num = slots.num_instanced_vert;
 	for (int i = 0; i < explosion_num; i++)
 	{
 		const entity_t* entity = vkpt_refdef.fd->entities + explosion_indices[i];
 		const model_t* model = MOD_ForHandle(entity->model);
-		process_regular_entity(entity, model, qfalse, qfalse, &model_instance_idx, &instance_idx, &num_instanced_vert,
-			MESH_FILTER_ALL, NULL, NULL, &iqm_matrix_offset, qvk.iqm_matrices_shadow);
+		queue_regular_entity(entity, model, qfalse, qfalse, MESH_FILTER_ALL, qfalse, NULL, NULL, &slots);
 	}
 
 	upload_info->explosions_vertex_offset = explosion_base_vertex_num;
-	upload_info->explosions_vertex_num = num_instanced_vert - explosion_base_vertex_num;
+	upload_info->explosions_vertex_num = slots.num_instanced_vert - explosion_base_vertex_num;
+
+	upload_info->num_instances = slots.instance_idx;
+	upload_info->num_vertices  = slots.num_instanced_vert;
 
-	upload_info->num_instances = instance_idx;
-	upload_info->num_vertices  = num_instanced_vert;
+	process_queued_entities(&slots);
 
 	memset(instance_buffer->world_current_to_prev, ~0u, sizeof(instance_buffer->world_current_to_prev));
 	memset(instance_buffer->world_prev_to_current, ~0u, sizeof(instance_buffer->world_prev_to_current));
 	memset(instance_buffer->model_current_to_prev, ~0u, sizeof(instance_buffer->model_current_to_prev));
 	memset(instance_buffer->model_prev_to_current, ~0u, sizeof(instance_buffer->model_prev_to_current));
 
-	world_entity_id_count[entity_frame_num] = bsp_mesh_idx;
+	world_entity_id_count[entity_frame_num] = slots.bsp_mesh_idx;
 	for(int i = 0; i < world_entity_id_count[entity_frame_num]; i++) {
 		for(int j = 0; j < world_entity_id_count[!entity_frame_num]; j++) {
 			if(world_entity_ids[entity_frame_num][i] == world_entity_ids[!entity_frame_num][j]) {
@@ -2059,7 +2261,7 @@ prepare_entities(EntityUploadInfo* upload_info)
 		}
 	}
 
-	model_entity_id_count[entity_frame_num] = model_instance_idx;
+	model_entity_id_count[entity_frame_num] = slots.model_instance_idx;
 	for(int i = 0; i < model_entity_id_count[entity_frame_num]; i++) {
 		for(int j = 0; j < model_entity_id_count[!entity_frame_num]; j++) {
 			entity_hash_t hash = *(entity_hash_t*)&model_entity_ids[entity_frame_num][i];
@@ -2072,7 +2274,7 @@ prepare_entities(EntityUploadInfo* upload_info)
 	}
 
 	// Store the number of IQM matrices for the next frame
-	iqm_matrix_count[entity_frame_num] = iqm_matrix_offset;
+	iqm_matrix_count[entity_frame_num] = slots.iqm_matrix_offset;
 
 	if (iqm_matrix_count[entity_frame_num] > 0)
 	{
@@ -2096,15 +2298,22 @@ prepare_entities(EntityUploadInfo* upload_info)
 
 		// Store the current matrices for the next frame
 		memcpy(qvk.iqm_matrices_prev, qvk.iqm_matrices_shadow, iqm_matrix_count[entity_frame_num] * 12 * sizeof(float));
+	}
+}
 
-		// Upload the current matrices to the staging buffer
-		IqmMatrixBuffer* iqm_matrix_staging = buffer_map(&qvk.buf_iqm_matrices_staging[qvk.current_frame_index]);
+/* copies the IQM matrices from prepare_entities to the staging buffer */
+static void
+upload_iqm_matrices_to_staging(void)
+{
+	if (iqm_matrix_count[entity_frame_num] == 0)
+		return;
 
-		int total_matrix_count = (iqm_matrix_count[entity_frame_num] + iqm_matrix_count[!entity_frame_num]);
-		memcpy(iqm_matrix_staging, qvk.iqm_matrices_shadow, total_matrix_count * 12 * sizeof(float));
+	IqmMatrixBuffer* iqm_matrix_staging = buffer_map(&qvk.buf_iqm_matrices_staging[qvk.current_frame_index]);
 
-		buffer_unmap(&qvk.buf_iqm_matrices_staging[qvk.current_frame_index]);
-	}
+	int total_matrix_count = (iqm_matrix_count[entity_frame_num] + iqm_matrix_count[!entity_frame_num]);
+	memcpy(iqm_matrix_staging, qvk.iqm_matrices_shadow, total_matrix_count * 12 * sizeof(float));
+
+	buffer_unmap(&qvk.buf_iqm_matrices_staging[qvk.current_frame_index]);
 }
 
 #ifdef VKPT_IMAGE_DUMPS
@@ -2213,6 +2422,7 @@ process_render_feedback(ref_feedback_t *feedback, mleaf_t* viewleaf, qboolean* s
 			int material_id = readback.material & MATERIAL_INDEX_MASK;
 			feedback->view_material_index = material_id;
 			pbr_material_t const* material = MAT_ForIndex(material_id);
+			vkpt_textures_touch_material(material);
 			if (material)
 			{
 				image_t const* image = material->image_base;
@@ -2625,6 +2835,370 @@ prepare_ubo(refdef_t *fd, mleaf_t* viewleaf, const reference_mode_t* ref_mode, c
 }
 
 
+/* runs func on each map named from argument first_arg on, or on all maps,
+   loaded as the world without any of the uploads; no map may be loaded */
+static int
+for_each_tool_map(int first_arg, void (*func)(const char *map_name, void *arg), void *arg)
+{
+	void **list = NULL;
+	int count = Cmd_Argc() - first_arg;
+	int done = 0;
+
+	if (count <= 0)
+		list = FS_ListFiles("maps", ".bsp", FS_SEARCH_STRIPEXT, &count);
+
+	for (int i = 0; i < count; i++)
+	{
+		const char *map_name = list ? (const char *)list[i] : Cmd_Argv(first_arg + i);
+		char bsp_path[MAX_QPATH];
+
+		Q_concat(bsp_path, sizeof(bsp_path), "maps/", map_name, ".bsp", NULL);
+		qerror_t ret = BSP_Load(bsp_path, &bsp_world_model);
+		if (!bsp_world_model)
+		{
+			Com_EPrintf("Couldn't load %s: %s\n", bsp_path, Q_ErrorString(ret));
+			continue;
+		}
+
+		bsp_mesh_register_textures(bsp_world_model);
+		bsp_mesh_create_from_bsp(&vkpt_refdef.bsp_mesh_world, bsp_world_model, map_name);
+
+		func(map_name, arg);
+		done++;
+
+		bsp_mesh_destroy(&vkpt_refdef.bsp_mesh_world);
+		BSP_Free(bsp_world_model);
+		bsp_world_model = NULL;
+	}
+
+	if (list)
+		FS_FreeList(list);
+
+	return done;
+}
+
+/* CPU time spent in the stages of R_RenderFrame_RTX, captured over a number of
+   frames by pt_cpu_stages and compared against the previous capture */
+typedef enum {
+	CPU_STAGE_SETUP,
+	CPU_STAGE_ENTITIES,
+	CPU_STAGE_UBO,
+	CPU_STAGE_LIGHTS,
+	CPU_STAGE_TRANSPARENCY,
+	CPU_STAGE_SUBMIT_TRANSFER,
+	CPU_STAGE_INSTANCES,
+	CPU_STAGE_ACCEL,
+	CPU_STAGE_RECORD,
+	CPU_STAGE_COUNT
+} cpu_stage_t;
+
+static const char *cpu_stage_names[CPU_STAGE_COUNT] = {
+	"setup",
+	"entities",
+	"ubo",
+	"lights",
+	"transparency",
+	"transfer",
+	"instances",
+	"accel",
+	"record",
+};
+
+/* the stages that run without a device, on synthetic frames */
+#define CPU_STAGES_HEADLESS ((1 << CPU_STAGE_ENTITIES) | (1 << CPU_STAGE_LIGHTS) | (1 << CPU_STAGE_TRANSPARENCY))
+
+#define CPU_STAGES_DEFAULT_FRAMES 500
+#define CPU_STAGES_REGRESSION 1.1
+
+#define CPU_STAGES_PARTICLES 4096
+#define CPU_STAGES_BEAMS 32
+#define CPU_STAGES_LUMINANCE 0.005f
+
+static struct {
+	int frames_left;
+	int frames;
+	qboolean headless;
+	uint64_t usec[CPU_STAGE_COUNT + 1];
+	uint64_t max_usec[CPU_STAGE_COUNT + 1];
+	double prev_ms[CPU_STAGE_COUNT + 1];
+	qboolean have_prev;
+} cpu_stages;
+
+/* charges the time since *mark to the stage and advances the mark */
+static inline void
+cpu_stage_end(uint64_t *usec, cpu_stage_t stage, uint64_t *mark)
+{
+	if (!cpu_stages.frames_left)
+		return;
+
+	uint64_t now = Sys_Microseconds();
+	usec[stage] += now - *mark;
+	*mark = now;
+}
+
+static void
+cpu_stages_start(int frames, qboolean headless)
+{
+	memset(cpu_stages.usec, 0, sizeof(cpu_stages.usec));
+	memset(cpu_stages.max_usec, 0, sizeof(cpu_stages.max_usec));
+	cpu_stages.frames = 0;
+	cpu_stages.frames_left = frames;
+
+	// synthetic frames don't compare with rendered ones
+	if (headless != cpu_stages.headless)
+		cpu_stages.have_prev = qfalse;
+	cpu_stages.headless = headless;
+}
+
+static void
+cpu_stages_report(void)
+{
+	int regressions = 0;
+
+	Com_Printf("%-12s %9s %9s %9s %8s\n", "stage", "avg ms", "max ms", "prev ms", "change");
+
+	for (int i = 0; i <= CPU_STAGE_COUNT; i++)
+	{
+		double avg_ms = (double)cpu_stages.usec[i] * 1e-3 / cpu_stages.frames;
+		double max_ms = (double)cpu_stages.max_usec[i] * 1e-3;
+		const char *name = i < CPU_STAGE_COUNT ? cpu_stage_names[i] : "frame";
+
+		if (i < CPU_STAGE_COUNT && cpu_stages.headless && !(CPU_STAGES_HEADLESS & (1 << i)))
+			continue;
+
+		if (!cpu_stages.have_prev)
+		{
+			Com_Printf("%-12s %9.3f %9.3f\n", name, avg_ms, max_ms);
+		}
+		else
+		{
+			double prev_ms = cpu_stages.prev_ms[i];
+			double change = prev_ms > 0.0 ? (avg_ms / prev_ms - 1.0) * 100.0 : 0.0;
+
+			// ignore stages that are too short to measure reliably
+			qboolean regressed = avg_ms > prev_ms * CPU_STAGES_REGRESSION && avg_ms - prev_ms > 0.01;
+			if (regressed)
+				regressions++;
+
+			Com_Printf("%-12s %9.3f %9.3f %9.3f %+7.1f%%%s\n", name, avg_ms, max_ms, prev_ms, change, regressed ? " !" : "");
+		}
+
+		cpu_stages.prev_ms[i] = avg_ms;
+	}
+
+	if (cpu_stages.have_prev)
+		Com_Printf("%d frames, %d regressions\n", cpu_stages.frames, regressions);
+	else
+		Com_Printf("%d frames\n", cpu_stages.frames);
+
+	cpu_stages.have_prev = qtrue;
+}
+
+/* adds a finished frame to the capture */
+static void
+cpu_stages_frame(const uint64_t *usec, uint64_t frame_start)
+{
+	if (!cpu_stages.frames_left)
+		return;
+
+	uint64_t total = Sys_Microseconds() - frame_start;
+
+	for (int i = 0; i <= CPU_STAGE_COUNT; i++)
+	{
+		uint64_t t = i < CPU_STAGE_COUNT ? usec[i] : total;
+		cpu_stages.usec[i] += t;
+		cpu_stages.max_usec[i] = max(cpu_stages.max_usec[i], t);
+	}
+
+	cpu_stages.frames++;
+
+	if (--cpu_stages.frames_left == 0)
+		cpu_stages_report();
+}
+
+static entity_t cpu_stages_entities[MAX_ENTITIES];
+static particle_t cpu_stages_particles[CPU_STAGES_PARTICLES];
+static lightstyle_t cpu_stages_lightstyles[MAX_LIGHTSTYLES];
+
+/* a frame on the loaded map: the view steps through the clusters, the inline
+   models move up and down, beams circle the view in a cloud of particles */
+static void
+synthesize_cpu_stages_frame(refdef_t *fd, int frame, float *view_matrix)
+{
+	const bsp_mesh_t *wm = &vkpt_refdef.bsp_mesh_world;
+	const float time = frame * 0.016f;
+	const aabb_t *aabb = wm->num_clusters > 0 ? &wm->cluster_aabbs[(frame / 16) % wm->num_clusters] : &wm->world_aabb;
+
+	fd->time = time;
+	VectorAvg(aabb->mins, aabb->maxs, fd->vieworg);
+	VectorSet(fd->viewangles, 0.f, time * 30.f, 0.f);
+	create_view_matrix(view_matrix, fd);
+
+	for (int i = 0; i < MAX_LIGHTSTYLES; i++)
+		cpu_stages_lightstyles[i].white = 0.75f + 0.25f * sinf(time * 4.f + i);
+
+	fd->num_entities = 0;
+
+	for (int i = 1; i < wm->num_models && fd->num_entities < SHADER_MAX_BSP_ENTITIES; i++)
+	{
+		entity_t *e = fd->entities + fd->num_entities++;
+
+		memset(e, 0, sizeof(*e));
+		e->model = ~i;
+		e->id = fd->num_entities;
+		e->origin[2] = 32.f * sinf(time + i);
+		VectorCopy(e->origin, e->oldorigin);
+	}
+
+	for (int i = 0; i < CPU_STAGES_BEAMS; i++)
+	{
+		entity_t *e = fd->entities + fd->num_entities++;
+		float angle = time + i * (2.f * M_PI / CPU_STAGES_BEAMS);
+
+		memset(e, 0, sizeof(*e));
+		e->flags = RF_BEAM;
+		e->frame = (i & 1) ? 4 : 16;
+		e->skinnum = 0xd0 + (i & 7);
+		e->alpha = 0.3f;
+		e->id = fd->num_entities;
+		VectorSet(e->origin, fd->vieworg[0] + cosf(angle) * 128.f, fd->vieworg[1] + sinf(angle) * 128.f, fd->vieworg[2] - 32.f);
+		VectorSet(e->oldorigin, e->origin[0], e->origin[1], fd->vieworg[2] + 32.f);
+	}
+
+	fd->num_particles = CPU_STAGES_PARTICLES;
+
+	for (int i = 0; i < CPU_STAGES_PARTICLES; i++)
+	{
+		particle_t *p = fd->particles + i;
+		float angle = time + i * 2.39996f;
+		float radius = 16.f + (i & 63) * 4.f;
+
+		VectorSet(p->origin, fd->vieworg[0] + cosf(angle) * radius, fd->vieworg[1] + sinf(angle) * radius, fd->vieworg[2] + (i & 31) * 4.f - 64.f);
+		p->color = i & 0xff;
+		p->alpha = 0.5f + 0.5f * sinf(time + i);
+		p->brightness = 1.f;
+		p->radius = (i & 1) ? 0.f : 2.f;
+	}
+}
+
+/* runs the CPU stages on synthetic frames of the loaded map, with host
+   memory in place of the staging buffers */
+static void
+cpu_stages_run_map(const char *map_name, void *arg)
+{
+	const int frames = *(const int *)arg;
+	static refdef_t fd;
+	LightBuffer *light_buffers[MAX_FRAMES_IN_FLIGHT];
+	char *geometry[MAX_FRAMES_IN_FLIGHT];
+	const vec3_t sky_radiance = { 1.f, 1.f, 1.f };
+	refdef_t *prev_fd = vkpt_refdef.fd;
+	int anim_frame = -1;
+
+	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		light_buffers[i] = Z_Mallocz(sizeof(LightBuffer));
+		geometry[i] = Z_Malloc(get_transparency_frame_size());
+	}
+
+	memset(&fd, 0, sizeof(fd));
+	fd.entities = cpu_stages_entities;
+	fd.particles = cpu_stages_particles;
+	fd.lightstyles = cpu_stages_lightstyles;
+	vkpt_refdef.fd = &fd;
+	vkpt_light_buffer_reset_counts();
+
+	for (int frame = 0; frame < frames; frame++)
+	{
+		int buffer = frame % MAX_FRAMES_IN_FLIGHT;
+		float view_matrix[16];
+
+		synthesize_cpu_stages_frame(&fd, frame, view_matrix);
+
+		uint64_t frame_start = Sys_Microseconds();
+		uint64_t stage_mark = frame_start;
+		uint64_t stage_usec[CPU_STAGE_COUNT] = { 0 };
+
+		num_model_lights = 0;
+		EntityUploadInfo upload_info = { 0 };
+		prepare_entities(&upload_info);
+		vkpt_build_beam_lights(model_lights, &num_model_lights, MAX_MODEL_LIGHTS, bsp_world_model, fd.entities, fd.num_entities, CPU_STAGES_LUMINANCE);
+		cpu_stage_end(stage_usec, CPU_STAGE_ENTITIES, &stage_mark);
+
+		if (anim_frame != (int)(fd.time * 2))
+		{
+			anim_frame = (int)(fd.time * 2);
+			bsp_mesh_animate_light_polys(&vkpt_refdef.bsp_mesh_world);
+		}
+		vkpt_light_buffer_fill(light_buffers[buffer], buffer, qtrue, &vkpt_refdef.bsp_mesh_world, bsp_world_model, num_model_lights, model_lights, sky_radiance);
+		cpu_stage_end(stage_usec, CPU_STAGE_LIGHTS, &stage_mark);
+
+		write_transparency(geometry[buffer], fd.vieworg, view_matrix, fd.particles, fd.num_particles, fd.entities, fd.num_entities);
+		cpu_stage_end(stage_usec, CPU_STAGE_TRANSPARENCY, &stage_mark);
+
+		cpu_stages_frame(stage_usec, frame_start);
+	}
+
+	Com_Printf("%s: %d inline models, %d light polys\n", map_name, vkpt_refdef.bsp_mesh_world.num_models - 1, vkpt_refdef.bsp_mesh_world.num_light_polys);
+
+	vkpt_refdef.fd = prev_fd;
+	vkpt_light_buffer_reset_counts();
+
+	for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+	{
+		Z_Free(light_buffers[i]);
+		Z_Free(geometry[i]);
+	}
+}
+
+/*
+================
+vkpt_cpu_stages_f
+
+pt_cpu_stages [frames] [maps...]
+
+With a map loaded, times the CPU stages of the next rendered frames. Without
+one, which includes "+set dedicated 1" on machines without a GPU, runs the
+stages that don't need a device on synthetic frames of the given maps, or of
+all of them: entity preparation, the light buffer and the transparency
+geometry, written to host memory instead of the staging buffers.
+================
+*/
+static void
+vkpt_cpu_stages_f(void)
+{
+	int frames = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : CPU_STAGES_DEFAULT_FRAMES;
+
+	if (frames <= 0)
+	{
+		Com_Printf("Usage: %s [frames] [maps...]\n", Cmd_Argv(0));
+		return;
+	}
+
+	if (vkpt_refdef.bsp_mesh_world_loaded)
+	{
+		if (Cmd_Argc() > 2)
+		{
+			Com_Printf("Can't load other maps while a map is loaded.\n");
+			return;
+		}
+
+		cpu_stages_start(frames, qfalse);
+		Com_Printf("Capturing CPU stage times for the next %d frames.\n", frames);
+		return;
+	}
+
+	// beam colors use the client's pt_particle_emissive, which a dedicated session doesn't register
+	FX_Init();
+
+	// armed for all maps, reported once at the end
+	cpu_stages_start(INT_MAX, qtrue);
+	int maps = for_each_tool_map(2, cpu_stages_run_map, &frames);
+	cpu_stages.frames_left = 0;
+
+	if (maps)
+		cpu_stages_report();
+}
+
 /* renders the map ingame */
 void
 R_RenderFrame_RTX(refdef_t *fd)
@@ -2632,6 +3206,10 @@ R_RenderFrame_RTX(refdef_t *fd)
 	if (!qvk.swap_chain)
 		return;
 
+	uint64_t frame_start = cpu_stages.frames_left ? Sys_Microseconds() : 0;
+	uint64_t stage_mark = frame_start;
+	uint64_t stage_usec[CPU_STAGE_COUNT] = { 0 };
+
 	vkpt_refdef.fd = fd;
 	qboolean render_world = (fd->rdflags & RDF_NOWORLDMODEL) == 0;
 
@@ -2661,6 +3239,9 @@ R_RenderFrame_RTX(refdef_t *fd)
 	float adapted_luminance = 0.f;
 	process_render_feedback(&fd->feedback, viewleaf, &sun_visible_prev, &adapted_luminance);
 
+	if (bsp_world_model && vkpt_refdef.bsp_mesh_world_loaded)
+		vkpt_textures_touch_visible(&vkpt_refdef.bsp_mesh_world, bsp_world_model, viewleaf ? viewleaf->cluster : -1);
+
 	// Sometimes, the readback returns 1.0 luminance instead of the real value.
 	// Ignore these mysterious spikes.
 	if (adapted_luminance != 1.0f) 
@@ -2695,13 +3276,17 @@ R_RenderFrame_RTX(refdef_t *fd)
 	qboolean update_world_animations = (new_world_anim_frame != world_anim_frame);
 	world_anim_frame = new_world_anim_frame;
 
+	cpu_stage_end(stage_usec, CPU_STAGE_SETUP, &stage_mark);
+
 	num_model_lights = 0;
 	EntityUploadInfo upload_info = { 0 };
 	prepare_entities(&upload_info);
+	upload_iqm_matrices_to_staging();
 	if (bsp_world_model)
 	{
 		vkpt_build_beam_lights(model_lights, &num_model_lights, MAX_MODEL_LIGHTS, bsp_world_model, fd->entities, fd->num_entities, prev_adapted_luminance);
 	}
+	cpu_stage_end(stage_usec, CPU_STAGE_ENTITIES, &stage_mark);
 
 	QVKUniformBuffer_t *ubo = &vkpt_refdef.uniform_buffer;
 	prepare_ubo(fd, viewleaf, &ref_mode, sky_matrix, render_world);
@@ -2714,12 +3299,17 @@ R_RenderFrame_RTX(refdef_t *fd)
 
 	vkpt_physical_sky_update_ubo(ubo, &sun_light, render_world);
 	vkpt_bloom_update(ubo, frame_time, ubo->medium != MEDIUM_NONE, menu_mode);
+	cpu_stage_end(stage_usec, CPU_STAGE_UBO, &stage_mark);
 
 	if(update_world_animations)
 		bsp_mesh_animate_light_polys(&vkpt_refdef.bsp_mesh_world);
 	vec3_t sky_radiance;
 	VectorScale(avg_envmap_color, ubo->pt_env_scale, sky_radiance);
 	vkpt_light_buffer_upload_to_staging(render_world, &vkpt_refdef.bsp_mesh_world, bsp_world_model, num_model_lights, model_lights, sky_radiance);
+	cpu_stage_end(stage_usec, CPU_STAGE_LIGHTS, &stage_mark);
+
+	prepare_transparency(ubo->V, fd->particles, fd->num_particles, fd->entities, fd->num_entities);
+	cpu_stage_end(stage_usec, CPU_STAGE_TRANSPARENCY, &stage_mark);
 	
 	float shadowmap_view_proj[16];
 	float shadowmap_depth_scale;
@@ -2777,12 +3367,13 @@ R_RenderFrame_RTX(refdef_t *fd)
 			VK_NULL_HANDLE);
 
 		*prev_trace_signaled = qfalse;
+		cpu_stage_end(stage_usec, CPU_STAGE_SUBMIT_TRANSFER, &stage_mark);
 	}
 
 	{
 		VkCommandBuffer trace_cmd_buf = vkpt_begin_command_buffer(&qvk.cmd_buffers_graphics);
 
-		update_transparency(trace_cmd_buf, ubo->V, fd->particles, fd->num_particles, fd->entities, fd->num_entities);
+		upload_transparency(trace_cmd_buf);
 
 		_VK(vkpt_uniform_buffer_update(trace_cmd_buf));
 
@@ -2797,9 +3388,11 @@ R_RenderFrame_RTX(refdef_t *fd)
 		}
 		END_PERF_MARKER(trace_cmd_buf, PROFILER_UPDATE_ENVIRONMENT);
 
+		cpu_stage_end(stage_usec, CPU_STAGE_RECORD, &stage_mark);
 		BEGIN_PERF_MARKER(trace_cmd_buf, PROFILER_INSTANCE_GEOMETRY);
 		vkpt_instance_geometry(trace_cmd_buf, upload_info.num_instances, update_world_animations);
 		END_PERF_MARKER(trace_cmd_buf, PROFILER_INSTANCE_GEOMETRY);
+		cpu_stage_end(stage_usec, CPU_STAGE_INSTANCES, &stage_mark);
 
 		BEGIN_PERF_MARKER(trace_cmd_buf, PROFILER_BVH_UPDATE);
 		assert(upload_info.num_vertices % 3 == 0);
@@ -2807,6 +3400,7 @@ R_RenderFrame_RTX(refdef_t *fd)
 		vkpt_pt_create_toplevel(trace_cmd_buf, qvk.current_frame_index, render_world, upload_info.weapon_left_handed);
 		vkpt_pt_update_descripter_set_bindings(qvk.current_frame_index);
 		END_PERF_MARKER(trace_cmd_buf, PROFILER_BVH_UPDATE);
+		cpu_stage_end(stage_usec, CPU_STAGE_ACCEL, &stage_mark);
 
 		BEGIN_PERF_MARKER(trace_cmd_buf, PROFILER_SHADOW_MAP);
 		if (god_rays_enabled)
@@ -2940,6 +3534,9 @@ R_RenderFrame_RTX(refdef_t *fd)
 		vkpt_submit_command_buffer_simple(post_cmd_buf, qvk.queue_graphics, qtrue);
 	}
 
+	cpu_stage_end(stage_usec, CPU_STAGE_RECORD, &stage_mark);
+	cpu_stages_frame(stage_usec, frame_start);
+
 	temporal_frame_valid = ref_mode.enable_denoiser;
 	
 	frame_ready = qtrue;
@@ -3158,6 +3755,7 @@ retry:;
 	}
 
 	vkpt_textures_destroy_unused();
+	vkpt_textures_update_residency();
 	vkpt_textures_end_registration();
 	vkpt_textures_update_descriptor_set();
 
@@ -3310,6 +3908,29 @@ vkpt_show_pvs(void)
 	cluster_debug_index = vkpt_refdef.fd->feedback.lookatcluster;
 }
 
+static void
+light_lists_bench_map(const char *map_name, void *arg)
+{
+	Com_Printf("%s:\n", map_name);
+	vkpt_light_lists_bench(&vkpt_refdef.bsp_mesh_world, bsp_world_model);
+}
+
+/* on the current map, or without one on the given maps or all of them */
+static void
+vkpt_light_lists_bench_f(void)
+{
+	if (vkpt_refdef.bsp_mesh_world_loaded)
+	{
+		if (Cmd_Argc() > 3)
+			Com_Printf("Can't load other maps while a map is loaded.\n");
+		else
+			vkpt_light_lists_bench(&vkpt_refdef.bsp_mesh_world, bsp_world_model);
+		return;
+	}
+
+	for_each_tool_map(3, light_lists_bench_map, NULL);
+}
+
 static float halton(int base, int index) {
 	float f = 1.f;
 	float r = 0.f;
@@ -3332,20 +3953,12 @@ static void ray_tracing_api_g(genctx_t *ctx)
 	Prompt_AddMatch(ctx, "pipeline");
 }
 
-/* called when the library is loaded */
-qboolean
-R_Init_RTX(qboolean total)
+/* cvars and the CPU side subsystems, shared by the renderer and the offline tools */
+static void
+init_cpu_state(void)
 {
 	registration_sequence = 1;
 
-	if (!VID_Init(GAPI_VULKAN)) {
-		Com_Error(ERR_FATAL, "VID_Init failed\n");
-		return qfalse;
-	}
-
-	extern SDL_Window *sdl_window;
-	qvk.window = sdl_window;
-
 	cvar_profiler = Cvar_Get("profiler", "0", 0);
 	cvar_vsync = Cvar_Get("vid_vsync", "0", CVAR_REFRESH | CVAR_ARCHIVE);
 	cvar_vsync->changed = NULL; // in case the GL renderer has set it
@@ -3399,6 +4012,33 @@ R_Init_RTX(qboolean total)
 	cvar_pt_nearest = Cvar_Get("pt_nearest", "0", CVAR_ARCHIVE);
 	cvar_pt_nearest->changed = pt_nearest_changed;
 
+	// store processed normal maps and emissive textures under texcache/
+	cvar_pt_texture_cache = Cvar_Get("pt_texture_cache", "1", 0);
+	// megabytes the texture cache may grow to before the oldest entries are removed
+	cvar_pt_texture_cache_size = Cvar_Get("pt_texture_cache_size", "2048", CVAR_ARCHIVE);
+
+	// store the processed world mesh and light lists under meshcache/
+	cvar_pt_world_cache = Cvar_Get("pt_world_cache", "1", 0);
+
+	// cluster light lists skip polygons covering a smaller solid angle than
+	// this as seen from the cluster bounds; off by default because any
+	// cutoff can drop light, compare with pt_cluster_lights_bench first
+	cvar_pt_cluster_light_cutoff = Cvar_Get("pt_cluster_light_cutoff", "0", 0);
+
+	// upload albedo and emissive textures as BC1/BC3 when the GPU supports it
+	cvar_pt_texture_compression = Cvar_Get("pt_texture_compression", "1", CVAR_REFRESH);
+
+	// texture streaming: budget in MB for all textures, 0 keeps everything
+	// resident; textures registered while it is 0 are never streamed
+	cvar_pt_texture_budget = Cvar_Get("pt_texture_budget", "0", CVAR_ARCHIVE);
+	// largest mip of a streamed texture that always stays resident
+	cvar_pt_texture_stream_size = Cvar_Get("pt_texture_stream_size", "128", 0);
+	// MB of full textures uploaded per frame
+	cvar_pt_texture_upload_limit = Cvar_Get("pt_texture_upload_limit", "16", 0);
+
+	// store parsed .mat files under matcache/ and load them from there while unchanged
+	cvar_pt_material_db = Cvar_Get("pt_material_db", "1", 0);
+
 #ifdef VKPT_DEVICE_GROUPS
 	cvar_sli = Cvar_Get("sli", "1", CVAR_REFRESH | CVAR_ARCHIVE);
 #endif
@@ -3455,11 +4095,29 @@ R_Init_RTX(qboolean total)
 
 	cvar_pt_num_bounce_rays->flags |= CVAR_ARCHIVE;
 
-	qvk.win_width  = r_config.width;
-	qvk.win_height = r_config.height;
+	register_transparency_cvars();
 
 	IMG_Init();
 	IMG_GetPalette();
+}
+
+/* called when the library is loaded */
+qboolean
+R_Init_RTX(qboolean total)
+{
+	if (!VID_Init(GAPI_VULKAN)) {
+		Com_Error(ERR_FATAL, "VID_Init failed\n");
+		return qfalse;
+	}
+
+	extern SDL_Window *sdl_window;
+	qvk.window = sdl_window;
+
+	init_cpu_state();
+
+	qvk.win_width  = r_config.width;
+	qvk.win_height = r_config.height;
+
 	MOD_Init();
 	
 	if(!init_vulkan()) {
@@ -3480,6 +4138,7 @@ R_Init_RTX(qboolean total)
 	Cmd_AddCommand("reload_textures", (xcommand_t)&vkpt_reload_textures);
 	Cmd_AddCommand("show_pvs", (xcommand_t)&vkpt_show_pvs);
 	Cmd_AddCommand("next_sun", (xcommand_t)&vkpt_next_sun_preset);
+	Cmd_AddCommand("pt_world_mesh_memory", (xcommand_t)&vkpt_vertex_buffer_memory_f);
 #if CL_RTX_SHADERBALLS
 	Cmd_AddCommand("drop_balls", (xcommand_t)&vkpt_drop_shaderballs);
 #endif
@@ -3509,6 +4168,7 @@ R_Shutdown_RTX(qboolean total)
 	Cmd_RemoveCommand("reload_textures");
 	Cmd_RemoveCommand("show_pvs");
 	Cmd_RemoveCommand("next_sun");
+	Cmd_RemoveCommand("pt_world_mesh_memory");
 #if CL_RTX_SHADERBALLS
 	Cmd_RemoveCommand("drop_balls");
 #endif
@@ -3529,6 +4189,92 @@ R_Shutdown_RTX(qboolean total)
 	VID_Shutdown();
 }
 
+/*
+================
+OFFLINE TOOLS
+
+Tests, benchmarks and cache builders that only use the CPU side of the
+renderer. The client registers them at startup, before any renderer is
+initialized, so they also work on machines without a GPU: with
+"+set dedicated 1" no window or device is created, and the CPU state is
+brought up for the duration of each command instead. With the RTX renderer
+running, the benchmarks that take maps use the loaded one.
+================
+*/
+
+typedef struct {
+	const char *name;
+	xcommand_t func;
+} vkpt_tool_t;
+
+static const vkpt_tool_t vkpt_tools[] = {
+	{ "texture_kernel_test", vkpt_textures_kernel_test },
+	{ "texture_residency_test", vkpt_residency_test },
+	{ "material_db_test", MAT_DatabaseTest },
+	{ "pt_build_world_cache", bsp_mesh_build_cache_f },
+	{ "pt_cluster_lights_bench", bsp_mesh_cluster_lights_bench_f },
+	{ "pt_light_lists_bench", vkpt_light_lists_bench_f },
+	{ "pt_transparency_bench", vkpt_transparency_bench_f },
+	{ "pt_cpu_stages", vkpt_cpu_stages_f },
+};
+
+static qboolean tools_cpu_state;
+
+static void
+shutdown_tools_cpu_state(void)
+{
+	MAT_Shutdown();
+	IMG_FreeAll();
+	IMG_Shutdown();
+	tools_cpu_state = qfalse;
+}
+
+static void
+vkpt_run_tool(void)
+{
+	const vkpt_tool_t *tool = NULL;
+	qboolean headless = !cls.ref_initialized;
+
+	for (int i = 0; i < q_countof(vkpt_tools); i++)
+	{
+		if (!strcmp(vkpt_tools[i].name, Cmd_Argv(0)))
+			tool = &vkpt_tools[i];
+	}
+
+	if (!tool)
+		return;
+
+	if (!headless && R_Init != R_Init_RTX)
+	{
+		Com_Printf("%s needs the RTX renderer, set vid_rtx to 1 or run with +set dedicated 1.\n", tool->name);
+		return;
+	}
+
+	if (headless)
+	{
+		// left over if the previous tool was stopped by an error
+		if (tools_cpu_state)
+			shutdown_tools_cpu_state();
+
+		// image loading goes through the renderer's function pointers
+		R_RegisterFunctionsRTX();
+		init_cpu_state();
+		tools_cpu_state = qtrue;
+	}
+
+	tool->func();
+
+	if (headless)
+		shutdown_tools_cpu_state();
+}
+
+void
+R_RegisterToolsRTX(void)
+{
+	for (int i = 0; i < q_countof(vkpt_tools); i++)
+		Cmd_AddCommand(vkpt_tools[i].name, vkpt_run_tool);
+}
+
 // for screenshots
 byte *
 IMG_ReadPixels_RTX(int *width, int *height, int *rowbytes)
@@ -4040,6 +4786,12 @@ void R_RegisterFunctionsRTX()
 	MOD_LoadMD3 = MOD_LoadMD3_RTX;
 	MOD_LoadIQM = MOD_LoadIQM_RTX;
 	MOD_Reference = MOD_Reference_RTX;
+	MOD_ParseMD2 = MOD_ParseMD2_RTX;
+	MOD_FinalizeMD2 = MOD_FinalizeMD2_RTX;
+	MOD_ParseMD3 = MOD_ParseMD3_RTX;
+	MOD_FinalizeMD3 = MOD_FinalizeMD3_RTX;
+	MOD_ParseIQM = MOD_ParseIQM_RTX;
+	MOD_FinalizeIQM = MOD_FinalizeIQM_RTX;
 }
 
 // vim: shiftwidth=4 noexpandtab tabstop=4 cindent
@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 extern cvar_t *cvar_pt_surface_lights_fake_emissive_algo;
 extern cvar_t* cvar_pt_surface_lights_threshold;
+extern cvar_t *cvar_pt_material_db;
 
 extern void CL_PrepRefresh();
 
@@ -42,7 +43,21 @@ static list_t r_materialsHash[RMATERIALS_HASH];
 #define RELOAD_MAP		1
 #define RELOAD_EMISSIVE	2
 
+// stamp of one source .mat file, compared against the compiled database
+typedef struct {
+	char path[MAX_QPATH];
+	uint32_t source;        // IF_SRC_GAME or IF_SRC_BASE, 0 if the file doesn't exist
+	uint32_t size;
+	uint64_t stamp;         // FS_FileStamp, also covers files in packs
+} matdb_source_t;
+
+static matdb_source_t map_material_source;
+
 static uint32_t load_material_file(const char* file_name, pbr_material_t* dest, uint32_t max_items);
+static void stat_material_file(const char* file_name, matdb_source_t* src);
+static matdb_source_t* list_global_material_files(int* count);
+static uint32_t load_material_table(const char* db_name, const matdb_source_t* sources, int num_sources,
+	pbr_material_t* dest, uint32_t max_items);
 static void material_command();
 static void material_completer(genctx_t* ctx, int argnum);
 
@@ -62,6 +77,11 @@ static int compare_materials(const void* a, const void* b)
 	return (int)ma->source_line - (int)mb->source_line;
 }
 
+static int compare_sources(const void* a, const void* b)
+{
+	return strcmp(((const matdb_source_t*)a)->path, ((const matdb_source_t*)b)->path);
+}
+
 static void sort_and_deduplicate_materials(pbr_material_t* first, uint32_t* pCount)
 {
 	const uint32_t count = *pCount;
@@ -110,6 +130,7 @@ void MAT_Init()
 	memset(r_map_materials, 0, sizeof(r_map_materials));
 	num_global_materials = 0;
 	num_map_materials = 0;
+	memset(&map_material_source, 0, sizeof(map_material_source));
 
 	// initialize the hash table
 	for (int i = 0; i < RMATERIALS_HASH; i++)
@@ -117,32 +138,13 @@ void MAT_Init()
 		List_Init(r_materialsHash + i);
 	}
 
-	// find all *.mat files in the root
 	int num_files;
-	void** list = FS_ListFiles("materials", ".mat", 0, &num_files);
-	
-	for (int i = 0; i < num_files; i++) {
-		char* file_name = list[i];
-		char buffer[MAX_QPATH];
-		Q_concat(buffer, sizeof(buffer), "materials/", file_name, NULL);
-		
-		int mat_slots_available = MAX_PBR_MATERIALS - num_global_materials;
-		if (mat_slots_available > 0) {
-			uint32_t count = load_material_file(buffer, r_global_materials + num_global_materials,
-				mat_slots_available);
-			num_global_materials += count;
-			
-			Com_Printf("Loaded %d materials from %s\n", count, buffer);
-		}
-		else {
-			Com_WPrintf("Coundn't load materials from %s: no free slots.\n", buffer);
-		}
-		
-		Z_Free(file_name);
-	}
-	Z_Free(list);
+	matdb_source_t* sources = list_global_material_files(&num_files);
 
-	sort_and_deduplicate_materials(r_global_materials, &num_global_materials);
+	num_global_materials = load_material_table("matcache/materials.mdb", sources, num_files,
+		r_global_materials, MAX_PBR_MATERIALS);
+
+	Z_Free(sources);
 }
 
 void MAT_Shutdown()
@@ -585,6 +587,400 @@ static uint32_t load_material_file(const char* file_name, pbr_material_t* dest,
 	return count;
 }
 
+/*
+================
+COMPILED MATERIAL DATABASE
+
+The parsed, sorted and deduplicated material table of a set of .mat files
+is stored under matcache/ and loaded back with a single read as long as
+the stamps of all source files still match. Texture paths are stored with
+the '*' substitution already applied. All strings are interned into one
+table that records refer to by offset, offset 0 is the empty string.
+================
+*/
+
+#define MATDB_IDENT     (('B'<<24)+('D'<<16)+('M'<<8)+'Q')
+#define MATDB_VERSION   2
+
+typedef struct {
+	uint32_t ident;
+	uint32_t version;
+	int32_t  emissive_threshold;    // MAT_Reset default baked into the records
+	uint32_t num_sources;
+	uint32_t num_materials;
+	uint32_t strings_size;
+} matdb_header_t;
+
+typedef struct {
+	uint32_t name;
+	uint32_t filename_base;
+	uint32_t filename_normals;
+	uint32_t filename_emissive;
+	uint32_t filename_mask;
+	uint32_t source_matfile;
+	uint32_t source_line;
+	float    bump_scale;
+	float    roughness_override;
+	float    metalness_factor;
+	float    emissive_factor;
+	uint32_t flags;
+	int32_t  num_frames;
+	int32_t  next_frame;
+	uint32_t image_flags;
+	uint32_t image_type;
+	int32_t  emissive_threshold;
+	uint8_t  light_styles;
+	uint8_t  bsp_radiance;
+	uint8_t  synth_emissive;
+	uint8_t  pad;
+} matdb_record_t;
+
+typedef struct {
+	char*     data;
+	uint32_t  size;
+	uint32_t* hash;         // string offset + 1, 0 for free slots
+	uint32_t  hash_size;
+} matdb_strings_t;
+
+static void stat_material_file(const char* file_name, matdb_source_t* src)
+{
+	ssize_t len = Q_ERR_NOENT;
+
+	// same lookup order as load_material_file
+	memset(src, 0, sizeof(*src));
+	Q_strlcpy(src->path, file_name, sizeof(src->path));
+
+	src->source = IF_SRC_GAME;
+	if (fs_game->string[0] && strcmp(fs_game->string, BASEGAME) != 0)
+		len = FS_LoadFileEx(file_name, NULL, FS_PATH_GAME, TAG_FREE);
+
+	if (len < 0) {
+		src->source = IF_SRC_BASE;
+		len = FS_LoadFileEx(file_name, NULL, FS_PATH_BASE, TAG_FREE);
+	}
+
+	if (len < 0) {
+		src->source = 0;
+		return;
+	}
+
+	src->size = (uint32_t)len;
+	FS_FileStamp(file_name, &src->stamp);
+}
+
+// stamps all *.mat files in the materials directory, free with Z_Free
+static matdb_source_t* list_global_material_files(int* count)
+{
+	void** list = FS_ListFiles("materials", ".mat", 0, count);
+	matdb_source_t* sources = Z_Mallocz(sizeof(matdb_source_t) * max(*count, 1));
+
+	for (int i = 0; i < *count; i++) {
+		char buffer[MAX_QPATH];
+		Q_concat(buffer, sizeof(buffer), "materials/", (char*)list[i], NULL);
+		stat_material_file(buffer, sources + i);
+		Z_Free(list[i]);
+	}
+	Z_Free(list);
+
+	// the listing order depends on the search paths, keep the stamps stable
+	qsort(sources, *count, sizeof(matdb_source_t), compare_sources);
+	return sources;
+}
+
+static uint32_t intern_string(matdb_strings_t* st, const char* s)
+{
+	if (!*s)
+		return 0;
+
+	uint32_t h = Com_HashString(s, st->hash_size);
+	while (st->hash[h]) {
+		if (!strcmp(st->data + st->hash[h] - 1, s))
+			return st->hash[h] - 1;
+		h = (h + 1) & (st->hash_size - 1);
+	}
+
+	size_t len = strlen(s) + 1;
+	memcpy(st->data + st->size, s, len);
+	st->hash[h] = st->size + 1;
+	st->size += (uint32_t)len;
+	return st->hash[h] - 1;
+}
+
+// returns the database image of a sorted material table, free with Z_Free
+static byte* matdb_compile(const matdb_source_t* sources, int num_sources,
+	const pbr_material_t* materials, uint32_t count, size_t* size)
+{
+	matdb_strings_t st;
+	uint32_t max_strings = count * 6 + 1;
+
+	st.hash_size = 1;
+	while (st.hash_size < max_strings * 2)
+		st.hash_size <<= 1;
+	st.hash = Z_Mallocz(sizeof(uint32_t) * st.hash_size);
+	st.data = Z_Malloc(max_strings * MAX_QPATH);
+	st.data[0] = 0;
+	st.size = 1;
+
+	matdb_record_t* records = Z_Mallocz(sizeof(matdb_record_t) * max(count, 1));
+
+	for (uint32_t i = 0; i < count; i++) {
+		const pbr_material_t* mat = materials + i;
+		matdb_record_t* rec = records + i;
+
+		rec->name = intern_string(&st, mat->name);
+		rec->filename_base = intern_string(&st, mat->filename_base);
+		rec->filename_normals = intern_string(&st, mat->filename_normals);
+		rec->filename_emissive = intern_string(&st, mat->filename_emissive);
+		rec->filename_mask = intern_string(&st, mat->filename_mask);
+		rec->source_matfile = intern_string(&st, mat->source_matfile);
+		rec->source_line = mat->source_line;
+		rec->bump_scale = mat->bump_scale;
+		rec->roughness_override = mat->roughness_override;
+		rec->metalness_factor = mat->metalness_factor;
+		rec->emissive_factor = mat->emissive_factor;
+		rec->flags = mat->flags;
+		rec->num_frames = mat->num_frames;
+		rec->next_frame = mat->next_frame;
+		rec->image_flags = mat->image_flags;
+		rec->image_type = mat->image_type;
+		rec->emissive_threshold = mat->emissive_threshold;
+		rec->light_styles = mat->light_styles;
+		rec->bsp_radiance = mat->bsp_radiance;
+		rec->synth_emissive = mat->synth_emissive;
+	}
+
+	size_t sources_size = sizeof(matdb_source_t) * num_sources;
+	size_t records_size = sizeof(matdb_record_t) * count;
+
+	*size = sizeof(matdb_header_t) + sources_size + records_size + st.size;
+	byte* data = Z_Malloc(*size);
+
+	matdb_header_t* hdr = (matdb_header_t*)data;
+	hdr->ident = MATDB_IDENT;
+	hdr->version = MATDB_VERSION;
+	hdr->emissive_threshold = cvar_pt_surface_lights_threshold->integer;
+	hdr->num_sources = num_sources;
+	hdr->num_materials = count;
+	hdr->strings_size = st.size;
+
+	byte* ptr = (byte*)(hdr + 1);
+	memcpy(ptr, sources, sources_size);
+	ptr += sources_size;
+	memcpy(ptr, records, records_size);
+	ptr += records_size;
+	memcpy(ptr, st.data, st.size);
+
+	Z_Free(records);
+	Z_Free(st.data);
+	Z_Free(st.hash);
+
+	return data;
+}
+
+// fills dest from a database image, fails if it is stale or malformed
+static qboolean matdb_parse(const byte* data, size_t size, const matdb_source_t* sources, int num_sources,
+	pbr_material_t* dest, uint32_t max_items, uint32_t* count)
+{
+	const matdb_header_t* hdr = (const matdb_header_t*)data;
+
+	if (size < sizeof(*hdr) ||
+		hdr->ident != MATDB_IDENT || hdr->version != MATDB_VERSION ||
+		hdr->emissive_threshold != cvar_pt_surface_lights_threshold->integer ||
+		hdr->num_sources != num_sources || hdr->num_materials > max_items ||
+		hdr->strings_size == 0)
+		return qfalse;
+
+	size_t sources_size = sizeof(matdb_source_t) * num_sources;
+	size_t records_size = sizeof(matdb_record_t) * hdr->num_materials;
+
+	if (size != sizeof(*hdr) + sources_size + records_size + hdr->strings_size)
+		return qfalse;
+
+	const byte* ptr = (const byte*)(hdr + 1);
+	if (memcmp(ptr, sources, sources_size) != 0)
+		return qfalse;
+
+	const matdb_record_t* records = (const matdb_record_t*)(ptr + sources_size);
+	const char* strings = (const char*)(ptr + sources_size + records_size);
+	uint32_t strings_size = hdr->strings_size;
+
+	if (strings[strings_size - 1] != 0)
+		return qfalse;
+
+	for (uint32_t i = 0; i < hdr->num_materials; i++) {
+		const matdb_record_t* rec = records + i;
+
+		if (rec->name >= strings_size || rec->filename_base >= strings_size ||
+			rec->filename_normals >= strings_size || rec->filename_emissive >= strings_size ||
+			rec->filename_mask >= strings_size || rec->source_matfile >= strings_size)
+			return qfalse;
+	}
+
+	for (uint32_t i = 0; i < hdr->num_materials; i++) {
+		const matdb_record_t* rec = records + i;
+		pbr_material_t* mat = dest + i;
+
+		memset(mat, 0, sizeof(*mat));
+		Q_strlcpy(mat->name, strings + rec->name, sizeof(mat->name));
+		Q_strlcpy(mat->filename_base, strings + rec->filename_base, sizeof(mat->filename_base));
+		Q_strlcpy(mat->filename_normals, strings + rec->filename_normals, sizeof(mat->filename_normals));
+		Q_strlcpy(mat->filename_emissive, strings + rec->filename_emissive, sizeof(mat->filename_emissive));
+		Q_strlcpy(mat->filename_mask, strings + rec->filename_mask, sizeof(mat->filename_mask));
+		Q_strlcpy(mat->source_matfile, strings + rec->source_matfile, sizeof(mat->source_matfile));
+		mat->source_line = rec->source_line;
+		mat->bump_scale = rec->bump_scale;
+		mat->roughness_override = rec->roughness_override;
+		mat->metalness_factor = rec->metalness_factor;
+		mat->emissive_factor = rec->emissive_factor;
+		mat->flags = rec->flags;
+		mat->registration_sequence = registration_sequence;
+		mat->num_frames = rec->num_frames;
+		mat->next_frame = rec->next_frame;
+		mat->light_styles = rec->light_styles;
+		mat->bsp_radiance = rec->bsp_radiance;
+		mat->image_flags = rec->image_flags;
+		mat->image_type = rec->image_type;
+		mat->synth_emissive = rec->synth_emissive;
+		mat->emissive_threshold = rec->emissive_threshold;
+	}
+
+	*count = hdr->num_materials;
+	return qtrue;
+}
+
+static qboolean matdb_load(const char* db_name, const matdb_source_t* sources, int num_sources,
+	pbr_material_t* dest, uint32_t max_items, uint32_t* count)
+{
+	byte* data;
+	ssize_t len = FS_LoadFile(db_name, (void**)&data);
+	if (!data)
+		return qfalse;
+
+	qboolean ok = matdb_parse(data, len, sources, num_sources, dest, max_items, count);
+	if (!ok)
+		Com_DPrintf("Ignoring stale %s\n", db_name);
+
+	FS_FreeFile(data);
+	return ok;
+}
+
+static void matdb_save(const char* db_name, const matdb_source_t* sources, int num_sources,
+	const pbr_material_t* materials, uint32_t count)
+{
+	qhandle_t f;
+	size_t size;
+
+	FS_FOpenFile(db_name, &f, FS_MODE_WRITE);
+	if (!f)
+		return;
+
+	byte* data = matdb_compile(sources, num_sources, materials, count, &size);
+	FS_Write(data, size, f);
+	Z_Free(data);
+
+	// a short write is rejected by the size check on load
+	FS_FCloseFile(f);
+}
+
+// text path: parses all existing sources into one sorted, deduplicated table
+static uint32_t parse_material_files(const matdb_source_t* sources, int num_sources,
+	pbr_material_t* dest, uint32_t max_items, qboolean verbose)
+{
+	uint32_t count = 0;
+
+	for (int i = 0; i < num_sources; i++) {
+		if (!sources[i].source)
+			continue;
+
+		if (count >= max_items) {
+			Com_WPrintf("Coundn't load materials from %s: no free slots.\n", sources[i].path);
+			continue;
+		}
+
+		uint32_t loaded = load_material_file(sources[i].path, dest + count, max_items - count);
+		count += loaded;
+
+		if (verbose)
+			Com_Printf("Loaded %d materials from %s\n", loaded, sources[i].path);
+	}
+
+	sort_and_deduplicate_materials(dest, &count);
+	return count;
+}
+
+static uint32_t load_material_table(const char* db_name, const matdb_source_t* sources, int num_sources,
+	pbr_material_t* dest, uint32_t max_items)
+{
+	uint32_t count = 0;
+
+	if (cvar_pt_material_db->integer && matdb_load(db_name, sources, num_sources, dest, max_items, &count)) {
+		Com_Printf("Loaded %d materials from %s\n", count, db_name);
+		return count;
+	}
+
+	count = parse_material_files(sources, num_sources, dest, max_items, qtrue);
+
+	if (cvar_pt_material_db->integer)
+		matdb_save(db_name, sources, num_sources, dest, count);
+
+	return count;
+}
+
+// compiles the text table into a database image, reads it back and compares
+static qboolean matdb_test_table(const matdb_source_t* sources, int num_sources)
+{
+	pbr_material_t* text = Z_Mallocz(sizeof(pbr_material_t) * MAX_PBR_MATERIALS * 2);
+	pbr_material_t* compiled = text + MAX_PBR_MATERIALS;
+	uint32_t num_text, num_compiled = 0;
+	qboolean ok = qtrue;
+	size_t size;
+
+	num_text = parse_material_files(sources, num_sources, text, MAX_PBR_MATERIALS, qfalse);
+
+	byte* data = matdb_compile(sources, num_sources, text, num_text, &size);
+
+	if (!matdb_parse(data, size, sources, num_sources, compiled, MAX_PBR_MATERIALS, &num_compiled)) {
+		Com_Printf("    compiled database rejected\n");
+		ok = qfalse;
+	}
+	else if (num_compiled != num_text) {
+		Com_Printf("    %u materials parsed, %u compiled\n", num_text, num_compiled);
+		ok = qfalse;
+	}
+	else {
+		for (uint32_t i = 0; i < num_text; i++) {
+			if (memcmp(text + i, compiled + i, sizeof(pbr_material_t)) != 0) {
+				Com_Printf("    material %s differs\n", text[i].name);
+				ok = qfalse;
+			}
+		}
+	}
+
+	Com_Printf("    %u materials from %d files, %"PRIz" bytes compiled\n", num_text, num_sources, size);
+
+	Z_Free(data);
+	Z_Free(text);
+	return ok;
+}
+
+void MAT_DatabaseTest(void)
+{
+	int num_files;
+	matdb_source_t* sources = list_global_material_files(&num_files);
+	qboolean ok;
+
+	Com_Printf("global materials:\n");
+	ok = matdb_test_table(sources, num_files);
+	Z_Free(sources);
+
+	if (map_material_source.source) {
+		Com_Printf("%s:\n", map_material_source.path);
+		ok &= matdb_test_table(&map_material_source, 1);
+	}
+
+	Com_Printf("%s\n", ok ? "PASSED" : "FAILED");
+}
+
 static void save_materials(const char* file_name, qboolean save_all, qboolean force)
 {
 	if (!force && FS_FileExistsEx(file_name, FS_TYPE_REAL))
@@ -688,9 +1084,12 @@ void MAT_ChangeMap(const char* map_name)
 	truncate_extension(map_name, map_name_no_ext);
 	char file_name[MAX_QPATH];
 	Q_snprintf(file_name, sizeof(file_name), "%s.mat", map_name_no_ext);
-	num_map_materials = load_material_file(file_name, r_map_materials, MAX_PBR_MATERIALS);
-	if (num_map_materials > 0) {	
-		Com_Printf("Loaded %d materials from %s\n", num_map_materials, file_name);
+	stat_material_file(file_name, &map_material_source);
+	num_map_materials = 0;
+	if (map_material_source.source) {
+		char db_name[MAX_QPATH];
+		Q_concat(db_name, sizeof(db_name), "matcache/", map_name_no_ext, ".mdb", NULL);
+		num_map_materials = load_material_table(db_name, &map_material_source, 1, r_map_materials, MAX_PBR_MATERIALS);
 	}
 
 	// if there are any overrides now or there were some overrides before,
@@ -851,6 +1250,55 @@ pbr_material_t* MAT_Find(const char* name, imagetype_t type, imageflags_t flags)
 	return mat;
 }
 
+// queues the images MAT_Find would load for decoding on worker threads
+void MAT_Prefetch(const char* name, imagetype_t type, imageflags_t flags)
+{
+	char mat_name_no_ext[MAX_QPATH];
+	truncate_extension(name, mat_name_no_ext);
+	Q_strlwr(mat_name_no_ext);
+
+	uint32_t hash = Com_HashString(mat_name_no_ext, RMATERIALS_HASH);
+
+	if (find_material(mat_name_no_ext, hash, r_materials, MAX_PBR_MATERIALS))
+		return;
+
+	pbr_material_t* matdef = find_material_sorted(mat_name_no_ext, r_global_materials, num_global_materials);
+
+	if (type == IT_WALL)
+	{
+		pbr_material_t* map_mat = find_material_sorted(mat_name_no_ext, r_map_materials, num_map_materials);
+
+		if (map_mat)
+			matdef = map_mat;
+	}
+
+	if (matdef)
+	{
+		imageflags_t src = flags | IF_EXACT | (matdef->image_flags & IF_SRC_MASK);
+
+		if (matdef->filename_base[0])
+			IMG_Prefetch(matdef->filename_base, type, src | IF_SRGB);
+		if (matdef->filename_normals[0])
+			IMG_Prefetch(matdef->filename_normals, type, src);
+		if (matdef->filename_emissive[0])
+			IMG_Prefetch(matdef->filename_emissive, type, src | IF_SRGB);
+		if (matdef->filename_mask[0])
+			IMG_Prefetch(matdef->filename_mask, type, src);
+	}
+	else
+	{
+		char file_name[MAX_QPATH];
+
+		IMG_Prefetch(name, type, flags | IF_SRGB);
+
+		Q_snprintf(file_name, sizeof(file_name), "%s_n.tga", mat_name_no_ext);
+		IMG_Prefetch(file_name, type, flags);
+
+		Q_snprintf(file_name, sizeof(file_name), "%s_light.tga", mat_name_no_ext);
+		IMG_Prefetch(file_name, type, flags | IF_SRGB);
+	}
+}
+
 void MAT_UpdateRegistration(pbr_material_t * mat)
 {
 	if (!mat)
@@ -1009,7 +1457,7 @@ static void material_command(void)
 		save_materials(file_name, save_all, force);
 		return;
 	}
-	
+
 	pbr_material_t* mat = NULL;
 
 	if (vkpt_refdef.fd)
@@ -76,6 +76,9 @@ void MAT_ChangeMap(const char* map_name);
 // all available textures will be initialized in the returned material
 pbr_material_t* MAT_Find(const char* name, imagetype_t type, imageflags_t flags);
 
+// resolves the textures MAT_Find would load and queues them for IMG_DecodePrefetched
+void MAT_Prefetch(const char* name, imagetype_t type, imageflags_t flags);
+
 // registration sequence: update registration sequence of images used by the material
 void MAT_UpdateRegistration(pbr_material_t * mat);
 
@@ -97,4 +100,7 @@ qboolean MAT_IsKind(uint32_t material, uint32_t kind);
 // synthesize 'emissive' image for a material, if necessary
 void MAT_SynthesizeEmissive(pbr_material_t * mat);
 
+// checks that the compiled material database matches the .mat files
+void MAT_DatabaseTest(void);
+
 #endif // __MATERIAL_H_
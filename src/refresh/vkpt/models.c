@@ -205,7 +205,16 @@ static void extract_model_lights(model_t* model)
 	}
 }
 
-qerror_t MOD_LoadMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
+// Hunk_End is left to finalize_alias_model, which runs on the main thread
+// after the materials have been looked up.
+static void finalize_alias_model(model_t* model)
+{
+	extract_model_lights(model);
+
+	Hunk_End(&model->hunk);
+}
+
+qerror_t MOD_ParseMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
 {
 	dmd2header_t    header;
 	dmd2frame_t     *src_frame;
@@ -341,27 +350,18 @@ qerror_t MOD_LoadMD2_RTX(model_t *model, const void *rawdata, size_t length, con
 	dst_mesh->tex_coords = MOD_Malloc(numverts   * header.num_frames * sizeof(vec2_t));
     dst_mesh->indices    = MOD_Malloc(numindices * sizeof(int));
 
-	if (dst_mesh->numtris != header.num_tris) {
-		Com_DPrintf("%s has %d bad triangles\n", model->name, header.num_tris - dst_mesh->numtris);
-	}
-
 	// store final triangle indices
 	for (int i = 0; i < numindices; i++) {
 		dst_mesh->indices[i] = finalIndices[i];
 	}
 
-	// load all skins
+	// check all skins, MOD_FinalizeMD2_RTX looks up the materials
 	src_skin = (char *)rawdata + header.ofs_skins;
 	for (int i = 0; i < header.num_skins; i++) {
 		if (!Q_memccpy(skinname, src_skin, 0, sizeof(skinname))) {
 			ret = Q_ERR_STRING_TRUNCATED;
 			goto fail;
 		}
-		FS_NormalizePath(skinname, skinname);
-
-		pbr_material_t * mat = MAT_Find(skinname, IT_SKIN, IF_NONE);
-		
-		dst_mesh->materials[i] = mat;
 
         src_skin += MD2_MAX_SKINNAME;
 	}
@@ -462,9 +462,6 @@ qerror_t MOD_LoadMD2_RTX(model_t *model, const void *rawdata, size_t length, con
 		dst_mesh->indices[i + 2] = tmp;
 	}
 
-	extract_model_lights(model);
-
-	Hunk_End(&model->hunk);
 	return Q_ERR_SUCCESS;
 
 fail:
@@ -472,6 +469,51 @@ fail:
 	return ret;
 }
 
+qerror_t MOD_FinalizeMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
+{
+	dmd2header_t    header;
+	maliasmesh_t    *dst_mesh = model->meshes;
+	char            *src_skin;
+	char            skinname[MAX_QPATH];
+
+	if (model->type == MOD_EMPTY) {
+		return Q_ERR_SUCCESS;
+	}
+
+	// byte swap the header, it has been validated by MOD_ParseMD2_RTX
+	header = *(dmd2header_t *)rawdata;
+	for (int i = 0; i < sizeof(header) / 4; i++) {
+		((uint32_t *)&header)[i] = LittleLong(((uint32_t *)&header)[i]);
+	}
+
+	if (dst_mesh->numtris != header.num_tris) {
+		Com_DPrintf("%s has %d bad triangles\n", model->name, header.num_tris - dst_mesh->numtris);
+	}
+
+	// load all skins
+	src_skin = (char *)rawdata + header.ofs_skins;
+	for (int i = 0; i < header.num_skins; i++) {
+		Q_memccpy(skinname, src_skin, 0, sizeof(skinname));
+		FS_NormalizePath(skinname, skinname);
+
+		dst_mesh->materials[i] = MAT_Find(skinname, IT_SKIN, IF_NONE);
+
+		src_skin += MD2_MAX_SKINNAME;
+	}
+
+	finalize_alias_model(model);
+	return Q_ERR_SUCCESS;
+}
+
+qerror_t MOD_LoadMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
+{
+	qerror_t ret = MOD_ParseMD2_RTX(model, rawdata, length, mod_name);
+	if (ret)
+		return ret;
+
+	return MOD_FinalizeMD2_RTX(model, rawdata, length, mod_name);
+}
+
 #if USE_MD3
 
 #define TAB_SIN(x) qvk.sintab[(x) & 255]
@@ -535,16 +577,11 @@ static qerror_t MOD_LoadMD3Mesh(model_t *model, maliasmesh_t *mesh,
 	mesh->tex_coords = MOD_Malloc(header.num_verts * model->numframes * sizeof(vec2_t));
     mesh->indices = MOD_Malloc(sizeof(int) * header.num_tris * 3);
 
-	// load all skins
+	// check all skins, MOD_FinalizeMD3_RTX looks up the materials
 	src_skin = (dmd3skin_t *)(rawdata + header.ofs_skins);
 	for (i = 0; i < header.num_skins; i++, src_skin++) {
 		if (!Q_memccpy(skinname, src_skin->name, 0, sizeof(skinname)))
 			return Q_ERR_STRING_TRUNCATED;
-		FS_NormalizePath(skinname, skinname);
-
-		pbr_material_t * mat = MAT_Find(skinname, IT_SKIN, IF_NONE);
-		
-		mesh->materials[i] = mat;
     }
 
 	// load all vertices
@@ -601,7 +638,25 @@ static qerror_t MOD_LoadMD3Mesh(model_t *model, maliasmesh_t *mesh,
 	return Q_ERR_SUCCESS;
 }
 
-qerror_t MOD_LoadMD3_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
+// returns the size of the mesh, which has been validated by MOD_LoadMD3Mesh
+static size_t MOD_FindMD3Skins(maliasmesh_t *mesh, const byte *rawdata)
+{
+	const dmd3mesh_t *header = (const dmd3mesh_t *)rawdata;
+	const dmd3skin_t *src_skin = (const dmd3skin_t *)(rawdata + LittleLong(header->ofs_skins));
+	const int num_skins = LittleLong(header->num_skins);
+	char skinname[MAX_QPATH];
+
+	for (int i = 0; i < num_skins; i++, src_skin++) {
+		Q_memccpy(skinname, src_skin->name, 0, sizeof(skinname));
+		FS_NormalizePath(skinname, skinname);
+
+		mesh->materials[i] = MAT_Find(skinname, IT_SKIN, IF_NONE);
+	}
+
+	return LittleLong(header->meshsize);
+}
+
+qerror_t MOD_ParseMD3_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
 {
 	dmd3header_t    header;
 	size_t          end, offset, remaining;
@@ -672,23 +727,41 @@ qerror_t MOD_LoadMD3_RTX(model_t *model, const void *rawdata, size_t length, con
 	//if (strstr(model->name, "v_blast"))
 	//	export_obj_frames(model, "export/v_blast_%d.obj");
 
-	extract_model_lights(model);
-
-	Hunk_End(&model->hunk);
 	return Q_ERR_SUCCESS;
 
 fail:
 	Hunk_Free(&model->hunk);
 	return ret;
 }
+
+qerror_t MOD_FinalizeMD3_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
+{
+	const dmd3header_t *header = (const dmd3header_t *)rawdata;
+	const byte *src_mesh = (const byte *)rawdata + LittleLong(header->ofs_meshes);
+
+	for (int i = 0; i < model->nummeshes; i++)
+		src_mesh += MOD_FindMD3Skins(&model->meshes[i], src_mesh);
+
+	finalize_alias_model(model);
+	return Q_ERR_SUCCESS;
+}
+
+qerror_t MOD_LoadMD3_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name)
+{
+	qerror_t ret = MOD_ParseMD3_RTX(model, rawdata, length, mod_name);
+	if (ret)
+		return ret;
+
+	return MOD_FinalizeMD3_RTX(model, rawdata, length, mod_name);
+}
 #endif
 
-qerror_t MOD_LoadIQM_RTX(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+static qerror_t parse_iqm(model_t* model, const void* rawdata, size_t length, const char* mod_name, mod_load_t load_base)
 {
 	Hunk_Begin(&model->hunk, 0x4000000);
 	model->type = MOD_ALIAS;
 
-	qerror_t res = MOD_LoadIQM_Base(model, rawdata, length, mod_name);
+	qerror_t res = load_base(model, rawdata, length, mod_name);
 
 	if (res != Q_ERR_SUCCESS)
 	{
@@ -696,9 +769,6 @@ qerror_t MOD_LoadIQM_RTX(model_t* model, const void* rawdata, size_t length, con
 		return res;
 	}
 
-	char base_path[MAX_QPATH];
-	COM_FilePath(mod_name, base_path, sizeof(base_path));
-
 	model->meshes = MOD_Malloc(sizeof(maliasmesh_t) * model->iqmData->num_meshes);
 	model->nummeshes = (int)model->iqmData->num_meshes;
 	model->numframes = 1; // these are baked frames, so that the VBO uploader will only make one copy of the vertices
@@ -733,22 +803,49 @@ qerror_t MOD_LoadIQM_RTX(model_t* model, const void* rawdata, size_t length, con
 			mesh->indices[triangle_idx * 3 + 2] = tri[0] - (int)iqm_mesh->first_vertex;
 		}
 
+		mesh->numskins = 1; // looks like IQM only supports one skin?
+	}
+
+	return Q_ERR_SUCCESS;
+}
+
+qerror_t MOD_ParseIQM_RTX(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+{
+	return parse_iqm(model, rawdata, length, mod_name, MOD_ParseIQM_Base);
+}
+
+qerror_t MOD_FinalizeIQM_RTX(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+{
+	char base_path[MAX_QPATH];
+	COM_FilePath(mod_name, base_path, sizeof(base_path));
+
+	for (unsigned model_idx = 0; model_idx < model->iqmData->num_meshes; model_idx++)
+	{
+		const iqm_mesh_t* iqm_mesh = &model->iqmData->meshes[model_idx];
+		maliasmesh_t* mesh = &model->meshes[model_idx];
+
 	    char filename[MAX_QPATH];
 		Q_snprintf(filename, sizeof(filename), "%s/%s.pcx", base_path, iqm_mesh->material);
 		pbr_material_t* mat = MAT_Find(filename, IT_SKIN, IF_NONE);
 		assert(mat); // it's either found or created
 		
 		mesh->materials[0] = mat;
-		mesh->numskins = 1; // looks like IQM only supports one skin?
 	}
 
-	extract_model_lights(model);
-
-	Hunk_End(&model->hunk);
+	finalize_alias_model(model);
 	
 	return Q_ERR_SUCCESS;
 }
 
+qerror_t MOD_LoadIQM_RTX(model_t* model, const void* rawdata, size_t length, const char* mod_name)
+{
+	qerror_t res = parse_iqm(model, rawdata, length, mod_name, MOD_LoadIQM_Base);
+	if (res != Q_ERR_SUCCESS)
+		return res;
+
+	return MOD_FinalizeIQM_RTX(model, rawdata, length, mod_name);
+}
+
 void MOD_Reference_RTX(model_t *model)
 {
 	int mesh_idx, skin_idx, frame_idx;
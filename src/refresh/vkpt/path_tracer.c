@@ -434,7 +434,7 @@ vkpt_pt_create_accel_bottom(
 		.vertexStride = sizeof(float) * 3,
 		.maxVertex = num_vertices - 1,
 		.indexData = {.deviceAddress = buffer_index ? (buffer_index->address + offset_index) : 0 },
-		.indexType = buffer_index ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_NONE_KHR,
+		.indexType = buffer_index ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_NONE_KHR,
 	};
 
 	const VkAccelerationStructureGeometryDataKHR geometry_data = { 
@@ -0,0 +1,260 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "shared/shared.h"
+#include "common/common.h"
+#include "common/cmd.h"
+#include "refresh/images.h"
+#include "refresh/texcomp.h"
+#include "residency.h"
+
+// new textures start with the full chain if that fits the budget
+void
+residency_add(residency_t *r, int index, size_t low_size, size_t full_size, int low_mip, qboolean streamable)
+{
+	residency_entry_t *e = r->entries + index;
+
+	e->tracked = qtrue;
+	e->streamable = streamable && low_size < full_size;
+	e->low_size = low_size;
+	e->full_size = full_size;
+	e->low_mip = low_mip;
+	e->last_used = 0;
+	e->full = !e->streamable || r->used + full_size <= r->budget;
+
+	r->used += residency_cost(e);
+}
+
+void
+residency_remove(residency_t *r, int index)
+{
+	residency_entry_t *e = r->entries + index;
+
+	if (e->tracked)
+		r->used -= residency_cost(e);
+
+	memset(e, 0, sizeof(*e));
+}
+
+// least recently used full texture that was not touched this frame
+static int
+residency_find_lru(const residency_t *r)
+{
+	int best = -1;
+
+	for (int i = 0; i < r->num_entries; i++)
+	{
+		const residency_entry_t *e = r->entries + i;
+
+		if (!e->streamable || !e->full || e->last_used == r->frame)
+			continue;
+
+		if (best < 0 || e->last_used < r->entries[best].last_used)
+			best = i;
+	}
+
+	return best;
+}
+
+static void
+residency_evict(residency_t *r, int index, int *changed, int *num_changed)
+{
+	residency_entry_t *e = r->entries + index;
+
+	r->used -= e->full_size - e->low_size;
+	e->full = qfalse;
+	r->evictions++;
+	changed[(*num_changed)++] = index;
+}
+
+/*
+================
+residency_update
+
+Decides which textures change state for the frame that is ending. Indices
+of both promoted and evicted textures are written to changed, entry->full
+tells which is which. Starts a new frame.
+
+Textures touched in the frame are never evicted, so usage only stays
+above the budget while the working set itself does not fit.
+================
+*/
+int
+residency_update(residency_t *r, size_t upload_limit, int *changed)
+{
+	int num_changed = 0, victim;
+	size_t uploaded = 0;
+
+	// the budget may have been lowered
+	while (r->used > r->budget && (victim = residency_find_lru(r)) >= 0)
+		residency_evict(r, victim, changed, &num_changed);
+
+	for (int i = 0; i < r->num_entries; i++)
+	{
+		residency_entry_t *e = r->entries + i;
+
+		if (!e->streamable || e->full || e->last_used != r->frame)
+			continue;
+
+		// always let one texture through so huge ones are not starved
+		if (uploaded && uploaded + e->full_size > upload_limit)
+			break;
+
+		size_t extra = e->full_size - e->low_size;
+		while (r->used + extra > r->budget && (victim = residency_find_lru(r)) >= 0)
+			residency_evict(r, victim, changed, &num_changed);
+
+		if (r->used + extra > r->budget)
+			break;
+
+		r->used += extra;
+		e->full = qtrue;
+		r->promotions++;
+		uploaded += e->full_size;
+		changed[num_changed++] = i;
+	}
+
+	r->frame++;
+	return num_changed;
+}
+
+// BC1 size of a square texture from low_mip down to 1x1
+static size_t
+chain_size(int size, int low_mip)
+{
+	size_t total = 0;
+
+	for (int mip = low_mip; (size >> mip) > 0; mip++)
+		total += TC_LevelSize(TC_BC1, size >> mip, size >> mip);
+
+	return total;
+}
+
+/*
+================
+vkpt_residency_test
+
+texture_residency_test [textures] [budget MB] [frames]
+
+Runs the residency bookkeeping against a simulated budget with a moving
+working set and checks its invariants. CPU only.
+================
+*/
+void
+vkpt_residency_test(void)
+{
+	int num_textures = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 2000;
+	float budget_mb = Cmd_Argc() > 2 ? atof(Cmd_Argv(2)) : 256;
+	int num_frames = Cmd_Argc() > 3 ? atoi(Cmd_Argv(3)) : 1000;
+	const size_t upload_limit = 16 * 1024 * 1024;
+	int failures = 0, hits = 0, touches = 0;
+
+	clamp(num_textures, 1, MAX_RIMAGES);
+	clamp(num_frames, 1, 100000);
+
+	residency_t r = { 0 };
+	r.entries = Z_Mallocz(num_textures * sizeof(residency_entry_t));
+	r.num_entries = num_textures;
+	r.budget = (size_t)(budget_mb * 1048576.0f);
+	r.frame = 1;
+
+	int *changed = Z_Malloc(num_textures * sizeof(int));
+	qboolean *touched = Z_Malloc(num_textures * sizeof(qboolean));
+
+	srand(num_textures);
+	for (int i = 0; i < num_textures; i++)
+	{
+		int size = 64 << (rand() % 6);
+		int low_mip = 0;
+		while ((size >> low_mip) > 128)
+			low_mip++;
+		residency_add(&r, i, chain_size(size, low_mip),
+			chain_size(size, 0), low_mip, qtrue);
+	}
+
+	for (int frame = 0; frame < num_frames; frame++)
+	{
+		// a window sliding over the textures plus a few random ones
+		int window = num_textures / 10 + 1;
+		int start = (frame * 3) % num_textures;
+
+		memset(touched, 0, num_textures * sizeof(qboolean));
+		for (int i = 0; i < window + 8; i++)
+		{
+			int index = i < window ? (start + i) % num_textures : rand() % num_textures;
+			residency_touch(&r, index);
+			touched[index] = qtrue;
+		}
+
+		for (int i = 0; i < num_textures; i++)
+		{
+			if (touched[i]) {
+				touches++;
+				hits += r.entries[i].full;
+			}
+		}
+
+		int num_changed = residency_update(&r, upload_limit, changed);
+
+		size_t used = 0, pinned = 0, uploaded = 0;
+		int uploads = 0;
+		for (int i = 0; i < num_textures; i++)
+		{
+			used += residency_cost(r.entries + i);
+			pinned += touched[i] ? residency_cost(r.entries + i) : r.entries[i].low_size;
+		}
+
+		for (int i = 0; i < num_changed; i++)
+		{
+			const residency_entry_t *e = r.entries + changed[i];
+			if (e->full) {
+				uploaded += e->full_size;
+				uploads++;
+			} else if (touched[changed[i]]) {
+				Com_Printf("frame %d: evicted texture %d that was in use\n", frame, changed[i]);
+				failures++;
+			}
+		}
+
+		if (used != r.used) {
+			Com_Printf("frame %d: used %"PRIz" bytes, accounted %"PRIz"\n", frame, used, r.used);
+			failures++;
+		}
+		if (used > MAX(r.budget, pinned)) {
+			Com_Printf("frame %d: %"PRIz" bytes over budget\n", frame, used - r.budget);
+			failures++;
+		}
+		if (uploads > 1 && uploaded > upload_limit) {
+			Com_Printf("frame %d: uploaded %"PRIz" bytes\n", frame, uploaded);
+			failures++;
+		}
+
+		if (failures > 10)
+			break;
+	}
+
+	Com_Printf("%d textures, %.0f MB budget, %d frames: %u promotions, %u evictions, "
+		"%.1f%% of touches hit a full texture, %.1f MB in use\n",
+		num_textures, budget_mb, num_frames, r.promotions, r.evictions,
+		touches ? 100.0 * hits / touches : 0.0, r.used / 1048576.0);
+	Com_Printf("%s\n", failures ? "FAILED" : "passed");
+
+	Z_Free(r.entries);
+	Z_Free(changed);
+	Z_Free(touched);
+}
@@ -0,0 +1,64 @@
+/*
+Copyright (C) 2019, NVIDIA CORPORATION. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef RESIDENCY_H_
+#define RESIDENCY_H_
+
+/*
+Least recently used bookkeeping for streamed textures, kept apart from
+the Vulkan code in textures.c so it can be tested without a device.
+*/
+
+typedef struct {
+	uint32_t    last_used;      // frame of the last touch, 0 if never
+	size_t      low_size;       // bytes with only the small mips
+	size_t      full_size;      // bytes with the whole chain
+	int         low_mip;        // first mip level kept when not full
+	qboolean    tracked;
+	qboolean    streamable;
+	qboolean    full;
+} residency_entry_t;
+
+typedef struct {
+	residency_entry_t   *entries;
+	int                 num_entries;
+	size_t              budget;
+	size_t              used;
+	uint32_t            frame;          // starts at 1
+	unsigned            promotions, evictions;
+} residency_t;
+
+static inline size_t
+residency_cost(const residency_entry_t *e)
+{
+	return e->full ? e->full_size : e->low_size;
+}
+
+static inline void
+residency_touch(residency_t *r, int index)
+{
+	r->entries[index].last_used = r->frame;
+}
+
+void residency_add(residency_t *r, int index, size_t low_size, size_t full_size, int low_mip, qboolean streamable);
+void residency_remove(residency_t *r, int index);
+int residency_update(residency_t *r, size_t upload_limit, int *changed);
+
+void vkpt_residency_test(void);
+
+#endif // RESIDENCY_H_
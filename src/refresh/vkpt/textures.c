@@ -25,6 +25,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <assert.h>
 
 #include "material.h"
+#include "residency.h"
+#include "refresh/texcomp.h"
+#include "common/jobs.h"
+#include "system/system.h"
 #include "../stb/stb_image.h"
 #include "../stb/stb_image_resize.h"
 #include "../stb/stb_image_write.h"
@@ -76,6 +80,12 @@ static uint8_t descriptor_set_dirty_flags[MAX_FRAMES_IN_FLIGHT] = { 0 }; // init
 static const float megabyte = 1048576.0f;
 
 extern cvar_t* cvar_pt_nearest;
+extern cvar_t* cvar_pt_texture_cache;
+extern cvar_t* cvar_pt_texture_cache_size;
+extern cvar_t* cvar_pt_texture_compression;
+extern cvar_t* cvar_pt_texture_budget;
+extern cvar_t* cvar_pt_texture_stream_size;
+extern cvar_t* cvar_pt_texture_upload_limit;
 
 void vkpt_textures_prefetch()
 {
@@ -89,16 +99,29 @@ void vkpt_textures_prefetch()
         return;
     }
 
-    char const * ptr = buffer;
-	char linebuf[MAX_QPATH];
-	while (sgets(linebuf, sizeof(linebuf), &ptr))
+	// first pass resolves the files and decodes them on worker threads,
+	// second pass creates the materials and uploads the decoded images
+	for (int pass = 0; pass < 2; pass++)
 	{
-		char* line = strtok(linebuf, " \t\r\n");
-		if (!line)
-			continue;
+		char const * ptr = buffer;
+		char linebuf[MAX_QPATH];
+		while (sgets(linebuf, sizeof(linebuf), &ptr))
+		{
+			char* line = strtok(linebuf, " \t\r\n");
+			if (!line)
+				continue;
+
+			if (pass == 0)
+				MAT_Prefetch(line, IT_SKIN, IF_PERMANENT);
+			else
+				MAT_Find(line, IT_SKIN, IF_PERMANENT);
+		}
 
-		MAT_Find(line, IT_SKIN, IF_PERMANENT);
+		if (pass == 0)
+			IMG_DecodePrefetched();
 	}
+
+	IMG_FlushPrefetched();
     // Com_Printf("Loaded '%s'\n", filename);
     FS_FreeFile(buffer);
 }
@@ -487,7 +510,11 @@ IMG_Load
 ================
 */
 
-static inline float decode_srgb(byte pix)
+static float srgb_decode_table[256];
+static float srgb_encode_thresholds[256];   // smallest value that encodes to index
+static qboolean srgb_tables_initialized = qfalse;
+
+static float decode_srgb_exact(byte pix)
 {
 	float x = (float)pix / 255.f;
 	
@@ -497,7 +524,7 @@ static inline float decode_srgb(byte pix)
 	return powf((x + 0.055f) / 1.055f, 2.4f);
 }
 
-static inline byte encode_srgb(float x)
+static byte encode_srgb_exact(float x)
 {
     if (x <= 0.0031308f)
         x *= 12.92f;
@@ -509,6 +536,59 @@ static inline byte encode_srgb(float x)
     return (byte)roundf(x * 255.f);
 }
 
+/* The encoding is monotonic, so the value where it steps up to each code
+   can be found by bisecting over the bit patterns of positive floats.
+   Encoding with these thresholds gives the same result as the formula. */
+static void init_srgb_tables(void)
+{
+	if (srgb_tables_initialized)
+		return;
+
+	for (int i = 0; i < 256; i++)
+		srgb_decode_table[i] = decode_srgb_exact(i);
+
+	srgb_encode_thresholds[0] = -INFINITY;
+	for (int i = 1; i < 256; i++)
+	{
+		uint32_t lo = 0, hi = 0x3f800000; // 0.0 .. 1.0
+		while (lo < hi)
+		{
+			uint32_t mid = lo + (hi - lo) / 2;
+			float x;
+			memcpy(&x, &mid, sizeof(x));
+			if (encode_srgb_exact(x) >= i)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		memcpy(&srgb_encode_thresholds[i], &lo, sizeof(float));
+	}
+
+	srgb_tables_initialized = qtrue;
+}
+
+static inline float decode_srgb(byte pix)
+{
+	return srgb_decode_table[pix];
+}
+
+static inline byte encode_srgb(float x)
+{
+	int i = 0;
+
+	// binary search for the last threshold not above x
+	if (x >= srgb_encode_thresholds[i + 128]) i += 128;
+	if (x >= srgb_encode_thresholds[i + 64]) i += 64;
+	if (x >= srgb_encode_thresholds[i + 32]) i += 32;
+	if (x >= srgb_encode_thresholds[i + 16]) i += 16;
+	if (x >= srgb_encode_thresholds[i + 8]) i += 8;
+	if (x >= srgb_encode_thresholds[i + 4]) i += 4;
+	if (x >= srgb_encode_thresholds[i + 2]) i += 2;
+	if (x >= srgb_encode_thresholds[i + 1]) i += 1;
+
+	return (byte)i;
+}
+
 static inline float decode_linear(byte pix)
 {
     return (float)pix / 255.f;
@@ -583,42 +663,99 @@ static void filterscratch_fill_from_float_image(struct filterscratch_s *scratch,
 	}
 }
 
-/* Apply a (separable) filter along one dimension of an image.
- * Whether this is done along the X or Y dimension depends on the "stripe size"
- * and "stripe stride" options. See filter_image() for how to use it practically. */
-static void filter_one_dimension_float(float* pixels, int num_comps,
-									   const float kernel[], unsigned kernel_size,
-									   int stripe_size, int num_stripes,
-									   int stripe_stride, int element_stride)
+/* Convolve one padded stripe. Components are interleaved, so output value k
+ * (pixel k / num_comps) sums src[k + j * num_comps] over the kernel taps.
+ * The SIMD path does the same additions in the same order as the scalar one,
+ * it is SSE2 only, see USE_SSE2 in shared/shared.h. */
+static void filter_stripe(float *dst, const float *src, int count, int num_comps,
+						  const float kernel[], unsigned kernel_size)
 {
+	int k = 0;
+
+#if USE_SSE2
+	for (; k + 4 <= count; k += 4)
+	{
+		__m128 sum = _mm_setzero_ps();
+		for (int j = 0; j < kernel_size; j++)
+			sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(kernel[j]), _mm_loadu_ps(src + k + j * num_comps)));
+		_mm_storeu_ps(dst + k, sum);
+	}
+#endif
+
+	for (; k < count; k++)
+	{
+		float sum = 0;
+		for (int j = 0; j < kernel_size; j++)
+			sum += kernel[j] * src[k + j * num_comps];
+		dst[k] = sum;
+	}
+}
+
+#define FILTER_STRIPES_PER_JOB	16
+
+typedef struct {
+	float *pixels;
+	int num_comps;
+	const float *kernel;
+	unsigned kernel_size;
+	int stripe_size, num_stripes;
+	int stripe_stride, element_stride;
+} filterjob_t;
+
+static void filter_stripes(void *arg, int index)
+{
+	const filterjob_t *job = arg;
+	const int num_comps = job->num_comps;
+	const int first = index * FILTER_STRIPES_PER_JOB;
+	const int last = min(first + FILTER_STRIPES_PER_JOB, job->num_stripes);
+
 	struct filterscratch_s scratch;
-	filterscratch_init(&scratch, kernel_size, stripe_size, num_comps);
-	float *current_stripe = pixels;
-	float* values = alloca(num_comps * sizeof(float));
-	for (int s = 0; s < num_stripes; s++)
+	filterscratch_init(&scratch, job->kernel_size, job->stripe_size, num_comps);
+	float *values = Z_Malloc(job->stripe_size * num_comps * sizeof(float));
+
+	for (int s = first; s < last; s++)
 	{
+		float *current_stripe = job->pixels + s * job->stripe_stride * num_comps;
 		// back up image data to scratch buffer
-		filterscratch_fill_from_float_image(&scratch, current_stripe, stripe_size, element_stride);
+		filterscratch_fill_from_float_image(&scratch, current_stripe, job->stripe_size, job->element_stride);
 		// filter the stripe
-		for (int i = 0; i < stripe_size; i++)
+		filter_stripe(values, scratch.ptr, job->stripe_size * num_comps, num_comps, job->kernel, job->kernel_size);
+		if (job->element_stride == 1)
 		{
-			memset(values, 0, num_comps * sizeof(float));
-			for (int j = 0; j < kernel_size; j++)
-			{
-				float f = kernel[j];
-				float *src_p = scratch.ptr + (i + j) * num_comps;
-				for (int c = 0; c < num_comps; c++)
-				{
-					values[c] += f * src_p[c];
-				}
-			}
-			memcpy(current_stripe + i * element_stride * num_comps, values, num_comps * sizeof(float));
+			memcpy(current_stripe, values, job->stripe_size * num_comps * sizeof(float));
+			continue;
 		}
-		current_stripe += stripe_stride * num_comps;
+		for (int i = 0; i < job->stripe_size; i++)
+			memcpy(current_stripe + i * job->element_stride * num_comps, values + i * num_comps, num_comps * sizeof(float));
 	}
+
+	Z_Free(values);
 	filterscratch_free(&scratch);
 }
 
+/* Apply a (separable) filter along one dimension of an image.
+ * Whether this is done along the X or Y dimension depends on the "stripe size"
+ * and "stripe stride" options. See filter_image() for how to use it practically.
+ * Stripes are independent and get filtered on worker threads in batches. */
+static void filter_one_dimension_float(float* pixels, int num_comps,
+									   const float kernel[], unsigned kernel_size,
+									   int stripe_size, int num_stripes,
+									   int stripe_stride, int element_stride)
+{
+	filterjob_t job = {
+		.pixels = pixels,
+		.num_comps = num_comps,
+		.kernel = kernel,
+		.kernel_size = kernel_size,
+		.stripe_size = stripe_size,
+		.num_stripes = num_stripes,
+		.stripe_stride = stripe_stride,
+		.element_stride = element_stride,
+	};
+
+	Job_ParallelFor(filter_stripes, &job, (num_stripes + FILTER_STRIPES_PER_JOB - 1) / FILTER_STRIPES_PER_JOB);
+}
+
 // Apply a (separable) filter to an image.
 static void filter_float_image(float* pixels, int num_comps, const float kernel[], unsigned kernel_size, int width, int height)
 {
@@ -628,105 +765,331 @@ static void filter_float_image(float* pixels, int num_comps, const float kernel[
 	filter_one_dimension_float(pixels, num_comps, kernel, kernel_size, height, width, 1, width);
 }
 
-struct bilerp_s
+/* Bilinear 2x upsampling of an RGB float image, wrapping around at the
+ * right and bottom edges. Even output pixels copy input pixels, odd ones
+ * average the two neighbours, vertically first, then horizontally. */
+typedef struct {
+	const float *input;
+	float *output;
+	int input_w, input_h;
+} upsample_t;
+
+static void upsample_2x_row(void *arg, int out_y)
 {
-	int current_output_row;
-	float *current_input_data;
-	float *next_input_data;
-	float *output_data;
+	const upsample_t *job = arg;
+	const int input_w = job->input_w;
+	const float *row = job->input + (out_y >> 1) * input_w * 3;
+	float *out = job->output + out_y * input_w * 2 * 3;
+	float *line = out + input_w * 3;  // second half of the output row as scratch
+
+	if (out_y & 1)
+	{
+		int next_y = (out_y >> 1) + 1;
+		// Wraparound last line
+		if (next_y >= job->input_h)
+			next_y = 0;
+		const float *next_row = job->input + next_y * input_w * 3;
+		for (int x = 0; x < input_w * 3; x++)
+			line[x] = (row[x] + next_row[x]) * 0.5f;
+	}
+	else
+	{
+		memcpy(line, row, input_w * 3 * sizeof(float));
+	}
+
+	/* The line sits in the second half of the output row. Step x reads line
+	   pixels x and x + 1 and writes output pixels 2x and 2x + 1, so writes
+	   never get ahead of reads. Only the last step needs the saved first pixel. */
+	vec3_t first, color;
+	VectorCopy(line, first);
+	for (int x = 0; x < input_w; x++)
+	{
+		const float *next = x + 1 < input_w ? line + (x + 1) * 3 : first;
+		float *o = out + x * 6;
+		VectorCopy(line + x * 3, color);
+		o[0] = color[0];
+		o[1] = color[1];
+		o[2] = color[2];
+		o[3] = (color[0] + next[0]) * 0.5f;
+		o[4] = (color[1] + next[1]) * 0.5f;
+		o[5] = (color[2] + next[2]) * 0.5f;
+	}
+}
+
+static void upsample_2x_rgb_f32(float *output, const float *input, int input_w, int input_h)
+{
+	upsample_t job = {
+		.input = input,
+		.output = output,
+		.input_w = input_w,
+		.input_h = input_h,
+	};
+
+	Job_ParallelFor(upsample_2x_row, &job, input_h * 2);
+}
+
+/*
+================
+TEXTURE CACHE
+
+Results of the CPU texture passes below are stored in the write directory
+under texcache/, named by a hash of the image name, source file, pass and
+parameter. The key includes the FS_FileStamp of the source file, so a
+texture edited in place or shipped in a rebuilt pack never picks up a stale
+entry, and looking up an entry doesn't need to touch the pixels.
+Images without a source file aren't cached. Once the directory grows past
+pt_texture_cache_size megabytes the oldest entries are removed.
+================
+*/
+
+#define TEXCACHE_IDENT      (('C'<<24)+('X'<<16)+('T'<<8)+'Q')
+#define TEXCACHE_VERSION    3
+
+enum {
+	TEXCACHE_NORMALS,
+	TEXCACHE_EMISSIVE_INFO,
+	TEXCACHE_FAKE_EMISSIVE,
+	TEXCACHE_BC,                    // block compressed mip chain, param is tcformat_t
 };
 
-static void bilerp_init(struct bilerp_s* bilerp, int input_w)
+typedef struct {
+	uint32_t ident;
+	uint32_t version;
+	uint32_t pass;
+	uint32_t param;
+	uint64_t hash;
+	uint64_t stamp;                 // FS_FileStamp of the source file
+	uint32_t src_width, src_height;
+	uint32_t width, height;         // output pixels, 0 for metadata only
+	uint32_t data_size;             // bytes following the header
+	float    light_color[3];
+	float    min_light_texcoord[2];
+	float    max_light_texcoord[2];
+	uint32_t entire_texture_emissive;
+} texcache_header_t;
+
+typedef struct {
+	char              path[MAX_QPATH];
+	texcache_header_t header;
+} texcache_key_t;
+
+static size_t texcache_written;
+
+static uint64_t texcache_hash(uint64_t hash, const void *data, size_t size)
 {
-	bilerp->current_output_row = -1;
-	bilerp->current_input_data = IMG_AllocPixels(input_w * sizeof(float) * 3);
-	bilerp->next_input_data = IMG_AllocPixels(input_w * sizeof(float) * 3);
-	bilerp->output_data = IMG_AllocPixels(input_w * 2 * sizeof(float) * 3);
+	const byte *p = data;
+
+	// FNV-1a
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ p[i]) * 1099511628211ULL;
+
+	return hash;
 }
 
-static void bilerp_free(struct bilerp_s* bilerp)
+static qboolean texcache_init_key(texcache_key_t *key, const image_t *image, int pass, int param)
 {
-	Z_Free(bilerp->current_input_data);
-	Z_Free(bilerp->next_input_data);
-	Z_Free(bilerp->output_data);
+	texcache_header_t *hdr = &key->header;
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t stamp;
+	uint32_t values[4] = { pass, param, image->type, image->flags };
+
+	if (!cvar_pt_texture_cache->integer || !image->pix_data)
+		return qfalse;
+
+	// clones keep the source file of the original, the name tells them apart
+	if (!image->filepath[0] || FS_FileStamp(image->filepath, &stamp))
+		return qfalse;
+
+	hash = texcache_hash(hash, image->name, strlen(image->name));
+	hash = texcache_hash(hash, image->filepath, strlen(image->filepath));
+	hash = texcache_hash(hash, values, sizeof(values));
+	hash = texcache_hash(hash, &stamp, sizeof(stamp));
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->ident = TEXCACHE_IDENT;
+	hdr->version = TEXCACHE_VERSION;
+	hdr->pass = pass;
+	hdr->param = param;
+	hdr->hash = hash;
+	hdr->stamp = stamp;
+	hdr->src_width = image->upload_width;
+	hdr->src_height = image->upload_height;
+
+	Q_snprintf(key->path, sizeof(key->path), "texcache/%016"PRIx64".tex", hash);
+	return qtrue;
 }
 
-static inline void _bilerp_get_next_output_line(struct bilerp_s *bilerp, const float** output_line, const float* next_input, int input_w)
+// returns file contents if a matching entry exists, free with FS_FreeFile
+static texcache_header_t *texcache_load(const texcache_key_t *key)
 {
-	if(bilerp->current_output_row == -1) {
-		memcpy(bilerp->next_input_data, next_input, input_w * sizeof(float) * 3);
-		bilerp->current_output_row = 0;
+	const texcache_header_t *want = &key->header;
+	texcache_header_t *hdr;
+	ssize_t len;
+
+	len = FS_LoadFile(key->path, (void **)&hdr);
+	if (!hdr)
+		return NULL;
+
+	if (len < sizeof(*hdr) ||
+		hdr->ident != want->ident || hdr->version != want->version ||
+		hdr->pass != want->pass || hdr->param != want->param ||
+		hdr->hash != want->hash || hdr->stamp != want->stamp ||
+		hdr->src_width != want->src_width || hdr->src_height != want->src_height ||
+		len != sizeof(*hdr) + (size_t)hdr->data_size ||
+		(hdr->pass != TEXCACHE_BC && hdr->data_size != (size_t)hdr->width * hdr->height * 4)) {
+		Com_DPrintf("Ignoring stale %s\n", key->path);
+		FS_FreeFile(hdr);
+		return NULL;
 	}
 
-	if((bilerp->current_output_row & 1) == 0) {
-		// Even output line: use input lines
-		// Swap next_input_data into current_input_data
-		float *tmp = bilerp->next_input_data;
-		bilerp->next_input_data = bilerp->current_input_data;
-		bilerp->current_input_data = tmp;
-	} else {
-		// Odd output line: interpolate between input lines
-		float *color_dest = bilerp->next_input_data;
-		memcpy(bilerp->next_input_data, next_input, input_w * sizeof(float) * 3);
-
-		float *color_ptr = bilerp->current_input_data;
-		float *next_color_ptr = bilerp->next_input_data;
-		for (int x = 0; x < input_w; x++) {
-			color_ptr[0] = (color_ptr[0] + next_color_ptr[0]) * 0.5f;
-			color_ptr[1] = (color_ptr[1] + next_color_ptr[1]) * 0.5f;
-			color_ptr[2] = (color_ptr[2] + next_color_ptr[2]) * 0.5f;
-			color_ptr += 3;
-			next_color_ptr += 3;
-		}
+	return hdr;
+}
+
+// copies cached pixels over image->pix_data, reallocating if needed
+static void texcache_apply_pixels(image_t *image, const texcache_header_t *hdr)
+{
+	size_t size = (size_t)hdr->width * hdr->height * 4;
+
+	if (hdr->width != image->upload_width || hdr->height != image->upload_height) {
+		Z_Free(image->pix_data);
+		image->pix_data = IMG_AllocPixels(size);
+		image->upload_width = hdr->width;
+		image->upload_height = hdr->height;
 	}
 
-	float *out_ptr = bilerp->output_data;
-	float color[3];
-	const float* color_ptr = bilerp->current_input_data;
-	for (int out_x = 0; out_x < input_w * 2 - 1; out_x++) {
-		if((out_x & 1) == 0) {
-			// Even output row: direct value
-			memcpy(color, color_ptr, 3 * sizeof(float));
-		} else {
-			// Odd output row: interpolate between colors
-			color_ptr += 3;
-			color[0] = (color[0] + color_ptr[0]) * 0.5f;
-			color[1] = (color[1] + color_ptr[1]) * 0.5f;
-			color[2] = (color[2] + color_ptr[2]) * 0.5f;
-		}
-		memcpy(out_ptr, color, 3 * sizeof(float));
-		out_ptr += 3;
+	memcpy(image->pix_data, hdr + 1, size);
+}
+
+// data is stored after the header, pass NULL for metadata only entries
+static void texcache_save(texcache_key_t *key, const image_t *image, const void *data, size_t size)
+{
+	texcache_header_t *hdr = &key->header;
+	qhandle_t f;
+
+	FS_FOpenFile(key->path, &f, FS_MODE_WRITE);
+	if (!f)
+		return;
+
+	if (data) {
+		hdr->width = image->upload_width;
+		hdr->height = image->upload_height;
+		hdr->data_size = size;
 	}
+	VectorCopy(image->light_color, hdr->light_color);
+	memcpy(hdr->min_light_texcoord, image->min_light_texcoord, sizeof(hdr->min_light_texcoord));
+	memcpy(hdr->max_light_texcoord, image->max_light_texcoord, sizeof(hdr->max_light_texcoord));
+	hdr->entire_texture_emissive = image->entire_texture_emissive;
 
-	// Last row: interpolate between last and first pixel
-	color[0] = (color_ptr[0] + bilerp->current_input_data[0]) * 0.5f;
-	color[1] = (color_ptr[1] + bilerp->current_input_data[1]) * 0.5f;
-	color[2] = (color_ptr[2] + bilerp->current_input_data[2]) * 0.5f;
-	memcpy(out_ptr, color, 3 * sizeof(float));
+	FS_Write(hdr, sizeof(*hdr), f);
+	if (data)
+		FS_Write(data, size, f);
 
-	*output_line = bilerp->output_data;
+	// a short write is rejected by the length check on load
+	FS_FCloseFile(f);
 
-	bilerp->current_output_row++;
+	texcache_written += sizeof(*hdr) + (data ? size : 0);
 }
 
-static inline void bilerp_get_next_output_line_from_rgb_f32(struct bilerp_s *bilerp, const float** output_line, const float* input_data, int input_w, int input_h)
+static int texcache_age_cmp(const void *p1, const void *p2)
 {
-	const float *next_input = NULL;
-	if (bilerp->current_output_row == -1) {
-		next_input = input_data;
-	} else if ((bilerp->current_output_row & 1) != 0) {
-		int in_y = (bilerp->current_output_row + 1) >> 1;
-		// Wraparound last line
-		if(in_y >= input_h)
-			in_y = 0;
-		next_input = input_data + in_y * input_w * 3;
+	const file_info_t *a = *(const file_info_t **)p1;
+	const file_info_t *b = *(const file_info_t **)p2;
+
+	return a->mtime < b->mtime ? -1 : a->mtime > b->mtime;
+}
+
+// removes the oldest entries until the cache fits into pt_texture_cache_size
+static void texcache_trim(void)
+{
+	size_t limit = (size_t)(max(cvar_pt_texture_cache_size->value, 0.f) * megabyte);
+	size_t total = 0;
+	int count, removed = 0;
+	file_info_t **list;
+
+	if (!texcache_written)
+		return;
+	texcache_written = 0;
+
+	list = (file_info_t **)FS_ListFiles("texcache", ".tex", FS_TYPE_REAL | FS_PATH_GAME | FS_SEARCH_EXTRAINFO, &count);
+	if (!list)
+		return;
+
+	for (int i = 0; i < count; i++)
+		total += list[i]->size;
+
+	if (total > limit) {
+		qsort(list, count, sizeof(list[0]), texcache_age_cmp);
+
+		for (int i = 0; i < count && total > limit; i++) {
+			char path[MAX_OSPATH];
+
+			if (Q_snprintf(path, sizeof(path), "%s/texcache/%s", fs_gamedir, list[i]->name) >= sizeof(path))
+				continue;
+			if (os_unlink(path))
+				continue;
+
+			total -= list[i]->size;
+			removed++;
+		}
+
+		Com_DPrintf("Removed %d texture cache entries, %"PRIz" bytes left\n", removed, total);
+	}
+
+	FS_FreeList((void **)list);
+}
+
+typedef struct {
+	const float *input;
+	byte *output;
+	int width;
+} encodejob_t;
+
+// RGB float -> SRGB with opaque alpha, one row
+static void encode_srgb_row(void *arg, int y)
+{
+	const encodejob_t *job = arg;
+	const float *current_pixel = job->input + y * job->width * 3;
+	byte *out_pixel = job->output + y * job->width * 4;
+
+	for (int x = 0; x < job->width; x++) {
+		out_pixel[0] = encode_srgb(current_pixel[0]);
+		out_pixel[1] = encode_srgb(current_pixel[1]);
+		out_pixel[2] = encode_srgb(current_pixel[2]);
+		out_pixel[3] = 255;
+
+		current_pixel += 3;
+		out_pixel += 4;
 	}
-	_bilerp_get_next_output_line(bilerp, output_line, next_input, input_w);
+}
+
+// the .dds blocks no longer match once the pixels are rewritten
+static void drop_dds_blocks(image_t *image)
+{
+	Z_Free(image->dds_blocks);
+	image->dds_blocks = NULL;
+	image->dds_size = 0;
+	image->dds_levels = 0;
 }
 
 // Fake an emissive texture from a diffuse texture by using pixels brighter than a certain amount
 static void apply_fake_emissive_threshold(image_t *image, int bright_threshold_int)
 {
+	drop_dds_blocks(image);
+
+	texcache_key_t key;
+	qboolean cached = texcache_init_key(&key, image, TEXCACHE_FAKE_EMISSIVE, bright_threshold_int);
+
+	if (cached) {
+		texcache_header_t *hdr = texcache_load(&key);
+		if (hdr) {
+			texcache_apply_pixels(image, hdr);
+			FS_FreeFile(hdr);
+			return;
+		}
+	}
+
+	init_srgb_tables();
+
 	int w = image->upload_width;
 	int h = image->upload_height;
 
@@ -817,16 +1180,7 @@ static void apply_fake_emissive_threshold(image_t *image, int bright_threshold_i
 	int height_2x = h * 2;
 	float *final_2x = IMG_AllocPixels(width_2x * height_2x * 3 * sizeof(float));
 
-	struct bilerp_s bilerp_final;
-	bilerp_init(&bilerp_final, w);
-	float *out_final_2x = final_2x;
-	for (int out_y = 0; out_y < height_2x; out_y++) {
-		float *img_line;
-		bilerp_get_next_output_line_from_rgb_f32(&bilerp_final, (const float**)&img_line, final, w, h);
-		memcpy(out_final_2x, img_line, width_2x * 3 * sizeof(float));
-		out_final_2x += width_2x * 3;
-	}
-	bilerp_free(&bilerp_final);
+	upsample_2x_rgb_f32(final_2x, final, w, h);
 	Z_Free(final);
 
 	const float filter_final[] = { 0.157731f, 0.684538f, 0.157731f };
@@ -839,21 +1193,13 @@ static void apply_fake_emissive_threshold(image_t *image, int bright_threshold_i
 	image->upload_width = width_2x;
 	image->upload_height = height_2x;
 
-	float* current_pixel = final_2x;
-	byte *out_pixel = image->pix_data;
-	for (int y = 0; y < height_2x; y++) {
-		for (int x = 0; x < width_2x; x++) {
-			out_pixel[0] = encode_srgb(current_pixel[0]);
-			out_pixel[1] = encode_srgb(current_pixel[1]);
-			out_pixel[2] = encode_srgb(current_pixel[2]);
-			out_pixel[3] = 255;
-
-			current_pixel += 3;
-			out_pixel += 4;
-		}
-	}
+	encodejob_t encode = { final_2x, image->pix_data, width_2x };
+	Job_ParallelFor(encode_srgb_row, &encode, height_2x);
 
 	Z_Free(final_2x);
+
+	if (cached)
+		texcache_save(&key, image, image->pix_data, image->upload_width * image->upload_height * 4);
 }
 
 image_t *vkpt_fake_emissive_texture(image_t *image, int bright_threshold_int)
@@ -894,6 +1240,24 @@ image_t *vkpt_fake_emissive_texture(image_t *image, int bright_threshold_int)
 void
 vkpt_extract_emissive_texture_info(image_t *image)
 {
+	texcache_key_t key;
+	qboolean cached = texcache_init_key(&key, image, TEXCACHE_EMISSIVE_INFO, 0);
+
+	if (cached) {
+		texcache_header_t *hdr = texcache_load(&key);
+		if (hdr) {
+			VectorCopy(hdr->light_color, image->light_color);
+			memcpy(image->min_light_texcoord, hdr->min_light_texcoord, sizeof(image->min_light_texcoord));
+			memcpy(image->max_light_texcoord, hdr->max_light_texcoord, sizeof(image->max_light_texcoord));
+			image->entire_texture_emissive = hdr->entire_texture_emissive;
+			image->processing_complete = qtrue;
+			FS_FreeFile(hdr);
+			return;
+		}
+	}
+
+	init_srgb_tables();
+
 	int w = image->upload_width;
 	int h = image->upload_height;
 
@@ -949,11 +1313,33 @@ vkpt_extract_emissive_texture_info(image_t *image)
 	image->entire_texture_emissive = (min_x == 0) && (min_y == 0) && (max_x == w - 1) && (max_y == h - 1);
 
 	image->processing_complete = qtrue;
+
+	if (cached)
+		texcache_save(&key, image, NULL, 0);
 }
 
 void
 vkpt_normalize_normal_map(image_t *image)
 {
+    drop_dds_blocks(image);
+
+    texcache_key_t key;
+    qboolean cached = texcache_init_key(&key, image, TEXCACHE_NORMALS, 0);
+
+    // alpha holds metalness and the normal length feeds specular AA,
+    // so normal maps are never block compressed
+    image->flags |= IF_NORMAL_MAP;
+
+    if (cached) {
+        texcache_header_t *hdr = texcache_load(&key);
+        if (hdr) {
+            texcache_apply_pixels(image, hdr);
+            image->processing_complete = qtrue;
+            FS_FreeFile(hdr);
+            return;
+        }
+    }
+
     int w = image->upload_width;
     int h = image->upload_height;
 
@@ -989,6 +1375,169 @@ vkpt_normalize_normal_map(image_t *image)
     }
 
     image->processing_complete = qtrue;
+
+    if (cached)
+        texcache_save(&key, image, image->pix_data, image->upload_width * image->upload_height * 4);
+}
+
+// straightforward versions of the kernels above, for checking results
+static void filter_reference(float *pixels, int num_comps, const float kernel[], unsigned kernel_size, int width, int height)
+{
+	float *copy = Z_Malloc(width * height * num_comps * sizeof(float));
+	int pad = kernel_size / 2;
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		memcpy(copy, pixels, width * height * num_comps * sizeof(float));
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				for (int c = 0; c < num_comps; c++)
+				{
+					float sum = 0;
+					for (int j = 0; j < kernel_size; j++)
+					{
+						int sx = x, sy = y;
+						if (pass == 0)
+							sx = ((x + j - pad) % width + width) % width;
+						else
+							sy = ((y + j - pad) % height + height) % height;
+						sum += kernel[j] * copy[(sy * width + sx) * num_comps + c];
+					}
+					pixels[(y * width + x) * num_comps + c] = sum;
+				}
+			}
+		}
+	}
+
+	Z_Free(copy);
+}
+
+static float upsample_reference(const float *in, int w, int h, int x, int y, int c)
+{
+	int x0 = x >> 1, x1 = (x0 + 1) % w;
+	int y0 = y >> 1, y1 = (y0 + 1) % h;
+	float a = in[(y0 * w + x0) * 3 + c];
+	float b = in[(y0 * w + x1) * 3 + c];
+
+	if (y & 1)
+	{
+		a = (a + in[(y1 * w + x0) * 3 + c]) * 0.5f;
+		b = (b + in[(y1 * w + x1) * 3 + c]) * 0.5f;
+	}
+
+	return (x & 1) ? (a + b) * 0.5f : a;
+}
+
+static float max_difference(const float *a, const float *b, int count)
+{
+	float diff = 0;
+
+	for (int i = 0; i < count; i++)
+		diff = max(diff, fabsf(a[i] - b[i]));
+
+	return diff;
+}
+
+/*
+================
+vkpt_textures_kernel_test
+
+texture_kernel_test [size]
+
+Checks the sRGB tables, separable filter and 2x upsampling used for
+texture processing against plain versions and times them. Runs on the
+CPU only and does not touch any GPU resources.
+================
+*/
+void vkpt_textures_kernel_test(void)
+{
+	int size = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 512;
+	int failures = 0, mismatches, count;
+	unsigned start, msec, ref_msec;
+	volatile int sink = 0;
+
+	clamp(size, 4, 4096);
+	init_srgb_tables();
+
+	// sRGB decoding is a copy of the formula, encoding must match it exactly
+	mismatches = 0;
+	for (int i = 0; i < 256; i++)
+	{
+		mismatches += decode_srgb(i) != decode_srgb_exact(i);
+		mismatches += encode_srgb(decode_srgb(i)) != i;
+	}
+
+	count = 1 << 20;
+	srand(size);
+	float *values = Z_Malloc(count * sizeof(float));
+	for (int i = 0; i < count; i++)
+		values[i] = (float)rand() / RAND_MAX * 1.2f - 0.1f;
+
+	start = Sys_Milliseconds();
+	for (int i = 0; i < count; i++)
+		sink += encode_srgb_exact(values[i]);
+	ref_msec = Sys_Milliseconds() - start;
+
+	start = Sys_Milliseconds();
+	for (int i = 0; i < count; i++)
+		sink += encode_srgb(values[i]);
+	msec = Sys_Milliseconds() - start;
+
+	for (int i = 0; i < count; i++)
+		mismatches += encode_srgb(values[i]) != encode_srgb_exact(values[i]);
+	Z_Free(values);
+
+	failures += mismatches;
+	Com_Printf("srgb encode %8d values %6u msec ref %6u msec, %d mismatches\n", count, msec, ref_msec, mismatches);
+
+	// separable blur, same kernel as fake emissive textures
+	const float filter[] = { 0.0093f, 0.028002f, 0.065984f, 0.121703f, 0.175713f, 0.198596f, 0.175713f, 0.121703f, 0.065984f, 0.028002f, 0.0093f };
+	count = size * size * 3;
+	float *image = Z_Malloc(count * sizeof(float));
+	float *result = Z_Malloc(count * sizeof(float));
+	float *reference = Z_Malloc(count * 4 * sizeof(float));
+	for (int i = 0; i < count; i++)
+		image[i] = (float)rand() / RAND_MAX;
+
+	memcpy(reference, image, count * sizeof(float));
+	start = Sys_Milliseconds();
+	filter_reference(reference, 3, filter, sizeof(filter) / sizeof(filter[0]), size, size);
+	ref_msec = Sys_Milliseconds() - start;
+
+	memcpy(result, image, count * sizeof(float));
+	start = Sys_Milliseconds();
+	filter_float_image(result, 3, filter, sizeof(filter) / sizeof(filter[0]), size, size);
+	msec = Sys_Milliseconds() - start;
+
+	float diff = max_difference(result, reference, count);
+	failures += diff > 1e-5f;
+	Com_Printf("filter      %4dx%-4d %6u msec ref %6u msec, max difference %g\n", size, size, msec, ref_msec, diff);
+
+	// 2x upsampling must be bit exact
+	float *upsampled = Z_Malloc(count * 4 * sizeof(float));
+	start = Sys_Milliseconds();
+	for (int y = 0; y < size * 2; y++)
+		for (int x = 0; x < size * 2; x++)
+			for (int c = 0; c < 3; c++)
+				reference[(y * size * 2 + x) * 3 + c] = upsample_reference(image, size, size, x, y, c);
+	ref_msec = Sys_Milliseconds() - start;
+
+	start = Sys_Milliseconds();
+	upsample_2x_rgb_f32(upsampled, image, size, size);
+	msec = Sys_Milliseconds() - start;
+
+	diff = max_difference(upsampled, reference, count * 4);
+	failures += diff != 0;
+	Com_Printf("upsample 2x %4dx%-4d %6u msec ref %6u msec, max difference %g\n", size, size, msec, ref_msec, diff);
+
+	Z_Free(image);
+	Z_Free(result);
+	Z_Free(reference);
+	Z_Free(upsampled);
+
+	Com_Printf("%s\n", failures ? "FAILED" : "passed");
 }
 
 void
@@ -998,17 +1547,10 @@ IMG_Load_RTX(image_t *image, byte *pic)
 	image_loading_dirty_flag = 1;
 }
 
-void
-IMG_Unload_RTX(image_t *image)
+// hands the image over to be destroyed once no frame in flight uses it
+static void
+destroy_tex_image(int index)
 {
-	if(image->pix_data)
-		Z_Free(image->pix_data);
-	image->pix_data = NULL;
-
-	const uint32_t index = image - r_images;
-
-	if (tex_images[index])
-	{
 	const uint32_t frame_index = (qvk.frame_counter + MAX_FRAMES_IN_FLIGHT + 1) % DESTROY_LATENCY;
 	UnusedResources* unused_resources = texture_system.unused_resources + frame_index;
 
@@ -1022,7 +1564,24 @@ IMG_Unload_RTX(image_t *image)
 	tex_image_views[index] = VK_NULL_HANDLE;
 
 	vkpt_invalidate_texture_descriptors();
-	}
+}
+
+static void forget_texture(int index);
+
+void
+IMG_Unload_RTX(image_t *image)
+{
+	if(image->pix_data)
+		Z_Free(image->pix_data);
+	image->pix_data = NULL;
+	drop_dds_blocks(image);
+
+	const uint32_t index = image - r_images;
+
+	forget_texture(index);
+
+	if (tex_images[index])
+		destroy_tex_image(index);
 }
 
 void IMG_ReloadAll(void)
@@ -1053,12 +1612,17 @@ void IMG_ReloadAll(void)
             continue; // skip if file has not been modified since last read
 
         // image has been modified : try loading in new_image
-        image_t new_image;
+        image_t new_image = { 0 };
         if (load_img(filepath, &new_image) == Q_ERR_SUCCESS)
         {
             Z_Free(image->pix_data);
+            drop_dds_blocks(image);
 
             image->pix_data = new_image.pix_data;
+            image->dds_blocks = new_image.dds_blocks;
+            image->dds_size = new_image.dds_size;
+            image->dds_format = new_image.dds_format;
+            image->dds_levels = new_image.dds_levels;
             image->width = new_image.width;
             image->height = new_image.width;
             image->upload_width = new_image.upload_width;
@@ -1078,6 +1642,8 @@ void IMG_ReloadAll(void)
 
             image->last_modified = last_modifed; // reset time stamp because load_img doesn't
 
+            forget_texture(i);
+
             // destroy Vk ressources to force vkpt_textures_end_registration
             // to recreate them next time a frame is drawn
             if (tex_image_views[i]) {
@@ -1410,6 +1976,8 @@ static void
 destroy_tex_images()
 {
 	for(int i = 0; i < MAX_RIMAGES; i++) {
+		forget_texture(i);
+
 		if(tex_image_views[i]) {
 			vkDestroyImageView(qvk.device, tex_image_views[i], NULL);
 			tex_image_views[i] = VK_NULL_HANDLE;
@@ -1470,6 +2038,253 @@ static VkMemoryAllocateFlagsInfo mem_alloc_flags_broadcast = {
 };
 #endif
 
+/*
+================
+BLOCK COMPRESSION
+
+Albedo and emissive textures are uploaded as BC1, or BC3 if any texel is
+not fully opaque, with the whole mip chain encoded on the CPU. Encoding is
+slow, so results go through the texture cache. Textures loaded from .dds
+files keep their own blocks, only missing small mips are encoded.
+================
+*/
+
+static byte        *tex_compressed_data  [MAX_RIMAGES];
+static size_t       tex_compressed_size  [MAX_RIMAGES];
+static tcformat_t   tex_compressed_format[MAX_RIMAGES];
+
+static tcformat_t
+choose_compression(const image_t *image)
+{
+	if (!qvk.supports_texture_compression_bc || !cvar_pt_texture_compression->integer)
+		return TC_NONE;
+
+	if (image->type != IT_WALL && image->type != IT_SKIN)
+		return TC_NONE;
+
+	if ((image->flags & IF_NORMAL_MAP) || image->upload_width < 4 || image->upload_height < 4)
+		return TC_NONE;
+
+	// punch through alpha in DXT1 needs BC3, the BC1 formats used are RGB only
+	if (image->dds_blocks && (image->dds_format == TC_BC3 || (image->flags & IF_OPAQUE)))
+		return image->dds_format;
+
+	int count = image->upload_width * image->upload_height;
+	for (int i = 0; i < count; i++)
+		if (image->pix_data[i * 4 + 3] != 255)
+			return TC_BC3;
+
+	return TC_BC1;
+}
+
+static size_t
+texture_chain_size(tcformat_t format, int w, int h, int base_mip)
+{
+	size_t size = 0;
+
+	for (int mip = get_num_miplevels(w, h) - 1; mip >= base_mip; mip--) {
+		int mw = MAX(w >> mip, 1);
+		int mh = MAX(h >> mip, 1);
+		size += format == TC_NONE ? (size_t)mw * mh * 4 : TC_LevelSize(format, mw, mh);
+	}
+
+	return size;
+}
+
+// leaves the encoded mip chain in tex_compressed_data[index], or NULL
+static void
+compress_texture(int index)
+{
+	image_t *image = r_images + index;
+	size_t size = 0;
+	int num_levels;
+
+	// kept from an earlier upload of a streamed texture
+	if (tex_compressed_data[index])
+		return;
+
+	tcformat_t format = choose_compression(image);
+	tex_compressed_size[index] = 0;
+	tex_compressed_format[index] = format;
+
+	if (format == TC_NONE)
+		return;
+
+	if (image->dds_blocks && image->dds_format == format) {
+		tex_compressed_data[index] = TC_CompleteMipChain(format, image->dds_blocks, image->dds_levels,
+			image->upload_width, image->upload_height, image->is_srgb, &num_levels, &size);
+		tex_compressed_size[index] = size;
+		return;
+	}
+
+	texcache_key_t key;
+	qboolean cached = texcache_init_key(&key, image, TEXCACHE_BC, format);
+
+	if (cached) {
+		texcache_header_t *hdr = texcache_load(&key);
+		if (hdr) {
+			size = texture_chain_size(format, image->upload_width, image->upload_height, 0);
+			if (hdr->data_size == size) {
+				tex_compressed_data[index] = Z_Malloc(size);
+				tex_compressed_size[index] = size;
+				memcpy(tex_compressed_data[index], hdr + 1, size);
+				FS_FreeFile(hdr);
+				return;
+			}
+			FS_FreeFile(hdr);
+		}
+	}
+
+	tex_compressed_data[index] = TC_EncodeMipChain(format, image->pix_data,
+		image->upload_width, image->upload_height, image->is_srgb, &num_levels, &size);
+	tex_compressed_size[index] = size;
+
+	if (cached)
+		texcache_save(&key, image, tex_compressed_data[index], size);
+}
+
+static VkFormat
+get_texture_format(qboolean srgb, tcformat_t format)
+{
+	switch (format) {
+	case TC_BC1:
+		return srgb ? VK_FORMAT_BC1_RGB_SRGB_BLOCK : VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+	case TC_BC3:
+		return srgb ? VK_FORMAT_BC3_SRGB_BLOCK : VK_FORMAT_BC3_UNORM_BLOCK;
+	default:
+		return srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+	}
+}
+
+/*
+================
+TEXTURE RESIDENCY
+
+With pt_texture_budget set, wall and skin textures larger than
+pt_texture_stream_size are registered with only their small mips.
+Textures touched by the renderer get their full chain uploaded, at most
+pt_texture_upload_limit megabytes per frame, and the least recently used
+full textures fall back to the small mips when the budget runs out.
+The bookkeeping itself is in residency.c.
+================
+*/
+
+static residency_entry_t    tex_residency_entries[MAX_RIMAGES];
+static residency_t          tex_residency = { tex_residency_entries, MAX_RIMAGES, SIZE_MAX, 0, 1 };
+
+static qboolean
+texture_streaming_enabled(void)
+{
+	return cvar_pt_texture_budget->value > 0;
+}
+
+// registers the image on first use and returns the mip level it starts at
+static int
+get_base_mip(int index)
+{
+	residency_entry_t *e = tex_residency.entries + index;
+	const image_t *image = r_images + index;
+
+	if (!e->tracked)
+	{
+		int w = image->upload_width;
+		int h = image->upload_height;
+		int low_mip = 0;
+		qboolean streamable = texture_streaming_enabled() &&
+			(image->type == IT_WALL || image->type == IT_SKIN) &&
+			cvar_pt_texture_stream_size->integer > 0;
+
+		while (streamable && MAX(w >> low_mip, h >> low_mip) > cvar_pt_texture_stream_size->integer)
+			low_mip++;
+
+		residency_add(&tex_residency, index,
+			texture_chain_size(tex_compressed_format[index], w, h, low_mip),
+			texture_chain_size(tex_compressed_format[index], w, h, 0),
+			low_mip, streamable);
+	}
+
+	return e->full ? 0 : e->low_mip;
+}
+
+void
+vkpt_textures_touch_image(const image_t *image)
+{
+	if (image)
+		residency_touch(&tex_residency, image - r_images);
+}
+
+void
+vkpt_textures_touch_material(const pbr_material_t *mat)
+{
+	if (!mat)
+		return;
+
+	vkpt_textures_touch_image(mat->image_base);
+	vkpt_textures_touch_image(mat->image_normals);
+	vkpt_textures_touch_image(mat->image_emissive);
+	vkpt_textures_touch_image(mat->image_mask);
+}
+
+// touches the materials of all clusters potentially visible from viewcluster
+void
+vkpt_textures_touch_visible(const bsp_mesh_t *wm, bsp_t *bsp, int viewcluster)
+{
+	if (!texture_streaming_enabled() || !wm->cluster_material_offsets)
+		return;
+
+	const byte *pvs = (viewcluster >= 0 && bsp->vis) ? BSP_GetPvs(bsp, viewcluster) : NULL;
+
+	for (int cluster = 0; cluster <= wm->num_clusters; cluster++)
+	{
+		if (pvs && cluster < wm->num_clusters && !Q_IsBitSet(pvs, cluster))
+			continue;
+
+		for (int i = wm->cluster_material_offsets[cluster]; i < wm->cluster_material_offsets[cluster + 1]; i++)
+			vkpt_textures_touch_material(MAT_ForIndex(wm->cluster_materials[i]));
+	}
+}
+
+// drops the compressed chain and residency entry kept for the image pixels
+static void
+forget_texture(int index)
+{
+	Z_Free(tex_compressed_data[index]);
+	tex_compressed_data[index] = NULL;
+	tex_compressed_size[index] = 0;
+	tex_compressed_format[index] = TC_NONE;
+
+	residency_remove(&tex_residency, index);
+}
+
+/*
+================
+vkpt_textures_update_residency
+
+Called at the start of a frame. Textures that change residency lose their
+Vulkan image here and get a new one with the right number of mips from
+vkpt_textures_end_registration right after.
+================
+*/
+void
+vkpt_textures_update_residency(void)
+{
+	static int changed[MAX_RIMAGES];
+
+	tex_residency.budget = texture_streaming_enabled() ? (size_t)(cvar_pt_texture_budget->value * megabyte) : SIZE_MAX;
+
+	int num_changed = residency_update(&tex_residency,
+		(size_t)(MAX(cvar_pt_texture_upload_limit->value, 0) * megabyte), changed);
+
+	for (int i = 0; i < num_changed; i++)
+	{
+		if (!tex_images[changed[i]])
+			continue;
+
+		destroy_tex_image(changed[i]);
+		image_loading_dirty_flag = 1;
+	}
+}
+
 VkResult
 vkpt_textures_end_registration()
 {
@@ -1531,10 +2346,13 @@ vkpt_textures_end_registration()
 		if (tex_images[i] != VK_NULL_HANDLE || !q_img->registration_sequence || q_img->pix_data == NULL)
 			continue;
 
-		img_info.extent.width = q_img->upload_width;
-		img_info.extent.height = q_img->upload_height;
-		img_info.mipLevels = get_num_miplevels(q_img->upload_width, q_img->upload_height);
-		img_info.format = q_img->is_srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+		compress_texture(i);
+
+		int base_mip = get_base_mip(i);
+		img_info.extent.width = MAX(q_img->upload_width >> base_mip, 1);
+		img_info.extent.height = MAX(q_img->upload_height >> base_mip, 1);
+		img_info.mipLevels = get_num_miplevels(img_info.extent.width, img_info.extent.height);
+		img_info.format = get_texture_format(q_img->is_srgb, tex_compressed_format[i]);
 
 		_VK(vkCreateImage(qvk.device, &img_info, NULL, tex_images + i));
 		ATTACH_LABEL_VARIABLE(tex_images[i], IMAGE);
@@ -1542,10 +2360,12 @@ vkpt_textures_end_registration()
 		VkMemoryRequirements mem_req;
 		vkGetImageMemoryRequirements(qvk.device, tex_images[i], &mem_req);
 
-		assert(!(mem_req.alignment & (mem_req.alignment - 1)));
-		total_size += mem_req.alignment - 1;
-		total_size &= ~(mem_req.alignment - 1);
-		total_size += mem_req.size;
+		// block copies need offsets aligned to the block size
+		size_t alignment = MAX(mem_req.alignment, 16);
+		assert(!(alignment & (alignment - 1)));
+		total_size += alignment - 1;
+		total_size &= ~(alignment - 1);
+		total_size += MAX(mem_req.size, tex_compressed_size[i]);
 
 		DeviceMemory* image_memory = tex_image_memory + i;
 		image_memory->size = mem_req.size;
@@ -1587,17 +2407,17 @@ vkpt_textures_end_registration()
 		if (tex_images[i] == VK_NULL_HANDLE || tex_image_views[i] != VK_NULL_HANDLE)
 			continue;
 
-		int num_mip_levels = get_num_miplevels(q_img->upload_width, q_img->upload_height);
+		int base_mip = get_base_mip(i);
+		uint32_t wd = MAX(q_img->upload_width >> base_mip, 1);
+		uint32_t ht = MAX(q_img->upload_height >> base_mip, 1);
+		int num_mip_levels = get_num_miplevels(wd, ht);
 
 		VkMemoryRequirements mem_req;
 		vkGetImageMemoryRequirements(qvk.device, tex_images[i], &mem_req);
 
-		assert(!(mem_req.alignment & (mem_req.alignment - 1)));
-		offset += mem_req.alignment - 1;
-		offset &= ~(mem_req.alignment - 1);
-
-		uint32_t wd = q_img->upload_width;
-		uint32_t ht = q_img->upload_height;
+		size_t alignment = MAX(mem_req.alignment, 16);
+		offset += alignment - 1;
+		offset &= ~(alignment - 1);
 
 		VkImageSubresourceRange subresource_range = {
 			.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -1616,8 +2436,65 @@ vkpt_textures_end_registration()
 				.newLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
 		);
 
+		if (tex_compressed_data[i])
+		{
+			// every level comes from the encoder, nothing to blit
+			VkBufferImageCopy cpy_info[16];
+			size_t skip = tex_compressed_size[i] - texture_chain_size(tex_compressed_format[i],
+				q_img->upload_width, q_img->upload_height, base_mip);
+			size_t level_offset = offset;
+
+			assert(num_mip_levels <= LENGTH(cpy_info));
+			memcpy(staging_buffer + offset, tex_compressed_data[i] + skip, tex_compressed_size[i] - skip);
+
+			for (int mip = 0; mip < num_mip_levels; mip++)
+			{
+				cpy_info[mip] = (VkBufferImageCopy) {
+					.bufferOffset = level_offset,
+					.imageSubresource = {
+						.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel       = mip,
+						.baseArrayLayer = 0,
+						.layerCount     = 1,
+					},
+					.imageOffset    = { 0, 0, 0 },
+					.imageExtent    = { wd, ht, 1 }
+				};
+
+				level_offset += TC_LevelSize(tex_compressed_format[i], wd, ht);
+				wd = MAX(wd >> 1, 1);
+				ht = MAX(ht >> 1, 1);
+			}
+
+			vkCmdCopyBufferToImage(cmd_buf, buf_img_upload.buffer, tex_images[i],
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, num_mip_levels, cpy_info);
+
+			IMAGE_BARRIER(cmd_buf,
+				.image            = tex_images[i],
+				.subresourceRange = subresource_range,
+				.srcAccessMask    = VK_ACCESS_TRANSFER_WRITE_BIT,
+				.dstAccessMask    = VK_ACCESS_SHADER_READ_BIT,
+				.oldLayout        = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.newLayout        = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+			);
+
+			// streamed textures may need the chain again
+			if (!tex_residency.entries[i].streamable)
+			{
+				Z_Free(tex_compressed_data[i]);
+				tex_compressed_data[i] = NULL;
+			}
+		}
+		else
 		{
-			memcpy(staging_buffer + offset, q_img->pix_data, wd * ht * 4);
+			if (base_mip == 0)
+				memcpy(staging_buffer + offset, q_img->pix_data, wd * ht * 4);
+			else if (q_img->is_srgb)
+				stbir_resize_uint8_srgb(q_img->pix_data, q_img->upload_width, q_img->upload_height, 0,
+					(byte *)staging_buffer + offset, wd, ht, 0, 4, 3, 0);
+			else
+				stbir_resize_uint8(q_img->pix_data, q_img->upload_width, q_img->upload_height, 0,
+					(byte *)staging_buffer + offset, wd, ht, 0, 4);
 
 			VkBufferImageCopy cpy_info = {
 				.bufferOffset = offset,
@@ -1633,88 +2510,88 @@ vkpt_textures_end_registration()
 
 			vkCmdCopyBufferToImage(cmd_buf, buf_img_upload.buffer, tex_images[i],
 				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &cpy_info);
-		}
-
-		subresource_range.levelCount = 1;
 
-		for (int mip = 1; mip < num_mip_levels; mip++) 
-		{
-			subresource_range.baseMipLevel = mip - 1;
+			subresource_range.levelCount = 1;
 
-			IMAGE_BARRIER(cmd_buf,
-				.image = tex_images[i],
-				.subresourceRange = subresource_range,
-				.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-				.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-				.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-				);
+			for (int mip = 1; mip < num_mip_levels; mip++) 
+			{
+				subresource_range.baseMipLevel = mip - 1;
 
-			int nwd = (wd > 1) ? (wd >> 1) : wd;
-			int nht = (ht > 1) ? (ht >> 1) : ht;
+				IMAGE_BARRIER(cmd_buf,
+					.image = tex_images[i],
+					.subresourceRange = subresource_range,
+					.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+					.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+					.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+					.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+					);
+
+				int nwd = (wd > 1) ? (wd >> 1) : wd;
+				int nht = (ht > 1) ? (ht >> 1) : ht;
+
+				VkImageBlit region = {
+					.srcSubresource = {
+						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel = mip - 1,
+						.baseArrayLayer = 0,
+						.layerCount = 1
+					},
+					.srcOffsets = { 
+						{ 0, 0, 0 }, 
+						{ wd, ht, 1 } },
+
+					.dstSubresource = {
+						.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+						.mipLevel = mip,
+						.baseArrayLayer = 0,
+						.layerCount = 1
+					},
+					.dstOffsets = { 
+						{ 0, 0, 0 }, 
+						{ nwd, nht, 1 } }
+				};
 
-			VkImageBlit region = {
-				.srcSubresource = {
-					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-					.mipLevel = mip - 1,
-					.baseArrayLayer = 0,
-					.layerCount = 1
-				},
-				.srcOffsets = { 
-					{ 0, 0, 0 }, 
-					{ wd, ht, 1 } },
+				vkCmdBlitImage(
+					cmd_buf, 
+					tex_images[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
+					tex_images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
+					1, &region, 
+					VK_FILTER_LINEAR);
 
-				.dstSubresource = {
-					.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-					.mipLevel = mip,
-					.baseArrayLayer = 0,
-					.layerCount = 1
-				},
-				.dstOffsets = { 
-					{ 0, 0, 0 }, 
-					{ nwd, nht, 1 } }
-			};
+				subresource_range.baseMipLevel = mip - 1;
 
-			vkCmdBlitImage(
-				cmd_buf, 
-				tex_images[i], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, 
-				tex_images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 
-				1, &region, 
-				VK_FILTER_LINEAR);
+				IMAGE_BARRIER(cmd_buf,
+					.image = tex_images[i],
+					.subresourceRange = subresource_range,
+					.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+					.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+					.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+					.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+					);
+
+				wd = nwd;
+				ht = nht;
+			}
 
-			subresource_range.baseMipLevel = mip - 1;
+			subresource_range.baseMipLevel = num_mip_levels - 1;
 
 			IMAGE_BARRIER(cmd_buf,
 				.image = tex_images[i],
 				.subresourceRange = subresource_range,
 				.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
 				.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 				.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
 				);
-
-			wd = nwd;
-			ht = nht;
 		}
 
-		subresource_range.baseMipLevel = num_mip_levels - 1;
-
-		IMAGE_BARRIER(cmd_buf,
-			.image = tex_images[i],
-			.subresourceRange = subresource_range,
-			.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-			.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-			);
-
 		img_view_info.image = tex_images[i];
 		img_view_info.subresourceRange.levelCount = num_mip_levels;
-		img_view_info.format = q_img->is_srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+		img_view_info.format = get_texture_format(q_img->is_srgb, tex_compressed_format[i]);
 		_VK(vkCreateImageView(qvk.device, &img_view_info, NULL, tex_image_views + i));
 		ATTACH_LABEL_VARIABLE(tex_image_views[i], IMAGE_VIEW);
 
-		offset += mem_req.size;
+		offset += MAX(mem_req.size, tex_compressed_size[i]);
 	}
 
 	buffer_unmap(&buf_img_upload);
@@ -1737,6 +2614,8 @@ vkpt_textures_end_registration()
 	Com_DPrintf("Texture pool: using %.2f MB, allocated %.2f MB\n", 
 		(float)texture_memory_used / megabyte, (float)texture_memory_allocated / megabyte);
 
+	texcache_trim();
+
 	return VK_SUCCESS;
 }
 
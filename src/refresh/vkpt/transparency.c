@@ -21,8 +21,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "vkpt.h"
 #include "vk_util.h"
 #include "conversion.h"
+#include "common/jobs.h"
+#include "system/system.h"
 
-#define TR_PARTICLE_MAX_NUM    MAX_PARTICLES
+#define TR_PARTICLE_MAX_NUM    particle_budget
 #define TR_BEAM_MAX_NUM        MAX_ENTITIES
 #define TR_SPRITE_MAX_NUM      MAX_ENTITIES
 #define TR_VERTEX_MAX_NUM      ((TR_PARTICLE_MAX_NUM + TR_SPRITE_MAX_NUM) * 4)
@@ -33,16 +35,49 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define TR_BEAM_INTERSECT_SIZE (12 * sizeof(float))
 #define TR_SPRITE_INFO_SIZE    (2 * sizeof(float))
 
-struct
+#define TR_PARTICLES_PER_JOB   1024
+#define TR_BEAMS_PER_JOB       256
+#define TR_SPRITES_PER_JOB     256
+
+// where each kind of data goes within one frame of the host buffer
+typedef struct
 {
 	size_t vertex_position_host_offset;
 	size_t beam_aabb_host_offset;
 	size_t particle_color_host_offset;
 	size_t beam_color_host_offset;
 	size_t sprite_info_host_offset;
-	size_t current_upload_size;
-
 	size_t beam_intersect_host_offset;
+	size_t upload_size;
+} trlayout_t;
+
+// everything the geometry jobs read, gathered on the main thread
+typedef struct
+{
+	char* dst;
+	const trlayout_t* layout;
+	vec3_t view_origin;
+	vec3_t view_x;
+	vec3_t view_y;
+	float particle_size;
+	float beam_width;
+	float hdr_factor;
+	int projection;
+	const particle_t* particles;
+	const entity_t* const* beams;
+	const entity_t* const* sprites;
+	const model_t* const* sprite_models;
+	int particle_num;
+	int beam_num;
+	int sprite_num;
+	int particle_jobs;
+	int beam_jobs;
+	int sprite_jobs;
+} trgeometryjob_t;
+
+struct
+{
+	trlayout_t layout;
 
 	size_t sprite_vertex_device_offset;
 
@@ -54,7 +89,9 @@ struct
 	unsigned int host_frame_index;
 	unsigned int host_buffered_frame_num;
 	char* mapped_host_buffer;
-	char* host_buffer_shadow;
+	const entity_t* beams[TR_BEAM_MAX_NUM];
+	const entity_t* sprites[TR_SPRITE_MAX_NUM];
+	const model_t* sprite_models[TR_SPRITE_MAX_NUM];
 	BufferResource_t vertex_buffer;
 	BufferResource_t index_buffer;
 	BufferResource_t beam_aabb_buffer;
@@ -78,11 +115,13 @@ static void create_buffer_views();
 static void fill_index_buffer();
 
 // update
-static void write_particle_geometry(const float* view_matrix, const particle_t* particles, int particle_num);
-static void write_beam_geometry(const entity_t* entities, int entity_num);
-static void write_sprite_geometry(const float* view_matrix, const entity_t* entities, int entity_num);
+static void compute_layout(trlayout_t* layout, int particle_num, int beam_num, int sprite_num);
+static void write_geometry(trgeometryjob_t* job, int threads);
 static void upload_geometry(VkCommandBuffer command_buffer);
 
+// cl_maxparticles when the renderer started, changing it restarts the renderer
+static int particle_budget = MAX_PARTICLES;
+
 cvar_t* cvar_pt_particle_size = NULL;
 cvar_t* cvar_pt_beam_width = NULL;
 cvar_t* cvar_pt_beam_lights = NULL;
@@ -103,13 +142,40 @@ void cast_u32_to_f32_color(int color_index, const color_t* pcolor, float* color_
 }
 
 qboolean initialize_transparency()
+{
+	memset(&transparency, 0, sizeof(transparency));
+
+	transparency.host_buffered_frame_num = MAX_FRAMES_IN_FLIGHT;
+	transparency.host_frame_size = get_transparency_frame_size();
+	transparency.host_buffer_size = transparency.host_buffered_frame_num * transparency.host_frame_size;
+
+	create_buffers();
+
+	if (allocate_and_bind_memory_to_buffers() != VK_TRUE)
+		return qfalse;
+
+	create_buffer_views(transparency);
+	fill_index_buffer(transparency);
+
+	return qtrue;
+}
+
+// registered with the other CPU state, the offline tools use them as well
+void register_transparency_cvars()
 {
 	cvar_pt_particle_size = Cvar_Get("pt_particle_size", "0.35", 0);
 	cvar_pt_beam_width = Cvar_Get("pt_beam_width", "1.0", 0);
 	cvar_pt_beam_lights = Cvar_Get("pt_beam_lights", "1.0", 0);
 
-	memset(&transparency, 0, sizeof(transparency));
+	// the renderer starts before the client effects, which clamp it the same way
+	cvar_t* cl_maxparticles = Cvar_Get("cl_maxparticles", va("%d", MAX_PARTICLES), CVAR_REFRESH);
+	particle_budget = cl_maxparticles->integer;
+	clamp(particle_budget, MIN_PARTICLE_BUDGET, MAX_PARTICLE_BUDGET);
+}
 
+// size of one frame of geometry, written by write_transparency
+size_t get_transparency_frame_size()
+{
 	const size_t particle_vertex_position_max_size = TR_VERTEX_MAX_NUM * TR_POSITION_SIZE;
 	const size_t particle_color_size = TR_PARTICLE_MAX_NUM * TR_COLOR_SIZE;
 	const size_t particle_data_size = particle_vertex_position_max_size + particle_color_size;
@@ -122,20 +188,8 @@ qboolean initialize_transparency()
 	const size_t sprite_vertex_position_max_size = TR_SPRITE_MAX_NUM * TR_POSITION_SIZE;
 	const size_t sprite_info_size = TR_SPRITE_MAX_NUM * TR_SPRITE_INFO_SIZE;
 	const size_t sprite_data_size = sprite_vertex_position_max_size + sprite_info_size;
-	
-	transparency.host_buffered_frame_num = MAX_FRAMES_IN_FLIGHT;
-	transparency.host_frame_size = particle_data_size + beam_data_size + sprite_data_size;
-	transparency.host_buffer_size = transparency.host_buffered_frame_num * transparency.host_frame_size;
 
-	create_buffers();
-
-	if (allocate_and_bind_memory_to_buffers() != VK_TRUE)
-		return qfalse;
-
-	create_buffer_views(transparency);
-	fill_index_buffer(transparency);
-
-	return qtrue;
+	return particle_data_size + beam_data_size + sprite_data_size;
 }
 
 void destroy_transparency()
@@ -155,17 +209,13 @@ void destroy_transparency()
 	vkDestroyBuffer(qvk.device, transparency.host_buffer, NULL);
 	vkFreeMemory(qvk.device, transparency.host_buffer_memory, NULL);
 
-	if (transparency.host_buffer_shadow)
-	{
-		Z_Free(transparency.host_buffer_shadow);
-		transparency.host_buffer_shadow = NULL;
-	}
 }
 
-void update_transparency(VkCommandBuffer command_buffer, const float* view_matrix,
+// Gathers the beams and sprites and writes the geometry of a frame to dst,
+// only on the CPU. The counts and the layout are kept for upload_transparency.
+void write_transparency(char* dst, const float* view_origin, const float* view_matrix,
 	const particle_t* particles, int particle_num, const entity_t* entities, int entity_num)
 {
-	transparency.host_frame_index = (transparency.host_frame_index + 1) % transparency.host_buffered_frame_num;
 	particle_num = min(particle_num, TR_PARTICLE_MAX_NUM);
 
 	uint32_t beam_num = 0;
@@ -175,43 +225,69 @@ void update_transparency(VkCommandBuffer command_buffer, const float* view_matri
 		if (entities[i].flags & RF_BEAM)
 		{
 			// write_beam_geometry skips zero-width beams as well
-			if(entities[i].frame > 0)
-				++beam_num;
+			if(entities[i].frame > 0 && beam_num < TR_BEAM_MAX_NUM)
+				transparency.beams[beam_num++] = entities + i;
 		}
 		else if ((entities[i].model & 0x80000000) == 0)
 		{
 			const model_t* model = MOD_ForHandle(entities[i].model);
-			if (model && model->type == MOD_SPRITE)
+			if (model && model->type == MOD_SPRITE && sprite_num < TR_SPRITE_MAX_NUM)
+			{
+				transparency.sprites[sprite_num] = entities + i;
+				transparency.sprite_models[sprite_num] = model;
 				++sprite_num;
+			}
 		}
 	}
-	beam_num = min(beam_num, TR_BEAM_MAX_NUM);
-	sprite_num = min(sprite_num, TR_SPRITE_MAX_NUM);
 
 	transparency.beam_num = beam_num;
 	transparency.particle_num = particle_num;
 	transparency.sprite_num = sprite_num;
 
-	const size_t particle_vertices_size = particle_num * (4 * TR_POSITION_SIZE);
-	const size_t sprite_vertices_size = sprite_num * (4 * TR_POSITION_SIZE);
-
-	transparency.vertex_position_host_offset = 0;
-	transparency.particle_color_host_offset = transparency.vertex_position_host_offset + particle_vertices_size + sprite_vertices_size;
-	transparency.sprite_info_host_offset = transparency.particle_color_host_offset + particle_num * TR_COLOR_SIZE;
-	transparency.beam_aabb_host_offset = transparency.sprite_info_host_offset + sprite_num * TR_SPRITE_INFO_SIZE;
-	transparency.beam_color_host_offset = transparency.beam_aabb_host_offset + beam_num * TR_BEAM_AABB_SIZE;
-	transparency.beam_intersect_host_offset = transparency.beam_color_host_offset + beam_num * TR_COLOR_SIZE;
-	transparency.current_upload_size = transparency.beam_intersect_host_offset + beam_num * TR_BEAM_INTERSECT_SIZE;
+	compute_layout(&transparency.layout, particle_num, beam_num, sprite_num);
 
 	if (particle_num > 0 || beam_num > 0 || sprite_num > 0)
 	{
-		write_particle_geometry(view_matrix, particles, particle_num);
-		write_beam_geometry(entities, entity_num);
-		write_sprite_geometry(view_matrix, entities, entity_num);
-		upload_geometry(command_buffer);
+		trgeometryjob_t job = {
+			.dst = dst,
+			.layout = &transparency.layout,
+			.view_origin = { view_origin[0], view_origin[1], view_origin[2] },
+			.view_x = { view_matrix[0], view_matrix[4], view_matrix[8] },
+			.view_y = { view_matrix[1], view_matrix[5], view_matrix[9] },
+			.particle_size = cvar_pt_particle_size->value,
+			.beam_width = cvar_pt_beam_width->value,
+			.hdr_factor = cvar_pt_particle_emissive->value,
+			.projection = cvar_pt_projection->integer,
+			.particles = particles,
+			.beams = transparency.beams,
+			.sprites = transparency.sprites,
+			.sprite_models = transparency.sprite_models,
+			.particle_num = particle_num,
+			.beam_num = beam_num,
+			.sprite_num = sprite_num
+		};
+
+		write_geometry(&job, Job_NumWorkers() + 1);
 	}
 }
 
+void prepare_transparency(const float* view_matrix,
+	const particle_t* particles, int particle_num, const entity_t* entities, int entity_num)
+{
+	transparency.host_frame_index = (transparency.host_frame_index + 1) % transparency.host_buffered_frame_num;
+
+	// the geometry goes straight into this frame's part of the mapped buffer
+	// TODO: remove vkpt_refdef.fd, it's better to calculate it from the view matrix
+	write_transparency(transparency.mapped_host_buffer + transparency.host_frame_index * transparency.host_frame_size,
+		vkpt_refdef.fd->vieworg, view_matrix, particles, particle_num, entities, entity_num);
+}
+
+void upload_transparency(VkCommandBuffer command_buffer)
+{
+	if (transparency.particle_num > 0 || transparency.beam_num > 0 || transparency.sprite_num > 0)
+		upload_geometry(command_buffer);
+}
+
 void vkpt_get_transparency_buffers(
 	vkpt_transparency_t ttype,
 	BufferResource_t** vertex_buffer,
@@ -284,95 +360,189 @@ void get_transparency_counts(int* particle_num, int* beam_num, int* sprite_num)
 	*sprite_num = transparency.sprite_num;
 }
 
-static void write_particle_geometry(const float* view_matrix, const particle_t* particles, int particle_num)
+static void compute_layout(trlayout_t* layout, int particle_num, int beam_num, int sprite_num)
 {
-	const float particle_size = cvar_pt_particle_size->value;
+	const size_t particle_vertices_size = particle_num * (4 * TR_POSITION_SIZE);
+	const size_t sprite_vertices_size = sprite_num * (4 * TR_POSITION_SIZE);
 
-	const vec3_t view_y = { view_matrix[1], view_matrix[5], view_matrix[9] };
+	layout->vertex_position_host_offset = 0;
+	layout->particle_color_host_offset = layout->vertex_position_host_offset + particle_vertices_size + sprite_vertices_size;
+	layout->sprite_info_host_offset = layout->particle_color_host_offset + particle_num * TR_COLOR_SIZE;
+	layout->beam_aabb_host_offset = layout->sprite_info_host_offset + sprite_num * TR_SPRITE_INFO_SIZE;
+	layout->beam_color_host_offset = layout->beam_aabb_host_offset + beam_num * TR_BEAM_AABB_SIZE;
+	layout->beam_intersect_host_offset = layout->beam_color_host_offset + beam_num * TR_COLOR_SIZE;
+	layout->upload_size = layout->beam_intersect_host_offset + beam_num * TR_BEAM_INTERSECT_SIZE;
+}
 
-	// TODO: remove vkpt_refdef.fd, it's better to calculate it from the view matrix
-	const vec3_t view_origin = { vkpt_refdef.fd->vieworg[0], vkpt_refdef.fd->vieworg[1], vkpt_refdef.fd->vieworg[2] };
+static inline void write_particle_color(const particle_t* particle, float* color)
+{
+	cast_u32_to_f32_color(particle->color, &particle->rgba, color, particle->brightness);
+	color[3] = particle->alpha;
+}
+
+static inline float get_particle_scale(const trgeometryjob_t* job, const particle_t* particle)
+{
+	if (particle->radius == 0.f)
+	{
+		const float size_factor = pow(particle->alpha, 0.05f);
+		return job->particle_size * size_factor;
+	}
+
+	return particle->radius;
+}
+
+static void write_particle(const trgeometryjob_t* job, int index)
+{
+	const particle_t* particle = job->particles + index;
 
 	// TODO: use better alignment?
-	vec3_t* vertex_positions = (vec3_t*)(transparency.host_buffer_shadow + transparency.vertex_position_host_offset);
-	float* particle_colors = (float*)(transparency.host_buffer_shadow + transparency.particle_color_host_offset);
+	vec3_t* vertex_positions = (vec3_t*)(job->dst + job->layout->vertex_position_host_offset) + index * 4;
+	float* particle_colors = (float*)(job->dst + job->layout->particle_color_host_offset) + index * 4;
 
-	for (int i = 0; i < particle_num; i++)
-	{
-		const particle_t* particle = particles + i;
+	write_particle_color(particle, particle_colors);
 
-		cast_u32_to_f32_color(particle->color, &particle->rgba, particle_colors, particle->brightness);
-		particle_colors[3] = particle->alpha;
-		particle_colors = particle_colors + 4;
+	vec3_t origin;
+	VectorCopy(particle->origin, origin);
 
-		vec3_t origin;
-		VectorCopy(particle->origin, origin);
+	vec3_t z_axis;
+	VectorSubtract(job->view_origin, origin, z_axis);
+	VectorNormalize(z_axis);
 
-		vec3_t z_axis;
-		VectorSubtract(view_origin, origin, z_axis);
-		VectorNormalize(z_axis);
+	vec3_t x_axis;
+	vec3_t y_axis;
+	CrossProduct(z_axis, job->view_y, x_axis);
+	CrossProduct(x_axis, z_axis, y_axis);
 
-		vec3_t x_axis;
-		vec3_t y_axis;
-		CrossProduct(z_axis, view_y, x_axis);
-		CrossProduct(x_axis, z_axis, y_axis);
+	const float scale = get_particle_scale(job, particle);
+	VectorScale(y_axis, scale, y_axis);
+	VectorScale(x_axis, scale, x_axis);
 
-		const float size_factor = pow(particle->alpha, 0.05f);
-		if (particle->radius == 0.f)
-		{
-			VectorScale(y_axis, particle_size * size_factor, y_axis);
-			VectorScale(x_axis, particle_size * size_factor, x_axis);
-		}
-		else
-		{
-			VectorScale(y_axis, particle->radius, y_axis);
-			VectorScale(x_axis, particle->radius, x_axis);
-		}
+	vec3_t temp;
+	VectorSubtract(origin, x_axis, temp);
+	VectorAdd(temp, y_axis, vertex_positions[0]);
 
-		vec3_t temp;
-		VectorSubtract(origin, x_axis, temp);
-		VectorAdd(temp, y_axis, vertex_positions[0]);
+	VectorAdd(origin, x_axis, temp);
+	VectorAdd(temp, y_axis, vertex_positions[1]);
 
-		VectorAdd(origin, x_axis, temp);
-		VectorAdd(temp, y_axis, vertex_positions[1]);
+	VectorAdd(origin, x_axis, temp);
+	VectorSubtract(temp, y_axis, vertex_positions[2]);
 
-		VectorAdd(origin, x_axis, temp);
-		VectorSubtract(temp, y_axis, vertex_positions[2]);
+	VectorSubtract(origin, x_axis, temp);
+	VectorSubtract(temp, y_axis, vertex_positions[3]);
+}
 
-		VectorSubtract(origin, x_axis, temp);
-		VectorSubtract(temp, y_axis, vertex_positions[3]);
+#if USE_SSE2
+#define SELECT_PS(mask, a, b) _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b))
 
-		vertex_positions += 4;
+// Expands four particles at a time, one per lane. The operations are the
+// same as in write_particle and in the same order, so the output matches
+// it bit for bit. SSE2 only, see USE_SSE2 in shared/shared.h. Returns the
+// number of particles written.
+static int write_particles_sse2(const trgeometryjob_t* job, int first, int count)
+{
+	const particle_t* particles = job->particles;
+	float* vertex_positions = (float*)(job->dst + job->layout->vertex_position_host_offset);
+	float* particle_colors = (float*)(job->dst + job->layout->particle_color_host_offset);
+
+	const __m128 view_origin_x = _mm_set1_ps(job->view_origin[0]);
+	const __m128 view_origin_y = _mm_set1_ps(job->view_origin[1]);
+	const __m128 view_origin_z = _mm_set1_ps(job->view_origin[2]);
+	const __m128 view_y_x = _mm_set1_ps(job->view_y[0]);
+	const __m128 view_y_y = _mm_set1_ps(job->view_y[1]);
+	const __m128 view_y_z = _mm_set1_ps(job->view_y[2]);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+
+	int n;
+	for (n = 0; n + 4 <= count; n += 4)
+	{
+		const particle_t* p = particles + first + n;
+		float scale[4];
+
+		for (int k = 0; k < 4; k++)
+		{
+			write_particle_color(p + k, particle_colors + (first + n + k) * 4);
+			scale[k] = get_particle_scale(job, p + k);
+		}
+
+		const __m128 ox = _mm_setr_ps(p[0].origin[0], p[1].origin[0], p[2].origin[0], p[3].origin[0]);
+		const __m128 oy = _mm_setr_ps(p[0].origin[1], p[1].origin[1], p[2].origin[1], p[3].origin[1]);
+		const __m128 oz = _mm_setr_ps(p[0].origin[2], p[1].origin[2], p[2].origin[2], p[3].origin[2]);
+
+		// VectorNormalize leaves vectors of zero length alone
+		__m128 zx = _mm_sub_ps(view_origin_x, ox);
+		__m128 zy = _mm_sub_ps(view_origin_y, oy);
+		__m128 zz = _mm_sub_ps(view_origin_z, oz);
+		const __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(zx, zx), _mm_mul_ps(zy, zy)), _mm_mul_ps(zz, zz)));
+		const __m128 nonzero = _mm_cmpneq_ps(length, zero);
+		const __m128 ilength = _mm_div_ps(one, length);
+		zx = SELECT_PS(nonzero, _mm_mul_ps(zx, ilength), zx);
+		zy = SELECT_PS(nonzero, _mm_mul_ps(zy, ilength), zy);
+		zz = SELECT_PS(nonzero, _mm_mul_ps(zz, ilength), zz);
+
+		__m128 xx = _mm_sub_ps(_mm_mul_ps(zy, view_y_z), _mm_mul_ps(zz, view_y_y));
+		__m128 xy = _mm_sub_ps(_mm_mul_ps(zz, view_y_x), _mm_mul_ps(zx, view_y_z));
+		__m128 xz = _mm_sub_ps(_mm_mul_ps(zx, view_y_y), _mm_mul_ps(zy, view_y_x));
+
+		__m128 yx = _mm_sub_ps(_mm_mul_ps(xy, zz), _mm_mul_ps(xz, zy));
+		__m128 yy = _mm_sub_ps(_mm_mul_ps(xz, zx), _mm_mul_ps(xx, zz));
+		__m128 yz = _mm_sub_ps(_mm_mul_ps(xx, zy), _mm_mul_ps(xy, zx));
+
+		const __m128 s = _mm_loadu_ps(scale);
+		xx = _mm_mul_ps(xx, s); xy = _mm_mul_ps(xy, s); xz = _mm_mul_ps(xz, s);
+		yx = _mm_mul_ps(yx, s); yy = _mm_mul_ps(yy, s); yz = _mm_mul_ps(yz, s);
+
+		const __m128 lx = _mm_sub_ps(ox, xx), ly = _mm_sub_ps(oy, xy), lz = _mm_sub_ps(oz, xz);
+		const __m128 rx = _mm_add_ps(ox, xx), ry = _mm_add_ps(oy, xy), rz = _mm_add_ps(oz, xz);
+
+		// the four corners, then transposed so that each particle
+		// gets its twelve floats in three consecutive stores
+		__m128 a0 = _mm_add_ps(lx, yx), a1 = _mm_add_ps(ly, yy), a2 = _mm_add_ps(lz, yz), a3 = _mm_add_ps(rx, yx);
+		__m128 b0 = _mm_add_ps(ry, yy), b1 = _mm_add_ps(rz, yz), b2 = _mm_sub_ps(rx, yx), b3 = _mm_sub_ps(ry, yy);
+		__m128 c0 = _mm_sub_ps(rz, yz), c1 = _mm_sub_ps(lx, yx), c2 = _mm_sub_ps(ly, yy), c3 = _mm_sub_ps(lz, yz);
+
+		_MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+		_MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+		_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+
+		float* dst = vertex_positions + (first + n) * 12;
+		_mm_storeu_ps(dst + 0, a0); _mm_storeu_ps(dst + 4, b0); _mm_storeu_ps(dst + 8, c0);
+		_mm_storeu_ps(dst + 12, a1); _mm_storeu_ps(dst + 16, b1); _mm_storeu_ps(dst + 20, c1);
+		_mm_storeu_ps(dst + 24, a2); _mm_storeu_ps(dst + 28, b2); _mm_storeu_ps(dst + 32, c2);
+		_mm_storeu_ps(dst + 36, a3); _mm_storeu_ps(dst + 40, b3); _mm_storeu_ps(dst + 44, c3);
 	}
+
+	return n;
 }
+#endif
 
-static void write_beam_geometry(const entity_t* entities, int entity_num)
+static void write_particle_geometry(const trgeometryjob_t* job, int first, int count)
 {
-	const float hdr_factor = cvar_pt_particle_emissive->value;
+	int n = 0;
 
-	if (transparency.beam_num == 0)
-		return;
+#if USE_SSE2
+	n = write_particles_sse2(job, first, count);
+#endif
 
-	const size_t beam_aabb_offset = transparency.beam_aabb_host_offset;
+	for (; n < count; n++)
+		write_particle(job, first + n);
+}
 
+static void write_beam_geometry(const trgeometryjob_t* job, int first, int count)
+{
 	// TODO: use better alignment?
-	VkAabbPositionsKHR* aabb_positions = (VkAabbPositionsKHR*)(transparency.host_buffer_shadow + beam_aabb_offset);
-	uint32_t* beam_infos = (uint32_t*)(transparency.host_buffer_shadow + transparency.beam_intersect_host_offset);
-	float* beam_colors = (float*)(transparency.host_buffer_shadow + transparency.beam_color_host_offset);
+	VkAabbPositionsKHR* aabb_positions = (VkAabbPositionsKHR*)(job->dst + job->layout->beam_aabb_host_offset) + first;
+	uint32_t* beam_infos = (uint32_t*)(job->dst + job->layout->beam_intersect_host_offset) + first * (TR_BEAM_INTERSECT_SIZE / sizeof(uint32_t));
+	float* beam_colors = (float*)(job->dst + job->layout->beam_color_host_offset) + first * 4;
 
-	for (int i = 0; i < entity_num; i++)
+	for (int i = first; i < first + count; i++)
 	{
-		if ((entities[i].flags & RF_BEAM) == 0)
-			continue;
-
-		const entity_t* beam = entities + i;
+		const entity_t* beam = job->beams[i];
 
 		// Adjust beam width. Default "narrow" beams have a width of 4, "fat" beams have 16.
-		if (beam->frame == 0)
-			continue;
-		const float beam_radius = cvar_pt_beam_width->value * beam->frame * 0.5;
+		const float beam_radius = job->beam_width * beam->frame * 0.5;
 
-		cast_u32_to_f32_color(beam->skinnum, &beam->rgba, beam_colors, hdr_factor);
+		cast_u32_to_f32_color(beam->skinnum, &beam->rgba, beam_colors, job->hdr_factor);
 		beam_colors[3] = beam->alpha;
 		beam_colors += 4;
 
@@ -610,36 +780,21 @@ void vkpt_build_beam_lights(light_poly_t* light_list, int* num_lights, int max_l
 	}
 }
 
-static void write_sprite_geometry(const float* view_matrix, const entity_t* entities, int entity_num)
+static void write_sprite_geometry(const trgeometryjob_t* job, int first, int count)
 {
-	if (transparency.sprite_num == 0)
-		return;
-
-	const vec3_t view_x = { view_matrix[0], view_matrix[4], view_matrix[8] };
-	const vec3_t view_y = { view_matrix[1], view_matrix[5], view_matrix[9] };
 	const vec3_t world_y = { 0.f, 0.f, 1.f };
 
-	// TODO: remove vkpt_refdef.fd, it's better to calculate it from the view matrix
-	const vec3_t view_origin = { vkpt_refdef.fd->vieworg[0], vkpt_refdef.fd->vieworg[1], vkpt_refdef.fd->vieworg[2] };
-
-	const size_t particle_vertex_data_size = transparency.particle_num * 4 * TR_POSITION_SIZE;
-	const size_t sprite_vertex_offset = transparency.vertex_position_host_offset + particle_vertex_data_size;
+	const size_t particle_vertex_data_size = job->particle_num * 4 * TR_POSITION_SIZE;
+	const size_t sprite_vertex_offset = job->layout->vertex_position_host_offset + particle_vertex_data_size;
 
 	// TODO: use better alignment?
-	vec3_t* vertex_positions = (vec3_t*)(transparency.host_buffer_shadow + sprite_vertex_offset);
-	uint32_t* sprite_info = (uint32_t*)(transparency.host_buffer_shadow + transparency.sprite_info_host_offset);
+	vec3_t* vertex_positions = (vec3_t*)(job->dst + sprite_vertex_offset) + first * 4;
+	uint32_t* sprite_info = (uint32_t*)(job->dst + job->layout->sprite_info_host_offset) + first * (TR_SPRITE_INFO_SIZE / sizeof(int));
 
-	int sprite_count = 0;
-	for (int i = 0; i < entity_num; i++)
+	for (int i = first; i < first + count; i++)
 	{
-		const entity_t *e = entities + i;
-
-		if (e->model & 0x80000000)
-			continue;
-
-		const model_t* model = MOD_ForHandle(e->model);
-		if (!model || model->type != MOD_SPRITE)
-			continue;
+		const entity_t *e = job->sprites[i];
+		const model_t* model = job->sprite_models[i];
 
 		mspriteframe_t *frame = &model->spriteframes[e->frame % model->numframes];
 		image_t *image = frame->image;
@@ -651,12 +806,12 @@ static void write_sprite_geometry(const float* view_matrix, const entity_t* enti
 
 		vec3_t up, down, left, right;
 
-		if (cvar_pt_projection->integer == 1)
+		if (job->projection == 1)
 		{
 			// make the sprite always face the camera and always vertical in cylindrical projection mode
 
 			vec3_t to_camera;
-			VectorSubtract(view_origin, e->origin, to_camera);
+			VectorSubtract(job->view_origin, e->origin, to_camera);
 			
 			vec3_t cyl_x;
 			CrossProduct(world_y, to_camera, cyl_x);
@@ -670,8 +825,8 @@ static void write_sprite_geometry(const float* view_matrix, const entity_t* enti
 		}
 		else
 		{
-			VectorScale(view_x, frame->origin_x, left);
-			VectorScale(view_x, frame->origin_x - frame->width, right);
+			VectorScale(job->view_x, frame->origin_x, left);
+			VectorScale(job->view_x, frame->origin_x - frame->width, right);
 
 			if (model->sprite_vertical)
 			{
@@ -680,8 +835,8 @@ static void write_sprite_geometry(const float* view_matrix, const entity_t* enti
 			}
 			else
 			{
-				VectorScale(view_y, -frame->origin_y, down);
-				VectorScale(view_y, frame->height - frame->origin_y, up);
+				VectorScale(job->view_y, -frame->origin_y, down);
+				VectorScale(job->view_y, frame->height - frame->origin_y, up);
 			}
 		}
 
@@ -692,10 +847,167 @@ static void write_sprite_geometry(const float* view_matrix, const entity_t* enti
 
 		vertex_positions += 4;
 		sprite_info += TR_SPRITE_INFO_SIZE / sizeof(int);
+	}
+}
 
-		if (++sprite_count >= TR_SPRITE_MAX_NUM)
-			return;
+// Particles, beams and sprites are split into batches that write disjoint
+// parts of the frame, numbered in that order.
+static void write_geometry_job(void* arg, int index)
+{
+	const trgeometryjob_t* job = arg;
+
+	if (index < job->particle_jobs)
+	{
+		const int first = index * TR_PARTICLES_PER_JOB;
+		write_particle_geometry(job, first, min(job->particle_num - first, TR_PARTICLES_PER_JOB));
+		return;
+	}
+	index -= job->particle_jobs;
+
+	if (index < job->beam_jobs)
+	{
+		const int first = index * TR_BEAMS_PER_JOB;
+		write_beam_geometry(job, first, min(job->beam_num - first, TR_BEAMS_PER_JOB));
+		return;
+	}
+	index -= job->beam_jobs;
+
+	const int first = index * TR_SPRITES_PER_JOB;
+	write_sprite_geometry(job, first, min(job->sprite_num - first, TR_SPRITES_PER_JOB));
+}
+
+static void write_geometry(trgeometryjob_t* job, int threads)
+{
+	job->particle_jobs = (job->particle_num + TR_PARTICLES_PER_JOB - 1) / TR_PARTICLES_PER_JOB;
+	job->beam_jobs = (job->beam_num + TR_BEAMS_PER_JOB - 1) / TR_BEAMS_PER_JOB;
+	job->sprite_jobs = (job->sprite_num + TR_SPRITES_PER_JOB - 1) / TR_SPRITES_PER_JOB;
+
+	Job_ParallelForEx(write_geometry_job, job, job->particle_jobs + job->beam_jobs + job->sprite_jobs, threads);
+}
+
+/*
+================
+vkpt_transparency_bench_f
+
+pt_transparency_bench [maxthreads]
+
+Expands synthetic particle sets of increasing size, with one beam for
+every 16 particles, into a scratch buffer: with the scalar reference, and
+batched on one and on all threads. The batched output must match the
+reference exactly.
+================
+*/
+void vkpt_transparency_bench_f(void)
+{
+	const int particle_counts[] = { 256, 1024, 4096, TR_PARTICLE_MAX_NUM };
+	const int iterations = 20;
+	int threads = Job_NumWorkers() + 1;
+	int failures = 0;
+
+	if (Cmd_Argc() > 1)
+	{
+		int n = atoi(Cmd_Argv(1));
+		clamp(n, 1, threads);
+		threads = n;
+	}
+
+	particle_t* particles = Z_Malloc(TR_PARTICLE_MAX_NUM * sizeof(particle_t));
+	entity_t* beam_entities = Z_Mallocz(TR_BEAM_MAX_NUM * sizeof(entity_t));
+	const entity_t** beams = Z_Malloc(TR_BEAM_MAX_NUM * sizeof(entity_t*));
+	char* reference = Z_Mallocz(get_transparency_frame_size());
+	char* output = Z_Mallocz(get_transparency_frame_size());
+
+	trgeometryjob_t job = {
+		.view_origin = { 100.f, -200.f, 50.f },
+		.particle_size = 0.35f,
+		.beam_width = 1.f,
+		.hdr_factor = 1.f,
+		.particles = particles,
+		.beams = beams
+	};
+
+	vec3_t angles = { 20.f, 135.f, 0.f }, forward;
+	AngleVectors(angles, forward, job.view_x, job.view_y);
+
+	for (int i = 0; i < TR_PARTICLE_MAX_NUM; i++)
+	{
+		particle_t* p = particles + i;
+
+		// some particles sit right in the eye, which leaves their z axis at zero
+		if (i % 97 == 0)
+			VectorCopy(job.view_origin, p->origin);
+		else
+			VectorSet(p->origin, crand() * 2048.f, crand() * 2048.f, crand() * 512.f);
+
+		p->color = (i & 1) ? -1 : rand() & 0xff;
+		p->rgba.u32 = rand();
+		p->alpha = frand();
+		p->brightness = 1.f + frand();
+		p->radius = (i & 2) ? 0.f : 0.5f + frand() * 4.f;
 	}
+
+	for (int i = 0; i < TR_BEAM_MAX_NUM; i++)
+	{
+		entity_t* e = beam_entities + i;
+
+		e->flags = RF_BEAM;
+		e->frame = (i & 1) ? 4 : 16;
+		e->skinnum = rand() & 0xff;
+		e->alpha = frand();
+		VectorSet(e->origin, crand() * 1024.f, crand() * 1024.f, crand() * 256.f);
+		VectorSet(e->oldorigin, crand() * 1024.f, crand() * 1024.f, crand() * 256.f);
+		beams[i] = e;
+	}
+
+	Com_Printf("%9s %6s %9s %9s %9s %s\n", "particles", "beams", "ref us", "1 thr us", "all us", "match");
+
+	for (size_t c = 0; c < LENGTH(particle_counts) && particle_counts[c] <= TR_PARTICLE_MAX_NUM; c++)
+	{
+		trlayout_t layout;
+
+		job.particle_num = particle_counts[c];
+		job.beam_num = min(job.particle_num / 16, TR_BEAM_MAX_NUM);
+		job.layout = &layout;
+		compute_layout(&layout, job.particle_num, job.beam_num, 0);
+
+		job.dst = reference;
+		uint64_t start = Sys_Microseconds();
+		for (int it = 0; it < iterations; it++)
+		{
+			for (int i = 0; i < job.particle_num; i++)
+				write_particle(&job, i);
+			write_beam_geometry(&job, 0, job.beam_num);
+		}
+		uint64_t ref_usec = (Sys_Microseconds() - start) / iterations;
+
+		job.dst = output;
+		start = Sys_Microseconds();
+		for (int it = 0; it < iterations; it++)
+			write_geometry(&job, 1);
+		uint64_t one_usec = (Sys_Microseconds() - start) / iterations;
+
+		qboolean match = !memcmp(output, reference, layout.upload_size);
+		memset(output, 0, layout.upload_size);
+
+		start = Sys_Microseconds();
+		for (int it = 0; it < iterations; it++)
+			write_geometry(&job, threads);
+		uint64_t all_usec = (Sys_Microseconds() - start) / iterations;
+
+		match = match && !memcmp(output, reference, layout.upload_size);
+		failures += !match;
+
+		Com_Printf("%9d %6d %9"PRIu64" %9"PRIu64" %9"PRIu64" %s\n", job.particle_num, job.beam_num,
+			ref_usec, one_usec, all_usec, match ? "yes" : "NO");
+	}
+
+	Com_Printf("%d threads, %d iterations, %d mismatches\n", threads, iterations, failures);
+
+	Z_Free(particles);
+	Z_Free(beam_entities);
+	Z_Free(beams);
+	Z_Free(reference);
+	Z_Free(output);
 }
 
 static void upload_geometry(VkCommandBuffer command_buffer)
@@ -706,42 +1018,41 @@ static void upload_geometry(VkCommandBuffer command_buffer)
 
     const size_t host_buffer_offset = transparency.host_frame_index * transparency.host_frame_size;
 
-	assert(transparency.current_upload_size > 0);
-	memcpy(transparency.mapped_host_buffer + host_buffer_offset, transparency.host_buffer_shadow, transparency.current_upload_size);
-	transparency.current_upload_size = 0;
+	// write_geometry has filled the mapped buffer already
+	assert(transparency.layout.upload_size > 0);
 
 	const VkBufferCopy vertices = {
-		.srcOffset = host_buffer_offset + transparency.vertex_position_host_offset,
+		.srcOffset = host_buffer_offset + transparency.layout.vertex_position_host_offset,
 		.dstOffset = 0,
 		.size = (transparency.particle_num + transparency.sprite_num) * 4 * TR_POSITION_SIZE
 	};
 
 	const VkBufferCopy beam_aabbs = {
-		.srcOffset = host_buffer_offset + transparency.beam_aabb_host_offset,
+		.srcOffset = host_buffer_offset + transparency.layout.beam_aabb_host_offset,
 		.dstOffset = 0,
 		.size = transparency.beam_num * TR_BEAM_AABB_SIZE
 	};
 
 	const VkBufferCopy particle_colors = {
-		.srcOffset = host_buffer_offset + transparency.particle_color_host_offset,
+		.srcOffset = host_buffer_offset + transparency.layout.particle_color_host_offset,
 		.dstOffset = 0,
 		.size = transparency.particle_num * TR_COLOR_SIZE
 	};
 
 	const VkBufferCopy beam_colors = {
-		.srcOffset = host_buffer_offset + transparency.beam_color_host_offset,
+		.srcOffset = host_buffer_offset + transparency.layout.beam_color_host_offset,
 		.dstOffset = 0,
 		.size = transparency.beam_num * TR_COLOR_SIZE
 	};
 
 	const VkBufferCopy sprite_infos = {
-		.srcOffset = host_buffer_offset + transparency.sprite_info_host_offset,
+		.srcOffset = host_buffer_offset + transparency.layout.sprite_info_host_offset,
 		.dstOffset = 0,
 		.size = transparency.sprite_num * TR_SPRITE_INFO_SIZE
 	};
 
 	const VkBufferCopy beam_intersect = {
-		.srcOffset = host_buffer_offset + transparency.beam_intersect_host_offset,
+		.srcOffset = host_buffer_offset + transparency.layout.beam_intersect_host_offset,
 		.dstOffset = 0,
 		.size = transparency.beam_num * TR_BEAM_INTERSECT_SIZE
 	};
@@ -818,7 +1129,7 @@ static void create_buffers()
 
 	buffer_create(
 		&transparency.index_buffer,
-		TR_INDEX_MAX_NUM * sizeof(uint16_t),
+		TR_INDEX_MAX_NUM * sizeof(uint32_t),
 		VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
@@ -878,8 +1189,6 @@ static qboolean allocate_and_bind_memory_to_buffers()
 	_VK(vkMapMemory(qvk.device, transparency.host_buffer_memory, 0, host_buffer_size, 0,
 		(void**)&transparency.mapped_host_buffer));
 
-	transparency.host_buffer_shadow = Z_Mallocz(transparency.host_frame_size);
-	
 	return qtrue;
 }
 
@@ -928,13 +1237,14 @@ static void create_buffer_views()
 
 static void fill_index_buffer()
 {
-	uint16_t* indices = (uint16_t*)transparency.host_buffer_shadow;
+	// 32-bit, a particle budget above 16384 has more than 65536 vertices
+	uint32_t* indices = (uint32_t*)transparency.mapped_host_buffer;
 
 	for (size_t i = 0; i < TR_INDEX_MAX_NUM / 6; i++)
 	{
-		uint16_t* quad = indices + i * 6;
+		uint32_t* quad = indices + i * 6;
 
-		const uint16_t base_vertex = i * 4;
+		const uint32_t base_vertex = i * 4;
 		quad[0] = base_vertex + 0;
 		quad[1] = base_vertex + 1;
 		quad[2] = base_vertex + 2;
@@ -943,8 +1253,6 @@ static void fill_index_buffer()
 		quad[5] = base_vertex + 0;
 	}
 
-	memcpy(transparency.mapped_host_buffer, transparency.host_buffer_shadow, sizeof(uint16_t) * TR_INDEX_MAX_NUM);
-
 	VkCommandBuffer cmd_buf = vkpt_begin_command_buffer(&qvk.cmd_buffers_transfer);
 
 	const VkBufferMemoryBarrier pre_barrier = {
@@ -961,7 +1269,7 @@ static void fill_index_buffer()
 		0, 0, NULL, 1, &pre_barrier, 0, NULL);
 
 	const VkBufferCopy region = {
-		.size = TR_INDEX_MAX_NUM * sizeof(uint16_t)
+		.size = TR_INDEX_MAX_NUM * sizeof(uint32_t)
 	};
 
 	vkCmdCopyBuffer(cmd_buf, transparency.host_buffer, transparency.index_buffer.buffer, 1, &region);
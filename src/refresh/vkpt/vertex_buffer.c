@@ -24,6 +24,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include <assert.h>
 #include <stdio.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 #include "conversion.h"
 #include "precomputed_sky.h"
 
@@ -42,6 +45,15 @@ typedef struct {
 model_vbo_t model_vertex_data[MAX_MODELS];
 static BufferResource_t null_buffer;
 
+// The BSP streams are packed back to back in the staging buffer, which is sized
+// for the current map, and copied to their fixed offsets in BspVertexBuffer.
+#define BSP_STAGING_STREAMS     8
+
+static VkBufferCopy bsp_staging_regions[BSP_STAGING_STREAMS];
+static int num_bsp_staging_regions;
+static int bsp_staging_vertices;
+static VkDeviceSize bsp_staging_used;
+
 VkResult
 vkpt_vertex_buffer_bsp_upload_staging()
 {
@@ -50,10 +62,7 @@ vkpt_vertex_buffer_bsp_upload_staging()
 	
 	VkCommandBuffer cmd_buf = vkpt_begin_command_buffer(&qvk.cmd_buffers_graphics);
 
-	VkBufferCopy copyRegion = {
-		.size = sizeof(BspVertexBuffer),
-	};
-	vkCmdCopyBuffer(cmd_buf, qvk.buf_vertex_bsp_staging.buffer, qvk.buf_vertex_bsp.buffer, 1, &copyRegion);
+	vkCmdCopyBuffer(cmd_buf, qvk.buf_vertex_bsp_staging.buffer, qvk.buf_vertex_bsp.buffer, num_bsp_staging_regions, bsp_staging_regions);
 
 	BUFFER_BARRIER(cmd_buf,
 		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
@@ -111,12 +120,57 @@ vkpt_iqm_matrix_buffer_upload_staging(VkCommandBuffer cmd_buf)
 	return VK_SUCCESS;
 }
 
+// Appends one stream to the staging data, or only measures it if staging is NULL
+static void
+add_bsp_staging_stream(byte *staging, VkDeviceSize *offset, size_t dst_offset, const void *src, size_t size)
+{
+	if (!size)
+		return;
+
+	assert(num_bsp_staging_regions < BSP_STAGING_STREAMS);
+
+	if (staging)
+		memcpy(staging + *offset, src, size);
+
+	VkBufferCopy *region = bsp_staging_regions + num_bsp_staging_regions++;
+	region->srcOffset = *offset;
+	region->dstOffset = dst_offset;
+	region->size = size;
+
+	*offset += size;
+}
+
+static VkDeviceSize
+write_bsp_staging_streams(byte *staging, const bsp_mesh_t *bsp_mesh, int num_vertices, int num_clusters)
+{
+	VkDeviceSize offset = 0;
+
+	num_bsp_staging_regions = 0;
+
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, positions_bsp),
+		bsp_mesh->positions, num_vertices * sizeof(float) * 3);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, tex_coords_bsp),
+		bsp_mesh->tex_coords, num_vertices * sizeof(float) * 2);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, tangents_bsp),
+		bsp_mesh->tangents, num_vertices * sizeof(uint32_t) / 3);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, materials_bsp),
+		bsp_mesh->materials, num_vertices * sizeof(uint32_t) / 3);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, emissive_factors_bsp),
+		bsp_mesh->emissive_factors, num_vertices * sizeof(uint32_t) / 3);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, clusters_bsp),
+		bsp_mesh->clusters, num_vertices * sizeof(uint32_t) / 3);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, texel_density_bsp),
+		bsp_mesh->texel_density, num_vertices * sizeof(float) / 3);
+	add_bsp_staging_stream(staging, &offset, offsetof(BspVertexBuffer, sky_visibility),
+		bsp_mesh->sky_visibility, (num_clusters + 7) / 8);
+
+	return offset;
+}
+
 VkResult
 vkpt_vertex_buffer_upload_bsp_mesh_to_staging(bsp_mesh_t *bsp_mesh)
 {
 	assert(bsp_mesh);
-	BspVertexBuffer *vbo = (BspVertexBuffer *) buffer_map(&qvk.buf_vertex_bsp_staging);
-	assert(vbo);
 
 	int num_vertices = bsp_mesh->num_vertices;
 	if (num_vertices > MAX_VERT_BSP)
@@ -125,14 +179,6 @@ vkpt_vertex_buffer_upload_bsp_mesh_to_staging(bsp_mesh_t *bsp_mesh)
 		num_vertices = MAX_VERT_BSP;
 	}
 
-	memcpy(vbo->positions_bsp,  bsp_mesh->positions, num_vertices * sizeof(float) * 3   );
-	memcpy(vbo->tex_coords_bsp, bsp_mesh->tex_coords,num_vertices * sizeof(float) * 2   );
-    memcpy(vbo->tangents_bsp,   bsp_mesh->tangents,  num_vertices * sizeof(uint32_t) / 3);
-	memcpy(vbo->materials_bsp,  bsp_mesh->materials, num_vertices * sizeof(uint32_t) / 3);
-	memcpy(vbo->emissive_factors_bsp,  bsp_mesh->emissive_factors, num_vertices * sizeof(uint32_t) / 3);
-	memcpy(vbo->clusters_bsp, bsp_mesh->clusters, num_vertices * sizeof(uint32_t) / 3);
-	memcpy(vbo->texel_density_bsp, bsp_mesh->texel_density, num_vertices * sizeof(float) / 3);
-
 	int num_clusters = bsp_mesh->num_clusters;
 	if (num_clusters > MAX_LIGHT_LISTS)
 	{
@@ -140,28 +186,353 @@ vkpt_vertex_buffer_upload_bsp_mesh_to_staging(bsp_mesh_t *bsp_mesh)
 		num_clusters = MAX_LIGHT_LISTS;
 	}
 
-	memcpy(vbo->sky_visibility, bsp_mesh->sky_visibility, (num_clusters + 7) / 8);
+	VkDeviceSize size = write_bsp_staging_streams(NULL, bsp_mesh, num_vertices, num_clusters);
+
+	// only grow the staging buffer, with some headroom so that going back and
+	// forth between maps of similar size doesn't reallocate it every time
+	if (qvk.buf_vertex_bsp_staging.size < size)
+	{
+		vkWaitForFences(qvk.device, 1, &qvk.fence_vertex_sync, VK_TRUE, ~((uint64_t)0));
+		buffer_destroy(&qvk.buf_vertex_bsp_staging);
+
+		VkDeviceSize capacity = min(size + size / 4, sizeof(BspVertexBuffer));
+		_VK(buffer_create(&qvk.buf_vertex_bsp_staging, capacity,
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT));
+	}
+
+	byte *staging = (byte *) buffer_map(&qvk.buf_vertex_bsp_staging);
+	assert(staging);
+
+	write_bsp_staging_streams(staging, bsp_mesh, num_vertices, num_clusters);
 
 	buffer_unmap(&qvk.buf_vertex_bsp_staging);
-	vbo = NULL;
+	staging = NULL;
+
+	bsp_staging_vertices = num_vertices;
+	bsp_staging_used = size;
+
+	Com_DPrintf("World mesh: %d vertices, %.1f MB of vertex data (%.1f MB less than the fixed size staging buffer)\n",
+		num_vertices, size / 1048576.0, (sizeof(BspVertexBuffer) - size) / 1048576.0);
 
 	return VK_SUCCESS;
 }
 
-static int local_light_counts[MAX_MAP_LEAFS];
-static int cluster_light_counts[MAX_MAP_LEAFS];
+/*
+================
+vkpt_vertex_buffer_memory_f
+
+pt_world_mesh_memory
+
+Prints how much of the BSP staging buffer the current map uses.
+================
+*/
+void
+vkpt_vertex_buffer_memory_f(void)
+{
+	if (!bsp_staging_used)
+	{
+		Com_Printf("No world mesh has been uploaded.\n");
+		return;
+	}
+
+	Com_Printf("World mesh: %d vertices, %.1f MB of vertex data\n",
+		bsp_staging_vertices, bsp_staging_used / 1048576.0);
+	Com_Printf("Staging buffer: %.1f MB allocated, %.1f MB for the fixed size layout\n",
+		qvk.buf_vertex_bsp_staging.size / 1048576.0, sizeof(BspVertexBuffer) / 1048576.0);
+}
+
+/*
+Model lights are injected into the cluster light lists every frame. Each list
+holds the cluster's static lights, followed by max_counts[c] slots for the
+model lights visible from that cluster, padded with ~0. The slot counts only
+grow until the next map is loaded, so the layout of the lists rarely changes,
+and the static parts are only written to a staging buffer when it does.
+Otherwise, only the slots of the clusters whose set of visible model lights
+changed are rewritten. Each staging buffer is written every MAX_FRAMES_IN_FLIGHT
+frames, so each buffer keeps its own set of clusters to patch.
+*/
+
+#define LIGHT_LIST_WORDS    (MAX_LIGHT_LISTS / 32)
+
+typedef struct {
+	int         num_lights;
+	int         light_clusters[MAX_LIGHT_POLYS];
+	int         counts[MAX_LIGHT_LISTS];            // model lights visible from each cluster
+	int         max_counts[MAX_LIGHT_LISTS];        // model light slots in each list
+	int         num_slots;                          // sum of max_counts
+	int         layout;                             // changes when max_counts grows
+	int         offsets_layout;
+	uint32_t    offsets[MAX_LIGHT_LISTS + 1];       // list offsets for offsets_layout
+	int         buffer_layouts[MAX_FRAMES_IN_FLIGHT]; // layout of each buffer, 0 if not valid
+	qboolean    buffer_dirty[MAX_FRAMES_IN_FLIGHT];
+	uint32_t    dirty[MAX_FRAMES_IN_FLIGHT][LIGHT_LIST_WORDS];
+} light_lists_t;
+
+static light_lists_t light_lists = { .layout = 1 };
 static int light_list_tails[MAX_MAP_LEAFS];
-static int max_cluster_model_lights[MAX_MAP_LEAFS];
-static int max_model_lights;
+
+static void
+light_lists_reset(light_lists_t *ll)
+{
+	int layout = ll->layout;
+
+	memset(ll, 0, sizeof(*ll));
+	ll->layout = layout + 1;
+}
 
 void vkpt_light_buffer_reset_counts()
 {
-	memset(max_cluster_model_lights, 0, sizeof(max_cluster_model_lights));
-	max_model_lights = 0;
+	light_lists_reset(&light_lists);
 }
 
-void
-inject_model_lights(bsp_mesh_t* bsp_mesh, bsp_t* bsp, int num_model_lights, light_poly_t* transformed_model_lights, int model_light_offset, uint32_t* dst_list_offsets, uint32_t* dst_lists)
+static inline int
+lowest_bit(uint32_t bits)
+{
+#ifdef __GNUC__
+	return __builtin_ctz(bits);
+#elif defined _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, bits);
+	return (int)index;
+#else
+	int index = 0;
+	while (!(bits & 1)) {
+		bits >>= 1;
+		index++;
+	}
+	return index;
+#endif
+}
+
+// Returns the bits of clusters [word * 32, word * 32 + 32) from a PVS row,
+// which is neither aligned nor padded to a multiple of 4 bytes
+static inline uint32_t
+pvs_word(const byte *row, int rowsize, int word)
+{
+	int offset = word * 4;
+
+	if (!row)
+		return 0;
+
+	if (offset + 4 <= rowsize)
+		return (uint32_t)row[offset] | (uint32_t)row[offset + 1] << 8 |
+			(uint32_t)row[offset + 2] << 16 | (uint32_t)row[offset + 3] << 24;
+
+	uint32_t bits = 0;
+	for (int i = 0; offset + i < rowsize; i++)
+		bits |= (uint32_t)row[offset + i] << (i * 8);
+	return bits;
+}
+
+// Applies the change of the model lights since the last frame to the counts
+// and the dirty sets. Lights are identified by their index, so a light that
+// changes clusters affects the clusters that see only one of the two.
+static void
+update_light_lists(light_lists_t *ll, const bsp_mesh_t *bsp_mesh, bsp_t *bsp, int num_model_lights, const light_poly_t *transformed_model_lights)
+{
+	int num_words = (bsp_mesh->num_clusters + 31) / 32;
+	uint32_t last_mask = (bsp_mesh->num_clusters & 31) ? (1u << (bsp_mesh->num_clusters & 31)) - 1 : ~0u;
+	int num_lights;
+	qboolean layout_changed = qfalse;
+
+	num_model_lights = min(num_model_lights, MAX_LIGHT_POLYS);
+	num_lights = max(num_model_lights, ll->num_lights);
+
+	// Remove the old clusters first, then add the new ones, so that the counts
+	// only peak at their values for this frame
+
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (int nlight = 0; nlight < num_lights; nlight++)
+		{
+			int old_cluster = nlight < ll->num_lights ? ll->light_clusters[nlight] : -1;
+			int new_cluster = nlight < num_model_lights ? transformed_model_lights[nlight].cluster : -1;
+
+			if (old_cluster == new_cluster)
+				continue;
+
+			const byte *old_row = old_cluster >= 0 ? BSP_GetPvs(bsp, old_cluster) : NULL;
+			const byte *new_row = new_cluster >= 0 ? BSP_GetPvs(bsp, new_cluster) : NULL;
+
+			for (int w = 0; w < num_words; w++)
+			{
+				uint32_t old_bits = pvs_word(old_row, bsp->visrowsize, w) & (w == num_words - 1 ? last_mask : ~0u);
+				uint32_t new_bits = pvs_word(new_row, bsp->visrowsize, w) & (w == num_words - 1 ? last_mask : ~0u);
+				uint32_t bits = pass ? new_bits & ~old_bits : old_bits & ~new_bits;
+
+				if (pass)
+				{
+					for (int f = 0; f < MAX_FRAMES_IN_FLIGHT; f++)
+						ll->dirty[f][w] |= old_bits ^ new_bits;
+				}
+
+				while (bits)
+				{
+					int c = w * 32 + lowest_bit(bits);
+					bits &= bits - 1;
+
+					if (!pass)
+					{
+						ll->counts[c]--;
+					}
+					else if (++ll->counts[c] > ll->max_counts[c])
+					{
+						ll->max_counts[c] = ll->counts[c];
+						ll->num_slots++;
+						layout_changed = qtrue;
+					}
+				}
+			}
+
+			if (pass)
+			{
+				for (int f = 0; f < MAX_FRAMES_IN_FLIGHT; f++)
+					ll->buffer_dirty[f] = qtrue;
+
+				if (nlight < num_model_lights)
+					ll->light_clusters[nlight] = new_cluster;
+			}
+		}
+	}
+
+	ll->num_lights = num_model_lights;
+
+	if (layout_changed)
+		ll->layout++;
+
+	if (ll->offsets_layout != ll->layout)
+	{
+		uint32_t tail = 0;
+		for (int c = 0; c < bsp_mesh->num_clusters; c++)
+		{
+			ll->offsets[c] = tail;
+			tail += bsp_mesh->cluster_light_offsets[c + 1] - bsp_mesh->cluster_light_offsets[c] + ll->max_counts[c];
+		}
+		ll->offsets[bsp_mesh->num_clusters] = tail;
+		ll->offsets_layout = ll->layout;
+	}
+}
+
+// Writes the model light slots of the clusters set in mask, looking only at
+// the given words of it. Lights are written in order and followed by ~0.
+static void
+write_model_light_slots(const light_lists_t *ll, const bsp_mesh_t *bsp_mesh, bsp_t *bsp, const uint32_t *mask, const int *words, int num_words, int model_light_offset, uint32_t *dst_lists)
+{
+	for (int i = 0; i < num_words; i++)
+	{
+		int w = words[i];
+
+		for (uint32_t bits = mask[w]; bits; bits &= bits - 1)
+		{
+			int c = w * 32 + lowest_bit(bits);
+			light_list_tails[c] = ll->offsets[c] + bsp_mesh->cluster_light_offsets[c + 1] - bsp_mesh->cluster_light_offsets[c];
+		}
+	}
+
+	for (int nlight = 0; nlight < ll->num_lights; nlight++)
+	{
+		const byte *row = BSP_GetPvs(bsp, ll->light_clusters[nlight]);
+
+		for (int i = 0; i < num_words; i++)
+		{
+			int w = words[i];
+
+			for (uint32_t bits = pvs_word(row, bsp->visrowsize, w) & mask[w]; bits; bits &= bits - 1)
+			{
+				int c = w * 32 + lowest_bit(bits);
+				dst_lists[light_list_tails[c]++] = model_light_offset + nlight;
+			}
+		}
+	}
+
+	for (int i = 0; i < num_words; i++)
+	{
+		int w = words[i];
+
+		for (uint32_t bits = mask[w]; bits; bits &= bits - 1)
+		{
+			int c = w * 32 + lowest_bit(bits);
+
+			for (uint32_t n = light_list_tails[c]; n < ll->offsets[c + 1]; n++)
+				dst_lists[n] = ~0u;
+		}
+	}
+}
+
+// Brings the lists in one staging buffer up to date: all of them if the
+// layout of the buffer is stale, or only the dirty clusters otherwise
+static void
+write_light_lists(light_lists_t *ll, int buffer, const bsp_mesh_t *bsp_mesh, bsp_t *bsp, int model_light_offset, uint32_t *dst_list_offsets, uint32_t *dst_lists)
+{
+	static uint32_t mask[LIGHT_LIST_WORDS];
+	static int words[LIGHT_LIST_WORDS];
+	int num_clusters = bsp_mesh->num_clusters;
+	int num_static = bsp_mesh->cluster_light_offsets[num_clusters];
+	int num_words = (num_clusters + 31) / 32;
+	int num_dirty_words = 0;
+
+	// See if we have enough room in the interaction buffer
+
+	if (num_static + ll->num_slots > MAX_LIGHT_LIST_NODES)
+	{
+		Com_WPrintf("Insufficient light interaction buffer size (%d needed). Increase MAX_LIGHT_LIST_NODES.\n", num_static + ll->num_slots);
+
+		// Copy the BSP light lists verbatim
+		memcpy(dst_lists, bsp_mesh->cluster_lights, sizeof(uint32_t) * num_static);
+		memcpy(dst_list_offsets, bsp_mesh->cluster_light_offsets, sizeof(uint32_t) * (num_clusters + 1));
+		ll->buffer_layouts[buffer] = 0;
+
+		return;
+	}
+
+	if (ll->buffer_layouts[buffer] != ll->layout)
+	{
+		// Copy the static light lists, and write the model lights after them
+
+		memcpy(dst_list_offsets, ll->offsets, sizeof(uint32_t) * (num_clusters + 1));
+
+		for (int c = 0; c < num_clusters; c++)
+		{
+			int original_size = bsp_mesh->cluster_light_offsets[c + 1] - bsp_mesh->cluster_light_offsets[c];
+			memcpy(dst_lists + ll->offsets[c], bsp_mesh->cluster_lights + bsp_mesh->cluster_light_offsets[c], sizeof(uint32_t) * original_size);
+		}
+
+		for (int w = 0; w < num_words; w++)
+		{
+			mask[w] = ~0u;
+			words[w] = w;
+		}
+		if (num_clusters & 31)
+			mask[num_words - 1] = (1u << (num_clusters & 31)) - 1;
+
+		write_model_light_slots(ll, bsp_mesh, bsp, mask, words, num_words, model_light_offset, dst_lists);
+
+		ll->buffer_layouts[buffer] = ll->layout;
+	}
+	else if (ll->buffer_dirty[buffer])
+	{
+		// Patch the clusters whose model lights changed since the buffer was written
+
+		for (int w = 0; w < num_words; w++)
+		{
+			if (ll->dirty[buffer][w])
+				words[num_dirty_words++] = w;
+		}
+
+		write_model_light_slots(ll, bsp_mesh, bsp, ll->dirty[buffer], words, num_dirty_words, model_light_offset, dst_lists);
+	}
+
+	memset(ll->dirty[buffer], 0, sizeof(uint32_t) * num_words);
+	ll->buffer_dirty[buffer] = qfalse;
+}
+
+static int local_light_counts[MAX_MAP_LEAFS];
+static int cluster_light_counts[MAX_MAP_LEAFS];
+
+// Original version that rebuilds all lists every frame, kept as a reference for pt_light_lists_bench.
+static void
+inject_model_lights_reference(const bsp_mesh_t* bsp_mesh, bsp_t* bsp, int num_model_lights, const light_poly_t* transformed_model_lights, int model_light_offset, int* max_cluster_model_lights, uint32_t* dst_list_offsets, uint32_t* dst_lists)
 {
 	memset(local_light_counts, 0, bsp_mesh->num_clusters * sizeof(int));
 	memset(cluster_light_counts, 0, bsp_mesh->num_clusters * sizeof(int));
@@ -261,6 +632,162 @@ inject_model_lights(bsp_mesh_t* bsp_mesh, bsp_t* bsp, int num_model_lights, ligh
 	}
 }
 
+static int
+count_bits(const uint32_t *words, int num_words)
+{
+	int count = 0;
+
+	for (int w = 0; w < num_words; w++)
+	{
+		for (uint32_t bits = words[w]; bits; bits &= bits - 1)
+			count++;
+	}
+
+	return count;
+}
+
+#define BENCH_PATH_LENGTH   4
+
+/*
+================
+vkpt_light_lists_bench
+
+pt_light_lists_bench [lights] [frames] [maps...]
+
+Replays a stream of model lights on the current map, or without one on the
+given maps or all of them, with a growing number of them changing clusters
+every frame. Like entities patrolling an area, each moving light steps
+through a few clusters that are visible from its first one.
+Times the reference injection against the incremental one, alternating
+between two lists like the staging buffers do. The lists must match.
+================
+*/
+void
+vkpt_light_lists_bench(const bsp_mesh_t *bsp_mesh, bsp_t *bsp)
+{
+	static const int moving_counts[] = { 0, 1, 4, 16, 64, 256, MAX_LIGHT_POLYS };
+	int num_lights = Cmd_Argc() > 1 ? atoi(Cmd_Argv(1)) : 256;
+	int num_frames = Cmd_Argc() > 2 ? atoi(Cmd_Argv(2)) : 500;
+	int num_clusters = bsp_mesh->num_clusters;
+	int model_light_offset = bsp_mesh->num_light_polys;
+	int failures = 0;
+
+	num_lights = max(1, min(num_lights, MAX_LIGHT_POLYS - 1 - model_light_offset));
+	num_frames = max(1, num_frames);
+
+	if (num_clusters <= 0)
+	{
+		Com_Printf("The map has no clusters.\n");
+		return;
+	}
+
+	light_poly_t *lights = Z_Mallocz(num_lights * sizeof(light_poly_t));
+	int *paths = Z_Malloc(num_lights * BENCH_PATH_LENGTH * sizeof(int));
+	light_lists_t *ll = Z_Mallocz(sizeof(light_lists_t));
+	int *ref_max_counts = Z_Malloc(MAX_LIGHT_LISTS * sizeof(int));
+	uint32_t *ref_offsets = Z_Malloc(MAX_LIGHT_LISTS * sizeof(uint32_t));
+	uint32_t *ref_lists = Z_Malloc(MAX_LIGHT_LIST_NODES * sizeof(uint32_t));
+	uint32_t *offsets[MAX_FRAMES_IN_FLIGHT];
+	uint32_t *lists[MAX_FRAMES_IN_FLIGHT];
+
+	for (int f = 0; f < MAX_FRAMES_IN_FLIGHT; f++)
+	{
+		offsets[f] = Z_Malloc(MAX_LIGHT_LISTS * sizeof(uint32_t));
+		lists[f] = Z_Malloc(MAX_LIGHT_LIST_NODES * sizeof(uint32_t));
+	}
+
+	Com_Printf("%8s %10s %10s %10s %10s %10s %s\n", "moving", "ref us", "incr us", "patched", "rewrites", "slots", "match");
+
+	for (int m = 0; m < LENGTH(moving_counts); m++)
+	{
+		int num_moving = min(moving_counts[m], num_lights);
+		uint64_t ref_usec = 0, incr_usec = 0;
+		int64_t patched = 0;
+		int rewrites = 0;
+		qboolean match = qtrue;
+
+		if (m > 0 && num_moving == min(moving_counts[m - 1], num_lights))
+			break;
+
+		srand(1);
+		for (int nlight = 0; nlight < num_lights; nlight++)
+		{
+			int *path = paths + nlight * BENCH_PATH_LENGTH;
+			const byte *row;
+
+			path[0] = rand() % num_clusters;
+			row = BSP_GetPvs(bsp, path[0]);
+
+			for (int n = 1; n < BENCH_PATH_LENGTH; n++)
+			{
+				path[n] = rand() % num_clusters;
+				for (int tries = 0; tries < 64 && !(row[path[n] >> 3] & (1 << (path[n] & 7))); tries++)
+					path[n] = rand() % num_clusters;
+			}
+
+			lights[nlight].cluster = path[0];
+		}
+
+		memset(ref_max_counts, 0, MAX_LIGHT_LISTS * sizeof(int));
+		light_lists_reset(ll);
+
+		// The first half lets the slot counts settle and isn't measured
+
+		for (int frame = -num_frames; frame < num_frames; frame++)
+		{
+			int buffer = (frame + num_frames) % MAX_FRAMES_IN_FLIGHT;
+
+			for (int nlight = 0; nlight < num_moving; nlight++)
+			{
+				int step = (frame + num_frames + nlight) % BENCH_PATH_LENGTH;
+				lights[nlight].cluster = paths[nlight * BENCH_PATH_LENGTH + step];
+			}
+
+			uint64_t start = Sys_Microseconds();
+			inject_model_lights_reference(bsp_mesh, bsp, num_lights, lights, model_light_offset, ref_max_counts, ref_offsets, ref_lists);
+			uint64_t ref_end = Sys_Microseconds();
+
+			update_light_lists(ll, bsp_mesh, bsp, num_lights, lights);
+			qboolean full = ll->buffer_layouts[buffer] != ll->layout;
+			int dirty = full ? 0 : count_bits(ll->dirty[buffer], (num_clusters + 31) / 32);
+			write_light_lists(ll, buffer, bsp_mesh, bsp, model_light_offset, offsets[buffer], lists[buffer]);
+			uint64_t incr_end = Sys_Microseconds();
+
+			match = match && !memcmp(offsets[buffer], ref_offsets, (num_clusters + 1) * sizeof(uint32_t)) &&
+				!memcmp(lists[buffer], ref_lists, ref_offsets[num_clusters] * sizeof(uint32_t));
+
+			if (frame < 0)
+				continue;
+
+			ref_usec += ref_end - start;
+			incr_usec += incr_end - ref_end;
+			patched += dirty;
+			rewrites += full;
+		}
+
+		Com_Printf("%8d %10.1f %10.1f %10.1f %10d %10d %s\n", num_moving,
+			(double)ref_usec / num_frames, (double)incr_usec / num_frames,
+			(double)patched / num_frames, rewrites, ll->num_slots, match ? "yes" : "NO");
+
+		failures += !match;
+	}
+
+	Com_Printf("%d lights, %d clusters, %d frames, %d mismatches\n", num_lights, num_clusters, num_frames, failures);
+	Com_Printf("times and patched clusters are per frame, rewrites are whole buffers after the lists grew\n");
+
+	for (int f = 0; f < MAX_FRAMES_IN_FLIGHT; f++)
+	{
+		Z_Free(offsets[f]);
+		Z_Free(lists[f]);
+	}
+	Z_Free(ref_lists);
+	Z_Free(ref_offsets);
+	Z_Free(ref_max_counts);
+	Z_Free(ll);
+	Z_Free(paths);
+	Z_Free(lights);
+}
+
 static inline void
 copy_light(const light_poly_t* light, float* vblight, const float* sky_radiance)
 {
@@ -303,16 +830,13 @@ copy_light(const light_poly_t* light, float* vblight, const float* sky_radiance)
 extern vkpt_refdef_t vkpt_refdef;
 extern char cluster_debug_mask[VIS_MAX_BYTES];
 
-VkResult
-vkpt_light_buffer_upload_to_staging(qboolean render_world, bsp_mesh_t *bsp_mesh, bsp_t* bsp, int num_model_lights, light_poly_t* transformed_model_lights, const float* sky_radiance)
+// Fills the light buffer on the CPU. The light lists are patched in place, so
+// lbo must keep what was last written to it with the same buffer index.
+void
+vkpt_light_buffer_fill(LightBuffer *lbo, int buffer, qboolean render_world, bsp_mesh_t *bsp_mesh, bsp_t* bsp, int num_model_lights, light_poly_t* transformed_model_lights, const float* sky_radiance)
 {
 	assert(bsp_mesh);
 
-	BufferResource_t* staging = qvk.buf_light_staging + qvk.current_frame_index;
-
-	LightBuffer *lbo = (LightBuffer *)buffer_map(staging);
-	assert(lbo);
-
 	if (render_world)
 	{
 		assert(bsp_mesh->num_clusters + 1 < MAX_LIGHT_LISTS);
@@ -320,20 +844,13 @@ vkpt_light_buffer_upload_to_staging(qboolean render_world, bsp_mesh_t *bsp_mesh,
 		assert(bsp_mesh->num_light_polys + num_model_lights < MAX_LIGHT_POLYS);
 
 		int model_light_offset = bsp_mesh->num_light_polys;
-		max_model_lights = max(max_model_lights, num_model_lights);
 
-		if(max_model_lights > 0)
-		{
-			// If any of the BSP models contain lights, inject these lights right into the visibility lists.
-			// The shader doesn't know that these lights are dynamic.
+		// If any of the BSP models contain lights, inject these lights right into the visibility lists.
+		// The shader doesn't know that these lights are dynamic.
+		// Without model lights, the lists are the static ones.
 
-			inject_model_lights(bsp_mesh, bsp, num_model_lights, transformed_model_lights, model_light_offset, lbo->light_list_offsets, lbo->light_list_lights);
-		}
-		else
-		{
-			memcpy(lbo->light_list_offsets, bsp_mesh->cluster_light_offsets, (bsp_mesh->num_clusters + 1) * sizeof(uint32_t));
-			memcpy(lbo->light_list_lights, bsp_mesh->cluster_lights, bsp_mesh->num_cluster_lights * sizeof(uint32_t));
-		}
+		update_light_lists(&light_lists, bsp_mesh, bsp, num_model_lights, transformed_model_lights);
+		write_light_lists(&light_lists, buffer, bsp_mesh, bsp, model_light_offset, lbo->light_list_offsets, lbo->light_list_lights);
 
 		for (int nlight = 0; nlight < bsp_mesh->num_light_polys; nlight++)
 		{
@@ -353,6 +870,7 @@ vkpt_light_buffer_upload_to_staging(qboolean render_world, bsp_mesh_t *bsp_mesh,
 	{
 		lbo->light_list_offsets[0] = 0;
 		lbo->light_list_offsets[1] = 0;
+		light_lists.buffer_layouts[buffer] = 0;
 	}
 
 	/* effects.c declares this - hence the assert below:
@@ -400,6 +918,17 @@ vkpt_light_buffer_upload_to_staging(qboolean render_world, bsp_mesh_t *bsp_mesh,
 	}
 
 	memcpy(lbo->cluster_debug_mask, cluster_debug_mask, MAX_LIGHT_LISTS / 8);
+}
+
+VkResult
+vkpt_light_buffer_upload_to_staging(qboolean render_world, bsp_mesh_t *bsp_mesh, bsp_t* bsp, int num_model_lights, light_poly_t* transformed_model_lights, const float* sky_radiance)
+{
+	BufferResource_t* staging = qvk.buf_light_staging + qvk.current_frame_index;
+
+	LightBuffer *lbo = (LightBuffer *)buffer_map(staging);
+	assert(lbo);
+
+	vkpt_light_buffer_fill(lbo, qvk.current_frame_index, render_world, bsp_mesh, bsp, num_model_lights, transformed_model_lights, sky_radiance);
 
 	buffer_unmap(staging);
 	lbo = NULL;
@@ -700,9 +1229,7 @@ vkpt_vertex_buffer_create()
 		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
 		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-	buffer_create(&qvk.buf_vertex_bsp_staging, sizeof(BspVertexBuffer),
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	// buf_vertex_bsp_staging is created per map in vkpt_vertex_buffer_upload_bsp_mesh_to_staging
 
 	buffer_create(&qvk.buf_vertex_model_dynamic, sizeof(ModelDynamicVertexBuffer),
 		VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
@@ -717,6 +1244,7 @@ vkpt_vertex_buffer_create()
 		buffer_create(qvk.buf_light_staging + frame, sizeof(LightBuffer),
 			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+		light_lists.buffer_layouts[frame] = 0;
 	}
 
 	buffer_create(&qvk.buf_readback, sizeof(ReadbackBuffer),
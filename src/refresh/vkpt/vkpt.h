@@ -193,6 +193,7 @@ typedef struct QVK_s {
 	VkImageView*                swap_chain_image_views;
 	
 	qboolean                    use_ray_query;
+	qboolean                    supports_texture_compression_bc;
 	qboolean                    enable_validation;
 
 	cmd_buf_group_t             cmd_buffers_graphics;
@@ -376,6 +377,10 @@ typedef struct bsp_mesh_s {
 	int *cluster_light_offsets;
 	int *cluster_lights;
 
+	// distinct material indices per cluster, plus one list for inline models
+	int *cluster_material_offsets;
+	uint16_t *cluster_materials;
+
 	int num_light_polys;
 	int allocated_light_polys;
 	light_poly_t *light_polys;
@@ -392,10 +397,12 @@ typedef struct bsp_mesh_s {
 	aabb_t* cluster_aabbs;
 } bsp_mesh_t;
 
-void bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name);
+qboolean bsp_mesh_create_from_bsp(bsp_mesh_t *wm, bsp_t *bsp, const char* map_name);
 void bsp_mesh_destroy(bsp_mesh_t *wm);
 void bsp_mesh_register_textures(bsp_t *bsp);
 void bsp_mesh_animate_light_polys(bsp_mesh_t *wm);
+void bsp_mesh_build_cache_f(void);
+void bsp_mesh_cluster_lights_bench_f(void);
 
 typedef struct vkpt_refdef_s {
 	QVKUniformBuffer_t uniform_buffer;
@@ -515,6 +522,11 @@ void vkpt_normalize_normal_map(image_t *image);
 image_t *vkpt_fake_emissive_texture(image_t *image, int bright_threshold_int);
 void vkpt_extract_emissive_texture_info(image_t *image);
 void vkpt_textures_prefetch();
+void vkpt_textures_kernel_test(void);
+void vkpt_textures_update_residency(void);
+void vkpt_textures_touch_image(const image_t *image);
+void vkpt_textures_touch_material(const struct pbr_material_s *mat);
+void vkpt_textures_touch_visible(const bsp_mesh_t *wm, bsp_t *bsp, int viewcluster);
 void vkpt_invalidate_texture_descriptors();
 void vkpt_init_light_textures();
 
@@ -585,13 +597,16 @@ VkResult vkpt_uniform_buffer_update(VkCommandBuffer command_buffer);
 VkResult vkpt_vertex_buffer_create();
 VkResult vkpt_vertex_buffer_destroy();
 VkResult vkpt_vertex_buffer_upload_bsp_mesh_to_staging(bsp_mesh_t *bsp_mesh);
+void vkpt_vertex_buffer_memory_f(void);
 VkResult vkpt_vertex_buffer_create_pipelines();
 VkResult vkpt_vertex_buffer_destroy_pipelines();
 VkResult vkpt_instance_geometry(VkCommandBuffer cmd_buf, uint32_t num_instances, qboolean update_world_animations);
 VkResult vkpt_vertex_buffer_upload_models();
 VkResult vkpt_vertex_buffer_bsp_upload_staging();
 void vkpt_light_buffer_reset_counts();
+void vkpt_light_buffer_fill(LightBuffer *lbo, int buffer, qboolean render_world, bsp_mesh_t *bsp_mesh, bsp_t* bsp, int num_model_lights, light_poly_t* transformed_model_lights, const float* sky_radiance);
 VkResult vkpt_light_buffer_upload_to_staging(qboolean render_world, bsp_mesh_t *bsp_mesh, bsp_t* bsp, int num_model_lights, light_poly_t* transformed_model_lights, const float* sky_radiance);
+void vkpt_light_lists_bench(const bsp_mesh_t *bsp_mesh, bsp_t *bsp);
 VkResult vkpt_light_buffer_upload_staging(VkCommandBuffer cmd_buf);
 VkResult vkpt_light_stats_create(bsp_mesh_t *bsp_mesh);
 VkResult vkpt_light_stats_destroy();
@@ -657,8 +672,13 @@ qerror_t load_img(const char *name, image_t *image);
 qboolean initialize_transparency();
 void destroy_transparency();
 
-void update_transparency(VkCommandBuffer command_buffer, const float* view_matrix,
+void register_transparency_cvars();
+size_t get_transparency_frame_size();
+void write_transparency(char* dst, const float* view_origin, const float* view_matrix,
+	const particle_t* particles, int particle_num, const entity_t* entities, int entity_num);
+void prepare_transparency(const float* view_matrix,
 	const particle_t* particles, int particle_num, const entity_t* entities, int entity_num);
+void upload_transparency(VkCommandBuffer command_buffer);
 
 typedef enum {
 	VKPT_TRANSPARENCY_PARTICLES,
@@ -685,6 +705,7 @@ VkBufferView get_transparency_beam_color_buffer_view();
 VkBufferView get_transparency_sprite_info_buffer_view();
 VkBufferView get_transparency_beam_intersect_buffer_view();
 void get_transparency_counts(int* particle_num, int* beam_num, int* sprite_num);
+void vkpt_transparency_bench_f(void);
 void vkpt_build_beam_lights(light_poly_t* light_list, int* num_lights, int max_lights, bsp_t *bsp, entity_t* entities, int num_entites, float adapted_luminance);
 qboolean vkpt_build_cylinder_light(light_poly_t* light_list, int* num_lights, int max_lights, bsp_t *bsp, vec3_t begin, vec3_t end, vec3_t color, float radius);
 qboolean get_triangle_off_center(const float* positions, float* center, float* anti_center, float offset);
@@ -793,6 +814,12 @@ byte *IMG_ReadPixels_RTX(int *width, int *height, int *rowbytes);
 qerror_t MOD_LoadMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
 qerror_t MOD_LoadMD3_RTX(model_t* model, const void* rawdata, size_t length, const char* mod_name);
 qerror_t MOD_LoadIQM_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
+qerror_t MOD_ParseMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
+qerror_t MOD_FinalizeMD2_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
+qerror_t MOD_ParseMD3_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
+qerror_t MOD_FinalizeMD3_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
+qerror_t MOD_ParseIQM_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
+qerror_t MOD_FinalizeIQM_RTX(model_t *model, const void *rawdata, size_t length, const char* mod_name);
 void MOD_Reference_RTX(model_t *model);
 
 #endif  /*__VKPT_H__*/
@@ -28,6 +28,22 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 cvar_t *sv_savedir = NULL;
 
 
+/*
+Files in the save directories may be hard links sharing storage with
+another slot (see link_file). Game DLL and FS_WriteFile both truncate
+in place, so a file must be unlinked before it is rewritten, otherwise
+the new contents would leak into every slot linking to it.
+*/
+static void unshare_file(const char *dir, const char *name)
+{
+    char path[MAX_OSPATH];
+
+    if (Q_snprintf(path, MAX_OSPATH, "%s/%s/%s/%s", fs_gamedir,
+                   sv_savedir->string, dir, name) < MAX_OSPATH)
+        os_unlink(path);
+}
+
+
 static int write_server_file(qboolean autosave)
 {
     char        name[MAX_OSPATH];
@@ -65,6 +81,7 @@ static int write_server_file(qboolean autosave)
 
     // write server state
 	Q_snprintf(name, MAX_OSPATH, "%s/%s/server.ssv", sv_savedir->string, SAVE_CURRENT);
+    unshare_file(SAVE_CURRENT, "server.ssv");
     ret = FS_WriteFile(name, msg_write.data, msg_write.cursize);
 
     SZ_Clear(&msg_write);
@@ -78,6 +95,7 @@ static int write_server_file(qboolean autosave)
     if (len >= MAX_OSPATH)
         return -1;
 
+    unshare_file(SAVE_CURRENT, "game.ssv");
     ge->WriteGame(name, autosave);
     return 0;
 }
@@ -116,10 +134,12 @@ static int write_level_file(void)
     MSG_WriteData(portalbits, len);
 
     len = Q_snprintf(name, MAX_QPATH, "%s/%s/%s.sv2", sv_savedir->string, SAVE_CURRENT, sv.name);
-    if (len >= MAX_QPATH)
+    if (len >= MAX_QPATH) {
         ret = -1;
-    else
+    } else {
+        unshare_file(SAVE_CURRENT, va("%s.sv2", sv.name));
         ret = FS_WriteFile(name, msg_write.data, msg_write.cursize);
+    }
 
     SZ_Clear(&msg_write);
 
@@ -132,6 +152,7 @@ static int write_level_file(void)
     if (len >= MAX_OSPATH)
         return -1;
 
+    unshare_file(SAVE_CURRENT, va("%s.sav", sv.name));
     ge->WriteLevel(name);
     return 0;
 }
@@ -159,6 +180,9 @@ static int copy_file(const char *src, const char *dst, const char *name)
     if (FS_CreatePath(path))
         goto fail1;
 
+    // never write through a link shared with the source
+    os_unlink(path);
+
     ofp = fopen(path, "wb");
     if (!ofp)
         goto fail1;
@@ -183,6 +207,38 @@ fail0:
     return ret;
 }
 
+static int link_file(const char *src, const char *dst, const char *name)
+{
+#ifndef _WIN32
+    char        srcpath[MAX_OSPATH], dstpath[MAX_OSPATH];
+    Q_STATBUF   srcst, dstst;
+
+    if (Q_snprintf(srcpath, MAX_OSPATH, "%s/%s/%s/%s", fs_gamedir, sv_savedir->string, src, name) >= MAX_OSPATH)
+        return -1;
+
+    if (Q_snprintf(dstpath, MAX_OSPATH, "%s/%s/%s/%s", fs_gamedir, sv_savedir->string, dst, name) >= MAX_OSPATH)
+        return -1;
+
+    if (os_stat(srcpath, &srcst))
+        return -1;
+
+    // file hasn't been rewritten since the last sync, nothing to do
+    if (!os_stat(dstpath, &dstst) && srcst.st_dev == dstst.st_dev && srcst.st_ino == dstst.st_ino)
+        return 0;
+
+    if (FS_CreatePath(dstpath))
+        return -1;
+
+    os_unlink(dstpath);
+
+    if (!link(srcpath, dstpath))
+        return 0;
+#endif
+
+    // no hard link support, fall back to copying
+    return copy_file(src, dst, name);
+}
+
 static int remove_file(const char *dir, const char *name)
 {
     char path[MAX_OSPATH];
@@ -216,18 +272,35 @@ static int wipe_save_dir(const char *dir)
     return ret;
 }
 
-static int copy_save_dir(const char *src, const char *dst)
+/*
+Makes `dst' mirror `src' touching only what differs: stale files are
+removed and files not already sharing storage with their source are
+hard linked (or copied). Files untouched since the previous sync cost
+a single stat.
+*/
+static int sync_save_dir(const char *src, const char *dst)
 {
-    void **list;
-    int i, count, ret = 0;
+    void **srclist, **dstlist;
+    int i, j, srccount, dstcount, ret = 0;
 
-    if ((list = list_save_dir(src, &count)) == NULL)
+    if ((srclist = list_save_dir(src, &srccount)) == NULL)
         return -1;
 
-    for (i = 0; i < count; i++)
-        ret |= copy_file(src, dst, list[i]);
+    if ((dstlist = list_save_dir(dst, &dstcount)) != NULL) {
+        for (i = 0; i < dstcount; i++) {
+            for (j = 0; j < srccount; j++)
+                if (!strcmp(dstlist[i], srclist[j]))
+                    break;
+            if (j == srccount)
+                ret |= remove_file(dst, dstlist[i]);
+        }
+        FS_FreeList(dstlist);
+    }
 
-    FS_FreeList(list);
+    for (i = 0; i < srccount; i++)
+        ret |= link_file(src, dst, srclist[i]);
+
+    FS_FreeList(srclist);
     return ret;
 }
 
@@ -515,6 +588,10 @@ void SV_AutoSaveBegin(mapcmd_t *cmd)
 
 void SV_AutoSaveEnd(void)
 {
+#ifdef _DEBUG
+    unsigned start = Sys_Milliseconds();
+#endif
+
     if (sv.state != ss_game)
         return;
 
@@ -534,17 +611,15 @@ void SV_AutoSaveEnd(void)
         return;
     }
 
-    // clear whatever savegames are there
-    if (wipe_save_dir(SAVE_AUTO)) {
-        Com_EPrintf("Couldn't wipe '%s' directory.\n", SAVE_AUTO);
-        return;
-    }
-
-    // copy off the level to the autosave slot
-    if (copy_save_dir(SAVE_CURRENT, SAVE_AUTO)) {
+    // update the autosave slot with levels changed since the last autosave
+    if (sync_save_dir(SAVE_CURRENT, SAVE_AUTO)) {
         Com_EPrintf("Couldn't write '%s' directory.\n", SAVE_AUTO);
         return;
     }
+
+#ifdef _DEBUG
+    Com_DPrintf("Autosave took %u msec\n", Sys_Milliseconds() - start);
+#endif
 }
 
 void SV_CheckForSavegame(mapcmd_t *cmd)
@@ -608,14 +683,8 @@ static void SV_Loadgame_f(void)
         return;
     }
 
-    // clear whatever savegames are there
-    if (wipe_save_dir(SAVE_CURRENT)) {
-        Com_Printf("Couldn't wipe '%s' directory.\n", SAVE_CURRENT);
-        return;
-    }
-
     // copy it off
-    if (copy_save_dir(dir, SAVE_CURRENT)) {
+    if (sync_save_dir(dir, SAVE_CURRENT)) {
         Com_Printf("Couldn't read '%s' directory.\n", dir);
         return;
     }
@@ -682,14 +751,8 @@ static void SV_Savegame_f(void)
         return;
     }
 
-    // clear whatever savegames are there
-    if (wipe_save_dir(dir)) {
-        Com_Printf("Couldn't wipe '%s' directory.\n", dir);
-        return;
-    }
-
     // copy it off
-    if (copy_save_dir(SAVE_CURRENT, dir)) {
+    if (sync_save_dir(SAVE_CURRENT, dir)) {
         Com_Printf("Couldn't write '%s' directory.\n", dir);
         return;
     }
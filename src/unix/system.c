@@ -76,6 +76,14 @@ unsigned Sys_Milliseconds(void)
     return time;
 }
 
+uint64_t Sys_Microseconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /*
 =================
 Sys_Quit
@@ -646,6 +646,18 @@ unsigned Sys_Milliseconds(void)
     return timeGetTime();
 }
 
+uint64_t Sys_Microseconds(void)
+{
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (uint64_t)(now.QuadPart / freq.QuadPart * 1000000 +
+                      now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+}
+
 void Sys_AddDefaultConfig(void)
 {
 }